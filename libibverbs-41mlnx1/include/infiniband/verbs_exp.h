@@ -2910,7 +2910,8 @@ ibv_exp_ec_encode_sync(struct ibv_exp_ec_calc *calc,
  * @ec_mem:           erasure coding memory layout
  * @erasures:         pointer to byte-map of which blocks were erased
  * 		      and needs to be recovered
- * @decode_matrix:    buffer that contains the decode matrix
+ * @decode_matrix:    buffer that contains the decode matrix, or NULL
+ *		      (w = 8) to have it derived from the encode matrix
  * @ec_comp:          EC calculation completion context
  *
  * Restrictions:
@@ -2934,6 +2935,8 @@ ibv_exp_ec_encode_sync(struct ibv_exp_ec_calc *calc,
  * The ec_calc will perform the erasure coding calc operation,
  * once it completes, it will call ec_comp->done() handle.
  * The caller will take it from there
+ * Derived decode matrices are cached per erasure pattern, so repeated
+ * degraded reads of the same blocks do not pay for the inversion.
  */
 static inline int
 ibv_exp_ec_decode_async(struct ibv_exp_ec_calc *calc,
@@ -2959,7 +2962,8 @@ ibv_exp_ec_decode_async(struct ibv_exp_ec_calc *calc,
  * @ec_mem:           erasure coding memory layout
  * @erasures:         pointer to byte-map of which blocks were erased
  * 		      and needs to be recovered
- * @decode_matrix:    registered buffer of the decode matrix
+ * @decode_matrix:    registered buffer of the decode matrix, or NULL
+ *		      (w = 8) to have it derived from the encode matrix
  *
  * Restrictions:
  * - ec_calc is an initialized erasure coding calc engine structure
@@ -91,6 +91,17 @@ HIDDEN int ibverbs_init();
 HIDDEN struct ibv_mr *__ibv_reg_shared_mr(struct ibv_exp_reg_shared_mr_in *in);
 HIDDEN struct ibv_mr *__ibv_exp_reg_mr(struct ibv_exp_reg_mr_in *in);
 HIDDEN struct ibv_qp *ibv_find_xrc_qp(uint32_t qpn);
+HIDDEN struct ibv_mr *ibv_reg_mr_nocache(struct ibv_pd *pd, void *addr,
+					 size_t length, int access);
+HIDDEN int ibv_dereg_mr_nocache(struct ibv_mr *mr);
+
+extern HIDDEN int ibv_mr_cache_enabled;
+HIDDEN void ibv_mr_cache_init(void);
+HIDDEN struct ibv_mr *ibv_mr_cache_reg(struct ibv_pd *pd, void *addr,
+				       size_t length, int access);
+HIDDEN int ibv_mr_cache_release(struct ibv_mr *mr);
+HIDDEN int ibv_mr_cache_detach(struct ibv_mr *mr);
+HIDDEN void ibv_mr_cache_flush_pd(struct ibv_pd *pd);
 
 #define IBV_INIT_CMD(cmd, size, opcode)					\
 	do {								\
@@ -556,6 +556,8 @@ HIDDEN int ibverbs_init()
 			fprintf(stderr, PFX "Warning: fork()-safety requested "
 				"but init failed\n");
 
+	ibv_mr_cache_init();
+
 	sysfs_path = ibv_get_sysfs_path();
 	if (!sysfs_path)
 		return -ENOSYS;
@@ -70,8 +70,24 @@ struct ibv_mem_node {
 	int			refcnt;
 };
 
-static struct ibv_mem_node *mm_root;
-static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * The address space is tracked in 1GB regions spread over MM_SHARDS
+ * independent trees, each with its own lock, so registrations in
+ * different regions don't serialize. Every tree covers the whole address
+ * space but only ever holds ranges of the regions hashed to it. The
+ * region size is a multiple of the 2MB and 1GB huge page sizes, so a
+ * region boundary doesn't split a huge page.
+ */
+#define MM_SHARD_SHIFT	30
+#define MM_SHARDS	64
+
+struct ibv_mem_shard {
+	pthread_mutex_t		mutex;
+	struct ibv_mem_node    *root;
+} __attribute__((aligned(64)));
+
+static struct ibv_mem_shard mm_shard[MM_SHARDS];
+static int mm_enabled;
 static int page_size;
 static int huge_page_enabled;
 static int too_late;
@@ -136,11 +152,13 @@ out:
 
 int ibv_fork_init(void)
 {
+	struct ibv_mem_node *node;
 	void *tmp, *tmp_aligned;
 	int ret;
+	int i;
 	unsigned long size;
 
-	if (mm_root)
+	if (mm_enabled)
 		return 0;
 
 	if (too_late)
@@ -174,19 +192,32 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
-	if (!mm_root)
-		return ENOMEM;
+	for (i = 0; i < MM_SHARDS; ++i) {
+		node = malloc(sizeof *node);
+		if (!node)
+			goto err;
+
+		node->parent = NULL;
+		node->left   = NULL;
+		node->right  = NULL;
+		node->color  = IBV_BLACK;
+		node->start  = 0;
+		node->end    = UINTPTR_MAX;
+		node->refcnt = 0;
+
+		pthread_mutex_init(&mm_shard[i].mutex, NULL);
+		mm_shard[i].root = node;
+	}
 
-	mm_root->parent = NULL;
-	mm_root->left   = NULL;
-	mm_root->right  = NULL;
-	mm_root->color  = IBV_BLACK;
-	mm_root->start  = 0;
-	mm_root->end    = UINTPTR_MAX;
-	mm_root->refcnt = 0;
+	mm_enabled = 1;
 
 	return 0;
+
+err:
+	while (i--)
+		free(mm_shard[i].root);
+
+	return ENOMEM;
 }
 
 static struct ibv_mem_node *__mm_prev(struct ibv_mem_node *node)
@@ -221,7 +252,8 @@ static struct ibv_mem_node *__mm_next(struct ibv_mem_node *node)
 	return node;
 }
 
-static void __mm_rotate_right(struct ibv_mem_node *node)
+static void __mm_rotate_right(struct ibv_mem_node **root,
+			      struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -237,7 +269,7 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		*root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -245,7 +277,8 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 	node->parent = tmp;
 }
 
-static void __mm_rotate_left(struct ibv_mem_node *node)
+static void __mm_rotate_left(struct ibv_mem_node **root,
+			     struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -261,7 +294,7 @@ static void __mm_rotate_left(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		*root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -270,7 +303,8 @@ static void __mm_rotate_left(struct ibv_mem_node *node)
 }
 
 
-static void __mm_add_rebalance(struct ibv_mem_node *node)
+static void __mm_add_rebalance(struct ibv_mem_node **root,
+			       struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *parent, *gp, *uncle;
 
@@ -289,7 +323,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->right) {
-					__mm_rotate_left(parent);
+					__mm_rotate_left(root, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -297,7 +331,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_right(gp);
+				__mm_rotate_right(root, gp);
 			}
 		} else {
 			uncle = gp->left;
@@ -310,7 +344,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->left) {
-					__mm_rotate_right(parent);
+					__mm_rotate_right(root, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -318,19 +352,19 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_left(gp);
+				__mm_rotate_left(root, gp);
 			}
 		}
 	}
 
-	mm_root->color = IBV_BLACK;
+	(*root)->color = IBV_BLACK;
 }
 
-static void __mm_add(struct ibv_mem_node *new)
+static void __mm_add(struct ibv_mem_node **root, struct ibv_mem_node *new)
 {
 	struct ibv_mem_node *node, *parent = NULL;
 
-	node = mm_root;
+	node = *root;
 	while (node) {
 		parent = node;
 		if (node->start < new->start)
@@ -349,10 +383,11 @@ static void __mm_add(struct ibv_mem_node *new)
 	new->right  = NULL;
 
 	new->color = IBV_RED;
-	__mm_add_rebalance(new);
+	__mm_add_rebalance(root, new);
 }
 
-static void __mm_remove(struct ibv_mem_node *node)
+static void __mm_remove(struct ibv_mem_node **root,
+			struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *child, *parent, *sib, *tmp;
 	int nodecol;
@@ -387,7 +422,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				node->parent->right = tmp;
 		} else
-			mm_root = tmp;
+			*root = tmp;
 	} else {
 		nodecol = node->color;
 
@@ -402,7 +437,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				parent->right = child;
 		} else
-			mm_root = child;
+			*root = child;
 	}
 
 	free(node);
@@ -410,14 +445,14 @@ static void __mm_remove(struct ibv_mem_node *node)
 	if (nodecol == IBV_RED)
 		return;
 
-	while ((!child || child->color == IBV_BLACK) && child != mm_root) {
+	while ((!child || child->color == IBV_BLACK) && child != *root) {
 		if (parent->left == child) {
 			sib = parent->right;
 
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_left(parent);
+				__mm_rotate_left(root, parent);
 				sib = parent->right;
 			}
 
@@ -431,7 +466,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->left)
 						sib->left->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_right(sib);
+					__mm_rotate_right(root, sib);
 					sib = parent->right;
 				}
 
@@ -439,8 +474,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->right)
 					sib->right->color = IBV_BLACK;
-				__mm_rotate_left(parent);
-				child = mm_root;
+				__mm_rotate_left(root, parent);
+				child = *root;
 				break;
 			}
 		} else {
@@ -449,7 +484,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_right(parent);
+				__mm_rotate_right(root, parent);
 				sib = parent->left;
 			}
 
@@ -463,7 +498,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->right)
 						sib->right->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_left(sib);
+					__mm_rotate_left(root, sib);
 					sib = parent->left;
 				}
 
@@ -471,8 +506,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->left)
 					sib->left->color = IBV_BLACK;
-				__mm_rotate_right(parent);
-				child = mm_root;
+				__mm_rotate_right(root, parent);
+				child = *root;
 				break;
 			}
 		}
@@ -482,9 +517,10 @@ static void __mm_remove(struct ibv_mem_node *node)
 		child->color = IBV_BLACK;
 }
 
-static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
+static struct ibv_mem_node *__mm_find_start(struct ibv_mem_node **root,
+					    uintptr_t start, uintptr_t end)
 {
-	struct ibv_mem_node *node = mm_root;
+	struct ibv_mem_node *node = *root;
 
 	while (node) {
 		if (node->start <= start && node->end >= start)
@@ -499,17 +535,19 @@ static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
 	return node;
 }
 
-static struct ibv_mem_node *merge_ranges(struct ibv_mem_node *node,
+static struct ibv_mem_node *merge_ranges(struct ibv_mem_node **root,
+					 struct ibv_mem_node *node,
 					 struct ibv_mem_node *prev)
 {
 	prev->end = node->end;
 	prev->refcnt = node->refcnt;
-	__mm_remove(node);
+	__mm_remove(root, node);
 
 	return prev;
 }
 
-static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
+static struct ibv_mem_node *split_range(struct ibv_mem_node **root,
+					struct ibv_mem_node *node,
 					uintptr_t cut_line)
 {
 	struct ibv_mem_node *new_node = NULL;
@@ -521,23 +559,24 @@ static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
 	new_node->end    = node->end;
 	new_node->refcnt = node->refcnt;
 	node->end  = cut_line - 1;
-	__mm_add(new_node);
+	__mm_add(root, new_node);
 
 	return new_node;
 }
 
-static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
+static struct ibv_mem_node *get_start_node(struct ibv_mem_node **root,
+					   uintptr_t start, uintptr_t end,
 					   int inc)
 {
 	struct ibv_mem_node *node, *tmp = NULL;
 
-	node = __mm_find_start(start, end);
+	node = __mm_find_start(root, start, end);
 	if (node->start < start)
-		node = split_range(node, start);
+		node = split_range(root, node, start);
 	else {
 		tmp = __mm_prev(node);
 		if (tmp && tmp->refcnt == node->refcnt + inc)
-			node = merge_ranges(node, tmp);
+			node = merge_ranges(root, node, tmp);
 	}
 	return node;
 }
@@ -546,7 +585,8 @@ static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
  * This function is called if madvise() fails to undo merging/splitting
  * operations performed on the node.
  */
-static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
+static struct ibv_mem_node *undo_node(struct ibv_mem_node **root,
+				      struct ibv_mem_node *node,
 				      uintptr_t start, int inc)
 {
 	struct ibv_mem_node *tmp = NULL;
@@ -556,7 +596,7 @@ static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
 	 * node with the previous one, so we need to split them.
 	*/
 	if (start > node->start) {
-		tmp = split_range(node, start);
+		tmp = split_range(root, node, start);
 		if (tmp) {
 			node->refcnt += inc;
 			node = tmp;
@@ -566,49 +606,57 @@ static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
 
 	tmp  =  __mm_prev(node);
 	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(node, tmp);
+		node = merge_ranges(root, node, tmp);
 
 	tmp  =  __mm_next(node);
 	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(tmp, node);
+		node = merge_ranges(root, tmp, node);
 
 	return node;
 }
 
-static int ibv_madvise_range(void *base, size_t size, int advice)
+/*
+ * Nodes needing madvise() in one walk are contiguous, so one call covers
+ * all of them; their refcnts are only updated once it succeeded.
+ */
+static int flush_batch(struct ibv_mem_node *node, uintptr_t start,
+		       uintptr_t end, int inc, int advice)
 {
-	uintptr_t start, end;
-	struct ibv_mem_node *node, *tmp;
-	int inc;
-	int rolling_back = 0;
-	int ret = 0;
-	unsigned long range_page_size;
+	if (start < node->start)
+		start = node->start;
 
-	if (!size)
-		return 0;
+	if (madvise((void *) start, end - start + 1, advice))
+		return -1;
 
-	if (huge_page_enabled)
-		range_page_size = get_page_size(base);
-	else
-		range_page_size = page_size;
+	for (; node && node->start <= end; node = __mm_next(node))
+		node->refcnt += inc;
 
-	start = (uintptr_t) base & ~(range_page_size - 1);
-	end   = ((uintptr_t) (base + size + range_page_size - 1) &
-		 ~(range_page_size - 1)) - 1;
+	return 0;
+}
+
+/* Called with the shard's mutex held, start ... end lies in one region */
+static int mm_madvise_range(struct ibv_mem_node **root, uintptr_t start,
+			    uintptr_t end, int advice)
+{
+	struct ibv_mem_node *node, *tmp, *batch = NULL;
+	int inc;
+	int rolling_back = 0;
+	int batching = 1;
+	int ret = 0;
 
-	pthread_mutex_lock(&mm_mutex);
 again:
 	inc = advice == MADV_DONTFORK ? 1 : -1;
 
-	node = get_start_node(start, end, inc);
+	node = get_start_node(root, start, end, inc);
 	if (!node) {
 		ret = -1;
 		goto out;
 	}
 
+walk:
 	while (node && node->start <= end) {
 		if (node->end > end) {
-			if (!split_range(node, end + 1)) {
+			if (!split_range(root, node, end + 1)) {
 				ret = -1;
 				goto out;
 			}
@@ -616,6 +664,13 @@ again:
 
 		if ((inc == -1 && node->refcnt == 1) ||
 		    (inc ==  1 && node->refcnt == 0)) {
+			if (batching) {
+				if (!batch)
+					batch = node;
+				node = __mm_next(node);
+				continue;
+			}
+
 			/*
 			 * If this is the first time through the loop,
 			 * and we merged this node with the previous
@@ -635,7 +690,7 @@ again:
 					      node->end - node->start + 1,
 					      advice);
 			if (ret) {
-				node = undo_node(node, start, inc);
+				node = undo_node(root, node, start, inc);
 
 				if (rolling_back || !node)
 					goto out;
@@ -652,28 +707,117 @@ again:
 			}
 		}
 
+		if (batch) {
+			tmp = batch;
+			batch = NULL;
+			/*
+			 * Nothing from the batch on was touched yet, so on
+			 * failure redo it node by node to find the culprit
+			 * and roll back.
+			 */
+			if (flush_batch(tmp, start, node->start - 1, inc,
+					advice)) {
+				batching = 0;
+				node = tmp;
+				continue;
+			}
+		}
+
 		node->refcnt += inc;
 		node = __mm_next(node);
 	}
 
+	if (batch) {
+		tmp = batch;
+		batch = NULL;
+		if (flush_batch(tmp, start, end, inc, advice)) {
+			batching = 0;
+			node = tmp;
+			goto walk;
+		}
+	}
+
 	if (node) {
 		tmp = __mm_prev(node);
 		if (tmp && node->refcnt == tmp->refcnt)
-			node = merge_ranges(node, tmp);
+			node = merge_ranges(root, node, tmp);
 	}
 
 out:
 	if (rolling_back)
 		ret = -1;
 
-	pthread_mutex_unlock(&mm_mutex);
+	return ret;
+}
+
+static int mm_madvise_shard(uintptr_t start, uintptr_t end, int advice)
+{
+	struct ibv_mem_shard *shard;
+	int ret;
+
+	shard = &mm_shard[(start >> MM_SHARD_SHIFT) % MM_SHARDS];
+
+	pthread_mutex_lock(&shard->mutex);
+	ret = mm_madvise_range(&shard->root, start, end, advice);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return ret;
+}
+
+static int ibv_madvise_range(void *base, size_t size, int advice)
+{
+	uintptr_t start, end, cur, cur_end;
+	unsigned long range_page_size;
+	int ret = 0;
+
+	if (!size)
+		return 0;
+
+	if (huge_page_enabled)
+		range_page_size = get_page_size(base);
+	else
+		range_page_size = page_size;
+
+	start = (uintptr_t) base & ~(range_page_size - 1);
+	end   = ((uintptr_t) (base + size + range_page_size - 1) &
+		 ~(range_page_size - 1)) - 1;
+
+	/* Each region is handled under its own shard lock in turn */
+	for (cur = start; ; cur = cur_end + 1) {
+		cur_end = (cur | ((1UL << MM_SHARD_SHIFT) - 1));
+		if (cur_end > end)
+			cur_end = end;
+
+		ret = mm_madvise_shard(cur, cur_end, advice);
+		if (ret)
+			break;
+
+		if (cur_end == end)
+			return 0;
+	}
+
+	/* Undo the regions done before the failing one */
+	if (cur == start)
+		return ret;
+
+	advice = advice == MADV_DONTFORK ? MADV_DOFORK : MADV_DONTFORK;
+	end = cur - 1;
+	for (cur = start; ; cur = cur_end + 1) {
+		cur_end = (cur | ((1UL << MM_SHARD_SHIFT) - 1));
+		if (cur_end > end)
+			cur_end = end;
+
+		mm_madvise_shard(cur, cur_end, advice);
+		if (cur_end == end)
+			break;
+	}
 
 	return ret;
 }
 
 int ibv_dontfork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_enabled)
 		return ibv_madvise_range(base, size, MADV_DONTFORK);
 	else {
 		too_late = 1;
@@ -683,7 +827,7 @@ int ibv_dontfork_range(void *base, size_t size)
 
 int ibv_dofork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_enabled)
 		return ibv_madvise_range(base, size, MADV_DOFORK);
 	else {
 		too_late = 1;
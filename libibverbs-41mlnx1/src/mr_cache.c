@@ -0,0 +1,570 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "ibverbs.h"
+
+/*
+ * Registration cache, enabled with RDMAV_MR_CACHE.
+ *
+ * ibv_dereg_mr() of a cached MR only drops a reference. Unreferenced MRs
+ * stay registered on an LRU list, up to RDMAV_MR_CACHE_SIZE bytes, and a
+ * later ibv_reg_mr() with the same pd, addr, length and access returns
+ * the same MR.
+ *
+ * A cached MR pins the pages that were mapped when it was registered, so
+ * it must not be handed out once its range is unmapped or its pages are
+ * dropped. Every cached range is registered with a userfaultfd in
+ * write-protect mode, which never write-protects anything but delivers
+ * the unmap, madvise(MADV_DONTNEED/MADV_REMOVE) and mremap events for
+ * it. The thread doing munmap() etc. blocks until its event is read,
+ * and the reader holds the cache mutex, so by the time such a call
+ * returns its range has already left the cache.
+ *
+ * The event thread never deregisters or frees anything itself: free()
+ * may unmap memory registered with the same userfaultfd and wait for
+ * the event thread forever. Invalidated MRs are queued and deregistered
+ * by the next thread going through the cache.
+ *
+ * Pages stay registered with the userfaultfd while any entry still in
+ * mr_hash covers them. Entries leaving the cache unregister whatever is
+ * no longer covered; both happen under the mutex so a concurrent
+ * ibv_reg_mr() can't lose its registration.
+ */
+
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY		1
+#endif
+
+#define MR_CACHE_HASH_SIZE		4096
+#define MR_CACHE_DEFAULT_SIZE		(256UL << 20)
+
+struct mr_cache_entry {
+	struct mr_cache_entry  *key_next;	/* key hash, or victim list */
+	struct mr_cache_entry  *mr_next;	/* mr hash */
+	struct mr_cache_entry  *lru_prev, *lru_next;
+	struct ibv_mr	       *mr;
+	struct ibv_pd	       *pd;
+	void		       *addr;
+	size_t			length;
+	int			access;
+	int			refcnt;
+	int			stale;
+};
+
+static struct {
+	pthread_mutex_t		mutex;
+	int			uffd;
+	size_t			max_idle;
+	size_t			idle_bytes;
+	struct mr_cache_entry  *key_hash[MR_CACHE_HASH_SIZE];
+	struct mr_cache_entry  *mr_hash[MR_CACHE_HASH_SIZE];
+	struct mr_cache_entry	lru;		/* lru.lru_next is the newest */
+	struct mr_cache_entry  *victims;
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+	uint64_t		invalidations;
+	uint64_t		uncached;
+} mr_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.uffd  = -1,
+	.lru   = { .lru_prev = &mr_cache.lru, .lru_next = &mr_cache.lru },
+};
+
+HIDDEN int ibv_mr_cache_enabled;
+
+static unsigned key_hash(struct ibv_pd *pd, void *addr, size_t length,
+			 int access)
+{
+	uint64_t h;
+
+	h = ((uintptr_t) pd ^ (uintptr_t) addr ^ ((uint64_t) length << 20) ^
+	     access) * 0x9e3779b97f4a7c15ULL;
+
+	return h >> 52;
+}
+
+static unsigned mr_hash(struct ibv_mr *mr)
+{
+	return ((uintptr_t) mr * 0x9e3779b97f4a7c15ULL) >> 52;
+}
+
+static void lru_del(struct mr_cache_entry *ent)
+{
+	ent->lru_prev->lru_next = ent->lru_next;
+	ent->lru_next->lru_prev = ent->lru_prev;
+	mr_cache.idle_bytes -= ent->length;
+}
+
+static void lru_add(struct mr_cache_entry *ent)
+{
+	ent->lru_next = mr_cache.lru.lru_next;
+	ent->lru_prev = &mr_cache.lru;
+	mr_cache.lru.lru_next->lru_prev = ent;
+	mr_cache.lru.lru_next = ent;
+	mr_cache.idle_bytes += ent->length;
+}
+
+static void key_unlink(struct mr_cache_entry *ent)
+{
+	struct mr_cache_entry **p;
+
+	p = &mr_cache.key_hash[key_hash(ent->pd, ent->addr, ent->length,
+					ent->access)];
+	while (*p != ent)
+		p = &(*p)->key_next;
+	*p = ent->key_next;
+}
+
+static void mr_unlink(struct mr_cache_entry *ent)
+{
+	struct mr_cache_entry **p;
+
+	p = &mr_cache.mr_hash[mr_hash(ent->mr)];
+	while (*p != ent)
+		p = &(*p)->mr_next;
+	*p = ent->mr_next;
+}
+
+static struct mr_cache_entry *mr_lookup(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *ent;
+
+	for (ent = mr_cache.mr_hash[mr_hash(mr)]; ent; ent = ent->mr_next)
+		if (ent->mr == mr)
+			return ent;
+
+	return NULL;
+}
+
+/* Called with the mutex held, the entry is unreferenced and in no hash */
+static void add_victim(struct mr_cache_entry *ent)
+{
+	ent->key_next = mr_cache.victims;
+	mr_cache.victims = ent;
+}
+
+/* Unlink an unreferenced, valid entry and queue it for deregistration */
+static void evict(struct mr_cache_entry *ent)
+{
+	lru_del(ent);
+	key_unlink(ent);
+	mr_unlink(ent);
+	add_victim(ent);
+}
+
+/* Called without the mutex */
+static void free_victims(struct mr_cache_entry *ent)
+{
+	struct mr_cache_entry *next;
+
+	for (; ent; ent = next) {
+		next = ent->key_next;
+		if (ibv_dereg_mr_nocache(ent->mr))
+			fprintf(stderr, PFX "Warning: failed to deregister "
+				"cached MR %p\n", ent->addr);
+		free(ent);
+	}
+}
+
+/* Called with the mutex held, from the event thread only */
+static void invalidate(uintptr_t start, uintptr_t end)
+{
+	struct mr_cache_entry **p, *ent;
+	int i;
+
+	for (i = 0; i < MR_CACHE_HASH_SIZE; ++i) {
+		p = &mr_cache.key_hash[i];
+		while ((ent = *p)) {
+			if ((uintptr_t) ent->addr >= end ||
+			    (uintptr_t) ent->addr + ent->length <= start) {
+				p = &ent->key_next;
+				continue;
+			}
+
+			*p = ent->key_next;
+			ent->stale = 1;
+			++mr_cache.invalidations;
+
+			/* In use MRs are dropped by their last dereg */
+			if (!ent->refcnt) {
+				lru_del(ent);
+				mr_unlink(ent);
+				add_victim(ent);
+			}
+		}
+	}
+}
+
+static void *mr_cache_event_thread(void *arg)
+{
+	struct pollfd pfd = { .fd = mr_cache.uffd, .events = POLLIN };
+	struct uffd_msg msg[16];
+	sigset_t set;
+	ssize_t n;
+	int i;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0)
+			continue;
+
+		pthread_mutex_lock(&mr_cache.mutex);
+		while ((n = read(mr_cache.uffd, msg, sizeof(msg))) > 0) {
+			for (i = 0; i < n / sizeof(msg[0]); ++i) {
+				switch (msg[i].event) {
+				case UFFD_EVENT_UNMAP:
+				case UFFD_EVENT_REMOVE:
+					invalidate(msg[i].arg.remove.start,
+						   msg[i].arg.remove.end);
+					break;
+				case UFFD_EVENT_REMAP:
+					invalidate(msg[i].arg.remap.from,
+						   msg[i].arg.remap.from +
+						   msg[i].arg.remap.len);
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&mr_cache.mutex);
+	}
+
+	return NULL;
+}
+
+static void page_range(void *addr, size_t length, uintptr_t *start,
+		       uintptr_t *end)
+{
+	uintptr_t ps = sysconf(_SC_PAGESIZE);
+
+	*start = (uintptr_t) addr & ~(ps - 1);
+	*end = ((uintptr_t) addr + length + ps - 1) & ~(ps - 1);
+}
+
+/* Called with the mutex held */
+static int watch_range(void *addr, size_t length)
+{
+	struct uffdio_register reg;
+	uintptr_t start, end;
+
+	page_range(addr, length, &start, &end);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.range.start = start;
+	reg.range.len = end - start;
+	reg.mode = UFFDIO_REGISTER_MODE_WP;
+
+	return ioctl(mr_cache.uffd, UFFDIO_REGISTER, &reg);
+}
+
+/*
+ * Called with the mutex held once ent is out of mr_hash: unregister the
+ * parts of its range no entry left in mr_hash covers. Ranges that were
+ * unmapped meanwhile have nothing left to unregister, so errors are
+ * ignored.
+ */
+static void unwatch_range(struct mr_cache_entry *ent)
+{
+	struct uffdio_range range;
+	struct mr_cache_entry *other;
+	uintptr_t cur, end, next, s, e;
+	int i;
+
+	page_range(ent->addr, ent->length, &cur, &end);
+	while (cur < end) {
+		/* Skip what others cover, else find where the gap ends */
+		next = end;
+		for (i = 0; i < MR_CACHE_HASH_SIZE; ++i) {
+			for (other = mr_cache.mr_hash[i]; other;
+			     other = other->mr_next) {
+				page_range(other->addr, other->length, &s, &e);
+				if (s <= cur && e > cur)
+					break;
+				if (s > cur && s < next)
+					next = s;
+			}
+			if (other)
+				break;
+		}
+
+		if (other) {
+			cur = e;
+			continue;
+		}
+
+		range.start = cur;
+		range.len = next - cur;
+		ioctl(mr_cache.uffd, UFFDIO_UNREGISTER, &range);
+		cur = next;
+	}
+}
+
+/* Called with the mutex held, not from the event thread */
+static struct mr_cache_entry *take_victims(void)
+{
+	struct mr_cache_entry *victims = mr_cache.victims;
+	struct mr_cache_entry *ent;
+
+	for (ent = victims; ent; ent = ent->key_next)
+		unwatch_range(ent);
+
+	mr_cache.victims = NULL;
+	return victims;
+}
+
+struct ibv_mr *ibv_mr_cache_reg(struct ibv_pd *pd, void *addr, size_t length,
+				int access)
+{
+	struct mr_cache_entry *ent, *victims;
+	struct ibv_mr *mr = NULL;
+	unsigned h = key_hash(pd, addr, length, access);
+
+	pthread_mutex_lock(&mr_cache.mutex);
+	for (ent = mr_cache.key_hash[h]; ent; ent = ent->key_next) {
+		if (ent->pd == pd && ent->addr == addr &&
+		    ent->length == length && ent->access == access) {
+			if (!ent->refcnt++)
+				lru_del(ent);
+			++mr_cache.hits;
+			mr = ent->mr;
+			break;
+		}
+	}
+	victims = take_victims();
+	pthread_mutex_unlock(&mr_cache.mutex);
+
+	free_victims(victims);
+	if (mr)
+		return mr;
+
+	mr = ibv_reg_mr_nocache(pd, addr, length, access);
+	if (!mr)
+		return NULL;
+
+	ent = malloc(sizeof(*ent));
+	if (ent) {
+		ent->mr = mr;
+		ent->pd = pd;
+		ent->addr = addr;
+		ent->length = length;
+		ent->access = access;
+		ent->refcnt = 1;
+		ent->stale = 0;
+	}
+
+	/* Ranges the userfaultfd can't watch are registered uncached */
+	pthread_mutex_lock(&mr_cache.mutex);
+	if (!ent || watch_range(addr, length)) {
+		++mr_cache.uncached;
+		pthread_mutex_unlock(&mr_cache.mutex);
+		free(ent);
+		return mr;
+	}
+
+	++mr_cache.misses;
+	ent->key_next = mr_cache.key_hash[h];
+	mr_cache.key_hash[h] = ent;
+	ent->mr_next = mr_cache.mr_hash[mr_hash(mr)];
+	mr_cache.mr_hash[mr_hash(mr)] = ent;
+	pthread_mutex_unlock(&mr_cache.mutex);
+
+	return mr;
+}
+
+/* Returns -1 if the MR is not cached and must be deregistered */
+int ibv_mr_cache_release(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *ent, *victims;
+
+	pthread_mutex_lock(&mr_cache.mutex);
+	ent = mr_lookup(mr);
+	if (!ent) {
+		pthread_mutex_unlock(&mr_cache.mutex);
+		return -1;
+	}
+
+	if (!--ent->refcnt) {
+		if (ent->stale) {
+			mr_unlink(ent);
+			add_victim(ent);
+		} else {
+			lru_add(ent);
+			while (mr_cache.idle_bytes > mr_cache.max_idle) {
+				evict(mr_cache.lru.lru_prev);
+				++mr_cache.evictions;
+			}
+		}
+	}
+	victims = take_victims();
+	pthread_mutex_unlock(&mr_cache.mutex);
+
+	free_victims(victims);
+	return 0;
+}
+
+/*
+ * Take the MR out of the cache before ibv_rereg_mr() changes what it
+ * maps. Fails if other users share it.
+ */
+int ibv_mr_cache_detach(struct ibv_mr *mr)
+{
+	struct mr_cache_entry *ent;
+
+	pthread_mutex_lock(&mr_cache.mutex);
+	ent = mr_lookup(mr);
+	if (ent && ent->refcnt > 1) {
+		pthread_mutex_unlock(&mr_cache.mutex);
+		return EBUSY;
+	}
+
+	if (ent) {
+		if (!ent->stale)
+			key_unlink(ent);
+		mr_unlink(ent);
+		unwatch_range(ent);
+	}
+	pthread_mutex_unlock(&mr_cache.mutex);
+
+	free(ent);
+	return 0;
+}
+
+/* Idle MRs keep their PD busy, drop them before deallocating it */
+void ibv_mr_cache_flush_pd(struct ibv_pd *pd)
+{
+	struct mr_cache_entry *ent, *prev, *victims;
+
+	pthread_mutex_lock(&mr_cache.mutex);
+	for (ent = mr_cache.lru.lru_prev; ent != &mr_cache.lru; ent = prev) {
+		prev = ent->lru_prev;
+		if (ent->pd == pd)
+			evict(ent);
+	}
+	victims = take_victims();
+	pthread_mutex_unlock(&mr_cache.mutex);
+
+	free_victims(victims);
+}
+
+static void mr_cache_print_stats(void)
+{
+	pthread_mutex_lock(&mr_cache.mutex);
+	fprintf(stderr, PFX "MR cache: %llu hits, %llu misses, %llu uncached, "
+		"%llu evictions, %llu invalidations, %zu idle bytes\n",
+		(unsigned long long) mr_cache.hits,
+		(unsigned long long) mr_cache.misses,
+		(unsigned long long) mr_cache.uncached,
+		(unsigned long long) mr_cache.evictions,
+		(unsigned long long) mr_cache.invalidations,
+		mr_cache.idle_bytes);
+	pthread_mutex_unlock(&mr_cache.mutex);
+}
+
+void ibv_mr_cache_init(void)
+{
+	struct uffdio_api api;
+	pthread_attr_t attr;
+	pthread_t thread;
+	char *env;
+	int ret;
+
+	env = getenv("RDMAV_MR_CACHE");
+	if (!env || !strcmp(env, "0"))
+		return;
+
+	mr_cache.max_idle = MR_CACHE_DEFAULT_SIZE;
+	env = getenv("RDMAV_MR_CACHE_SIZE");
+	if (env)
+		mr_cache.max_idle = strtoull(env, NULL, 0);
+
+#ifdef __NR_userfaultfd
+	/* Only unmap events are needed, which user mode only handles too */
+	mr_cache.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK |
+				UFFD_USER_MODE_ONLY);
+	if (mr_cache.uffd < 0)
+		mr_cache.uffd = syscall(__NR_userfaultfd,
+					O_CLOEXEC | O_NONBLOCK);
+#endif
+	if (mr_cache.uffd < 0) {
+		fprintf(stderr, PFX "Warning: MR cache requested but "
+			"userfaultfd is not available\n");
+		return;
+	}
+
+	memset(&api, 0, sizeof(api));
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_EVENT_UNMAP | UFFD_FEATURE_EVENT_REMOVE |
+		       UFFD_FEATURE_EVENT_REMAP;
+	if (ioctl(mr_cache.uffd, UFFDIO_API, &api)) {
+		fprintf(stderr, PFX "Warning: MR cache requested but "
+			"userfaultfd lacks unmap events\n");
+		goto err;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, mr_cache_event_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		fprintf(stderr, PFX "Warning: MR cache requested but "
+			"its event thread can't be started\n");
+		goto err;
+	}
+
+	if (getenv("RDMAV_MR_CACHE_STATS"))
+		atexit(mr_cache_print_stats);
+
+	ibv_mr_cache_enabled = 1;
+	return;
+
+err:
+	close(mr_cache.uffd);
+	mr_cache.uffd = -1;
+}
@@ -220,6 +220,9 @@ default_symver(__ibv_alloc_pd, ibv_alloc_pd);
 
 int __ibv_dealloc_pd(struct ibv_pd *pd)
 {
+	if (ibv_mr_cache_enabled)
+		ibv_mr_cache_flush_pd(pd);
+
 	return pd->context->ops.dealloc_pd(pd);
 }
 default_symver(__ibv_dealloc_pd, ibv_dealloc_pd);
@@ -324,8 +327,8 @@ struct ibv_mr *__ibv_exp_reg_mr(struct ibv_exp_reg_mr_in *in)
 	return __ibv_common_reg_mr(in, ctx);
 }
 
-struct ibv_mr *__ibv_reg_mr(struct ibv_pd *pd, void *addr,
-			    size_t length, int access)
+struct ibv_mr *ibv_reg_mr_nocache(struct ibv_pd *pd, void *addr,
+				  size_t length, int access)
 {
 	struct ibv_exp_reg_mr_in in;
 
@@ -337,6 +340,15 @@ struct ibv_mr *__ibv_reg_mr(struct ibv_pd *pd, void *addr,
 
 	return __ibv_common_reg_mr(&in, NULL);
 }
+
+struct ibv_mr *__ibv_reg_mr(struct ibv_pd *pd, void *addr,
+			    size_t length, int access)
+{
+	if (ibv_mr_cache_enabled)
+		return ibv_mr_cache_reg(pd, addr, length, access);
+
+	return ibv_reg_mr_nocache(pd, addr, length, access);
+}
 default_symver(__ibv_reg_mr, ibv_reg_mr);
 
 int __ibv_rereg_mr(struct ibv_mr *mr, int flags,
@@ -369,6 +381,12 @@ int __ibv_rereg_mr(struct ibv_mr *mr, int flags,
 		return IBV_REREG_MR_ERR_INPUT;
 	}
 
+	/* A cached MR must not change under its other users */
+	if (ibv_mr_cache_enabled && ibv_mr_cache_detach(mr)) {
+		errno = EBUSY;
+		return IBV_REREG_MR_ERR_INPUT;
+	}
+
 	if (flags & IBV_REREG_MR_CHANGE_TRANSLATION) {
 		err = ibv_dontfork_range(addr, length);
 		if (err)
@@ -401,7 +419,7 @@ int __ibv_rereg_mr(struct ibv_mr *mr, int flags,
 }
 default_symver(__ibv_rereg_mr, ibv_rereg_mr);
 
-int __ibv_dereg_mr(struct ibv_mr *mr)
+int ibv_dereg_mr_nocache(struct ibv_mr *mr)
 {
 	int ret;
 	struct verbs_context_exp *vctx;
@@ -425,6 +443,14 @@ int __ibv_dereg_mr(struct ibv_mr *mr)
 
 	return ret;
 }
+
+int __ibv_dereg_mr(struct ibv_mr *mr)
+{
+	if (ibv_mr_cache_enabled && !ibv_mr_cache_release(mr))
+		return 0;
+
+	return ibv_dereg_mr_nocache(mr);
+}
 default_symver(__ibv_dereg_mr, ibv_dereg_mr);
 
 static struct ibv_comp_channel *ibv_create_comp_channel_v2(struct ibv_context *context)
@@ -302,6 +302,7 @@ static void handle_ec_comp(struct mlx5_ec_calc *calc, struct ibv_wc *wc)
 
 		if (wc->wr_id == EC_BEACON_WRID) {
 			pthread_mutex_lock(&calc->beacon_mutex);
+			calc->beacons++;
 			pthread_cond_signal(&calc->beacon_cond);
 			pthread_mutex_unlock(&calc->beacon_mutex);
 			return;
@@ -333,13 +334,13 @@ static void handle_ec_comp(struct mlx5_ec_calc *calc, struct ibv_wc *wc)
 	}
 }
 
-static int ec_poll_cq(struct mlx5_ec_calc *calc, int budget)
+static int ec_poll_cq(struct mlx5_ec_calc *calc, struct ibv_cq *cq, int budget)
 {
 	struct ibv_wc wcs[EC_POLL_BATCH];
 	int poll_batch = min(EC_POLL_BATCH, budget);
 	int i, n, count = 0;
 
-	while ((n = ibv_poll_cq(calc->cq, poll_batch, wcs)) > 0) {
+	while ((n = ibv_poll_cq(cq, poll_batch, wcs)) > 0) {
 		if (unlikely(n < 0)) {
 			fprintf(stderr, "poll CQ failed\n");
 			return n;
@@ -356,7 +357,8 @@ static int ec_poll_cq(struct mlx5_ec_calc *calc, int budget)
 	return count;
 }
 
-static int mlx5_ec_poll_cq(struct mlx5_ec_calc *calc)
+/* nevents[] counts the events got on calc->cq and calc->pipe_cq */
+static int mlx5_ec_poll_cq(struct mlx5_ec_calc *calc, int *nevents)
 {
 	struct ibv_cq *ev_cq;
 	void *ev_ctx;
@@ -366,18 +368,19 @@ static int mlx5_ec_poll_cq(struct mlx5_ec_calc *calc)
 	if (unlikely(err))
 		return err;
 
-	if (unlikely(ev_cq != calc->cq)) {
+	if (unlikely(ev_cq != calc->cq && ev_cq != calc->pipe_cq)) {
 		fprintf(stderr, "CQ event for unknown CQ %p\n", ev_cq);
 		return -1;
 	}
+	nevents[ev_cq != calc->cq]++;
 
-	if (ibv_req_notify_cq(calc->cq, 0)) {
+	if (ibv_req_notify_cq(ev_cq, 0)) {
 		fprintf(stderr, "Couldn't request CQ notification\n");
 		return -1;
 	}
 
 	do {
-		count = ec_poll_cq(calc, EC_POLL_BUDGET);
+		count = ec_poll_cq(calc, ev_cq, EC_POLL_BUDGET);
 	} while (count > 0);
 
 	return 0;
@@ -390,7 +393,7 @@ static void ec_sig_handler(int signo)
 void *handle_comp_events(void *data)
 {
 	struct mlx5_ec_calc *calc = data;
-	int n = 0;
+	int n[2] = { 0, 0 };
 	struct sigaction sa = { };
 
 	sigemptyset(&sa.sa_mask);
@@ -398,20 +401,26 @@ void *handle_comp_events(void *data)
 	sigaction(SIGINT, &sa, 0);
 
 	while (!calc->stop_ec_poller) {
-		if(unlikely(mlx5_ec_poll_cq(calc)))
+		if(unlikely(mlx5_ec_poll_cq(calc, n)))
 			break;
-		if (n++ == EC_ACK_NEVENTS) {
-			ibv_ack_cq_events(calc->cq, n);
-			n = 0;
+		if (n[0] == EC_ACK_NEVENTS) {
+			ibv_ack_cq_events(calc->cq, n[0]);
+			n[0] = 0;
+		}
+		if (n[1] == EC_ACK_NEVENTS) {
+			ibv_ack_cq_events(calc->pipe_cq, n[1]);
+			n[1] = 0;
 		}
 	}
 
-	ibv_ack_cq_events(calc->cq, n);
+	ibv_ack_cq_events(calc->cq, n[0]);
+	if (calc->pipe_cq)
+		ibv_ack_cq_events(calc->pipe_cq, n[1]);
 
 	return NULL;
 }
 
-struct ibv_qp *alloc_calc_qp(struct mlx5_ec_calc *calc)
+struct ibv_qp *alloc_calc_qp(struct mlx5_ec_calc *calc, struct ibv_cq *cq)
 {
 	struct ibv_qp_init_attr qp_init_attr;
 	struct ibv_qp_attr qp_attr;
@@ -435,8 +444,8 @@ struct ibv_qp *alloc_calc_qp(struct mlx5_ec_calc *calc)
 	};
 
 	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-	qp_init_attr.send_cq = calc->cq;
-	qp_init_attr.recv_cq = calc->cq;
+	qp_init_attr.send_cq = cq;
+	qp_init_attr.recv_cq = cq;
 	/* FIXME: should really communicate that we do UMRs */
 	qp_init_attr.cap.max_send_wr = calc->max_inflight_calcs * MLX5_EC_MAX_WQE_BBS;
 	qp_init_attr.cap.max_recv_wr = calc->max_inflight_calcs;
@@ -862,6 +871,177 @@ free_dump:
 	return err;
 }
 
+static void free_calc_qps(struct mlx5_ec_calc *calc)
+{
+	int i;
+
+	for (i = 0; i < calc->nqps; i++)
+		ibv_destroy_qp(calc->qps[i]);
+}
+
+static int alloc_calc_qps(struct mlx5_ec_calc *calc)
+{
+	int i;
+
+	for (i = 0; i < calc->nqps; i++) {
+		calc->qps[i] = alloc_calc_qp(calc, i ? calc->pipe_cq : calc->cq);
+		if (!calc->qps[i]) {
+			while (i--)
+				ibv_destroy_qp(calc->qps[i]);
+			return ENOMEM;
+		}
+	}
+	calc->qp = calc->qps[0];
+
+	return 0;
+}
+
+/*
+ * Calcs are spread round robin over the calc QPs so one op's UMRs and
+ * vector calc don't serialize behind another's. encode_send keeps using
+ * calc->qp, the only QP counted in cq_count.
+ */
+static inline struct mlx5_qp *ec_get_qp(struct mlx5_ec_calc *calc)
+{
+	unsigned int i;
+
+	if (calc->nqps == 1)
+		return to_mqp(calc->qp);
+
+	i = __atomic_fetch_add(&calc->next_qp, 1, __ATOMIC_RELAXED);
+
+	return to_mqp(calc->qps[i % calc->nqps]);
+}
+
+static void free_dec_cache(struct mlx5_ec_calc *calc)
+{
+	struct mlx5_ec_dec_cache *cache = &calc->dec_cache;
+
+	free(cache->buf);
+	free(cache->ents);
+	free(cache->enc);
+}
+
+static int alloc_dec_cache(struct mlx5_ec_calc *calc,
+			   struct ibv_exp_ec_calc_init_attr *attr)
+{
+	struct mlx5_ec_dec_cache *cache = &calc->dec_cache;
+	int n = calc->k + calc->m;
+	size_t ent_size = n + calc->k * calc->m;
+	int size = MLX5_EC_DEC_CACHE;
+	char env[16];
+	int i;
+
+	INIT_LIST_HEAD(&cache->lru);
+	INIT_LIST_HEAD(&cache->free);
+	mlx5_lock_init(&cache->lock, 1, mlx5_get_locktype());
+
+	/* decode matrices are only derived in GF(2^8) */
+	if (calc->w != 8)
+		return 0;
+
+	cache->enc = malloc(calc->k * calc->m);
+	if (!cache->enc)
+		return ENOMEM;
+	memcpy(cache->enc, attr->encode_matrix, calc->k * calc->m);
+
+	if (!ibv_exp_cmd_getenv(calc->pd->context, "MLX5_EC_DEC_CACHE",
+				env, sizeof(env)))
+		size = atoi(env);
+	if (size <= 0)
+		return 0;
+
+	cache->ents = calloc(size, sizeof(*cache->ents));
+	cache->buf = malloc(size * ent_size);
+	if (!cache->ents || !cache->buf) {
+		fprintf(stderr, "failed to alloc decode matrix cache\n");
+		free_dec_cache(calc);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < size; i++) {
+		cache->ents[i].erasures = cache->buf + i * ent_size;
+		cache->ents[i].mat = cache->ents[i].erasures + n;
+		list_add_tail(&cache->ents[i].node, &cache->free);
+	}
+
+	return 0;
+}
+
+static uint32_t ec_dec_hash(const uint8_t *erasures, int n)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < n; i++)
+		hash = (hash ^ erasures[i]) * 16777619;
+
+	return hash;
+}
+
+/*
+ * Fills mat with the decode matrix for erasures, from the cache or
+ * derived from the encode matrix. The inversion runs unlocked, so two
+ * racing misses may both cache a pattern; the spare copy just ages out.
+ */
+static int ec_get_dec_matrix(struct mlx5_ec_calc *calc, uint8_t *erasures,
+			     uint8_t *mat)
+{
+	struct mlx5_ec_dec_cache *cache = &calc->dec_cache;
+	struct mlx5_ec_dec_ent *ent;
+	int n = calc->k + calc->m;
+	uint8_t key[n];
+	uint32_t hash;
+	int i, err, ne = 0;
+
+	if (!cache->enc) {
+		fprintf(stderr, "decode matrix is required for w = %d\n",
+			calc->w);
+		return EINVAL;
+	}
+
+	for (i = 0; i < n; i++) {
+		key[i] = !!erasures[i];
+		ne += key[i];
+	}
+	hash = ec_dec_hash(key, n);
+
+	mlx5_lock(&cache->lock);
+	list_for_each_entry(ent, &cache->lru, node) {
+		if (ent->hash == hash && !memcmp(ent->erasures, key, n)) {
+			memcpy(mat, ent->mat, calc->k * ne);
+			list_move(&ent->node, &cache->lru);
+			mlx5_unlock(&cache->lock);
+			return 0;
+		}
+	}
+	mlx5_unlock(&cache->lock);
+
+	err = mlx5_ec_gf_decode_matrix(calc->k, calc->m, cache->enc, key, mat);
+	if (err) {
+		fprintf(stderr, "erasures can not be decoded\n");
+		return err;
+	}
+
+	if (!cache->ents)
+		return 0;
+
+	mlx5_lock(&cache->lock);
+	if (!list_empty(&cache->free))
+		ent = list_first_entry(&cache->free, struct mlx5_ec_dec_ent,
+				       node);
+	else
+		ent = list_entry(cache->lru.prev, struct mlx5_ec_dec_ent,
+				 node);
+	ent->hash = hash;
+	memcpy(ent->erasures, key, n);
+	memcpy(ent->mat, mat, calc->k * ne);
+	list_move(&ent->node, &cache->lru);
+	mlx5_unlock(&cache->lock);
+
+	return 0;
+}
+
 static int
 ec_attr_sanity_checks(struct ibv_exp_ec_calc_init_attr *attr)
 {
@@ -908,6 +1088,7 @@ mlx5_alloc_ec_calc(struct ibv_pd *pd,
 {
 	struct mlx5_ec_calc *calc;
 	struct ibv_exp_ec_calc *ibcalc;
+	char env[16];
 	void *status;
 	int err;
 
@@ -940,10 +1121,34 @@ mlx5_alloc_ec_calc(struct ibv_pd *pd,
 	calc->w = attr->w;
 	calc->polling = attr->polling;
 
+	err = alloc_dec_cache(calc, attr);
+	if (err) {
+		errno = err;
+		goto free_calc;
+	}
+
+	if (mlx5_ec_sw_wanted(pd, attr)) {
+		err = mlx5_ec_sw_init(calc, attr);
+		if (err) {
+			errno = err;
+			goto free_dec_cache;
+		}
+		return ibcalc;
+	}
+
+	calc->nqps = 1;
+	if (!ibv_exp_cmd_getenv(pd->context, "MLX5_EC_CALC_QPS",
+				env, sizeof(env)))
+		calc->nqps = atoi(env);
+	if (calc->nqps < 1)
+		calc->nqps = 1;
+	if (calc->nqps > MLX5_EC_MAX_QPS)
+		calc->nqps = MLX5_EC_MAX_QPS;
+
 	calc->channel = ibv_create_comp_channel(calc->pd->context);
 	if (!calc->channel) {
 		fprintf(stderr, "failed to alloc calc channel\n");
-		goto free_calc;
+		goto free_dec_cache;
 	};
 
 	calc->cq = ibv_create_cq(calc->pd->context,
@@ -954,18 +1159,32 @@ mlx5_alloc_ec_calc(struct ibv_pd *pd,
 		goto free_channel;
 	};
 
+	if (calc->nqps > 1) {
+		calc->pipe_cq = ibv_create_cq(calc->pd->context,
+					      calc->max_inflight_calcs *
+					      MLX5_EC_CQ_FACTOR,
+					      NULL, calc->channel,
+					      attr->affinity_hint);
+		if (!calc->pipe_cq) {
+			fprintf(stderr, "failed to alloc calc pipe cq\n");
+			goto free_cq;
+		}
+	}
+
 	if (!calc->polling) {
 		err = ibv_req_notify_cq(calc->cq, 0);
+		if (!err && calc->pipe_cq)
+			err = ibv_req_notify_cq(calc->pipe_cq, 0);
 		if (err) {
 			fprintf(stderr, "failed to req notify cq\n");
-			goto free_cq;
+			goto free_pipe_cq;
 		}
 
 		err = pthread_create(&calc->ec_poller, NULL,
 				     handle_comp_events, calc);
 		if (err) {
 			fprintf(stderr, "failed to create ec_poller\n");
-			goto free_cq;
+			goto free_pipe_cq;
 		}
 	}
 
@@ -973,8 +1192,8 @@ mlx5_alloc_ec_calc(struct ibv_pd *pd,
 	if (err)
 		goto free_ec_poller;
 
-	calc->qp = alloc_calc_qp(calc);
-	if (!calc->qp)
+	err = alloc_calc_qps(calc);
+	if (err)
 		goto encode_matrix;
 
 	err = alloc_matrices(calc);
@@ -1002,7 +1221,7 @@ free_dump:
 free_mat:
 	free_matrices(calc);
 calc_qp:
-	ibv_destroy_qp(calc->qp);
+	free_calc_qps(calc);
 encode_matrix:
 	dereg_encode_matrix(calc);
 free_ec_poller:
@@ -1012,10 +1231,15 @@ free_ec_poller:
 		pthread_kill(calc->ec_poller, SIGINT);
 		pthread_join(calc->ec_poller, &status);
 	}
+free_pipe_cq:
+	if (calc->pipe_cq)
+		ibv_destroy_cq(calc->pipe_cq);
 free_cq:
 	ibv_destroy_cq(calc->cq);
 free_channel:
 	ibv_destroy_comp_channel(calc->channel);
+free_dec_cache:
+	free_dec_cache(calc);
 free_calc:
 	free(calc);
 
@@ -1028,27 +1252,42 @@ mlx5_dealloc_ec_calc(struct ibv_exp_ec_calc *ec_calc)
 	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
 	struct ibv_qp_attr qp_attr;
 	void *status;
-	int err;
+	int i, err;
 
-	qp_attr.qp_state = IBV_QPS_ERR;
-	err = ibv_modify_qp(calc->qp, &qp_attr, IBV_QP_STATE);
-	if (err) {
-		perror("failed to modify calc qp to ERR");
+	if (calc->sw) {
+		mlx5_ec_sw_cleanup(calc);
+		free_dec_cache(calc);
+		free(calc);
 		return;
 	}
 
+	qp_attr.qp_state = IBV_QPS_ERR;
+	for (i = 0; i < calc->nqps; i++) {
+		err = ibv_modify_qp(calc->qps[i], &qp_attr, IBV_QP_STATE);
+		if (err) {
+			perror("failed to modify calc qp to ERR");
+			return;
+		}
+	}
+
 	if (!calc->polling) {
 		pthread_mutex_init(&calc->beacon_mutex, NULL);
 		pthread_cond_init(&calc->beacon_cond, NULL);
 
-		err = ec_post_recv(calc->qp, NULL, (void *)EC_BEACON_WRID);
-		if (err) {
-			perror("failed to post beacon\n");
-			goto free;
+		/* a beacon flushes out of each QP behind its last calc */
+		for (i = 0; i < calc->nqps; i++) {
+			err = ec_post_recv(calc->qps[i], NULL,
+					   (void *)EC_BEACON_WRID);
+			if (err) {
+				perror("failed to post beacon\n");
+				goto free;
+			}
 		}
 
 		pthread_mutex_lock(&calc->beacon_mutex);
-		pthread_cond_wait(&calc->beacon_cond, &calc->beacon_mutex);
+		while (calc->beacons < calc->nqps)
+			pthread_cond_wait(&calc->beacon_cond,
+					  &calc->beacon_mutex);
 		pthread_mutex_unlock(&calc->beacon_mutex);
 	}
 
@@ -1057,7 +1296,7 @@ free:
 	free_comps(calc);
 	free_dump(calc);
 	free_matrices(calc);
-	ibv_destroy_qp(calc->qp);
+	free_calc_qps(calc);
 	dereg_encode_matrix(calc);
 
 	if (!calc->polling) {
@@ -1067,8 +1306,11 @@ free:
 		pthread_join(calc->ec_poller, &status);
 	}
 
+	if (calc->pipe_cq)
+		ibv_destroy_cq(calc->pipe_cq);
 	ibv_destroy_cq(calc->cq);
 	ibv_destroy_comp_channel(calc->channel);
+	free_dec_cache(calc);
 	free(calc);
 }
 
@@ -1133,11 +1375,11 @@ rewind_sq(struct mlx5_qp *qp, void **seg, int *size, int *inc)
 
 static void
 set_ec_umr_pattern_ds(struct mlx5_ec_calc *calc,
+		      struct mlx5_qp *qp,
 		      struct ibv_sge *klms,
 		      int nklms, int nrklms,
 		      void **seg, int *size)
 {
-	struct mlx5_qp *qp = to_mqp(calc->qp);
 	struct mlx5_seg_repeat_block *rb;
 	struct mlx5_seg_repeat_ent *re;
 	int set, i, inc_size;
@@ -1187,11 +1429,11 @@ set_ec_umr_pattern_ds(struct mlx5_ec_calc *calc,
 
 static void
 set_ec_umr_klm_ds(struct mlx5_ec_calc *calc,
+		  struct mlx5_qp *qp,
 		  struct ibv_sge *klms,
 		  int nklms,
 		  void **seg, int *size)
 {
-	struct mlx5_qp *qp = to_mqp(calc->qp);
 	struct mlx5_klm *klm;
 	int set, i, inc_size;
 
@@ -1219,13 +1461,13 @@ set_ec_umr_klm_ds(struct mlx5_ec_calc *calc,
 
 static void
 post_ec_umr(struct mlx5_ec_calc *calc,
+	    struct mlx5_qp *qp,
 	    struct ibv_sge *klms,
 	    int nklms,
 	    int pattern,
 	    uint32_t umr_key,
 	    void **seg, int *size)
 {
-	struct mlx5_qp *qp = to_mqp(calc->qp);
 	struct mlx5_wqe_ctrl_seg *ctrl;
 	int nrklms = MLX5_EC_NOUTPUTS(nklms);
 
@@ -1248,9 +1490,9 @@ post_ec_umr(struct mlx5_ec_calc *calc,
 		*seg = mlx5_get_send_wqe(qp, 0);
 
 	if (pattern)
-		set_ec_umr_pattern_ds(calc, klms, nklms, nrklms, seg, size);
+		set_ec_umr_pattern_ds(calc, qp, klms, nklms, nrklms, seg, size);
 	else
-		set_ec_umr_klm_ds(calc, klms, nklms, seg, size);
+		set_ec_umr_klm_ds(calc, qp, klms, nklms, seg, size);
 
 	set_ctrl_seg((uint32_t *)ctrl, &qp->ctrl_seg,
 		     MLX5_OPCODE_UMR, qp->gen_data.scur_post, 0, *size,
@@ -1261,6 +1503,7 @@ post_ec_umr(struct mlx5_ec_calc *calc,
 
 static void
 post_ec_vec_calc(struct mlx5_ec_calc *calc,
+		 struct mlx5_qp *qp,
 		 struct ibv_sge *klm,
 		 int block_size,
 		 int nvecs,
@@ -1270,7 +1513,6 @@ post_ec_vec_calc(struct mlx5_ec_calc *calc,
 		 int signal,
 		 void *seg, int *size)
 {
-	struct mlx5_qp *qp = to_mqp(calc->qp);
 	struct mlx5_wqe_ctrl_seg *ctrl;
 	struct mlx5_vec_calc_seg *vc;
 	uint8_t fm_ce_se;
@@ -1343,6 +1585,7 @@ static void finish_wqe(struct mlx5_qp *qp, int idx,
 }
 
 static int ec_post_pad_umrs(struct mlx5_ec_calc *calc,
+			    struct mlx5_qp *qp,
 			    struct mlx5_ec_comp *comp,
 			    struct ibv_exp_ec_mem *ec_mem,
 			    int padding,
@@ -1353,7 +1596,6 @@ static int ec_post_pad_umrs(struct mlx5_ec_calc *calc,
 	int i, j;
 	int m = ec_mem->num_code_sge;
 	struct ibv_sge padded_klms[m << 1];
-	struct mlx5_qp *qp = to_mqp(calc->qp);
 	struct ibv_sge *code = ec_mem->code_blocks;
 
 	if (likely(!padding))
@@ -1368,7 +1610,7 @@ static int ec_post_pad_umrs(struct mlx5_ec_calc *calc,
 		padded_klms[j + 1].lkey = calc->dump_mr->lkey;
 		padded_klms[j + 1].length = padding;
 		*idx = begin_wqe(qp, &seg);
-		post_ec_umr(calc, padded_klms + j, 2, 0,
+		post_ec_umr(calc, qp, padded_klms + j, 2, 0,
 				comp->pad_mrs[i]->lkey, &seg, size);
 		finish_wqe(qp, *idx, *size, NULL);
 	}
@@ -1482,13 +1724,13 @@ static int mlx5_set_encode_data(struct mlx5_ec_calc *calc,
 }
 
 static int __mlx5_ec_encode_async(struct mlx5_ec_calc *calc,
+				  struct mlx5_qp *qp,
 				  int k, int m,
 				  uint8_t *mat, uint32_t mat_lkey,
 				  struct ibv_exp_ec_mem *ec_mem,
 				  struct ibv_exp_ec_comp *ec_comp,
 				  struct mlx5_ec_mat *ec_mat)
 {
-	struct mlx5_qp *qp = to_mqp(calc->qp);
 	struct mlx5_ec_comp *comp;
 	struct ibv_sge klms[MLX5_EC_NUM_OUTPUTS];
 	struct ibv_sge in, out, *out_ptr = NULL;
@@ -1529,13 +1771,13 @@ static int __mlx5_ec_encode_async(struct mlx5_ec_calc *calc,
 		goto comp_error;
 	}
 
-	wqe_count += ec_post_pad_umrs(calc, comp, ec_mem, padding,
+	wqe_count += ec_post_pad_umrs(calc, qp, comp, ec_mem, padding,
 			&idx, seg, &size);
 
 	if (m > 1 || padding) {
 		/* post pattern KLM - non-signaled */
 		idx = begin_wqe(qp, &seg);
-		post_ec_umr(calc, klms, m, 1, comp->outumr->lkey, &seg, &size);
+		post_ec_umr(calc, qp, klms, m, 1, comp->outumr->lkey, &seg, &size);
 		finish_wqe(qp, idx, size, NULL);
 		wqe_count++;
 	}
@@ -1544,7 +1786,7 @@ static int __mlx5_ec_encode_async(struct mlx5_ec_calc *calc,
 		/* post UMR of input - non-signaled */
 		idx = begin_wqe(qp, &seg);
 		blocks = padding ? k << 1 : k;
-		post_ec_umr(calc, data, blocks, 0,
+		post_ec_umr(calc, qp, data, blocks, 0,
 			    comp->inumr->lkey, &seg, &size);
 		finish_wqe(qp, idx, size, NULL);
 		wqe_count++;
@@ -1552,7 +1794,7 @@ static int __mlx5_ec_encode_async(struct mlx5_ec_calc *calc,
 
 	/* post vec_calc SEND - non-signaled */
 	idx = begin_wqe(qp, &seg);
-	post_ec_vec_calc(calc, &in, ec_mem->block_size + padding,
+	post_ec_vec_calc(calc, qp, &in, ec_mem->block_size + padding,
 			 k, m, mat, mat_lkey,
 			 0, seg, &size);
 	finish_wqe(qp, idx, size, NULL);
@@ -1564,7 +1806,8 @@ static int __mlx5_ec_encode_async(struct mlx5_ec_calc *calc,
 		  qp->gen_data.scur_post & 0xffff,
 		  seg, (size + 3) / 4);
 
-	calc->cq_count += 1;
+	if (qp == to_mqp(calc->qp))
+		calc->cq_count += 1;
 
 	return 0;
 
@@ -1633,6 +1876,7 @@ mlx5_multi_done(struct ibv_exp_ec_comp *comp)
 }
 
 int mlx5_ec_encode_async_big_m(struct mlx5_ec_calc *calc,
+			       struct mlx5_qp *qp,
 			       struct ibv_exp_ec_mem *ec_mem,
 			       struct ibv_exp_ec_comp *ec_comp)
 {
@@ -1663,7 +1907,7 @@ int mlx5_ec_encode_async_big_m(struct mlx5_ec_calc *calc,
 							calc->mult_num,
 							ec_mem->num_code_sge);
 		curr_mat = calc->matrices[i];
-		ret = __mlx5_ec_encode_async(calc, calc->k,
+		ret = __mlx5_ec_encode_async(calc, qp, calc->k,
 					     curr_ec_mem.num_code_sge, curr_mat,
 					     calc->mat_mr->lkey, &curr_ec_mem,
 					     &def_comp->comp, NULL);
@@ -1678,20 +1922,24 @@ int mlx5_ec_encode_async(struct ibv_exp_ec_calc *ec_calc,
 			 struct ibv_exp_ec_comp *ec_comp)
 {
 	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
-	struct mlx5_qp *qp = to_mqp(calc->qp);
+	struct mlx5_qp *qp;
 	int ret;
 
 	ret = check_sge(calc, ec_mem);
 	if (ret < 0)
 		return ret;
 
+	if (calc->sw)
+		return mlx5_ec_sw_encode(calc, ec_mem, ec_comp);
+
+	qp = ec_get_qp(calc);
 	mlx5_lock(&qp->sq.lock);
 	if (calc->m <= MLX5_EC_NUM_OUTPUTS)
-		ret = __mlx5_ec_encode_async(calc, calc->k, calc->m, calc->mat,
-					     calc->mat_mr->lkey, ec_mem,
-					     ec_comp, NULL);
+		ret = __mlx5_ec_encode_async(calc, qp, calc->k, calc->m,
+					     calc->mat, calc->mat_mr->lkey,
+					     ec_mem, ec_comp, NULL);
 	else
-		ret = mlx5_ec_encode_async_big_m(calc, ec_mem, ec_comp);
+		ret = mlx5_ec_encode_async_big_m(calc, qp, ec_mem, ec_comp);
 	mlx5_unlock(&qp->sq.lock);
 
 	return ret;
@@ -1718,6 +1966,7 @@ static int check_update_params(int k, int m, uint8_t *data_updates, int *num)
 }
 
 static int __mlx5_ec_update_async(struct mlx5_ec_calc *calc,
+				  struct mlx5_qp *qp,
 				  struct ibv_exp_ec_mem *ec_mem,
 				  uint8_t *data_updates,
 				  uint8_t *code_updates,
@@ -1738,7 +1987,7 @@ static int __mlx5_ec_update_async(struct mlx5_ec_calc *calc,
 	}
 
 	/* Get new code */
-	ret = __mlx5_ec_encode_async(calc, ec_mem->num_data_sge,
+	ret = __mlx5_ec_encode_async(calc, qp, ec_mem->num_data_sge,
 				     ec_mem->num_code_sge,
 				     (uint8_t *)(uintptr_t)update_mat->sge.addr,
 				     update_mat->sge.lkey,
@@ -1748,6 +1997,7 @@ static int __mlx5_ec_update_async(struct mlx5_ec_calc *calc,
 }
 
 int mlx5_ec_update_async_big_m(struct mlx5_ec_calc *calc,
+			       struct mlx5_qp *qp,
 			       struct ibv_exp_ec_mem *ec_mem,
 			       uint8_t *data_updates,
 			       uint8_t *code_updates,
@@ -1798,7 +2048,7 @@ int mlx5_ec_update_async_big_m(struct mlx5_ec_calc *calc,
 			curr_ec_mem.num_data_sge = curr_codes +
 						   2 * num_updated_data;
 
-			ret = __mlx5_ec_update_async(calc,
+			ret = __mlx5_ec_update_async(calc, qp,
 						     &curr_ec_mem,
 						     data_updates,
 						     code_updates,
@@ -1825,7 +2075,7 @@ int mlx5_ec_update_async(struct ibv_exp_ec_calc *ec_calc,
 			 struct ibv_exp_ec_comp *ec_comp)
 {
 	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
-	struct mlx5_qp *qp = to_mqp(calc->qp);
+	struct mlx5_qp *qp;
 	int ret, num_updates = 0;
 
 	/* Check that update is worth an effort */
@@ -1835,14 +2085,18 @@ int mlx5_ec_update_async(struct ibv_exp_ec_calc *ec_calc,
 		return -EINVAL;
 	}
 
+	if (calc->sw)
+		return mlx5_ec_sw_update(calc, ec_mem, data_updates,
+					 code_updates, ec_comp);
 
+	qp = ec_get_qp(calc);
 	mlx5_lock(&qp->sq.lock);
 	if (ec_mem->num_code_sge <= MLX5_EC_NUM_OUTPUTS)
-		ret = __mlx5_ec_update_async(calc, ec_mem, data_updates,
+		ret = __mlx5_ec_update_async(calc, qp, ec_mem, data_updates,
 					     code_updates, ec_comp,
 					     0, calc->m - 1);
 	else
-		ret = mlx5_ec_update_async_big_m(calc, ec_mem, data_updates,
+		ret = mlx5_ec_update_async_big_m(calc, qp, ec_mem, data_updates,
 						 code_updates, ec_comp,
 						 num_updates);
 	mlx5_unlock(&qp->sq.lock);
@@ -1976,6 +2230,7 @@ static int set_decode_klms(struct mlx5_ec_calc *calc,
 }
 
 static int __mlx5_ec_decode_async(struct mlx5_ec_calc *calc,
+			 struct mlx5_qp *qp,
 			 struct ibv_exp_ec_mem *ec_mem,
 			 uint8_t *erasures,
 			 uint8_t *decode_matrix,
@@ -1986,7 +2241,6 @@ static int __mlx5_ec_decode_async(struct mlx5_ec_calc *calc,
 			 int start_idx,
 			 int end_idx)
 {
-	struct mlx5_qp *qp = to_mqp(calc->qp);
 	struct mlx5_ec_mat *decode;
 	struct mlx5_ec_comp *comp;
 	struct ibv_sge in_klms[calc->k << 1];
@@ -2024,7 +2278,7 @@ static int __mlx5_ec_decode_async(struct mlx5_ec_calc *calc,
 		goto comp_error;
 
 	/* post recv for calc SEND */
-	err = ec_post_recv(calc->qp, &out, comp);
+	err = ec_post_recv(&qp->verbs_qp.qp, &out, comp);
 	if (unlikely(err)) {
 		fprintf(stderr, "failed to post recv calc\n");
 		goto comp_error;
@@ -2034,7 +2288,7 @@ static int __mlx5_ec_decode_async(struct mlx5_ec_calc *calc,
 		for (i = 0; i < m; i++) {
 			j =  i << 1;
 			idx = begin_wqe(qp, &seg);
-			post_ec_umr(calc, padded_klms + j, 2, 0,
+			post_ec_umr(calc, qp, padded_klms + j, 2, 0,
 					comp->pad_mrs[i]->lkey, &seg, &size);
 			finish_wqe(qp, idx, size, NULL);
 		}
@@ -2044,7 +2298,7 @@ static int __mlx5_ec_decode_async(struct mlx5_ec_calc *calc,
 	if (m > 1 || padding) {
 		/* post pattern KLM of output - non-signaled */
 		idx = begin_wqe(qp, &seg);
-		post_ec_umr(calc, out_klms, m, 1, comp->outumr->lkey, &seg, &size);
+		post_ec_umr(calc, qp, out_klms, m, 1, comp->outumr->lkey, &seg, &size);
 		finish_wqe(qp, idx, size, NULL);
 		wqe_count++;
 	}
@@ -2052,13 +2306,13 @@ static int __mlx5_ec_decode_async(struct mlx5_ec_calc *calc,
 	/* post UMR of input - non-signaled */
 	idx = begin_wqe(qp, &seg);
 	blocks = padding ? k << 1 : k;
-	post_ec_umr(calc, in_klms, blocks, 0, comp->inumr->lkey, &seg, &size);
+	post_ec_umr(calc, qp, in_klms, blocks, 0, comp->inumr->lkey, &seg, &size);
 	finish_wqe(qp, idx, size, NULL);
 	wqe_count++;
 
 	/* post vec_calc SEND - non-signaled */
 	idx = begin_wqe(qp, &seg);
-	post_ec_vec_calc(calc, &in, ec_mem->block_size + padding, k, m,
+	post_ec_vec_calc(calc, qp, &in, ec_mem->block_size + padding, k, m,
 			 (void *)(uintptr_t)decode->sge.addr, decode->sge.lkey,
 			 0, seg, &size);
 	finish_wqe(qp, idx, size, NULL);
@@ -2070,7 +2324,8 @@ static int __mlx5_ec_decode_async(struct mlx5_ec_calc *calc,
 		  qp->gen_data.scur_post & 0xffff,
 		  seg, (size + 3) / 4);
 
-	calc->cq_count += 2;
+	if (qp == to_mqp(calc->qp))
+		calc->cq_count += 2;
 
 	return 0;
 
@@ -2085,6 +2340,7 @@ mat_error:
 }
 
 int mlx5_ec_decode_async_big_m(struct mlx5_ec_calc *calc,
+			       struct mlx5_qp *qp,
 			       struct ibv_exp_ec_mem *ec_mem,
 			       uint8_t *erasures,
 			       uint8_t *decode_matrix,
@@ -2128,7 +2384,7 @@ int mlx5_ec_decode_async_big_m(struct mlx5_ec_calc *calc,
 			 * of the current calculation.
 			 */
 			end_idx = i;
-			ret = __mlx5_ec_decode_async(calc,
+			ret = __mlx5_ec_decode_async(calc, qp,
 						     ec_mem,
 						     erasures,
 						     decode_matrix,
@@ -2158,21 +2414,34 @@ int mlx5_ec_decode_async(struct ibv_exp_ec_calc *ec_calc,
 			 struct ibv_exp_ec_comp *ec_comp)
 {
 	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
-	struct mlx5_qp *qp = to_mqp(calc->qp);
+	uint8_t dec_mat[calc->k * calc->m];
+	struct mlx5_qp *qp;
 	int ret, i, num_erasures = 0;
 
+	if (!decode_matrix) {
+		ret = ec_get_dec_matrix(calc, erasures, dec_mat);
+		if (ret)
+			return ret;
+		decode_matrix = dec_mat;
+	}
+
+	if (calc->sw)
+		return mlx5_ec_sw_decode(calc, ec_mem, erasures,
+					 decode_matrix, ec_comp);
+
 	for (i = 0; i < calc->k + calc->m; i++)
 		if (erasures[i])
 			num_erasures++;
 
+	qp = ec_get_qp(calc);
 	mlx5_lock(&qp->sq.lock);
 	if (num_erasures <= MLX5_EC_NUM_OUTPUTS)
-		ret = __mlx5_ec_decode_async(calc, ec_mem, erasures,
+		ret = __mlx5_ec_decode_async(calc, qp, ec_mem, erasures,
 					     decode_matrix, ec_comp,
 					     num_erasures, num_erasures,
 					     0, 0, calc->k + calc->m - 1);
 	else
-		ret = mlx5_ec_decode_async_big_m(calc, ec_mem, erasures,
+		ret = mlx5_ec_decode_async_big_m(calc, qp, ec_mem, erasures,
 						 decode_matrix, ec_comp,
 						 num_erasures);
 	mlx5_unlock(&qp->sq.lock);
@@ -2193,6 +2462,7 @@ mlx5_sync_done(struct ibv_exp_ec_comp *comp)
 int mlx5_ec_encode_sync(struct ibv_exp_ec_calc *ec_calc,
 			struct ibv_exp_ec_mem *ec_mem)
 {
+	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
 	int err;
 	struct mlx5_ec_sync_comp def_comp = {
 		.comp = {.done = mlx5_sync_done},
@@ -2200,6 +2470,11 @@ int mlx5_ec_encode_sync(struct ibv_exp_ec_calc *ec_calc,
 		.cond = PTHREAD_COND_INITIALIZER,
 	};
 
+	if (calc->sw) {
+		err = check_sge(calc, ec_mem);
+		return err ? err : mlx5_ec_sw_encode(calc, ec_mem, NULL);
+	}
+
 	pthread_mutex_lock(&def_comp.mutex);
 	err = mlx5_ec_encode_async(ec_calc, ec_mem, &def_comp.comp);
 	if (err) {
@@ -2220,13 +2495,24 @@ int mlx5_ec_update_sync(struct ibv_exp_ec_calc *ec_calc,
 			uint8_t *data_updates,
 			uint8_t *code_updates)
 {
-	int err;
+	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
+	int err, num_updates;
 	struct mlx5_ec_sync_comp def_comp = {
 		.comp = {.done = mlx5_sync_done},
 		.mutex = PTHREAD_MUTEX_INITIALIZER,
 		.cond = PTHREAD_COND_INITIALIZER,
 	};
 
+	if (calc->sw) {
+		if (!check_update_params(calc->k, calc->m,
+					 data_updates, &num_updates)) {
+			fprintf(stderr, "Update not supported: encode preferred\n");
+			return -EINVAL;
+		}
+		return mlx5_ec_sw_update(calc, ec_mem, data_updates,
+					 code_updates, NULL);
+	}
+
 	pthread_mutex_lock(&def_comp.mutex);
 	err = mlx5_ec_update_async(ec_calc, ec_mem,
 				   data_updates, code_updates,
@@ -2249,6 +2535,8 @@ int mlx5_ec_decode_sync(struct ibv_exp_ec_calc *ec_calc,
 			uint8_t *erasures,
 			uint8_t *decode_matrix)
 {
+	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
+	uint8_t dec_mat[calc->k * calc->m];
 	int err;
 	struct mlx5_ec_sync_comp def_comp = {
 		.comp = {.done = mlx5_sync_done},
@@ -2256,6 +2544,17 @@ int mlx5_ec_decode_sync(struct ibv_exp_ec_calc *ec_calc,
 		.cond = PTHREAD_COND_INITIALIZER,
 	};
 
+	if (!decode_matrix) {
+		err = ec_get_dec_matrix(calc, erasures, dec_mat);
+		if (err)
+			return err;
+		decode_matrix = dec_mat;
+	}
+
+	if (calc->sw)
+		return mlx5_ec_sw_decode(calc, ec_mem, erasures,
+					 decode_matrix, NULL);
+
 	pthread_mutex_lock(&def_comp.mutex);
 	err = mlx5_ec_decode_async(ec_calc, ec_mem, erasures,
 				   decode_matrix, &def_comp.comp);
@@ -2276,7 +2575,18 @@ int mlx5_ec_poll(struct ibv_exp_ec_calc *ec_calc, int n)
 {
 	struct mlx5_ec_calc *calc = to_mcalc(ec_calc);
 
-	return ec_poll_cq(calc, n);
+	int count, ret;
+
+	if (calc->sw)
+		return mlx5_ec_sw_poll(calc, n);
+
+	count = ec_poll_cq(calc, calc->cq, n);
+	if (count < 0 || count >= n || !calc->pipe_cq)
+		return count;
+
+	ret = ec_poll_cq(calc, calc->pipe_cq, n - count);
+
+	return ret < 0 ? ret : count + ret;
 }
 
 int mlx5_ec_encode_send(struct ibv_exp_ec_calc *ec_calc,
@@ -2291,6 +2601,10 @@ int mlx5_ec_encode_send(struct ibv_exp_ec_calc *ec_calc,
 	struct ibv_send_wr *bad_wr;
 	int i, err;
 
+	if (calc->sw)
+		return mlx5_ec_sw_encode_send(calc, ec_mem, data_stripes,
+					      code_stripes);
+
 	if (calc->polling) {
 		fprintf(stderr, "encode_send is not supported in polling mode\n");
 		return -EINVAL;
@@ -2312,7 +2626,7 @@ int mlx5_ec_encode_send(struct ibv_exp_ec_calc *ec_calc,
 	 * therefore we must poll the cq to ensure we have resources for
 	 * the next calculation.
 	 */
-	if (ec_poll_cq(calc, 1)) {
+	if (ec_poll_cq(calc, calc->cq, 1)) {
 		err = ibv_req_notify_cq(calc->cq, 0);
 		if (unlikely(err)) {
 			fprintf(stderr, "Couldn't request CQ notification\n");
@@ -2321,7 +2635,7 @@ int mlx5_ec_encode_send(struct ibv_exp_ec_calc *ec_calc,
 	}
 	mlx5_lock(&qp->sq.lock);
 	/* post async encode */
-	err = __mlx5_ec_encode_async(calc, calc->k, calc->m, calc->mat,
+	err = __mlx5_ec_encode_async(calc, qp, calc->k, calc->m, calc->mat,
 				     calc->mat_mr->lkey, ec_mem, NULL, NULL);
 	if (unlikely(err)) {
 		fprintf(stderr, "mlx5_ec_encode_async failed\n");
@@ -34,6 +34,7 @@
 #define EC_H
 
 #include "mlx5.h"
+#include "ec_sw.h"
 
 #define EC_ACK_NEVENTS		100
 #define EC_POLL_BATCH		4
@@ -72,6 +73,10 @@
 	((idx) == (num_matrices) - 1 ? \
 	(MLX5_EC_LAST_COLS(m)) : MLX5_EC_NUM_OUTPUTS)
 #define EC_BEACON_WRID		0xfffffffffffffffeULL
+/* MLX5_EC_CALC_QPS: calc QPs ops are spread over, all polled together */
+#define MLX5_EC_MAX_QPS		16
+/* MLX5_EC_DEC_CACHE: decode matrices kept per calc, 0 disables */
+#define MLX5_EC_DEC_CACHE	64
 
 struct mlx5_ec_mat {
 	struct ibv_sge		sge;
@@ -119,11 +124,38 @@ struct mlx5_ec_multi_comp_pool {
 	struct list_head		list;
 };
 
+struct mlx5_ec_dec_ent {
+	struct list_head	node;
+	uint32_t		hash;
+	/* k + m bytes of 0/1, then k x (number of erasures) matrix */
+	uint8_t			*erasures;
+	uint8_t			*mat;
+};
+
+/*
+ * Decode matrices derived from the encode matrix, for decodes posted
+ * with a NULL decode_matrix, by erasure pattern. Most recently used first.
+ */
+struct mlx5_ec_dec_cache {
+	struct mlx5_lock	lock;
+	/* encode matrix as given at alloc, k x m */
+	uint8_t			*enc;
+	struct mlx5_ec_dec_ent	*ents;
+	uint8_t			*buf;
+	struct list_head	lru;
+	struct list_head	free;
+};
+
 struct mlx5_ec_calc {
 	struct ibv_exp_ec_calc	ibcalc;
 	struct ibv_pd		*pd;
 	struct ibv_qp		*qp;
 	struct ibv_cq		*cq;
+	/* qps[0] is qp on cq, the others share pipe_cq */
+	struct ibv_qp		*qps[MLX5_EC_MAX_QPS];
+	int			nqps;
+	unsigned int		next_qp;
+	struct ibv_cq		*pipe_cq;
 	struct ibv_comp_channel *channel;
 	uint8_t			log_chunk_size;
 	uint16_t		cq_count;
@@ -147,6 +179,10 @@ struct mlx5_ec_calc {
 	int			polling;
 	pthread_mutex_t         beacon_mutex;
 	pthread_cond_t          beacon_cond;
+	int			beacons;
+	struct mlx5_ec_dec_cache dec_cache;
+	/* software engine, none of the device resources above are used */
+	struct mlx5_ec_sw	*sw;
 };
 
 static inline struct mlx5_ec_calc *to_mcalc(struct ibv_exp_ec_calc *ec_calc)
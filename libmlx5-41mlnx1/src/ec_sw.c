@@ -0,0 +1,1070 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "ec.h"
+#include "ec_sw.h"
+#include "array_size.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define EC_SW_X86 1
+#endif
+
+/* Bytes of every block handled by one worker at a time, multiple of 64 */
+#define EC_SW_STRIPE		(16 * 1024)
+#define EC_SW_MAX_THREADS	64
+/* Outputs accumulated in registers per pass over the inputs */
+#define EC_SW_GROUP		4
+
+/*
+ * out[o] (^)= sum over r of coef[o * rows + r] * in[r], on bytes
+ * [off, off + len) of every block. acc XORs into out instead of storing.
+ */
+typedef void (*ec_sw_dot_fn)(int rows, int outs, const uint8_t *coef,
+			     uint8_t **in, uint8_t **out,
+			     size_t off, size_t len, int acc);
+
+struct mlx5_ec_sw_job {
+	struct list_head	node;
+	struct ibv_exp_ec_comp	*comp;
+	int			rows;
+	int			outs;
+	const uint8_t		*coef;
+	uint8_t			**in;
+	uint8_t			**out;
+	/* update only: old code blocks, out starts as a copy of them */
+	uint8_t			**base;
+	size_t			len;
+	int			nstripes;
+	int			next;
+	int			pending;
+	uint8_t			*coef_buf;
+};
+
+struct mlx5_ec_sw {
+	int			k;
+	int			m;
+	int			polling;
+	/* encode matrix transposed to m x k, rows of the dot product */
+	uint8_t			*enc;
+	ec_sw_dot_fn		dot;
+	struct mlx5_ec_sw_job	*jobs;
+	void			*job_mem;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct list_head	free;
+	struct list_head	queue;
+	struct list_head	done;
+	int			stop;
+	int			nthreads;
+	pthread_t		*threads;
+};
+
+/*
+ * GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1 (0x11d), as used by jerasure
+ * and ISA-L. Per coefficient c:
+ * gf_nib[c]: c times every low nibble, then every high nibble (pshufb)
+ * gf_aff[c]: multiplication by c as an 8x8 bit matrix (gf2p8affineqb)
+ */
+static uint8_t gf_mul_tbl[256][256];
+static uint8_t gf_nib[256][32] __attribute__((aligned(64)));
+static uint64_t gf_aff[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init(void)
+{
+	uint8_t gf_exp[510];
+	int gf_log[256];
+	int i, j, bit, x = 1;
+	uint64_t aff;
+	uint8_t row;
+
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+
+	for (i = 1; i < 256; i++)
+		for (j = 1; j < 256; j++)
+			gf_mul_tbl[i][j] = gf_exp[gf_log[i] + gf_log[j]];
+
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 16; j++) {
+			gf_nib[i][j] = gf_mul_tbl[i][j];
+			gf_nib[i][16 + j] = gf_mul_tbl[i][j << 4];
+		}
+
+		/* output bit 'bit' is the parity of qword byte 7 - bit & x */
+		aff = 0;
+		for (bit = 0; bit < 8; bit++) {
+			row = 0;
+			for (j = 0; j < 8; j++)
+				row |= ((gf_mul_tbl[i][1 << j] >> bit) & 1) << j;
+			aff |= (uint64_t)row << (8 * (7 - bit));
+		}
+		gf_aff[i] = aff;
+	}
+}
+
+static void ec_sw_dot_scalar(int rows, int outs, const uint8_t *coef,
+			     uint8_t **in, uint8_t **out,
+			     size_t off, size_t len, int acc)
+{
+	const uint8_t *mul, *src;
+	uint8_t *dst;
+	size_t i;
+	int o, r;
+
+	for (o = 0; o < outs; o++) {
+		dst = out[o] + off;
+		for (r = 0; r < rows; r++) {
+			mul = gf_mul_tbl[coef[o * rows + r]];
+			src = in[r] + off;
+			if (!r && !acc)
+				for (i = 0; i < len; i++)
+					dst[i] = mul[src[i]];
+			else
+				for (i = 0; i < len; i++)
+					dst[i] ^= mul[src[i]];
+		}
+	}
+}
+
+#ifdef EC_SW_X86
+/*
+ * Each kernel handles n <= EC_SW_GROUP outputs with n a compile-time
+ * constant after inlining; with the group loops unrolled the accumulators
+ * stay in registers.
+ */
+static inline __attribute__((always_inline, target("avx2")))
+void dot_avx2_n(int rows, const uint8_t *coef, uint8_t **in, uint8_t **out,
+		size_t off, size_t len, int acc, const int n)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	__m256i a[EC_SW_GROUP], x, lo, hi, tl, th;
+	const uint8_t *tbl;
+	size_t pos;
+	int g, r;
+
+	for (pos = off; pos < off + len; pos += 32) {
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			a[g] = acc ? _mm256_loadu_si256((__m256i *)(out[g] + pos)) :
+				     _mm256_setzero_si256();
+		for (r = 0; r < rows; r++) {
+			x = _mm256_loadu_si256((__m256i *)(in[r] + pos));
+			lo = _mm256_and_si256(x, mask);
+			hi = _mm256_and_si256(_mm256_srli_epi64(x, 4), mask);
+#pragma GCC unroll 4
+			for (g = 0; g < n; g++) {
+				tbl = gf_nib[coef[g * rows + r]];
+				tl = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)tbl));
+				th = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)(tbl + 16)));
+				a[g] = _mm256_xor_si256(a[g], _mm256_shuffle_epi8(tl, lo));
+				a[g] = _mm256_xor_si256(a[g], _mm256_shuffle_epi8(th, hi));
+			}
+		}
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			_mm256_storeu_si256((__m256i *)(out[g] + pos), a[g]);
+	}
+}
+
+static inline __attribute__((always_inline, target("avx512f,avx512bw")))
+void dot_avx512_n(int rows, const uint8_t *coef, uint8_t **in, uint8_t **out,
+		  size_t off, size_t len, int acc, const int n)
+{
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+	__m512i a[EC_SW_GROUP], x, lo, hi, tl, th;
+	const uint8_t *tbl;
+	size_t pos;
+	int g, r;
+
+	for (pos = off; pos < off + len; pos += 64) {
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			a[g] = acc ? _mm512_loadu_si512(out[g] + pos) :
+				     _mm512_setzero_si512();
+		for (r = 0; r < rows; r++) {
+			x = _mm512_loadu_si512(in[r] + pos);
+			lo = _mm512_and_si512(x, mask);
+			hi = _mm512_and_si512(_mm512_srli_epi64(x, 4), mask);
+#pragma GCC unroll 4
+			for (g = 0; g < n; g++) {
+				tbl = gf_nib[coef[g * rows + r]];
+				tl = _mm512_broadcast_i32x4(_mm_load_si128((__m128i *)tbl));
+				th = _mm512_broadcast_i32x4(_mm_load_si128((__m128i *)(tbl + 16)));
+				a[g] = _mm512_xor_si512(a[g], _mm512_shuffle_epi8(tl, lo));
+				a[g] = _mm512_xor_si512(a[g], _mm512_shuffle_epi8(th, hi));
+			}
+		}
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			_mm512_storeu_si512(out[g] + pos, a[g]);
+	}
+}
+
+static inline __attribute__((always_inline, target("avx2,gfni")))
+void dot_gfni_avx2_n(int rows, const uint8_t *coef, uint8_t **in,
+		     uint8_t **out, size_t off, size_t len, int acc,
+		     const int n)
+{
+	__m256i a[EC_SW_GROUP], x;
+	size_t pos;
+	int g, r;
+
+	for (pos = off; pos < off + len; pos += 32) {
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			a[g] = acc ? _mm256_loadu_si256((__m256i *)(out[g] + pos)) :
+				     _mm256_setzero_si256();
+		for (r = 0; r < rows; r++) {
+			x = _mm256_loadu_si256((__m256i *)(in[r] + pos));
+#pragma GCC unroll 4
+			for (g = 0; g < n; g++)
+				a[g] = _mm256_xor_si256(a[g],
+					_mm256_gf2p8affine_epi64_epi8(x,
+						_mm256_set1_epi64x(gf_aff[coef[g * rows + r]]), 0));
+		}
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			_mm256_storeu_si256((__m256i *)(out[g] + pos), a[g]);
+	}
+}
+
+static inline __attribute__((always_inline, target("avx512f,avx512bw,gfni")))
+void dot_gfni_avx512_n(int rows, const uint8_t *coef, uint8_t **in,
+		       uint8_t **out, size_t off, size_t len, int acc,
+		       const int n)
+{
+	__m512i a[EC_SW_GROUP], x;
+	size_t pos;
+	int g, r;
+
+	for (pos = off; pos < off + len; pos += 64) {
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			a[g] = acc ? _mm512_loadu_si512(out[g] + pos) :
+				     _mm512_setzero_si512();
+		for (r = 0; r < rows; r++) {
+			x = _mm512_loadu_si512(in[r] + pos);
+#pragma GCC unroll 4
+			for (g = 0; g < n; g++)
+				a[g] = _mm512_xor_si512(a[g],
+					_mm512_gf2p8affine_epi64_epi8(x,
+						_mm512_set1_epi64(gf_aff[coef[g * rows + r]]), 0));
+		}
+#pragma GCC unroll 4
+		for (g = 0; g < n; g++)
+			_mm512_storeu_si512(out[g] + pos, a[g]);
+	}
+}
+
+/* Splits the outputs into groups and leaves the sub-vector tail to C */
+#define EC_SW_DOT(name, isa, width)					\
+static __attribute__((target(isa)))					\
+void name(int rows, int outs, const uint8_t *coef,			\
+	  uint8_t **in, uint8_t **out,					\
+	  size_t off, size_t len, int acc)				\
+{									\
+	size_t vlen = len & ~(size_t)((width) - 1);			\
+	int o, n;							\
+									\
+	for (o = 0; o < outs; o += n) {					\
+		n = outs - o < EC_SW_GROUP ? outs - o : EC_SW_GROUP;	\
+		switch (n) {						\
+		case 1:							\
+			name##_n(rows, coef + o * rows, in, out + o,	\
+				 off, vlen, acc, 1);			\
+			break;						\
+		case 2:							\
+			name##_n(rows, coef + o * rows, in, out + o,	\
+				 off, vlen, acc, 2);			\
+			break;						\
+		case 3:							\
+			name##_n(rows, coef + o * rows, in, out + o,	\
+				 off, vlen, acc, 3);			\
+			break;						\
+		default:						\
+			name##_n(rows, coef + o * rows, in, out + o,	\
+				 off, vlen, acc, 4);			\
+			break;						\
+		}							\
+	}								\
+									\
+	if (vlen != len)						\
+		ec_sw_dot_scalar(rows, outs, coef, in, out,		\
+				 off + vlen, len - vlen, acc);		\
+}
+
+EC_SW_DOT(dot_avx2, "avx2", 32)
+EC_SW_DOT(dot_avx512, "avx512f,avx512bw", 64)
+EC_SW_DOT(dot_gfni_avx2, "avx2,gfni", 32)
+EC_SW_DOT(dot_gfni_avx512, "avx512f,avx512bw,gfni", 64)
+#endif
+
+static const struct {
+	const char	*name;
+	ec_sw_dot_fn	dot;
+} ec_sw_isas[] = {
+	/* slowest first, the best one the CPU supports wins */
+	{ "scalar",		ec_sw_dot_scalar },
+#ifdef EC_SW_X86
+	{ "avx2",		dot_avx2 },
+	{ "avx512",		dot_avx512 },
+	{ "gfni-avx2",		dot_gfni_avx2 },
+	{ "gfni-avx512",	dot_gfni_avx512 },
+#endif
+};
+
+static int ec_sw_isa_supported(int i)
+{
+#ifdef EC_SW_X86
+	__builtin_cpu_init();
+	switch (i) {
+	case 1:
+		return __builtin_cpu_supports("avx2");
+	case 2:
+		return __builtin_cpu_supports("avx512f") &&
+		       __builtin_cpu_supports("avx512bw");
+	case 3:
+		return __builtin_cpu_supports("avx2") &&
+		       __builtin_cpu_supports("gfni");
+	case 4:
+		return __builtin_cpu_supports("avx512f") &&
+		       __builtin_cpu_supports("avx512bw") &&
+		       __builtin_cpu_supports("gfni");
+	}
+#endif
+	return !i;
+}
+
+static ec_sw_dot_fn ec_sw_select(struct ibv_context *context)
+{
+	char env[32];
+	int i;
+
+	if (!ibv_exp_cmd_getenv(context, "MLX5_EC_SW_ISA", env, sizeof(env))) {
+		for (i = 0; i < ARRAY_SIZE(ec_sw_isas); i++)
+			if (!strcmp(env, ec_sw_isas[i].name))
+				break;
+
+		if (i < ARRAY_SIZE(ec_sw_isas) && ec_sw_isa_supported(i))
+			return ec_sw_isas[i].dot;
+
+		fprintf(stderr, "MLX5_EC_SW_ISA=%s is not available, ignored\n",
+			env);
+	}
+
+	for (i = ARRAY_SIZE(ec_sw_isas) - 1; i > 0; i--)
+		if (ec_sw_isa_supported(i))
+			break;
+
+	return ec_sw_isas[i].dot;
+}
+
+static void ec_sw_run_stripe(struct mlx5_ec_sw *sw,
+			     struct mlx5_ec_sw_job *job, int idx)
+{
+	size_t off = (size_t)idx * EC_SW_STRIPE;
+	size_t len = min(job->len - off, (size_t)EC_SW_STRIPE);
+	int o;
+
+	if (job->base)
+		for (o = 0; o < job->outs; o++)
+			if (job->base[o] != job->out[o])
+				memcpy(job->out[o] + off, job->base[o] + off,
+				       len);
+
+	sw->dot(job->rows, job->outs, job->coef, job->in, job->out,
+		off, len, !!job->base);
+}
+
+/*
+ * Called by whoever ran the last stripe. A synchronous job lives on its
+ * caller's stack, which may be gone as soon as pending drops to 0, hence
+ * comp is read first.
+ */
+static void ec_sw_stripe_done(struct mlx5_ec_sw *sw,
+			      struct mlx5_ec_sw_job *job)
+{
+	struct ibv_exp_ec_comp *comp = job->comp;
+
+	if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) || !comp)
+		return;
+
+	comp->status = IBV_EXP_EC_CALC_SUCCESS;
+
+	pthread_mutex_lock(&sw->lock);
+	if (sw->polling) {
+		list_add_tail(&job->node, &sw->done);
+		pthread_mutex_unlock(&sw->lock);
+		return;
+	}
+	list_add(&job->node, &sw->free);
+	pthread_mutex_unlock(&sw->lock);
+
+	comp->done(comp);
+}
+
+/* Takes the next stripe of job, called with sw->lock held */
+static int ec_sw_claim(struct mlx5_ec_sw_job *job)
+{
+	int idx = job->next++;
+
+	if (job->next == job->nstripes)
+		list_del(&job->node);
+
+	return idx;
+}
+
+static void *ec_sw_worker(void *arg)
+{
+	struct mlx5_ec_sw *sw = arg;
+	struct mlx5_ec_sw_job *job;
+	int idx;
+
+	pthread_mutex_lock(&sw->lock);
+	for (;;) {
+		while (list_empty(&sw->queue) && !sw->stop)
+			pthread_cond_wait(&sw->cond, &sw->lock);
+		if (list_empty(&sw->queue))
+			break;
+
+		job = list_first_entry(&sw->queue, struct mlx5_ec_sw_job, node);
+		idx = ec_sw_claim(job);
+		pthread_mutex_unlock(&sw->lock);
+
+		ec_sw_run_stripe(sw, job, idx);
+		ec_sw_stripe_done(sw, job);
+
+		pthread_mutex_lock(&sw->lock);
+	}
+	pthread_mutex_unlock(&sw->lock);
+
+	return NULL;
+}
+
+static void ec_sw_prepare(struct mlx5_ec_sw_job *job, size_t len)
+{
+	job->len = len;
+	job->nstripes = len ? (len + EC_SW_STRIPE - 1) / EC_SW_STRIPE : 1;
+	job->next = 0;
+	job->pending = job->nstripes;
+}
+
+/*
+ * Single-stripe calcs and engines without workers run in the caller;
+ * otherwise the workers take the stripes and a synchronous caller
+ * works on its own calc alongside them.
+ */
+static void ec_sw_submit(struct mlx5_ec_sw *sw, struct mlx5_ec_sw_job *job)
+{
+	int idx;
+
+	if (!sw->nthreads || (job->nstripes == 1 && !job->comp)) {
+		for (idx = 0; idx < job->nstripes; idx++) {
+			ec_sw_run_stripe(sw, job, idx);
+			ec_sw_stripe_done(sw, job);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&sw->lock);
+	list_add_tail(&job->node, &sw->queue);
+	if (job->nstripes > 1)
+		pthread_cond_broadcast(&sw->cond);
+	else
+		pthread_cond_signal(&sw->cond);
+
+	if (job->comp) {
+		pthread_mutex_unlock(&sw->lock);
+		return;
+	}
+
+	while (job->next < job->nstripes) {
+		idx = ec_sw_claim(job);
+		pthread_mutex_unlock(&sw->lock);
+		ec_sw_run_stripe(sw, job, idx);
+		ec_sw_stripe_done(sw, job);
+		pthread_mutex_lock(&sw->lock);
+	}
+	pthread_mutex_unlock(&sw->lock);
+
+	while (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static struct mlx5_ec_sw_job *ec_sw_get_job(struct mlx5_ec_calc *calc,
+					    struct ibv_exp_ec_comp *ec_comp)
+{
+	struct mlx5_ec_sw *sw = calc->sw;
+	struct mlx5_ec_sw_job *job;
+
+	pthread_mutex_lock(&sw->lock);
+	if (list_empty(&sw->free)) {
+		pthread_mutex_unlock(&sw->lock);
+		fprintf(stderr, "Failed to get comp from pool. \
+			Do not activate more then %d inflight calculations \
+			on this calc context.\n",
+			calc->user_max_inflight_calcs);
+		return NULL;
+	}
+	job = list_first_entry(&sw->free, struct mlx5_ec_sw_job, node);
+	list_del(&job->node);
+	pthread_mutex_unlock(&sw->lock);
+
+	job->comp = ec_comp;
+
+	return job;
+}
+
+static void ec_sw_put_job(struct mlx5_ec_sw *sw, struct mlx5_ec_sw_job *job)
+{
+	pthread_mutex_lock(&sw->lock);
+	list_add(&job->node, &sw->free);
+	pthread_mutex_unlock(&sw->lock);
+}
+
+/*
+ * Runs job either synchronously (ec_comp == NULL, job on the stack) or
+ * from the pool, on the error path the pool job is handed back.
+ */
+static int ec_sw_finish(struct mlx5_ec_sw *sw, struct mlx5_ec_sw_job *job,
+			int err)
+{
+	if (err) {
+		if (job->comp)
+			ec_sw_put_job(sw, job);
+		errno = err;
+		return err;
+	}
+
+	ec_sw_submit(sw, job);
+
+	return 0;
+}
+
+static uint8_t *ec_sw_block(struct ibv_exp_ec_mem *ec_mem,
+			    struct ibv_sge *sge, const char *name, int i)
+{
+	if (sge->length != ec_mem->block_size) {
+		fprintf(stderr, "Unsupported %s[%d] length %d\n",
+			name, i, sge->length);
+		return NULL;
+	}
+
+	return (uint8_t *)(uintptr_t)sge->addr;
+}
+
+/* Scratch arrays for a synchronous calc */
+#define EC_SW_STACK_JOB(job, calc)					\
+	uint8_t *job##_in[(calc)->k];					\
+	uint8_t *job##_out[(calc)->m];					\
+	uint8_t *job##_base[(calc)->m];					\
+	uint8_t job##_coef[(calc)->k * (calc)->m];			\
+	struct mlx5_ec_sw_job job##_stack = {				\
+		.in = job##_in,						\
+		.out = job##_out,					\
+		.base = job##_base,					\
+		.coef_buf = job##_coef,					\
+	}
+
+int mlx5_ec_sw_encode(struct mlx5_ec_calc *calc,
+		      struct ibv_exp_ec_mem *ec_mem,
+		      struct ibv_exp_ec_comp *ec_comp)
+{
+	struct mlx5_ec_sw *sw = calc->sw;
+	struct mlx5_ec_sw_job *job = NULL;
+	int i, err = 0;
+	EC_SW_STACK_JOB(sync, calc);
+
+	if (ec_comp) {
+		job = ec_sw_get_job(calc, ec_comp);
+		if (!job)
+			return -EOVERFLOW;
+	} else {
+		job = &sync_stack;
+	}
+
+	job->rows = sw->k;
+	job->outs = sw->m;
+	job->coef = sw->enc;
+	job->base = NULL;
+
+	for (i = 0; i < sw->k && !err; i++) {
+		job->in[i] = ec_sw_block(ec_mem, &ec_mem->data_blocks[i],
+					 "data_block", i);
+		if (!job->in[i])
+			err = EINVAL;
+	}
+	for (i = 0; i < sw->m && !err; i++) {
+		job->out[i] = ec_sw_block(ec_mem, &ec_mem->code_blocks[i],
+					  "code_block", i);
+		if (!job->out[i])
+			err = EINVAL;
+	}
+
+	ec_sw_prepare(job, ec_mem->block_size);
+
+	return ec_sw_finish(sw, job, err);
+}
+
+int mlx5_ec_sw_decode(struct mlx5_ec_calc *calc,
+		      struct ibv_exp_ec_mem *ec_mem,
+		      uint8_t *erasures,
+		      uint8_t *decode_matrix,
+		      struct ibv_exp_ec_comp *ec_comp)
+{
+	struct mlx5_ec_sw *sw = calc->sw;
+	struct mlx5_ec_sw_job *job = NULL;
+	struct ibv_sge *sge;
+	uint8_t *block;
+	int i, o, r, k = 0, m = 0, err = 0;
+	EC_SW_STACK_JOB(sync, calc);
+
+	for (i = 0; i < sw->k + sw->m; i++)
+		if (erasures[i])
+			m++;
+	if (!m || m > sw->m) {
+		fprintf(stderr, "bad number of erasures %d\n", m);
+		errno = EINVAL;
+		return EINVAL;
+	}
+
+	if (ec_comp) {
+		job = ec_sw_get_job(calc, ec_comp);
+		if (!job)
+			return -EOVERFLOW;
+	} else {
+		job = &sync_stack;
+	}
+
+	/* the first k survivors are the inputs, every erasure an output */
+	for (i = 0, o = 0; i < sw->k + sw->m && !err; i++) {
+		if (!erasures[i] && k == sw->k)
+			continue;
+
+		sge = i < sw->k ? &ec_mem->data_blocks[i] :
+				  &ec_mem->code_blocks[i - sw->k];
+		block = ec_sw_block(ec_mem, sge,
+				    i < sw->k ? "data_block" : "code_block",
+				    i < sw->k ? i : i - sw->k);
+		if (!block)
+			err = EINVAL;
+		else if (erasures[i])
+			job->out[o++] = block;
+		else
+			job->in[k++] = block;
+	}
+	if (!err && k < sw->k) {
+		fprintf(stderr, "not enough blocks survived to decode\n");
+		err = EINVAL;
+	}
+
+	job->rows = sw->k;
+	job->outs = m;
+	job->base = NULL;
+	for (o = 0; o < m; o++)
+		for (r = 0; r < sw->k; r++)
+			job->coef_buf[o * sw->k + r] = decode_matrix[r * m + o];
+	job->coef = job->coef_buf;
+
+	ec_sw_prepare(job, ec_mem->block_size);
+
+	return ec_sw_finish(sw, job, err);
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+	int i;
+
+	for (i = 1; i < 256; i++)
+		if (gf_mul_tbl[a][i] == 1)
+			return i;
+	return 0;
+}
+
+int mlx5_ec_gf_decode_matrix(int k, int m, const uint8_t *enc,
+			     const uint8_t *erasures, uint8_t *mat)
+{
+	uint8_t a[k][k], inv[k][k], t, c;
+	int surv[k], ers[m];
+	int i, j, r, p, o, n = 0, ne = 0;
+
+	pthread_once(&gf_once, gf_init);
+
+	for (i = 0; i < k + m; i++) {
+		if (erasures[i]) {
+			if (ne == m)
+				return EINVAL;
+			ers[ne++] = i;
+		} else if (n < k) {
+			surv[n++] = i;
+		}
+	}
+	if (n < k || !ne)
+		return EINVAL;
+
+	/* rows of the generator the survivors were computed with */
+	for (r = 0; r < k; r++)
+		for (i = 0; i < k; i++) {
+			if (surv[r] < k)
+				a[r][i] = surv[r] == i;
+			else
+				a[r][i] = enc[i * m + surv[r] - k];
+			inv[r][i] = r == i;
+		}
+
+	/* Gauss-Jordan, a becomes the identity and inv its inverse */
+	for (i = 0; i < k; i++) {
+		for (p = i; p < k && !a[p][i]; p++)
+			;
+		if (p == k)
+			return EINVAL;
+		for (j = 0; p != i && j < k; j++) {
+			t = a[i][j]; a[i][j] = a[p][j]; a[p][j] = t;
+			t = inv[i][j]; inv[i][j] = inv[p][j]; inv[p][j] = t;
+		}
+		c = gf_inv(a[i][i]);
+		for (j = 0; j < k; j++) {
+			a[i][j] = gf_mul_tbl[c][a[i][j]];
+			inv[i][j] = gf_mul_tbl[c][inv[i][j]];
+		}
+		for (r = 0; r < k; r++) {
+			if (r == i || !a[r][i])
+				continue;
+			c = a[r][i];
+			for (j = 0; j < k; j++) {
+				a[r][j] ^= gf_mul_tbl[c][a[i][j]];
+				inv[r][j] ^= gf_mul_tbl[c][inv[i][j]];
+			}
+		}
+	}
+
+	/* erased data is a row of inv, erased code enc^T times inv */
+	for (o = 0; o < ne; o++)
+		for (r = 0; r < k; r++) {
+			if (ers[o] < k) {
+				c = inv[ers[o]][r];
+			} else {
+				c = 0;
+				for (i = 0; i < k; i++)
+					c ^= gf_mul_tbl[enc[i * m + ers[o] - k]]
+						       [inv[i][r]];
+			}
+			mat[r * ne + o] = c;
+		}
+
+	return 0;
+}
+
+/*
+ * data_blocks holds the old code blocks being recomputed followed by an
+ * (old, new) pair per updated data block. Since both halves of a pair
+ * take the same coefficient, new code = old code + sum of
+ * enc[j][i] * (old d_i + new d_i), computed into code_blocks.
+ */
+int mlx5_ec_sw_update(struct mlx5_ec_calc *calc,
+		      struct ibv_exp_ec_mem *ec_mem,
+		      uint8_t *data_updates,
+		      uint8_t *code_updates,
+		      struct ibv_exp_ec_comp *ec_comp)
+{
+	struct mlx5_ec_sw *sw = calc->sw;
+	struct mlx5_ec_sw_job *job = NULL;
+	int nc = ec_mem->num_code_sge;
+	int i, j, o, r, nu = 0, ncodes = 0, err = 0;
+	uint8_t *block;
+	EC_SW_STACK_JOB(sync, calc);
+
+	for (i = 0; i < sw->k; i++)
+		if (data_updates[i])
+			nu++;
+	for (j = 0; j < sw->m; j++)
+		if (code_updates[j])
+			ncodes++;
+	if (nc != ncodes || nc > sw->m ||
+	    ec_mem->num_data_sge != nc + 2 * nu) {
+		fprintf(stderr, "update sges don't match the update maps\n");
+		errno = EINVAL;
+		return EINVAL;
+	}
+
+	if (ec_comp) {
+		job = ec_sw_get_job(calc, ec_comp);
+		if (!job)
+			return -EOVERFLOW;
+	} else {
+		job = &sync_stack;
+	}
+
+	for (i = 0; i < ec_mem->num_data_sge && !err; i++) {
+		block = ec_sw_block(ec_mem, &ec_mem->data_blocks[i],
+				    "data_block", i);
+		if (!block)
+			err = EINVAL;
+		else if (i < nc)
+			job->base[i] = block;
+		else
+			job->in[i - nc] = block;
+	}
+	for (o = 0; o < nc && !err; o++) {
+		job->out[o] = ec_sw_block(ec_mem, &ec_mem->code_blocks[o],
+					  "code_block", o);
+		if (!job->out[o])
+			err = EINVAL;
+	}
+
+	job->rows = 2 * nu;
+	job->outs = nc;
+	for (j = 0, o = 0; j < sw->m; j++) {
+		if (!code_updates[j])
+			continue;
+		for (i = 0, r = 0; i < sw->k; i++) {
+			if (!data_updates[i])
+				continue;
+			job->coef_buf[o * job->rows + r++] = sw->enc[j * sw->k + i];
+			job->coef_buf[o * job->rows + r++] = sw->enc[j * sw->k + i];
+		}
+		o++;
+	}
+	job->coef = job->coef_buf;
+
+	ec_sw_prepare(job, ec_mem->block_size);
+
+	return ec_sw_finish(sw, job, err);
+}
+
+int mlx5_ec_sw_poll(struct mlx5_ec_calc *calc, int n)
+{
+	struct mlx5_ec_sw *sw = calc->sw;
+	struct mlx5_ec_sw_job *job;
+	struct ibv_exp_ec_comp *comp;
+	int count = 0;
+
+	while (count < n) {
+		pthread_mutex_lock(&sw->lock);
+		if (list_empty(&sw->done)) {
+			pthread_mutex_unlock(&sw->lock);
+			break;
+		}
+		job = list_first_entry(&sw->done, struct mlx5_ec_sw_job, node);
+		comp = job->comp;
+		list_move(&job->node, &sw->free);
+		pthread_mutex_unlock(&sw->lock);
+
+		comp->done(comp);
+		count++;
+	}
+
+	return count;
+}
+
+int mlx5_ec_sw_encode_send(struct mlx5_ec_calc *calc,
+			   struct ibv_exp_ec_mem *ec_mem,
+			   struct ibv_exp_ec_stripe *data_stripes,
+			   struct ibv_exp_ec_stripe *code_stripes)
+{
+	struct ibv_send_wr *bad_wr;
+	int i, err;
+
+	if (calc->polling) {
+		fprintf(stderr, "encode_send is not supported in polling mode\n");
+		return -EINVAL;
+	}
+
+	/* stripe data */
+	for (i = 0; i < calc->k; i++) {
+		err = ibv_post_send(data_stripes[i].qp,
+				    data_stripes[i].wr, &bad_wr);
+		if (unlikely(err)) {
+			fprintf(stderr, "ibv_post_send(%d) failed\n", i);
+			return err;
+		}
+	}
+
+	/* no calc QP to wait on, the code is ready before it is posted */
+	err = mlx5_ec_sw_encode(calc, ec_mem, NULL);
+	if (unlikely(err)) {
+		fprintf(stderr, "mlx5_ec_sw_encode failed\n");
+		return err;
+	}
+
+	/* stripe code */
+	for (i = 0; i < calc->m; i++) {
+		err = ibv_post_send(code_stripes[i].qp,
+				    code_stripes[i].wr, &bad_wr);
+		if (unlikely(err)) {
+			fprintf(stderr, "ibv_post_send(%d) failed err=%d\n",
+				i, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+int mlx5_ec_sw_wanted(struct ibv_pd *pd,
+		      struct ibv_exp_ec_calc_init_attr *attr)
+{
+	struct ibv_exp_device_attr dev_attr;
+	char env[16];
+	int force = -1;
+
+	if (!ibv_exp_cmd_getenv(pd->context, "MLX5_EC_SW", env, sizeof(env)))
+		force = !!atoi(env);
+
+	if (attr->w != 8) {
+		if (force == 1)
+			fprintf(stderr, "software EC supports w=8 only, "
+				"using the device for w=%d\n", attr->w);
+		return 0;
+	}
+
+	if (force >= 0)
+		return force;
+
+	memset(&dev_attr, 0, sizeof(dev_attr));
+	dev_attr.comp_mask = IBV_EXP_DEVICE_ATTR_EXP_CAP_FLAGS;
+	if (ibv_exp_query_device(pd->context, &dev_attr))
+		return 0;
+
+	return !(dev_attr.exp_device_cap_flags & IBV_EXP_DEVICE_EC_OFFLOAD);
+}
+
+static void ec_sw_stop(struct mlx5_ec_sw *sw, int nthreads)
+{
+	int i;
+
+	pthread_mutex_lock(&sw->lock);
+	sw->stop = 1;
+	pthread_cond_broadcast(&sw->cond);
+	pthread_mutex_unlock(&sw->lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(sw->threads[i], NULL);
+}
+
+int mlx5_ec_sw_init(struct mlx5_ec_calc *calc,
+		    struct ibv_exp_ec_calc_init_attr *attr)
+{
+	struct mlx5_ec_sw *sw;
+	struct mlx5_ec_sw_job *job;
+	int k = attr->k, m = attr->m;
+	size_t job_size;
+	uint8_t *p;
+	char env[16];
+	int i, j, err;
+
+	pthread_once(&gf_once, gf_init);
+
+	sw = calloc(1, sizeof(*sw));
+	if (!sw)
+		return ENOMEM;
+
+	sw->k = k;
+	sw->m = m;
+	sw->polling = attr->polling;
+	sw->dot = ec_sw_select(calc->pd->context);
+	INIT_LIST_HEAD(&sw->free);
+	INIT_LIST_HEAD(&sw->queue);
+	INIT_LIST_HEAD(&sw->done);
+	pthread_mutex_init(&sw->lock, NULL);
+	pthread_cond_init(&sw->cond, NULL);
+
+	sw->nthreads = 1;
+	if (!ibv_exp_cmd_getenv(calc->pd->context, "MLX5_EC_SW_THREADS",
+				env, sizeof(env)))
+		sw->nthreads = atoi(env);
+	if (sw->nthreads > EC_SW_MAX_THREADS)
+		sw->nthreads = EC_SW_MAX_THREADS;
+	/* interrupt mode calls done() from a thread of ours, as the device does */
+	if (sw->nthreads < 1)
+		sw->nthreads = sw->polling ? 0 : 1;
+
+	sw->enc = malloc(k * m);
+	if (!sw->enc) {
+		err = ENOMEM;
+		goto free_sw;
+	}
+	for (i = 0; i < k; i++)
+		for (j = 0; j < m; j++)
+			sw->enc[j * k + i] = attr->encode_matrix[i * m + j];
+
+	job_size = sizeof(uint8_t *) * (k + 2 * m) + k * m;
+	sw->jobs = calloc(calc->user_max_inflight_calcs, sizeof(*sw->jobs));
+	sw->job_mem = calloc(calc->user_max_inflight_calcs, job_size);
+	if (!sw->jobs || !sw->job_mem) {
+		err = ENOMEM;
+		goto free_jobs;
+	}
+	for (i = 0, p = sw->job_mem; i < calc->user_max_inflight_calcs;
+	     i++, p += job_size) {
+		job = &sw->jobs[i];
+		job->in = (uint8_t **)p;
+		job->out = job->in + k;
+		job->base = job->out + m;
+		job->coef_buf = (uint8_t *)(job->base + m);
+		list_add_tail(&job->node, &sw->free);
+	}
+
+	sw->threads = calloc(sw->nthreads ? sw->nthreads : 1,
+			     sizeof(pthread_t));
+	if (!sw->threads) {
+		err = ENOMEM;
+		goto free_jobs;
+	}
+	for (i = 0; i < sw->nthreads; i++) {
+		err = pthread_create(&sw->threads[i], NULL, ec_sw_worker, sw);
+		if (err) {
+			fprintf(stderr, "failed to create ec worker\n");
+			ec_sw_stop(sw, i);
+			goto free_threads;
+		}
+	}
+
+	calc->sw = sw;
+
+	return 0;
+
+free_threads:
+	free(sw->threads);
+free_jobs:
+	free(sw->job_mem);
+	free(sw->jobs);
+	free(sw->enc);
+free_sw:
+	pthread_cond_destroy(&sw->cond);
+	pthread_mutex_destroy(&sw->lock);
+	free(sw);
+
+	return err;
+}
+
+/* Queued calcs are finished, and their done() called, before returning */
+void mlx5_ec_sw_cleanup(struct mlx5_ec_calc *calc)
+{
+	struct mlx5_ec_sw *sw = calc->sw;
+
+	ec_sw_stop(sw, sw->nthreads);
+
+	/* polling mode parks finished calcs on sw->done until polled */
+	mlx5_ec_sw_poll(calc, INT_MAX);
+
+	free(sw->threads);
+	free(sw->job_mem);
+	free(sw->jobs);
+	free(sw->enc);
+	pthread_cond_destroy(&sw->cond);
+	pthread_mutex_destroy(&sw->lock);
+	free(sw);
+	calc->sw = NULL;
+}
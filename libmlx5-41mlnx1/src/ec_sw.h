@@ -0,0 +1,62 @@
+#ifndef EC_SW_H
+#define EC_SW_H
+
+#include <infiniband/verbs.h>
+#include <infiniband/verbs_exp.h>
+
+/*
+ * Software Reed-Solomon engine behind ibv_exp_ec_calc, used on devices
+ * without EC offload or when MLX5_EC_SW=1. Arithmetic is GF(2^8) with
+ * the 0x11d polynomial, so only w == 8 calcs can run here.
+ *
+ * MLX5_EC_SW=0|1          never / always use it, default: when the
+ *                         device lacks IBV_EXP_DEVICE_EC_OFFLOAD
+ * MLX5_EC_SW_THREADS=<n>  worker threads striping each calc, default 1
+ * MLX5_EC_SW_ISA=<name>   scalar, avx2, avx512, gfni-avx2 or
+ *                         gfni-avx512, default: best the CPU supports
+ */
+
+struct mlx5_ec_calc;
+struct mlx5_ec_sw;
+
+int mlx5_ec_sw_wanted(struct ibv_pd *pd,
+		      struct ibv_exp_ec_calc_init_attr *attr);
+
+int mlx5_ec_sw_init(struct mlx5_ec_calc *calc,
+		    struct ibv_exp_ec_calc_init_attr *attr);
+
+void mlx5_ec_sw_cleanup(struct mlx5_ec_calc *calc);
+
+/* A NULL ec_comp runs the calc synchronously */
+int mlx5_ec_sw_encode(struct mlx5_ec_calc *calc,
+		      struct ibv_exp_ec_mem *ec_mem,
+		      struct ibv_exp_ec_comp *ec_comp);
+
+int mlx5_ec_sw_decode(struct mlx5_ec_calc *calc,
+		      struct ibv_exp_ec_mem *ec_mem,
+		      uint8_t *erasures,
+		      uint8_t *decode_matrix,
+		      struct ibv_exp_ec_comp *ec_comp);
+
+/*
+ * k x (number of erasures) GF(2^8) matrix recovering the erased blocks
+ * from the first k survivors, in the layout ibv_exp_ec_decode_* takes.
+ * enc is the k x m encode matrix. Returns EINVAL when undecodable.
+ */
+int mlx5_ec_gf_decode_matrix(int k, int m, const uint8_t *enc,
+			     const uint8_t *erasures, uint8_t *mat);
+
+int mlx5_ec_sw_update(struct mlx5_ec_calc *calc,
+		      struct ibv_exp_ec_mem *ec_mem,
+		      uint8_t *data_updates,
+		      uint8_t *code_updates,
+		      struct ibv_exp_ec_comp *ec_comp);
+
+int mlx5_ec_sw_poll(struct mlx5_ec_calc *calc, int n);
+
+int mlx5_ec_sw_encode_send(struct mlx5_ec_calc *calc,
+			   struct ibv_exp_ec_mem *ec_mem,
+			   struct ibv_exp_ec_stripe *data_stripes,
+			   struct ibv_exp_ec_stripe *code_stripes);
+
+#endif /* EC_SW_H */
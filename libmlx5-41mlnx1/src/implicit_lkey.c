@@ -19,6 +19,22 @@
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+/* Last translation done by this thread, one slot per implicit lkey
+ * parity so that interleaved r_ilkey/w_ilkey lookups do not evict each
+ * other. Slots are tagged with the ilkey id rather than its address, as
+ * the address is reused when a PD is freed and another one allocated.
+ */
+struct mlx5_ilkey_hit {
+	uint64_t id;
+	uint64_t start;
+	uint64_t end;
+	struct ibv_mr *mr;
+};
+
+static __thread struct mlx5_ilkey_hit ilkey_last[2];
+
+static uint64_t ilkey_next_id = 1;
+
 struct mlx5_implicit_lkey *mlx5_get_implicit_lkey(struct mlx5_pd *pd,
 						  uint64_t exp_access)
 {
@@ -70,6 +86,7 @@ int mlx5_init_implicit_lkey(struct mlx5_implicit_lkey *ilkey,
 {
 	ilkey->table = NULL;
 	ilkey->exp_access = exp_access;
+	ilkey->id = __atomic_fetch_add(&ilkey_next_id, 1, __ATOMIC_RELAXED);
 
 	if (!(exp_access & IBV_EXP_ACCESS_ON_DEMAND))
 		return -EINVAL;
@@ -141,17 +158,56 @@ void mlx5_dealloc_whole_addr_mr(struct ibv_mr *mr)
 	free(mr);
 }
 
+static struct ibv_mr *reg_implicit_mr(struct mlx5_pd *pd,
+				      struct mlx5_implicit_lkey *ilkey,
+				      uint64_t mr_base_addr)
+{
+	struct ibv_exp_reg_mr_in attr = {
+		.comp_mask = 0,
+		.pd = &pd->ibv_pd,
+		.addr = (void *)(unsigned long)mr_base_addr,
+		.length = 1 << MR_SIZE,
+		.exp_access = ilkey->exp_access,
+	};
+	struct ibv_mr *mr;
+
+	mr = ibv_exp_reg_mr(&attr);
+	if (!mr)
+		return NULL;
+
+	mr->addr = (void *)(unsigned long)mr_base_addr;
+	mr->length = 1 << MR_SIZE;
+	to_mmr(mr)->alloc_flags |= IBV_EXP_ACCESS_RELAXED;
+	to_mmr(mr)->type = MLX5_ODP_MR;
+
+	return mr;
+}
+
 int mlx5_get_real_mr_from_implicit_lkey(struct mlx5_pd *pd,
 					struct mlx5_implicit_lkey *ilkey,
 					uint64_t addr, uint64_t len,
 					struct ibv_mr **mr)
 {
+	struct mlx5_ilkey_hit *hit = &ilkey_last[ilkey->id & 1];
 	uint64_t key1 = (addr >> LEVEL1_SHIFT) & MASK(LEVEL1_SIZE);
 	uint64_t key2 = (addr >> LEVEL2_SHIFT) & MASK(LEVEL2_SIZE);
 	uint64_t addr_msb_bits = addr >> ADDR_EFFECTIVE_BITS;
 	uint64_t mr_base_addr = addr & ~MASK(MR_SIZE);
 	int mr_idx_in_pair = (((addr >> (MR_SIZE)) & 1) !=
 			      (((addr+len+1) >> (MR_SIZE)) & 1));
+	struct mlx5_pair_mrs **table;
+	struct mlx5_pair_mrs *level2;
+	struct ibv_mr **slot;
+	struct ibv_mr *found;
+
+	/* Consecutive SGEs and WRs usually fall in the same 256MB window,
+	 * so they skip the table walk entirely.
+	 */
+	if (hit->id == ilkey->id && addr >= hit->start && addr < hit->end &&
+	    len <= hit->end - addr) {
+		*mr = hit->mr;
+		return 0;
+	}
 
 	mr_base_addr |= (mr_idx_in_pair << (MR_SIZE-1));
 
@@ -176,67 +232,72 @@ int mlx5_get_real_mr_from_implicit_lkey(struct mlx5_pd *pd,
 	 *
 	 * As we only add items to the table, only lock it when adding
 	 * the items, and check that the item is still missing with
-	 * lock held. Assumes that writes to pointers are atomic, so
-	 * we will never read "half-pointer".
+	 * lock held. Every level is fully initialized before it is
+	 * published with a release store, and readers pair that with
+	 * an acquire load, so a reader that sees a pointer also sees
+	 * what it points to.
 	 */
-	if (!ilkey->table) {
+	table = __atomic_load_n(&ilkey->table, __ATOMIC_ACQUIRE);
+	if (!table) {
 		pthread_mutex_lock(&ilkey->lock);
-		if (!ilkey->table)
-			ilkey->table = calloc(1, sizeof(void *) *
-				       (1 << LEVEL1_SIZE));
+		table = ilkey->table;
+		if (!table) {
+			table = calloc(1, sizeof(void *) * (1 << LEVEL1_SIZE));
+			__atomic_store_n(&ilkey->table, table,
+					 __ATOMIC_RELEASE);
+		}
 		pthread_mutex_unlock(&ilkey->lock);
-		if (!ilkey->table) {
+		if (!table) {
 			errno = ENOMEM;
 			return ENOMEM;
 		}
 	}
 
-	if (!ilkey->table[key1]) {
+	level2 = __atomic_load_n(&table[key1], __ATOMIC_ACQUIRE);
+	if (!level2) {
 		pthread_mutex_lock(&ilkey->lock);
-		if (!ilkey->table[key1])
-			ilkey->table[key1] = calloc(1,
-						    (sizeof(struct mlx5_pair_mrs) *
-						    (1 << LEVEL2_SIZE)));
+		level2 = table[key1];
+		if (!level2) {
+			level2 = calloc(1, (sizeof(struct mlx5_pair_mrs) *
+					    (1 << LEVEL2_SIZE)));
+			__atomic_store_n(&table[key1], level2,
+					 __ATOMIC_RELEASE);
+		}
 		pthread_mutex_unlock(&ilkey->lock);
-		if (!ilkey->table[key1]) {
+		if (!level2) {
 			errno = ENOMEM;
 			return ENOMEM;
 		}
 	}
 
-	if (!ilkey->table[key1][key2].mrs[mr_idx_in_pair]) {
+	slot = &level2[key2].mrs[mr_idx_in_pair];
+	found = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (!found) {
 		pthread_mutex_lock(&ilkey->lock);
-		if (!ilkey->table[key1][key2].mrs[mr_idx_in_pair]) {
-			struct ibv_exp_reg_mr_in attr = {
-				.comp_mask = 0,
-				.pd = &pd->ibv_pd,
-				.addr = (void *)(unsigned long)mr_base_addr,
-				.length = 1 << MR_SIZE,
-				.exp_access = ilkey->exp_access,
-			};
-
-			ilkey->table[key1][key2].mrs[mr_idx_in_pair] = ibv_exp_reg_mr(&attr);
-			if (ilkey->table[key1][key2].mrs[mr_idx_in_pair]) {
-				ilkey->table[key1][key2].mrs[mr_idx_in_pair]->addr = (void *)(unsigned long)mr_base_addr;
-				ilkey->table[key1][key2].mrs[mr_idx_in_pair]->length = 1 << MR_SIZE;
-			}
-		}
-		if (ilkey->table[key1][key2].mrs[mr_idx_in_pair]) {
-			to_mmr(ilkey->table[key1][key2].mrs[mr_idx_in_pair])->alloc_flags |= IBV_EXP_ACCESS_RELAXED;
-			to_mmr(ilkey->table[key1][key2].mrs[mr_idx_in_pair])->type = MLX5_ODP_MR;
+		found = *slot;
+		if (!found) {
+			found = reg_implicit_mr(pd, ilkey, mr_base_addr);
+			if (found)
+				__atomic_store_n(slot, found,
+						 __ATOMIC_RELEASE);
 		}
 		pthread_mutex_unlock(&ilkey->lock);
-		if (!ilkey->table[key1][key2].mrs[mr_idx_in_pair]) {
+		if (!found) {
 			errno = ENOMEM;
 			return ENOMEM;
 		}
 	}
 
-	*mr = ilkey->table[key1][key2].mrs[mr_idx_in_pair];
+	*mr = found;
 
 	assert((*mr)->addr <= (void *)(unsigned long)addr &&
 	       (void *)(unsigned long)addr + len <=
 	       (*mr)->addr + (*mr)->length);
+
+	hit->id = ilkey->id;
+	hit->start = (uintptr_t)found->addr;
+	hit->end = hit->start + found->length;
+	hit->mr = found;
 	return 0;
 }
 
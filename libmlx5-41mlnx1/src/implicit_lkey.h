@@ -50,6 +50,7 @@ struct mlx5_pair_mrs {
 struct mlx5_implicit_lkey {
 	struct mlx5_pair_mrs **table;
 	uint64_t exp_access;
+	uint64_t id; /* never reused, tags the per-thread lookup cache */
 	pthread_mutex_t lock;
 };
 
@@ -1,7 +1,11 @@
 #include "perf.h"
+#include "perf_trace.h"
 #include "khash.h"
 #include <math.h>
 #include <arpa/inet.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <semaphore.h>
 #include "mlx5.h"
 
 uint64_t MAX_RATE = 12500000000;
@@ -11,15 +15,27 @@ uint64_t BURST_SIZE = 4000000;
 void* token_bucket;
 
 uint32_t CHUNK_SIZE = 8192; //BYTES
-uint32_t DUMMY_FACTOR = 4096; // the number of dummy factor : 1 dummy per x bytes
-uint32_t DUMMY_FACTOR_1 = 0;
-uint32_t DUMMY_FACTOR_2 = 0;
+uint32_t DUMMY_FACTOR = 0; // initial dummy factor: 1 dummy per x bytes, 0: start without dummies
+
+uint32_t PACE_INTERVAL = 1000;  //us between two pacing decisions
+uint32_t PACE_SHARE = 90;       //% of MAX_RATE left to bandwidth tenants next to delay-sensitive ones
+uint32_t PACE_SHARE_MSG = 50;   //same, when message-rate tenants are active as well
+uint32_t PACE_MAX_DUMMY = 64;   //dummy WRs per chunk before falling back to time-based pacing
+bool PACE_REPORT = false;
+
+uint32_t RECV_PIPELINE_DEPTH = 16; //receive chunks posted per doorbell
+uint32_t RECV_HEADROOM = 2;        //manage passes worth of receive completions to keep room for in the RQ
+
+uint32_t MAX_QP_NUM = 4096; //QPs per tenant, sizes the scheduling rings once
 
 uint32_t READ_PORT = 9999;   //For PeRF Read
 uint32_t POST_STOP_NUM_TH = 128;   
 uint32_t POST_STOP_BYTES_TH = 1024000; //BYTE
 uint32_t POST_STOP_TIME_TH = 1000; //us
 
+uint32_t MAX_MQP_NUM = 1;   //0: one master QP per online core
+uint32_t MQP_QP_RATIO = 0;  //tenant QPs per master QP, 0: unbounded
+
 uint32_t MAX_READ_QP_NUM = 64;
 uint32_t MAX_READ_BATCH_NUM = 1; //Batching Large Read is not supported yet!
 
@@ -35,11 +51,17 @@ static uint32_t tenant_id = -1;
 static uint32_t global_qnum = 0;
 static uint32_t global_cqnum = 0;
 static uint32_t global_mqnum = 0;
+static uint32_t mqp_managed_qnum = 0;
+static bool creating_mqp = false;
 
 cpu_set_t th_cpu;
 pthread_attr_t th_attr;
 
 pthread_t daemon_thread;
+static bool daemon_running = false;
+static pthread_t alive_thread;
+static sem_t alive_ready;
+static sem_t alive_release;
 static uint32_t new_qp_create = 0;
 
 bool read_qp_connected = 0;
@@ -55,7 +77,11 @@ bool crail = 0;
 uint32_t crail_type = 0;
 
 bool manage_stop;
-bool bw_send = false;
+
+uint32_t CLS_WINDOW = TENANT_SQ_CHECK_WINDOW; //us, histogram half-life
+uint32_t CLS_HOLD = 3;          //decisions a new class must persist
+uint32_t CLS_BW_ENTER = 50;     //% of large messages to become a bandwidth tenant
+uint32_t CLS_BW_EXIT = 20;      //% of large messages to stop being one
 
 //uint64_t* sorted_min_left;
 struct perf_tenant_context tenant_ctx;
@@ -192,6 +218,152 @@ void dequeue_recv_wr(uint32_t q_idx, uint32_t num)
   //LOG_ERROR("Dequeue WR: %d\n", qp_ctx[q_idx].recv_wr_queue_len);
 }
 
+struct perf_shm_context* perf_shm_attach()
+{
+  struct perf_shm_context* ctx = NULL;
+  struct stat st;
+
+  int shm_fd = shm_open("/perf-shm", O_RDWR, 0);
+  if(shm_fd == -1)
+  {
+    LOG_ERROR("Cannot load perf_shm\n");
+    return NULL;
+  }
+
+  //serialize against other tenants migrating the same segment
+  flock(shm_fd, LOCK_EX);
+
+  if(fstat(shm_fd, &st) == -1)
+  {
+    LOG_ERROR("Cannot stat perf_shm\n");
+    goto out;
+  }
+
+  if((size_t)st.st_size >= sizeof(uint32_t) * 2)
+  {
+    uint32_t* head = (uint32_t*) mmap(NULL, sizeof(uint32_t) * 2, PROT_READ, MAP_SHARED, shm_fd, 0);
+    if(head == MAP_FAILED)
+    {
+      LOG_ERROR("Error mapping shared memory perf_shm\n");
+      goto out;
+    }
+
+    bool versioned = head[0] == PERF_SHM_MAGIC;
+    uint32_t version = head[1];
+    uint32_t legacy_tenant_num = ((struct perf_shm_context_v1*) head)->tenant_num;
+    munmap(head, sizeof(uint32_t) * 2);
+
+    if(versioned && version != PERF_SHM_VERSION)
+    {
+      LOG_ERROR("perf_shm layout version %u, expected %u\n", version, PERF_SHM_VERSION);
+      goto out;
+    }
+
+    //an idle v1 segment is converted in place, a busy one belongs to an old controller
+    if(!versioned && legacy_tenant_num)
+    {
+      LOG_ERROR("perf_shm has the unversioned layout and %u tenants, restart the PeRF controller\n", legacy_tenant_num);
+      goto out;
+    }
+
+    if(!versioned)
+      st.st_size = 0;
+  }
+
+  if((size_t)st.st_size < sizeof(struct perf_shm_context) && ftruncate(shm_fd, sizeof(struct perf_shm_context)) == -1)
+  {
+    LOG_ERROR("Cannot resize perf_shm\n");
+    goto out;
+  }
+
+  ctx = (struct perf_shm_context*) mmap(NULL, sizeof(struct perf_shm_context), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if(ctx == MAP_FAILED)
+  {
+    LOG_ERROR("Error mapping shared memory perf_shm\n");
+    ctx = NULL;
+    goto out;
+  }
+
+  if(ctx->magic != PERF_SHM_MAGIC)
+  {
+    LOG_ERROR("Migrating perf_shm to layout version %u\n", PERF_SHM_VERSION);
+    perf_shm_init(ctx);
+  }
+
+out:
+  flock(shm_fd, LOCK_UN);
+  close(shm_fd);
+  return ctx;
+}
+
+bool perf_shm_over_limit()
+{
+  struct perf_shm_agg agg;
+  perf_shm_agg_read(shm_ctx, &agg);
+
+  return agg.active_tenant_num > 1 && agg.active_qps_num > agg.max_qps_limit;
+}
+
+//perf_thread writes the tenant slot, so it must be gone before the slot is released
+static void perf_stop_thread()
+{
+  if(!daemon_running || pthread_equal(pthread_self(), daemon_thread))
+    return;
+
+  pthread_cancel(daemon_thread);
+  pthread_join(daemon_thread, NULL);
+  daemon_running = false;
+}
+
+//Holds the tenant slot, and with it shm_ctx->tenant_alive[tenant_id], for the life of the
+//process: robust locks belong to a thread, and the application's threads may come and go
+static void* perf_alive_thread(void* para)
+{
+  int32_t* id = (int32_t*) para;
+  sigset_t all;
+
+  //perf_thread_end runs as a signal handler and joins this thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  *id = perf_shm_alloc_tenant(shm_ctx, getpid());
+  sem_post(&alive_ready);
+  if(*id < 0)
+    return NULL;
+
+  while(sem_wait(&alive_release))
+    ;
+  perf_shm_release_tenant(shm_ctx, *id);
+  return NULL;
+}
+
+static int32_t perf_take_tenant()
+{
+  static int32_t id;
+
+  sem_init(&alive_ready, 0, 0);
+  sem_init(&alive_release, 0, 0);
+  if(pthread_create(&alive_thread, NULL, perf_alive_thread, &id))
+    return -1;
+
+  while(sem_wait(&alive_ready))
+    ;
+  if(id < 0)
+    pthread_join(alive_thread, NULL);
+  return id;
+}
+
+static void perf_release_tenant()
+{
+  sem_post(&alive_release);
+  pthread_join(alive_thread, NULL);
+}
+
+static void perf_thread_unlock(void* para)
+{
+  pthread_mutex_unlock(&(shm_ctx->perf_thread_lock[tenant_id]));
+}
+
 void perf_thread_end()
 {
   sleep(1);
@@ -200,14 +372,8 @@ void perf_thread_end()
     return;
  
   tenant_ctx.is_active = false;
-  pthread_mutex_lock(&shm_ctx->lock);
-  shm_ctx->active_qps_per_tenant[tenant_id] = 0;
-  shm_ctx->delay_sensitive[tenant_id] = false;
-  shm_ctx->msg_sensitive[tenant_id] = false;
-  shm_ctx->resp_read[tenant_id] = false;
-  shm_ctx->btenant_can_post[tenant_id] = true;
-  pthread_mutex_unlock(&(shm_ctx->perf_thread_lock[tenant_id]));
-  pthread_mutex_unlock(&shm_ctx->lock);
+  perf_stop_thread();
+  perf_release_tenant();
 
   use_perf = false;
 
@@ -230,8 +396,9 @@ void* perf_thread(void *para)
     if(!rc_used || read_qp_connected)
     {
       perf_update_tenant_state();
+      perf_pace_update();
 
-      if(global_qnum > 1 && mqp_ctx && (global_qnum == mqp_ctx[0].manage_qnum || global_qnum == global_mqnum))
+      if(perf_mqp_ready())
         perf_mqp_process();
 
       perf_recv_wr_queue_manage();
@@ -242,13 +409,17 @@ void* perf_thread(void *para)
         tenant_ctx.resp_read = true;
       }
 
-      if(!shm_ctx->btenant_can_post[tenant_id])
+      if(!shm_ctx->tenant[tenant_id].btenant_can_post)
       {
         //printf("disable: %d\n", tenant_id);
-        pthread_mutex_lock(&(shm_ctx->perf_thread_lock[tenant_id]));
-        while(!shm_ctx->btenant_can_post[tenant_id])
-          pthread_cond_wait(&(shm_ctx->perf_thread_cond[tenant_id]), &(shm_ctx->perf_thread_lock[tenant_id]));  
-        pthread_mutex_unlock(&(shm_ctx->perf_thread_lock[tenant_id]));
+        if(!perf_shm_thread_lock(shm_ctx, tenant_id))
+        {
+          //a cancel in the wait returns holding the lock
+          pthread_cleanup_push(perf_thread_unlock, NULL);
+          while(!shm_ctx->tenant[tenant_id].btenant_can_post)
+            perf_shm_thread_wait(shm_ctx, tenant_id);
+          pthread_cleanup_pop(1);
+        }
 
         pthread_mutex_lock(&(tenant_ctx.poll_lock));
         pthread_cond_broadcast(&(tenant_ctx.poll_cond));
@@ -258,7 +429,7 @@ void* perf_thread(void *para)
 
       perf_wr_queue_manage();
 
-      if(!shm_ctx->delay_sensitive[tenant_id] && !shm_ctx->msg_sensitive[tenant_id])
+      if(!shm_ctx->tenant[tenant_id].delay_sensitive && !shm_ctx->tenant[tenant_id].msg_sensitive)
         perf_early_poll_cq();
     }
     usleep(0);
@@ -288,6 +459,8 @@ void load_perf_config()
   env = getenv("PERF_ENABLE");
 
   LOG_DEBUG("PERF_ENABLE: %s\n", env);
+  perf_trace_open(env && atoi(env) ? PERF_TRACE_SCHED_PERF : PERF_TRACE_SCHED_NONE);
+
   if(!env || atoi(env) == 0)
     use_perf = 0;
   else
@@ -304,42 +477,93 @@ void load_perf_config()
 
     env = getenv("PERF_DUMMY_FACTOR");
     if(env)
-      DUMMY_FACTOR_1 = atoi(env);
-    
-    DUMMY_FACTOR = DUMMY_FACTOR_1;
+      DUMMY_FACTOR = atoi(env);
+
+    env = getenv("PERF_PACE_INTERVAL");
+    if(env)
+      PACE_INTERVAL = atoi(env);
+
+    env = getenv("PERF_PACE_SHARE");
+    if(env)
+      PACE_SHARE = atoi(env);
+
+    env = getenv("PERF_PACE_SHARE_MSG");
+    if(env)
+      PACE_SHARE_MSG = atoi(env);
+
+    env = getenv("PERF_PACE_MAX_DUMMY");
+    if(env)
+      PACE_MAX_DUMMY = atoi(env);
+    if(!PACE_MAX_DUMMY)
+      PACE_MAX_DUMMY = 1;
+
+    env = getenv("PERF_PACE_REPORT");
+    if(env)
+      PACE_REPORT = atoi(env);
+
+    env = getenv("PERF_RECV_PIPELINE_DEPTH");
+    if(env)
+      RECV_PIPELINE_DEPTH = atoi(env);
+    if(!RECV_PIPELINE_DEPTH)
+      RECV_PIPELINE_DEPTH = 1;
+    if(RECV_PIPELINE_DEPTH > RECV_PIPELINE_MAX)
+      RECV_PIPELINE_DEPTH = RECV_PIPELINE_MAX;
+
+    env = getenv("PERF_RECV_HEADROOM");
+    if(env)
+      RECV_HEADROOM = atoi(env);
 
-    env = getenv("PERF_DUMMY_FACTOR_2");
+    env = getenv("PERF_MAX_QP_NUM");
     if(env)
-      DUMMY_FACTOR_2 = atoi(env);
+      MAX_QP_NUM = atoi(env);
+    if(!MAX_QP_NUM)
+      MAX_QP_NUM = 1;
 
     env = getenv("PERF_READ_PORT");
     if(env)
       READ_PORT = atoi(env);
 
-    LOG_ERROR("CHUNK_SIZE: %d, DUMMY_FACTOR: %d, DUMMY_FACTOR_2: %d (MUST LARGER THAN DUMMY_FACTOR)\n", CHUNK_SIZE, DUMMY_FACTOR_1, DUMMY_FACTOR_2);
+    env = getenv("PERF_MAX_MQP_NUM");
+    if(env)
+      MAX_MQP_NUM = atoi(env);
+
+    if(MAX_MQP_NUM == 0)
+      MAX_MQP_NUM = sysconf(_SC_NPROCESSORS_ONLN);
 
-    int shm_fd = shm_open("/perf-shm", O_RDWR, 0);
-    if(shm_fd == -1)
-    {
-      LOG_ERROR("Cannot load perf_shm\n");
-      exit(1);
-    }
+    env = getenv("PERF_MQP_QP_RATIO");
+    if(env)
+      MQP_QP_RATIO = atoi(env);
+
+    env = getenv("PERF_CLS_WINDOW");
+    if(env)
+      CLS_WINDOW = atoi(env);
+
+    env = getenv("PERF_CLS_HOLD");
+    if(env)
+      CLS_HOLD = atoi(env);
+
+    env = getenv("PERF_CLS_BW_ENTER");
+    if(env)
+      CLS_BW_ENTER = atoi(env);
+
+    env = getenv("PERF_CLS_BW_EXIT");
+    if(env)
+      CLS_BW_EXIT = atoi(env);
 
-    shm_ctx = (struct perf_shm_context*) mmap(NULL, sizeof(struct perf_shm_context), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    LOG_ERROR("CHUNK_SIZE: %d, DUMMY_FACTOR: %d, PACE_SHARE: %d/%d, PACE_MAX_DUMMY: %d\n", CHUNK_SIZE, DUMMY_FACTOR, PACE_SHARE, PACE_SHARE_MSG, PACE_MAX_DUMMY);
 
-    if (shm_ctx == MAP_FAILED){
-      LOG_ERROR("Error mapping shared memory perf_shm");
+    shm_ctx = perf_shm_attach();
+    if(!shm_ctx)
       exit(1);
-    }
 
-    pthread_mutex_lock(&shm_ctx->lock);
-    tenant_id = shm_ctx->next_tenant_id;
-    tenant_id = shm_ctx->next_tenant_id++;
-    shm_ctx->tenant_num++;
-    shm_ctx->active_qps_per_tenant[tenant_id] = 0;
-    shm_ctx->additional_qps_num[tenant_id] = 0;
+    int32_t id = perf_take_tenant();
+    if(id < 0)
+    {
+      LOG_ERROR("No free tenant slot in perf_shm\n");
+      exit(1);
+    }
+    tenant_id = id;
     LOG_ERROR("Set Tenant ID: %d\n", tenant_id);
-    pthread_mutex_unlock(&shm_ctx->lock);
 
     CPU_ZERO(&th_cpu);
     CPU_SET(0, &th_cpu);
@@ -355,14 +579,16 @@ void load_perf_config()
 
 void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr, uint32_t origin_max_send_wr, uint32_t origin_max_recv_wr, int sig_all)
 {
-  if(global_qnum >= 2 && mqp_ctx && ((USE_MULTI_MQP == true && global_qnum != global_mqnum) || (USE_MULTI_MQP == false && mqp_ctx[0].qp == NULL))) //triggered by master_qp
+  if(creating_mqp) //triggered by master_qp
     return;
 
   if(global_qnum == 1 && !read_qp_ctx.qp)
     return;
 
   new_qp_create = 1;
-  pthread_join(daemon_thread, NULL);
+  if(daemon_running)
+    pthread_join(daemon_thread, NULL);
+  daemon_running = false;
   new_qp_create = 0;
 
   int k = kh_get(qph, qp_hash, qp->qp_num);
@@ -372,6 +598,13 @@ void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr
     exit(1);
   }
 
+  //the scheduling rings are lock-free and sized once, see update_tenant_ctx
+  if(global_qnum == MAX_QP_NUM)
+  {
+    LOG_ERROR("Error! More than %u QPs, raise PERF_MAX_QP_NUM\n", MAX_QP_NUM);
+    exit(1);
+  }
+
   int ret;
   k = kh_put(qph, qp_hash, qp->qp_num, &ret);
   kh_value(qp_hash, k) = global_qnum;
@@ -404,6 +637,9 @@ void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr
   qp_ctx[q_idx].recv_wr_queue_head = 0;
   qp_ctx[q_idx].recv_wr_queue_tail = 0;
   qp_ctx[q_idx].recv_wr_queue_len = 0;
+  qp_ctx[q_idx].recv_chunk_idx = 0;
+  qp_ctx[q_idx].recv_rq_num = 0;
+  qp_ctx[q_idx].recv_rate = 0;
 
   for(uint32_t i=0; i<qp_ctx[q_idx].wr_queue_size; i++)
     qp_ctx[q_idx].wr_queue[i].sg_list = (struct ibv_sge*)malloc(sizeof(struct ibv_sge) * MAX_SGE_LEN);
@@ -412,15 +648,18 @@ void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr
   for(uint32_t i=0; i<qp_ctx[q_idx].recv_wr_queue_size; i++)
     qp_ctx[q_idx].recv_wr_queue[i].sg_list = (struct ibv_sge*)malloc(sizeof(struct ibv_sge) * MAX_SGE_LEN);
 
-  qp_ctx[q_idx].is_paused = true;
-  qp_ctx[q_idx].paused_idx = -1;
-  qp_ctx[q_idx].is_allowed = false;
+  atomic_init(&(qp_ctx[q_idx].sched_state), 0);
 
   qp_ctx[q_idx].is_active = false;
   qp_ctx[q_idx].post_num = 0;
   qp_ctx[q_idx].is_first_wait = true;
  
   qp_ctx[q_idx].is_reading = false;
+
+  qp_ctx[q_idx].mqp_idx = -1;
+
+  qp_ctx[q_idx].read_peer = -1;
+  qp_ctx[q_idx].dest_qpn = 0;
  
   if(q_idx == 0)
   {
@@ -438,10 +677,10 @@ void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr
   else
     qp_ctx[q_idx].zero_wait_cq = qp_ctx[0].zero_wait_cq;
 
-  qp_ctx[q_idx].dummy = (struct ibv_exp_send_wr*)malloc(sizeof(struct ibv_exp_send_wr) * (uint32_t)(CHUNK_SIZE/DUMMY_FACTOR_1));
+  qp_ctx[q_idx].dummy = (struct ibv_exp_send_wr*)malloc(sizeof(struct ibv_exp_send_wr) * PACE_MAX_DUMMY);
 
   qp_ctx[q_idx].chunk_sent_bytes = 0;
-  for(uint32_t i=0; i< (uint32_t)(CHUNK_SIZE/DUMMY_FACTOR_1); i++)
+  for(uint32_t i=0; i<PACE_MAX_DUMMY; i++)
   {
     qp_ctx[q_idx].dummy[i].wr_id = -1;
     qp_ctx[q_idx].dummy[i].sg_list = NULL;
@@ -457,7 +696,7 @@ void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr
     else
       qp_ctx[q_idx].dummy[i].exp_send_flags = 0;
 
-    if(i == (uint32_t)(CHUNK_SIZE/DUMMY_FACTOR_1) - 1)
+    if(i == PACE_MAX_DUMMY - 1)
     {
       qp_ctx[q_idx].dummy[i].exp_send_flags = IBV_EXP_SEND_SIGNALED;
       qp_ctx[q_idx].dummy[i].next = NULL;
@@ -470,26 +709,13 @@ void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr
   
   if(global_qnum == 1)
     update_tenant_ctx();
-  else
-  {
-    tenant_ctx.waiting_qps = (uint32_t*)realloc(tenant_ctx.waiting_qps, sizeof(uint32_t) * global_qnum);
-    tenant_ctx.paused_qps = (uint32_t*)realloc(tenant_ctx.paused_qps, sizeof(uint32_t) * global_qnum);
-    tenant_ctx.enabled_qps = (uint32_t*)realloc(tenant_ctx.enabled_qps, sizeof(uint32_t) * global_qnum);
-    tenant_ctx.enabled_time = (struct timeval*)realloc(tenant_ctx.enabled_time, sizeof(struct timeval) * global_qnum);
-    for(uint32_t i=0; i<global_qnum; i++)
-    {
-      tenant_ctx.waiting_qps[i] = -1;
-      tenant_ctx.enabled_qps[i] = -1;
-      tenant_ctx.paused_qps[i] = -1;
-    }
-  }
 
   if(global_qnum >= 2)
     update_mqp_ctx();
   
   pthread_t read_qp_con_thread;
   pthread_t read_qp_con_thread2;
-  pthread_create(&daemon_thread, &th_attr, perf_thread, NULL);
+  daemon_running = !pthread_create(&daemon_thread, &th_attr, perf_thread, NULL);
   
   if(qp->qp_type == IBV_QPT_RC)
     rc_used = 1;
@@ -522,8 +748,6 @@ void update_cq_ctx(struct ibv_qp *qp, uint32_t max_send_wr)
     else
     {
       cq_num = qp_ctx[i].cq_num;
-      cq_ctx[cq_num].max_cqe += max_send_wr * 4;
-      cq_ctx[cq_num].wc_list = (void*)realloc(cq_ctx[cq_num].wc_list, sizeof(struct ibv_exp_wc) * (cq_ctx[cq_num].max_cqe + 10));
       break;
     }
   }
@@ -531,8 +755,11 @@ void update_cq_ctx(struct ibv_qp *qp, uint32_t max_send_wr)
   if(global_cqnum == cq_num)
   {
     cq_ctx = (struct perf_cq_context*)realloc(cq_ctx, (global_cqnum + 1)*sizeof(struct perf_cq_context));
-    cq_ctx[cq_num].max_cqe = max_send_wr * 4;
-    cq_ctx[cq_num].wc_list = (void*)malloc(sizeof(struct ibv_exp_wc) * (cq_ctx[cq_num].max_cqe + 10));
+    //the application never has more than cqe completions outstanding, early polled or not
+    cq_ctx[cq_num].max_cqe = 1;
+    while(cq_ctx[cq_num].max_cqe < qp->send_cq->cqe)
+      cq_ctx[cq_num].max_cqe <<= 1;
+    cq_ctx[cq_num].wc_list = (struct perf_early_wc*)malloc(sizeof(struct perf_early_wc) * cq_ctx[cq_num].max_cqe);
     cq_ctx[cq_num].cq = qp->send_cq;
     cq_ctx[cq_num].wc_head = 0;
     cq_ctx[cq_num].wc_tail = 0;
@@ -564,6 +791,18 @@ void update_tenant_ctx()
   tenant_ctx.delay_sensitive = true;
   tenant_ctx.avg_msg_size = 0;
   tenant_ctx.max_msg_size = 0;
+
+  memset(&(tenant_ctx.pace), 0, sizeof(tenant_ctx.pace));
+  tenant_ctx.pace.dummy_num = DUMMY_FACTOR ? CHUNK_SIZE / DUMMY_FACTOR : 0;
+  if(tenant_ctx.pace.dummy_num > PACE_MAX_DUMMY)
+    tenant_ctx.pace.dummy_num = PACE_MAX_DUMMY;
+  tenant_ctx.pace.window_start = perf_now_ns();
+
+  memset(&(tenant_ctx.cls), 0, sizeof(tenant_ctx.cls));
+  tenant_ctx.cls.cls = PERF_CLASS_DELAY;
+  tenant_ctx.cls.candidate = PERF_CLASS_DELAY;
+  tenant_ctx.cls.confidence = 100;
+  gettimeofday(&(tenant_ctx.cls.last_decay_time), NULL);
   tenant_ctx.max_recv_msg_size = 0;
 
   tenant_ctx.is_active = false;
@@ -574,21 +813,12 @@ void update_tenant_ctx()
   tenant_ctx.is_first_wait = true;
   tenant_ctx.wait_num = 0;
   tenant_ctx.enable_num = 0;
-  tenant_ctx.waiting_qps = (uint32_t*)malloc(sizeof(uint32_t));
-  tenant_ctx.waiting_head = 0;
-  tenant_ctx.waiting_tail = 0;
-
-  tenant_ctx.enabled_time = (struct timeval*)malloc(sizeof(struct timeval));
-  tenant_ctx.enabled_qps = (uint32_t*)malloc(sizeof(uint32_t));
-  tenant_ctx.enabled_head = 0;
-  tenant_ctx.enabled_tail = 0;
+  perf_qring_init(&(tenant_ctx.waiting_qps), MAX_QP_NUM);
+  perf_qring_init(&(tenant_ctx.enabled_qps), MAX_QP_NUM);
 
   tenant_ctx.additional_enable_num = 0;
  
-  tenant_ctx.paused_qps = (uint32_t*)malloc(sizeof(uint32_t));
-  *(tenant_ctx.paused_qps) = -1;
-  tenant_ctx.paused_qps_head = 0; 
-  tenant_ctx.paused_qps_tail = 0; 
+  perf_qring_init(&(tenant_ctx.paused_qps), MAX_QP_NUM);
   tenant_ctx.allowed_qps_num = 0;
 
   tenant_ctx.resp_read = false;
@@ -597,9 +827,7 @@ void update_tenant_ctx()
   tenant_ctx.passive_msg_sensitive = false;
   tenant_ctx.is_bw_read = false;
 
-  pthread_mutex_init(&(tenant_ctx.wait_lock), NULL);
-  pthread_mutex_init(&(tenant_ctx.allow_lock), NULL);
-  
+  pthread_mutex_init(&(tenant_ctx.mqp_lock), NULL);
   pthread_mutex_init(&(tenant_ctx.poll_lock), NULL);
   pthread_cond_init(&(tenant_ctx.poll_cond), NULL);
   
@@ -609,15 +837,21 @@ void update_tenant_ctx()
 void update_mqp_ctx()
 {
   //LOG_ERROR("update_perf_mqp_state()\n");
-  //make Master UD QP
-  if((global_qnum >= 2 && USE_MULTI_MQP) || (global_qnum >= 2 && !USE_MULTI_MQP && mqp_ctx == NULL))
+  uint32_t mqp_num = MQP_QP_RATIO ? (global_qnum + MQP_QP_RATIO - 1) / MQP_QP_RATIO : 1;
+  if(mqp_num > MAX_MQP_NUM)
+    mqp_num = MAX_MQP_NUM;
+
+  //make Master QPs
+  if(mqp_num > global_mqnum)
   {
-    mqp_ctx = (struct perf_master_qp_context*)realloc(mqp_ctx, sizeof(struct perf_master_qp_context) * global_qnum);
+    mqp_ctx = (struct perf_master_qp_context*)realloc(mqp_ctx, sizeof(struct perf_master_qp_context) * mqp_num);
 
-    while(global_qnum != global_mqnum)
+    while(global_mqnum < mqp_num)
     {
       uint32_t mqp_idx = global_mqnum;
+      creating_mqp = true;
       perf_create_master_qp(mqp_idx);
+      creating_mqp = false;
 
       //create cqe_wait_wr of mqp
       mqp_ctx[mqp_idx].wait_cqe_wr.wr_id = -1;
@@ -655,24 +889,40 @@ void update_mqp_ctx()
       mqp_ctx[mqp_idx].self_wait_cqe_wr.task.cqe_wait.cq_count = 0;
       mqp_ctx[mqp_idx].self_wait_cqe_wr.next = NULL;
 
-      mqp_ctx[mqp_idx].manage_qnum = USE_MULTI_MQP ? 1 : 2;
+      mqp_ctx[mqp_idx].manage_qnum = 0;
       global_mqnum++;
-
-      if(!USE_MULTI_MQP)
-        break;
     }
   }
-  else if(!USE_MULTI_MQP && mqp_ctx[0].qp)
-  {
-    mqp_ctx[0].manage_qnum++;
-  }
-  else
+
+  //assign the new QPs (both on the first call) to the least loaded master QP
+  for(uint32_t i=0; i<global_qnum; i++)
   {
-    LOG_ERROR("Error when start mqp update\n");
-    exit(1);
+    if(qp_ctx[i].mqp_idx != -1)
+      continue;
+
+    uint32_t min_idx = 0;
+    for(uint32_t j=1; j<global_mqnum; j++)
+    {
+      if(mqp_ctx[j].manage_qnum < mqp_ctx[min_idx].manage_qnum)
+        min_idx = j;
+    }
+
+    qp_ctx[i].mqp_idx = min_idx;
+    mqp_ctx[min_idx].manage_qnum++;
+    mqp_managed_qnum++;
   }
 }
 
+bool perf_mqp_ready()
+{
+  return global_qnum > 1 && mqp_ctx && mqp_managed_qnum == global_qnum;
+}
+
+uint32_t perf_mqp_of(uint32_t q_idx)
+{
+  return q_idx == -1 ? 0 : qp_ctx[q_idx].mqp_idx;
+}
+
 void perf_create_master_qp(uint32_t mqp_idx)
 {
   struct ibv_context *context;
@@ -859,16 +1109,9 @@ void perf_destroy_qp()
   if(!use_perf)
     return;
   tenant_ctx.is_active = false;
-  pthread_mutex_lock(&shm_ctx->lock);
-  shm_ctx->active_qps_per_tenant[tenant_id] = 0;
-  shm_ctx->delay_sensitive[tenant_id] = false;
-  shm_ctx->msg_sensitive[tenant_id] = false;
-  shm_ctx->resp_read[tenant_id] = false;
-  shm_ctx->btenant_can_post[tenant_id] = true;
-  pthread_mutex_unlock(&(shm_ctx->perf_thread_lock[tenant_id]));
-  pthread_mutex_unlock(&shm_ctx->lock);
-  
-  pthread_cancel(daemon_thread);
+  perf_stop_thread();
+  perf_release_tenant();
+  perf_pace_report();
 
   use_perf = false; 
 }
@@ -876,6 +1119,7 @@ void perf_destroy_qp()
 void perf_early_poll_cq()
 {
   //LOG_ERROR("perf_early_poll_cq()\n");
+  struct ibv_exp_wc wc[EARLY_POLL_BATCH];
   uint32_t cq_poll_num;
   int polled;
   for(uint32_t i=0; i<global_cqnum; i++)
@@ -886,8 +1130,13 @@ void perf_early_poll_cq()
       //LOG_ERROR("before i: %d %d\n",  mlx5_get_sq_num(qp_ctx[0].qp), mlx5_get_sq_num(qp_ctx[1].qp)); 
       while(1)
       {
-        cq_poll_num = cq_ctx[i].max_cqe - cq_ctx[i].wc_tail;
-        polled = mlx5_poll_cq_ex2(cq_ctx[i].cq, cq_poll_num, (struct ibv_exp_wc*)(cq_ctx[i].wc_list) + cq_ctx[i].wc_tail, sizeof(struct ibv_exp_wc), 1, 1);
+        cq_poll_num = cq_ctx[i].max_cqe - cq_ctx[i].early_poll_num;
+        if(cq_poll_num > EARLY_POLL_BATCH)
+          cq_poll_num = EARLY_POLL_BATCH;
+        if(!cq_poll_num)
+          break;
+
+        polled = mlx5_poll_cq_ex2(cq_ctx[i].cq, cq_poll_num, wc, sizeof(struct ibv_exp_wc), 1, 1);
 
         if(polled < 0)
         {
@@ -901,12 +1150,24 @@ void perf_early_poll_cq()
         /*
         for(uint32_t j=0; j<polled; j++)
         {
-          LOG_ERROR("Comp WR ID: %lu %d\n", ((struct ibv_exp_wc*)cq_ctx[i].wc_list)[cq_ctx[i].wc_tail+j].wr_id, ((struct ibv_exp_wc*)cq_ctx[i].wc_list)[cq_ctx[i].wc_tail+j].status);
+          LOG_ERROR("Comp WR ID: %lu %d\n", wc[j].wr_id, wc[j].status);
         }
         */
 
-        cq_ctx[i].early_poll_num += polled;
-        cq_ctx[i].wc_tail = (cq_ctx[i].wc_tail + polled) % cq_ctx[i].max_cqe;
+        for(uint32_t j=0; j<polled; j++)
+        {
+          struct perf_early_wc* ewc = &(cq_ctx[i].wc_list[(cq_ctx[i].wc_tail + j) & (cq_ctx[i].max_cqe - 1)]);
+          ewc->wr_id = wc[j].wr_id;
+          ewc->byte_len = wc[j].byte_len;
+          ewc->qp_num = wc[j].qp_num;
+          ewc->imm_data = wc[j].imm_data;
+          ewc->opcode = wc[j].exp_opcode;
+          ewc->status = wc[j].status;
+          ewc->wc_flags = wc[j].exp_wc_flags & (IBV_WC_GRH | IBV_WC_WITH_IMM | IBV_WC_WITH_INV);
+        }
+
+        cq_ctx[i].wc_tail = (cq_ctx[i].wc_tail + polled) & (cq_ctx[i].max_cqe - 1);
+        atomic_fetch_add_explicit(&(cq_ctx[i].early_poll_num), polled, memory_order_release);
 
         //LOG_ERROR("Early Poll CQ: %d, early poll num: %d, wc_tail: %d\n",polled, cq_ctx[i].early_poll_num, cq_ctx[i].wc_tail);
       }
@@ -933,6 +1194,7 @@ void perf_update_tenant_state()
         max = mlx5_get_sq_num(qp_ctx[i].qp) + qp_ctx[i].wr_queue_len;
     }
       
+    //sq_history is only kept for the activity check
     tenant_ctx.sq_history[tenant_ctx.sq_ins_idx] = max;
     if(tenant_ctx.sq_ins_idx == tenant_ctx.sq_max_idx)
     {
@@ -943,41 +1205,31 @@ void perf_update_tenant_state()
           tenant_ctx.sq_max_idx = i;
         }
       }
-      if(tenant_ctx.is_bw_read)
-        tenant_ctx.delay_sensitive = true;
-      else if(tenant_ctx.sq_history[tenant_ctx.sq_max_idx] >= DELAY_SEN_NUM_TH ||
-          tenant_ctx.sq_history[tenant_ctx.sq_max_idx] * tenant_ctx.avg_msg_size >= DELAY_SEN_BYTES_TH || tenant_ctx.max_msg_size >= PERF_LARGE_FLOW || !tenant_ctx.passive_delay_sensitive)
-        tenant_ctx.delay_sensitive = false;
-      else
-        tenant_ctx.delay_sensitive = true;
     }
-    else
+    else if(max >= tenant_ctx.sq_history[tenant_ctx.sq_max_idx])
+      tenant_ctx.sq_max_idx = tenant_ctx.sq_ins_idx;
+
+    tenant_ctx.cls.depth_hist[perf_cls_bucket(max)]++;
+
+    t = (now.tv_usec - tenant_ctx.cls.last_decay_time.tv_usec) + 1000000 * (now.tv_sec - tenant_ctx.cls.last_decay_time.tv_sec);
+    if(t >= CLS_WINDOW)
     {
-      if(max >= tenant_ctx.sq_history[tenant_ctx.sq_max_idx])
-      {
-         tenant_ctx.sq_max_idx = tenant_ctx.sq_ins_idx;
-      
-         if(tenant_ctx.is_bw_read)
-           tenant_ctx.delay_sensitive = true;
-         else if(tenant_ctx.sq_history[tenant_ctx.sq_max_idx] >= DELAY_SEN_NUM_TH ||
-             tenant_ctx.sq_history[tenant_ctx.sq_max_idx] * tenant_ctx.avg_msg_size >= DELAY_SEN_BYTES_TH || tenant_ctx.max_msg_size >= PERF_LARGE_FLOW || !tenant_ctx.passive_delay_sensitive)
-           tenant_ctx.delay_sensitive = false;
-         else
-           tenant_ctx.delay_sensitive = true;
-      }
+      perf_cls_decay();
+      tenant_ctx.cls.last_decay_time = now;
     }
+
+    perf_classify();
+
+    if(tenant_ctx.is_bw_read)
+      tenant_ctx.delay_sensitive = true;
+    else
+      tenant_ctx.delay_sensitive = tenant_ctx.cls.cls == PERF_CLASS_DELAY && tenant_ctx.passive_delay_sensitive;
    
-    if(tenant_ctx.max_msg_size < PERF_LARGE_FLOW || (tenant_ctx.passive_reading && (tenant_ctx.passive_delay_sensitive || tenant_ctx.passive_msg_sensitive)) || tenant_ctx.is_bw_read)
+    if(tenant_ctx.cls.cls != PERF_CLASS_BW || (tenant_ctx.passive_reading && (tenant_ctx.passive_delay_sensitive || tenant_ctx.passive_msg_sensitive)) || tenant_ctx.is_bw_read)
       tenant_ctx.small_msg_sending = true;
     else
       tenant_ctx.small_msg_sending = false;
 
-    if(bw_send)
-    {
-      tenant_ctx.delay_sensitive = false;
-      tenant_ctx.small_msg_sending = false;
-    }
-
 
     tenant_ctx.sq_ins_idx = (tenant_ctx.sq_ins_idx + 1) % tenant_ctx.sq_history_len;
     gettimeofday(&(tenant_ctx.last_sq_check_time), NULL);
@@ -987,7 +1239,7 @@ void perf_update_tenant_state()
 
   t =  (now.tv_usec - tenant_ctx.last_active_check_time.tv_usec) + 1000000 * (now.tv_sec - tenant_ctx.last_active_check_time.tv_sec);
 
-  if((!shm_ctx->delay_sensitive[tenant_id] && t >= TENANT_ACTIVE_CHECK_INTERVAL) || (shm_ctx->delay_sensitive[tenant_id] && t >= TENANT_INACTIVE_CHECK_INTERVAL))
+  if((!shm_ctx->tenant[tenant_id].delay_sensitive && t >= TENANT_ACTIVE_CHECK_INTERVAL) || (shm_ctx->tenant[tenant_id].delay_sensitive && t >= TENANT_INACTIVE_CHECK_INTERVAL))
   {
     uint32_t cur_active_num = 0;
     
@@ -1019,9 +1271,11 @@ void perf_update_tenant_state()
     if(!tenant_ctx.active_qps_num)
     {
       tenant_ctx.is_active = false;
-      shm_ctx->active_qps_per_tenant[tenant_id] = 0;
-      shm_ctx->delay_sensitive[tenant_id] = true;
-      shm_ctx->msg_sensitive[tenant_id] = false;
+      shm_ctx->tenant[tenant_id].active_qps = 0;
+      shm_ctx->tenant[tenant_id].delay_sensitive = true;
+      shm_ctx->tenant[tenant_id].msg_sensitive = false;
+      shm_ctx->tenant[tenant_id].tenant_class = PERF_CLASS_IDLE;
+      shm_ctx->tenant[tenant_id].class_confidence = 100;
     }
     else
     {
@@ -1030,25 +1284,27 @@ void perf_update_tenant_state()
       {
         if(tenant_ctx.delay_sensitive)
         {
-          shm_ctx->delay_sensitive[tenant_id] = true;
-          shm_ctx->msg_sensitive[tenant_id] = false;
+          shm_ctx->tenant[tenant_id].delay_sensitive = true;
+          shm_ctx->tenant[tenant_id].msg_sensitive = false;
         }
         else
         {
-          shm_ctx->delay_sensitive[tenant_id] = false;
-          shm_ctx->msg_sensitive[tenant_id] = true;
+          shm_ctx->tenant[tenant_id].delay_sensitive = false;
+          shm_ctx->tenant[tenant_id].msg_sensitive = true;
         }
       }
       else
       {
-        shm_ctx->delay_sensitive[tenant_id] = false;
-        shm_ctx->msg_sensitive[tenant_id] = false;
+        shm_ctx->tenant[tenant_id].delay_sensitive = false;
+        shm_ctx->tenant[tenant_id].msg_sensitive = false;
       }
 
-      shm_ctx->resp_read[tenant_id] = tenant_ctx.resp_read;
+      shm_ctx->tenant[tenant_id].resp_read = tenant_ctx.resp_read;
 
-      shm_ctx->active_qps_per_tenant[tenant_id] = tenant_ctx.is_bw_read ? 1 : tenant_ctx.active_qps_num;
-      shm_ctx->avg_msg_size[tenant_id] = tenant_ctx.is_bw_read ? 16 : tenant_ctx.avg_msg_size; 
+      shm_ctx->tenant[tenant_id].active_qps = tenant_ctx.is_bw_read ? 1 : tenant_ctx.active_qps_num;
+      shm_ctx->tenant[tenant_id].avg_msg_size = tenant_ctx.is_bw_read ? 16 : tenant_ctx.avg_msg_size; 
+      shm_ctx->tenant[tenant_id].tenant_class = tenant_ctx.cls.cls;
+      shm_ctx->tenant[tenant_id].class_confidence = tenant_ctx.cls.confidence;
     }
     //pthread_mutex_unlock(&shm_ctx->lock);
 
@@ -1061,13 +1317,132 @@ void perf_update_tenant_state()
   }
 }
 
-void perf_mqp_process()
+uint32_t perf_cls_bucket(uint64_t v)
 {
-  if(!use_perf)
+  uint32_t b = v ? 64 - __builtin_clzll(v) : 0;
+  return b < CLS_BUCKET_NUM ? b : CLS_BUCKET_NUM - 1;
+}
+
+void perf_cls_decay()
+{
+  uint64_t max_msg_size = 0;
+
+  for(uint32_t b=0; b<CLS_BUCKET_NUM; b++)
+  {
+    uint32_t cnt = atomic_load_explicit(&(tenant_ctx.cls.msg_hist[b]), memory_order_relaxed);
+    atomic_fetch_sub_explicit(&(tenant_ctx.cls.msg_hist[b]), cnt - cnt / 2, memory_order_relaxed);
+    tenant_ctx.cls.depth_hist[b] /= 2;
+
+    if(cnt / 2)
+      max_msg_size = b ? (1ULL << b) - 1 : 0;
+  }
+
+  //a single large message must not mark the tenant as large forever
+  tenant_ctx.max_msg_size = max_msg_size;
+}
+
+void perf_classify()
+{
+  uint64_t msg_total = 0, large_num = 0, depth_total = 0, shallow_num = 0;
+  double size_sum = 0;
+  uint32_t large_b = perf_cls_bucket(PERF_LARGE_FLOW);
+  uint32_t shallow_b = perf_cls_bucket(DELAY_SEN_NUM_TH);
+
+  for(uint32_t b=0; b<CLS_BUCKET_NUM; b++)
+  {
+    uint32_t cnt = atomic_load_explicit(&(tenant_ctx.cls.msg_hist[b]), memory_order_relaxed);
+    msg_total += cnt;
+    size_sum += cnt * (b ? 1.5 * (1ULL << (b - 1)) : 0);
+    if(b >= large_b)
+      large_num += cnt;
+
+    depth_total += tenant_ctx.cls.depth_hist[b];
+    if(b < shallow_b)
+      shallow_num += tenant_ctx.cls.depth_hist[b];
+  }
+
+  if(!msg_total || !depth_total)
     return;
 
+  tenant_ctx.avg_msg_size = size_sum / msg_total;
+
+  //90th percentile of the outstanding depth, upper bound of its bucket
+  uint64_t acc = 0;
+  uint32_t depth_p90 = 0;
+  for(uint32_t b=0; b<CLS_BUCKET_NUM; b++)
+  {
+    acc += tenant_ctx.cls.depth_hist[b];
+    if(acc * 10 >= depth_total * 9)
+    {
+      depth_p90 = b ? (1U << b) - 1 : 0;
+      break;
+    }
+  }
+
+  uint32_t large_pct = large_num * 100 / msg_total;
+  uint32_t shallow_pct = shallow_num * 100 / depth_total;
+  uint32_t candidate, confidence;
+
+  if(large_pct >= (tenant_ctx.cls.cls == PERF_CLASS_BW ? CLS_BW_EXIT : CLS_BW_ENTER))
+  {
+    candidate = PERF_CLASS_BW;
+    confidence = large_pct;
+  }
+  else if(depth_p90 < DELAY_SEN_NUM_TH && depth_p90 * tenant_ctx.avg_msg_size < DELAY_SEN_BYTES_TH)
+  {
+    candidate = PERF_CLASS_DELAY;
+    confidence = shallow_pct;
+  }
+  else
+  {
+    candidate = PERF_CLASS_MSG;
+    confidence = 100 - shallow_pct;
+  }
+
+  if(candidate == tenant_ctx.cls.cls)
+    tenant_ctx.cls.candidate_num = 0;
+  else if(candidate == tenant_ctx.cls.candidate)
+    tenant_ctx.cls.candidate_num++;
+  else
+  {
+    tenant_ctx.cls.candidate = candidate;
+    tenant_ctx.cls.candidate_num = 1;
+  }
+
+  if(tenant_ctx.cls.candidate_num >= CLS_HOLD)
+  {
+    tenant_ctx.cls.cls = candidate;
+    tenant_ctx.cls.candidate_num = 0;
+  }
+
+  if(candidate == tenant_ctx.cls.cls)
+    tenant_ctx.cls.confidence = confidence;
+}
+
+//move the oldest waiting QP to enabled_qps, mqp_lock held
+static void perf_enable_next(struct timeval* now)
+{
+  uint32_t next_qidx;
+
+  //wait_num is counted after the push, so wait_num > enable_num means one is queued
+  if(!perf_qring_pop(&(tenant_ctx.waiting_qps), &next_qidx))
+  {
+    LOG_ERROR("waiting_qps is empty, wait %u enable %u\n", (uint32_t) tenant_ctx.wait_num, (uint32_t) tenant_ctx.enable_num);
+    exit(1);
+  }
+
+  qp_ctx[next_qidx].enabled_time = *now;
+  perf_qring_push(&(tenant_ctx.enabled_qps), next_qidx);
+}
+
+static void __perf_mqp_process()
+{
   for(uint32_t i=0; i<global_mqnum; i++)
   {
+    //master QPs share their CQs with the first one
+    if(i && mqp_ctx[i].qp->send_cq == mqp_ctx[0].qp->send_cq)
+      break;
+
     struct ibv_exp_wc wc[MASTER_QP_DEPTH];
     int ret =  mlx5_poll_cq_ex2(mqp_ctx[i].qp->send_cq, MASTER_QP_DEPTH, wc, sizeof(struct ibv_exp_wc), 1, 1);
 
@@ -1079,16 +1454,24 @@ void perf_mqp_process()
   }
 
   //if(!tenant_ctx.delay_sensitive && shm_ctx->active_tenant_num > 1 && (shm_ctx->active_qps_num > shm_ctx->max_qps_limit || shm_ctx->active_tenant_num != shm_ctx->active_stenant_num) && tenant_ctx.wait_num >= tenant_ctx.enable_num && (tenant_ctx.enable_num || tenant_ctx.wait_num))
-  if(!tenant_ctx.delay_sensitive && shm_ctx->active_tenant_num > 1 && shm_ctx->active_qps_num > shm_ctx->max_qps_limit && tenant_ctx.wait_num >= tenant_ctx.enable_num && (tenant_ctx.enable_num || tenant_ctx.wait_num))
+  struct perf_shm_agg agg;
+  perf_shm_agg_read(shm_ctx, &agg);
+  bool over_limit = agg.active_tenant_num > 1 && agg.active_qps_num > agg.max_qps_limit;
+
+  if(!tenant_ctx.delay_sensitive && over_limit && tenant_ctx.wait_num >= tenant_ctx.enable_num && (tenant_ctx.enable_num || tenant_ctx.wait_num))
   {
     struct timeval now;
     gettimeofday(&now, NULL);
 
     if(!tenant_ctx.is_first_wait && tenant_ctx.wait_num >= tenant_ctx.enable_num)
     {
-      pthread_mutex_lock(&tenant_ctx.wait_lock);
-      uint32_t le_qidx = tenant_ctx.enabled_qps[tenant_ctx.enabled_head];
-      uint32_t mqp_idx = USE_MULTI_MQP ? le_qidx : 0; 
+      uint32_t le_qidx = perf_qring_peek(&(tenant_ctx.enabled_qps));
+
+      //the first enabled QP is still being published by its posting thread
+      if(le_qidx == -1)
+        return;
+
+      uint32_t mqp_idx = perf_mqp_of(le_qidx); 
       
       if(le_qidx != -1 && tenant_ctx.wait_num > tenant_ctx.enable_num && (qp_ctx[le_qidx].post_num >= POST_STOP_NUM_TH || (qp_ctx[le_qidx].post_num * tenant_ctx.avg_msg_size) >= POST_STOP_BYTES_TH))
       {
@@ -1116,26 +1499,20 @@ void perf_mqp_process()
         tenant_ctx.enable_num++;
         qp_ctx[le_qidx].post_num = 0;
 
-        tenant_ctx.waiting_qps[tenant_ctx.waiting_tail] = le_qidx;
-        tenant_ctx.waiting_tail = (tenant_ctx.waiting_tail + 1) % global_qnum;
+        perf_qring_push(&(tenant_ctx.waiting_qps), le_qidx);
 
-        tenant_ctx.enabled_time[tenant_ctx.enabled_tail] = now;
-        tenant_ctx.enabled_qps[tenant_ctx.enabled_tail] = tenant_ctx.waiting_qps[tenant_ctx.waiting_head];
-        tenant_ctx.enabled_tail = (tenant_ctx.enabled_tail + 1) % global_qnum;
+        perf_enable_next(&now);
 
-        tenant_ctx.waiting_qps[tenant_ctx.waiting_head] = -1;
-        tenant_ctx.waiting_head = (tenant_ctx.waiting_head + 1) % global_qnum;
-
-        tenant_ctx.enabled_qps[tenant_ctx.enabled_head] = -1;
-        tenant_ctx.enabled_head = (tenant_ctx.enabled_head + 1) % global_qnum;
-        le_qidx = tenant_ctx.enabled_qps[tenant_ctx.enabled_head];
-        qp_ctx[le_qidx].post_num = 0;
+        perf_qring_pop(&(tenant_ctx.enabled_qps), &le_qidx);
+        le_qidx = perf_qring_peek(&(tenant_ctx.enabled_qps));
+        if(le_qidx != -1)
+          qp_ctx[le_qidx].post_num = 0;
 
-        mqp_idx = USE_MULTI_MQP ? le_qidx : 0; 
+        mqp_idx = perf_mqp_of(le_qidx); 
       }
       else if(le_qidx != -1 && tenant_ctx.wait_num > tenant_ctx.enable_num)
       {
-        uint64_t enabled_time = (now.tv_sec - tenant_ctx.enabled_time[tenant_ctx.enabled_head] .tv_sec) * 1000000 + (now.tv_usec - tenant_ctx.enabled_time[tenant_ctx.enabled_head].tv_usec);
+        uint64_t enabled_time = (now.tv_sec - qp_ctx[le_qidx].enabled_time.tv_sec) * 1000000 + (now.tv_usec - qp_ctx[le_qidx].enabled_time.tv_usec);
         //if(tenant_ctx.wait_num - tenant_ctx.enable_num && (perf_check_paused(le_qidx) || enabled_time > POST_STOP_TIME_TH))
         if(perf_check_paused(le_qidx) || enabled_time > POST_STOP_TIME_TH)
         {
@@ -1159,30 +1536,25 @@ void perf_mqp_process()
           qp_ctx[le_qidx].post_num = 0;
           qp_ctx[le_qidx].is_first_wait = true;
 
-          tenant_ctx.enabled_time[tenant_ctx.enabled_tail] = now;
-          tenant_ctx.enabled_qps[tenant_ctx.enabled_tail] = tenant_ctx.waiting_qps[tenant_ctx.waiting_head];
-          tenant_ctx.enabled_tail = (tenant_ctx.enabled_tail + 1) % global_qnum;
-          
-          tenant_ctx.waiting_qps[tenant_ctx.waiting_head] = -1;
-          tenant_ctx.waiting_head = (tenant_ctx.waiting_head + 1) % global_qnum;
+          perf_enable_next(&now);
 
-          if(!qp_ctx[le_qidx].is_paused)
+          if(!perf_qp_paused(le_qidx))
             perf_allowed_release(le_qidx);
         
-          tenant_ctx.enabled_qps[tenant_ctx.enabled_head] = -1;
-          tenant_ctx.enabled_head = (tenant_ctx.enabled_head + 1) % global_qnum;
-          le_qidx = tenant_ctx.enabled_qps[tenant_ctx.enabled_head];
-          qp_ctx[le_qidx].post_num = 0;
+          perf_qring_pop(&(tenant_ctx.enabled_qps), &le_qidx);
+          le_qidx = perf_qring_peek(&(tenant_ctx.enabled_qps));
+          if(le_qidx != -1)
+            qp_ctx[le_qidx].post_num = 0;
         
-          mqp_idx = USE_MULTI_MQP ? le_qidx : 0; 
+          mqp_idx = perf_mqp_of(le_qidx); 
         }
       }
 
-      if(le_qidx != -1 && tenant_ctx.additional_enable_num < shm_ctx->additional_qps_num[tenant_id] && tenant_ctx.wait_num > tenant_ctx.enable_num)
+      if(le_qidx != -1 && tenant_ctx.additional_enable_num < shm_ctx->tenant[tenant_id].additional_qps_num && tenant_ctx.wait_num > tenant_ctx.enable_num)
       {
         struct ibv_exp_send_wr *exp_bad_wr;
 
-        //LOG_ERROR("Additional Enable process: %d %d %d %d\n", le_qidx, tenant_ctx.allowed_qps_num, tenant_ctx.wait_num - tenant_ctx.enable_num, shm_ctx->additional_qps_num[tenant_id]);
+        //LOG_ERROR("Additional Enable process: %d %d %d %d\n", le_qidx, tenant_ctx.allowed_qps_num, tenant_ctx.wait_num - tenant_ctx.enable_num, shm_ctx->tenant[tenant_id].additional_qps_num);
 
         if(mlx5_exp_post_send2(mqp_ctx[mqp_idx].qp, &(mqp_ctx[mqp_idx].self_wait_cqe_wr), &exp_bad_wr, 1) != 0)
         {
@@ -1200,48 +1572,38 @@ void perf_mqp_process()
         tenant_ctx.additional_enable_num++;
         qp_ctx[le_qidx].post_num = 0;
 
-        tenant_ctx.enabled_time[tenant_ctx.enabled_tail] = now;
-        tenant_ctx.enabled_qps[tenant_ctx.enabled_tail] = tenant_ctx.waiting_qps[tenant_ctx.waiting_head];
-        tenant_ctx.enabled_tail = (tenant_ctx.enabled_tail + 1) % global_qnum;
-
-        tenant_ctx.waiting_qps[tenant_ctx.waiting_head] = -1;
-        tenant_ctx.waiting_head = (tenant_ctx.waiting_head + 1) % global_qnum;
+        perf_enable_next(&now);
       }
 
-      else if(le_qidx != -1 && tenant_ctx.additional_enable_num > shm_ctx->additional_qps_num[tenant_id])
+      else if(le_qidx != -1 && tenant_ctx.additional_enable_num > shm_ctx->tenant[tenant_id].additional_qps_num)
       {
-        //LOG_ERROR("Additional Wait process: %d %d %d %d\n", le_qidx, tenant_ctx.allowed_qps_num, tenant_ctx.wait_num - tenant_ctx.enable_num, shm_ctx->additional_qps_num[tenant_id]);
+        //LOG_ERROR("Additional Wait process: %d %d %d %d\n", le_qidx, tenant_ctx.allowed_qps_num, tenant_ctx.wait_num - tenant_ctx.enable_num, shm_ctx->tenant[tenant_id].additional_qps_num);
         
         qp_ctx[le_qidx].post_num = 0;
         qp_ctx[le_qidx].is_first_wait = true;
         tenant_ctx.additional_enable_num--;
 
-        if(!qp_ctx[le_qidx].is_paused)
+        if(!perf_qp_paused(le_qidx))
           perf_allowed_release(le_qidx);
 
-        tenant_ctx.enabled_qps[tenant_ctx.enabled_head] = -1;
-        tenant_ctx.enabled_head = (tenant_ctx.enabled_head + 1) % global_qnum;
-        le_qidx = tenant_ctx.enabled_qps[tenant_ctx.enabled_head];
-        qp_ctx[le_qidx].post_num = 0;
-        mqp_idx = USE_MULTI_MQP ? le_qidx : 0; 
+        perf_qring_pop(&(tenant_ctx.enabled_qps), &le_qidx);
+        le_qidx = perf_qring_peek(&(tenant_ctx.enabled_qps));
+        if(le_qidx != -1)
+          qp_ctx[le_qidx].post_num = 0;
+        mqp_idx = perf_mqp_of(le_qidx); 
       }
 
       if(le_qidx == -1)
       {
-        LOG_ERROR("enable_qps is empty\n");
-        for(uint32_t i=0; i<global_qnum; i++)
-          LOG_ERROR("%d %d\n", tenant_ctx.enabled_qps[i], tenant_ctx.waiting_qps[i]);
-        
+        LOG_ERROR("enable_qps is empty, %u waiting\n", perf_qring_len(&(tenant_ctx.waiting_qps)));
         exit(1);
       }
-      pthread_mutex_unlock(&tenant_ctx.wait_lock);
     }
   }
-  else if(tenant_ctx.wait_num && !(!tenant_ctx.delay_sensitive  && shm_ctx->active_tenant_num > 1 && (shm_ctx->active_qps_num > shm_ctx->max_qps_limit || shm_ctx->active_tenant_num != shm_ctx->active_stenant_num)))
+  else if(tenant_ctx.wait_num && !(!tenant_ctx.delay_sensitive && agg.active_tenant_num > 1 && (agg.active_qps_num > agg.max_qps_limit || agg.active_tenant_num != agg.active_stenant_num)))
   {
-    pthread_mutex_lock(&tenant_ctx.wait_lock);
-    uint32_t le_qidx = tenant_ctx.enabled_qps[tenant_ctx.enabled_head];
-    uint32_t mqp_idx = USE_MULTI_MQP ? le_qidx : 0; 
+    uint32_t le_qidx = perf_qring_peek(&(tenant_ctx.enabled_qps));
+    uint32_t mqp_idx = perf_mqp_of(le_qidx); 
     struct ibv_exp_send_wr *exp_bad_wr;
 
     //LOG_ERROR("Start Init process: %d\n", le_qidx);
@@ -1261,29 +1623,40 @@ void perf_mqp_process()
       }
     }
 
-    tenant_ctx.is_first_wait = true;
-    for(uint32_t i=0; i<global_qnum; i++)
-    {
-      qp_ctx[i].is_first_wait = true;
-      tenant_ctx.enabled_qps[i] = -1;
-      tenant_ctx.waiting_qps[i] = -1;
-    }
+    uint32_t drop;
+    while(perf_qring_pop(&(tenant_ctx.enabled_qps), &drop));
+    while(perf_qring_pop(&(tenant_ctx.waiting_qps), &drop));
 
     tenant_ctx.wait_num = 0;
     tenant_ctx.enable_num = 0;
-    tenant_ctx.waiting_head = 0;
-    tenant_ctx.waiting_tail = 0;
-    tenant_ctx.enabled_head = 0;
-    tenant_ctx.enabled_tail = 0;
     tenant_ctx.additional_enable_num = 0;
 
+    for(uint32_t i=0; i<global_qnum; i++)
+      qp_ctx[i].is_first_wait = true;
+    atomic_store(&(tenant_ctx.is_first_wait), true);
+
     perf_init_pause_state();
-    pthread_mutex_unlock(&tenant_ctx.wait_lock);
   }
 }
 
+//perf_thread and posting threads both get here; whoever holds mqp_lock does the work
+void perf_mqp_process()
+{
+  if(!use_perf)
+    return;
+
+  if(pthread_mutex_trylock(&(tenant_ctx.mqp_lock)))
+    return;
+
+  __perf_mqp_process();
+  pthread_mutex_unlock(&(tenant_ctx.mqp_lock));
+}
+
 int perf_process(struct ibv_qp *qp, struct ibv_send_wr *wr)
 {
+  if(perf_trace)
+    perf_trace_post(perf_trace, qp->qp_num, to_mqp(qp)->sq_signal_bits, wr);
+
   uint64_t size = 0;
   for(uint32_t i=0; i<wr->num_sge; i++)
     size += wr->sg_list[i].length;
@@ -1300,8 +1673,10 @@ int perf_process(struct ibv_qp *qp, struct ibv_send_wr *wr)
   while(rc_used && !read_qp_connected)
     sleep(1);
 
-  tenant_ctx.avg_msg_size = tenant_ctx.avg_msg_size == 0 ? size : 0.5 * tenant_ctx.avg_msg_size + 0.5 * size; 
+  atomic_fetch_add_explicit(&(tenant_ctx.cls.msg_hist[perf_cls_bucket(size)]), 1, memory_order_relaxed);
   tenant_ctx.max_msg_size = tenant_ctx.max_msg_size < size ? size : tenant_ctx.max_msg_size; 
+  if(tenant_ctx.avg_msg_size == 0)
+    tenant_ctx.avg_msg_size = size;
 
   if(size < PERF_LARGE_FLOW)
   {
@@ -1317,31 +1692,11 @@ int perf_process(struct ibv_qp *qp, struct ibv_send_wr *wr)
     }
     
     //if(!(shm_ctx->active_tenant_num > 1 &&  (shm_ctx->active_qps_num > shm_ctx->max_qps_limit || shm_ctx->active_tenant_num != shm_ctx->active_stenant_num)))
-    if(!(shm_ctx->active_tenant_num > 1 && shm_ctx->active_qps_num > shm_ctx->max_qps_limit))
+    if(!perf_shm_over_limit())
       return PERF_BYPASS;
 
-    if(tenant_ctx.allowed_qps_num == MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id] && qp_ctx[q_idx].is_paused)
-    {
-      pthread_mutex_lock(&(tenant_ctx.allow_lock));
-      if(tenant_ctx.allowed_qps_num == MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id] && qp_ctx[q_idx].is_paused)
-      {
-        if(qp_ctx[q_idx].paused_idx == -1 && !qp_ctx[q_idx].is_allowed)
-        {
-          if(tenant_ctx.paused_qps[tenant_ctx.paused_qps_tail] != -1)
-          {
-            LOG_ERROR("Pause QP insert error\n");
-            exit(1);
-          }
-          tenant_ctx.paused_qps[tenant_ctx.paused_qps_tail] = q_idx;
-          qp_ctx[q_idx].paused_idx = tenant_ctx.paused_qps_tail;
-          //LOG_ERROR("Paused QP Insert: %d %d\n", q_idx,  tenant_ctx.paused_qps_tail);
-          tenant_ctx.paused_qps_tail = (tenant_ctx.paused_qps_tail + 1) % global_qnum;
-        }
-        pthread_mutex_unlock(&(tenant_ctx.allow_lock));
-        return PERF_BACKGROUND;
-      }
-      pthread_mutex_unlock(&(tenant_ctx.allow_lock));
-    }
+    if(perf_pause_qp(q_idx))
+      return PERF_BACKGROUND;
     //else
     //{
       //LOG_ERROR("BYPASS QP: %d\n", q_idx);
@@ -1350,38 +1705,20 @@ int perf_process(struct ibv_qp *qp, struct ibv_send_wr *wr)
   }
   else
   {
+    uint32_t q_idx = kh_value(qp_hash, kh_get(qph, qp_hash, qp->qp_num));
+
     if(wr->opcode == IBV_WR_RDMA_READ)
     {
+      //responder not reachable through a read channel yet
+      if(perf_route_read_peer(q_idx) == -1)
+        return PERF_BYPASS;
+
       tenant_ctx.is_bw_read = true;
       return PERF_BACKGROUND;
     }
   
-    bw_send = true;
-
-    uint32_t q_idx = kh_value(qp_hash, kh_get(qph, qp_hash, qp->qp_num));
-
-    if(tenant_ctx.allowed_qps_num == MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id] && qp_ctx[q_idx].is_paused)
-    {
-      pthread_mutex_lock(&(tenant_ctx.allow_lock));
-      if(tenant_ctx.allowed_qps_num == MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id] && qp_ctx[q_idx].is_paused)
-      {
-        if(qp_ctx[q_idx].paused_idx == -1 && !qp_ctx[q_idx].is_allowed)
-        {
-          if(tenant_ctx.paused_qps[tenant_ctx.paused_qps_tail] != -1)
-          {
-            LOG_ERROR("Pause QP insert error\n");
-            exit(1);
-          }
-          tenant_ctx.paused_qps[tenant_ctx.paused_qps_tail] = q_idx;
-          qp_ctx[q_idx].paused_idx = tenant_ctx.paused_qps_tail;
-          //LOG_ERROR("Paused QP Insert: %d %d\n", q_idx,  tenant_ctx.paused_qps_tail);
-          tenant_ctx.paused_qps_tail = (tenant_ctx.paused_qps_tail + 1) % global_qnum;
-        }
-        pthread_mutex_unlock(&(tenant_ctx.allow_lock));
-        return PERF_BACKGROUND;
-      }
-      pthread_mutex_unlock(&(tenant_ctx.allow_lock));
-    }
+    if(perf_pause_qp(q_idx))
+      return PERF_BACKGROUND;
  
     if(size <= CHUNK_SIZE) //for poll post mode
       return size;
@@ -1398,7 +1735,7 @@ void perf_poll_post(struct ibv_qp *qp, struct ibv_send_wr *wr, uint32_t size)
   while(wr != NULL)
   {
     //for poll post mode
-    if(size > CHUNK_SIZE || qp_ctx[q_idx].wr_queue_len || !shm_ctx->btenant_can_post[tenant_id]) 
+    if(size > CHUNK_SIZE || qp_ctx[q_idx].wr_queue_len || !shm_ctx->tenant[tenant_id].btenant_can_post) 
     {
       perf_bg_post(qp, wr);
       break;
@@ -1408,8 +1745,15 @@ void perf_poll_post(struct ibv_qp *qp, struct ibv_send_wr *wr, uint32_t size)
       struct ibv_send_wr* next_wr;
       next_wr = wr->next;
       wr->next = NULL;
-      perf_large_process(q_idx, wr, size);
+      bool posted = perf_large_process(q_idx, wr, size);
       wr->next = next_wr;
+
+      //paced out or SQ full: a single chunk, so none of it went out, queue it with the rest
+      if(!posted)
+      {
+        perf_bg_post(qp, wr);
+        break;
+      }
     }
 
     wr = wr->next;
@@ -1477,155 +1821,243 @@ void perf_bg_recv_post(struct ibv_qp *qp, struct ibv_recv_wr *wr)
   }
 }
 
-void perf_init_pause_state()
+//once per ring, before any thread can push or pop
+void perf_qring_init(struct perf_qring* ring, uint32_t size)
 {
-  pthread_mutex_lock(&(tenant_ctx.allow_lock));
-  for(uint32_t i=0; i<global_qnum; i++)
-  {
-    qp_ctx[i].is_paused = true;
-    qp_ctx[i].paused_idx = -1;
-    qp_ctx[i].is_allowed = false;
-    tenant_ctx.paused_qps[i] = -1;
-  }
-  tenant_ctx.paused_qps_head = 0; 
-  tenant_ctx.paused_qps_tail = 0; 
-  tenant_ctx.allowed_qps_num = 0;
-  pthread_mutex_unlock(&(tenant_ctx.allow_lock));
+  uint32_t cap = 1;
+  while(cap < size)
+    cap <<= 1;
+
+  ring->cells = (struct perf_qring_cell*)malloc(sizeof(struct perf_qring_cell) * cap);
+  for(uint32_t i=0; i<cap; i++)
+    atomic_init(&(ring->cells[i].seq), i);
+
+  ring->mask = cap - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
 }
 
-bool perf_check_paused(uint32_t q_idx)
+bool perf_qring_push(struct perf_qring* ring, uint32_t val)
 {
-  if(!(!tenant_ctx.delay_sensitive && shm_ctx->active_tenant_num > 1 && shm_ctx->active_qps_num > shm_ctx->max_qps_limit && global_qnum > 1))
-  {
-    //LOG_ERROR("CHECK Paused pass\n");
-    return false;
-  }
-  
-  bool ret = false;
-  pthread_mutex_lock(&(tenant_ctx.allow_lock));
-  if(tenant_ctx.allowed_qps_num < MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id] && qp_ctx[q_idx].is_paused)
-  {
-    qp_ctx[q_idx].is_paused = false;
-    qp_ctx[q_idx].paused_idx = -1;
-    qp_ctx[q_idx].is_allowed = true;
-    gettimeofday(&(qp_ctx[q_idx].last_allowed_time), NULL);
-    tenant_ctx.allowed_qps_num++;
-    //LOG_ERROR("ALLOW INIT: %d %d\n", q_idx,  tenant_ctx.allowed_qps_num);
-  }
-  else if(qp_ctx[q_idx].is_paused)
-  {
-    ret = true;
-  }
-  else if(tenant_ctx.allowed_qps_num > MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id])
+  uint32_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while(1)
   {
-    qp_ctx[q_idx].is_allowed = false;
-    qp_ctx[q_idx].is_paused = true;
-    qp_ctx[q_idx].paused_idx = -1;
-    tenant_ctx.allowed_qps_num--;
-    ret = true;
-    //LOG_ERROR("Allow Released: %d %d\n", q_idx,  tenant_ctx.allowed_qps_num);
+    struct perf_qring_cell* cell = &(ring->cells[pos & ring->mask]);
+    int32_t dif = (int32_t)(atomic_load_explicit(&cell->seq, memory_order_acquire) - pos);
+
+    if(dif == 0)
+    {
+      if(atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+      {
+        cell->val = val;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return true;
+      }
+    }
+    else if(dif < 0)
+      return false; //full
+    else
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
   }
-  else
-  {
-    struct timeval now;
-    gettimeofday(&now, NULL);
+}
 
-    uint64_t t = (now.tv_sec - qp_ctx[q_idx].last_allowed_time.tv_sec) * 1000000 + (now.tv_usec - qp_ctx[q_idx].last_allowed_time.tv_usec);
+bool perf_qring_pop(struct perf_qring* ring, uint32_t* val)
+{
+  uint32_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while(1)
+  {
+    struct perf_qring_cell* cell = &(ring->cells[pos & ring->mask]);
+    int32_t dif = (int32_t)(atomic_load_explicit(&cell->seq, memory_order_acquire) - (pos + 1));
 
-    if(t >= ALLOWED_QP_TIME_TH && tenant_ctx.paused_qps[tenant_ctx.paused_qps_head] != -1)
+    if(dif == 0)
     {
-      //LOG_ERROR("Paused QP Delete: %d %d %d\n", q_idx,  tenant_ctx.paused_qps[tenant_ctx.paused_qps_head],  tenant_ctx.paused_qps_head);
-      
-      uint32_t allow_idx = tenant_ctx.paused_qps[tenant_ctx.paused_qps_head];
-
-      while(allow_idx != -1 && !qp_ctx[allow_idx].is_paused)
+      if(atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
       {
-        tenant_ctx.paused_qps[tenant_ctx.paused_qps_head] = -1;
-        tenant_ctx.paused_qps_head = (tenant_ctx.paused_qps_head + 1) % global_qnum;
-        allow_idx = tenant_ctx.paused_qps[tenant_ctx.paused_qps_head];
+        *val = cell->val;
+        atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+        return true;
       }
+    }
+    else if(dif < 0)
+      return false; //empty
+    else
+      pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  }
+}
 
-      if(allow_idx != -1)
-      {
-        qp_ctx[allow_idx].is_allowed = true;
+//Only valid from the single consumer, -1 if empty
+uint32_t perf_qring_peek(struct perf_qring* ring)
+{
+  uint32_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct perf_qring_cell* cell = &(ring->cells[pos & ring->mask]);
 
-        qp_ctx[q_idx].is_allowed = false;
+  if(atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1)
+    return -1;
+  return cell->val;
+}
 
-        qp_ctx[allow_idx].paused_idx = -1;
-        qp_ctx[allow_idx].last_allowed_time = now;
+uint32_t perf_qring_len(struct perf_qring* ring)
+{
+  return atomic_load(&ring->tail) - atomic_load(&ring->head);
+}
 
-        tenant_ctx.paused_qps[tenant_ctx.paused_qps_head] = -1;
-        tenant_ctx.paused_qps_head = (tenant_ctx.paused_qps_head + 1) % global_qnum;
+static uint32_t perf_allowed_limit()
+{
+  return MAX_ALLOWED_QP_NUM + shm_ctx->tenant[tenant_id].additional_qps_num;
+}
 
-        qp_ctx[q_idx].is_paused = true;
-        qp_ctx[allow_idx].is_paused = false;
+bool perf_qp_paused(uint32_t q_idx)
+{
+  return !(atomic_load_explicit(&(qp_ctx[q_idx].sched_state), memory_order_acquire) & PERF_QP_ALLOWED);
+}
 
-        //LOG_ERROR("ALLOWED: %d %d\n", q_idx, allow_idx);
-        ret = true;
-      }
-      else
-      {
-        qp_ctx[q_idx].is_allowed = false;
-        qp_ctx[q_idx].is_paused = true;
-        qp_ctx[q_idx].paused_idx = -1;
-        tenant_ctx.allowed_qps_num--;
-        //LOG_ERROR("Allow Released: %d %d\n", q_idx,  tenant_ctx.allowed_qps_num);
-      }
-    }
+//Take one of the tenant's allowed slots if one is free
+static bool perf_take_allowed_slot()
+{
+  uint32_t n = atomic_load(&tenant_ctx.allowed_qps_num);
+  while(n < perf_allowed_limit())
+  {
+    if(atomic_compare_exchange_weak(&tenant_ctx.allowed_qps_num, &n, n + 1))
+      return true;
   }
+  return false;
+}
 
-  pthread_mutex_unlock(&(tenant_ctx.allow_lock));
-  return ret;
+//Give the slot held by an allowed QP back, false if someone else already did
+static bool perf_drop_allowed(uint32_t q_idx)
+{
+  uint32_t st = atomic_load(&(qp_ctx[q_idx].sched_state));
+  while(st & PERF_QP_ALLOWED)
+  {
+    if(atomic_compare_exchange_weak(&(qp_ctx[q_idx].sched_state), &st, st & ~PERF_QP_ALLOWED))
+      return true;
+  }
+  return false;
 }
 
-void perf_allowed_release(uint32_t q_idx)
+//Mark a paused QP allowed; the caller already owns the slot it gets
+static bool perf_grant_allowed(uint32_t q_idx, bool dequeued, struct timeval* now)
 {
-  pthread_mutex_lock(&(tenant_ctx.allow_lock));
-  uint32_t allow_idx = -1;
- 
-  if(tenant_ctx.allowed_qps_num <= MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id] && tenant_ctx.paused_qps[tenant_ctx.paused_qps_head] != -1)
+  uint32_t st = atomic_load(&(qp_ctx[q_idx].sched_state));
+  while(1)
   {
-    //LOG_ERROR("Allow released & Paused QP Delete: %d %d %d\n", q_idx,  tenant_ctx.paused_qps[tenant_ctx.paused_qps_head],  tenant_ctx.paused_qps_head);
-    struct timeval now;
-    gettimeofday(&now, NULL);
+    uint32_t next = dequeued ? (st | PERF_QP_ALLOWED) & ~PERF_QP_QUEUED : st | PERF_QP_ALLOWED;
+    if(st & PERF_QP_ALLOWED)
+    {
+      if(!dequeued || atomic_compare_exchange_weak(&(qp_ctx[q_idx].sched_state), &st, st & ~PERF_QP_QUEUED))
+        return false;
+      continue;
+    }
+    if(atomic_compare_exchange_weak(&(qp_ctx[q_idx].sched_state), &st, next))
+      break;
+  }
+  qp_ctx[q_idx].last_allowed_time = *now;
+  return true;
+}
 
-    allow_idx = tenant_ctx.paused_qps[tenant_ctx.paused_qps_head];
- 
-    while(allow_idx != -1 && !qp_ctx[allow_idx].is_paused)
+//Hand the slot of q_idx (already dropped) to the oldest paused QP, false if none is left
+static bool perf_handoff_allowed(struct timeval* now)
+{
+  uint32_t allow_idx;
+  while(perf_qring_pop(&(tenant_ctx.paused_qps), &allow_idx))
+  {
+    if(perf_grant_allowed(allow_idx, true, now))
     {
-      tenant_ctx.paused_qps[tenant_ctx.paused_qps_head] = -1;
-      tenant_ctx.paused_qps_head = (tenant_ctx.paused_qps_head + 1) % global_qnum;
-      allow_idx = tenant_ctx.paused_qps[tenant_ctx.paused_qps_head];
+      //LOG_ERROR("ALLOWED: %d\n", allow_idx);
+      return true;
     }
+  }
+  return false;
+}
 
-    if(allow_idx != -1)
+//Called when a paused QP wants to post while all slots are taken, true if it must stay in background
+bool perf_pause_qp(uint32_t q_idx)
+{
+  if(!(tenant_ctx.allowed_qps_num == perf_allowed_limit() && perf_qp_paused(q_idx)))
+    return false;
+
+  uint32_t st = 0;
+  if(atomic_compare_exchange_strong(&(qp_ctx[q_idx].sched_state), &st, PERF_QP_QUEUED))
+  {
+    if(!perf_qring_push(&(tenant_ctx.paused_qps), q_idx))
     {
-      qp_ctx[allow_idx].is_allowed = true;
+      LOG_ERROR("Pause QP insert error\n");
+      exit(1);
+    }
+    //LOG_ERROR("Paused QP Insert: %d\n", q_idx);
+  }
+  return true;
+}
 
-      qp_ctx[q_idx].is_allowed = false;
+void perf_init_pause_state()
+{
+  uint32_t drop;
+  while(perf_qring_pop(&(tenant_ctx.paused_qps), &drop))
+    atomic_fetch_and(&(qp_ctx[drop].sched_state), ~PERF_QP_QUEUED);
 
-      qp_ctx[allow_idx].paused_idx = -1;
-      qp_ctx[allow_idx].last_allowed_time = now;
+  for(uint32_t i=0; i<global_qnum; i++)
+  {
+    if(atomic_fetch_and(&(qp_ctx[i].sched_state), ~PERF_QP_ALLOWED) & PERF_QP_ALLOWED)
+      tenant_ctx.allowed_qps_num--;
+  }
+}
 
-      tenant_ctx.paused_qps[tenant_ctx.paused_qps_head] = -1;
-      tenant_ctx.paused_qps_head = (tenant_ctx.paused_qps_head + 1) % global_qnum;
+bool perf_check_paused(uint32_t q_idx)
+{
+  if(!(!tenant_ctx.delay_sensitive && perf_shm_over_limit() && global_qnum > 1))
+  {
+    //LOG_ERROR("CHECK Paused pass\n");
+    return false;
+  }
+  
+  struct timeval now;
+  gettimeofday(&now, NULL);
 
-      qp_ctx[q_idx].is_paused = true;
-      qp_ctx[allow_idx].is_paused = false;
+  if(perf_qp_paused(q_idx))
+  {
+    if(!perf_take_allowed_slot())
+      return true;
 
-      //LOG_ERROR("Allow Released & NEW ALLOWED: %d %d\n", q_idx, allow_idx);
-    }
+    if(!perf_grant_allowed(q_idx, false, &now))
+      tenant_ctx.allowed_qps_num--; //allowed concurrently, give the extra slot back
+    //LOG_ERROR("ALLOW INIT: %d %d\n", q_idx,  tenant_ctx.allowed_qps_num);
+    return false;
   }
 
-  if(allow_idx == -1)
+  if(tenant_ctx.allowed_qps_num > perf_allowed_limit())
   {
-    qp_ctx[q_idx].is_allowed = false;
-    qp_ctx[q_idx].is_paused = true;
-    qp_ctx[q_idx].paused_idx = -1;
-    tenant_ctx.allowed_qps_num--;
+    if(perf_drop_allowed(q_idx))
+      tenant_ctx.allowed_qps_num--;
     //LOG_ERROR("Allow Released: %d %d\n", q_idx,  tenant_ctx.allowed_qps_num);
+    return true;
   }
-  pthread_mutex_unlock(&(tenant_ctx.allow_lock));
+
+  uint64_t t = (now.tv_sec - qp_ctx[q_idx].last_allowed_time.tv_sec) * 1000000 + (now.tv_usec - qp_ctx[q_idx].last_allowed_time.tv_usec);
+
+  if(t < ALLOWED_QP_TIME_TH || !perf_qring_len(&(tenant_ctx.paused_qps)) || !perf_drop_allowed(q_idx))
+    return false;
+
+  if(perf_handoff_allowed(&now))
+    return true;
+
+  tenant_ctx.allowed_qps_num--;
+  //LOG_ERROR("Allow Released: %d %d\n", q_idx,  tenant_ctx.allowed_qps_num);
+  return false;
+}
+
+void perf_allowed_release(uint32_t q_idx)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  if(!perf_drop_allowed(q_idx))
+    return;
+ 
+  if(tenant_ctx.allowed_qps_num <= perf_allowed_limit() && perf_handoff_allowed(&now))
+    return;
+
+  tenant_ctx.allowed_qps_num--;
+  //LOG_ERROR("Allow Released: %d %d\n", q_idx,  tenant_ctx.allowed_qps_num);
 }
 
 void perf_wr_queue_manage()
@@ -1640,7 +2072,7 @@ void perf_wr_queue_manage()
         continue;
 
       uint32_t p_num = 0;
-      while(qp_ctx[i].wr_queue_len - p_num > 0 && shm_ctx->btenant_can_post[tenant_id] && !(tenant_ctx.allowed_qps_num == MAX_ALLOWED_QP_NUM + shm_ctx->additional_qps_num[tenant_id] && qp_ctx[i].is_paused))
+      while(qp_ctx[i].wr_queue_len - p_num > 0 && shm_ctx->tenant[tenant_id].btenant_can_post && !(tenant_ctx.allowed_qps_num == perf_allowed_limit() && perf_qp_paused(i)))
       { 
         //LOG_ERROR("%d %d %d\n", mlx5_get_sq_num(qp_ctx[i].qp), qp_ctx[i].wr_queue_len, p_num);
         struct ibv_send_wr* wr = get_queued_wr(i, p_num);
@@ -1730,33 +2162,40 @@ void perf_recv_wr_queue_manage()
 {
   for(uint32_t i=0; i<global_qnum; i++)
   {
-    if(!qp_ctx[i].recv_wr_queue_len)
-      continue;
-
-    //LOG_ERROR("Rcev Queue Len: %d\n", qp_ctx[i].recv_wr_queue_len);
-    bool p_comp = false;
-    while(qp_ctx[i].recv_wr_queue_len > 0)
-    { 
-      //LOG_ERROR("%d %d \n", mlx5_get_rq_num(qp_ctx[i].qp), qp_ctx[i].recv_wr_queue_len);
-      struct ibv_recv_wr* wr = get_queued_recv_wr(i, 0);
+    uint32_t max_recv_wr = qp_ctx[i].max_recv_wr;
+    uint32_t rq_num = mlx5_get_rq_num(qp_ctx[i].qp);
+    uint32_t consumed = qp_ctx[i].recv_rq_num > rq_num ? qp_ctx[i].recv_rq_num - rq_num : 0;
+
+    //keep room for the receives expected to complete before the next pass,
+    //reaping early instead of waiting for the RQ to run full
+    uint32_t headroom = RECV_HEADROOM * qp_ctx[i].recv_rate / 16;
+    if(headroom == 0)
+      headroom = 1;
+    if(headroom > max_recv_wr)
+      headroom = max_recv_wr;
+
+    if(qp_ctx[i].recv_wr_queue_len && max_recv_wr - rq_num < headroom)
+    {
+      perf_early_poll_cq();
 
-      if(wr == NULL)
-        break;
+      uint32_t polled_rq_num = mlx5_get_rq_num(qp_ctx[i].qp);
+      if(polled_rq_num < rq_num)
+        consumed += rq_num - polled_rq_num;
+      rq_num = polled_rq_num;
+    }
 
-      uint64_t size = 0;
-      for(uint64_t i=0; i<wr->num_sge; i++)
-        size += wr->sg_list[i].length;
+    qp_ctx[i].recv_rate += consumed * 4 - qp_ctx[i].recv_rate / 4;
 
-      wr->next = NULL;
-      if(perf_large_recv_process(i, wr, size))
-        p_comp = true;
-      else
+    while(qp_ctx[i].recv_wr_queue_len > 0 && rq_num < max_recv_wr)
+    {
+      uint32_t posted = perf_large_recv_process(i, max_recv_wr - rq_num);
+      if(!posted)
         break;
 
-      if(p_comp)
-        dequeue_recv_wr(i, 1);
-      //LOG_ERROR("Pause WRs Processed: %d %d %d\n", i,  qp_ctx[i].wr_queue_len, p_num);
+      rq_num += posted;
     }
+
+    qp_ctx[i].recv_rq_num = rq_num;
   }
 }
 
@@ -1784,11 +2223,104 @@ bool perf_small_process(uint32_t q_idx, struct ibv_send_wr *wr, uint32_t nreq)
   return true;
 }
 
+uint64_t perf_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void perf_pace_report()
+{
+  uint64_t dummy = atomic_load(&(tenant_ctx.pace.dummy_wrs));
+  uint64_t data = atomic_load(&(tenant_ctx.pace.data_wrs));
+
+  LOG_ERROR("PeRF pace: target %lu B/s, achieved %lu B/s, %u dummy/chunk%s, dummy WR overhead %.2f%%\n",
+      tenant_ctx.pace.target_rate, tenant_ctx.pace.achieved_rate, tenant_ctx.pace.dummy_num, tenant_ctx.pace.time_pacing ? " + time pacing" : "",
+      dummy + data ? 100.0 * dummy / (dummy + data) : 0.0);
+}
+
+//Closed loop on the bytes the tenant's large flows actually pushed during the last interval (perf_thread only)
+void perf_pace_update()
+{
+  uint64_t now = perf_now_ns();
+  uint64_t t = now - tenant_ctx.pace.window_start;
+
+  if(t < PACE_INTERVAL * 1000ULL)
+    return;
+
+  uint64_t achieved = atomic_exchange(&(tenant_ctx.pace.window_bytes), 0) * 1000000000ULL / t;
+  tenant_ctx.pace.window_start = now;
+  tenant_ctx.pace.achieved_rate = achieved;
+
+  struct perf_shm_agg agg;
+  perf_shm_agg_read(shm_ctx, &agg);
+
+  //only shape while someone needs the headroom
+  if(!agg.active_stenant_num || tenant_ctx.delay_sensitive)
+  {
+    tenant_ctx.pace.target_rate = 0;
+    tenant_ctx.pace.time_pacing = false;
+    return;
+  }
+
+  uint32_t share = agg.active_mtenant_num ? PACE_SHARE_MSG : PACE_SHARE;
+  uint32_t btenant_num = agg.active_dtenant_num ? agg.active_dtenant_num : 1;
+  uint64_t target = MAX_RATE / 100 * share / btenant_num;
+  uint64_t slack = target / 50;
+  uint32_t step = tenant_ctx.pace.dummy_num / 8 ? tenant_ctx.pace.dummy_num / 8 : 1;
+
+  tenant_ctx.pace.target_rate = target;
+
+  if(achieved > target + slack)
+  {
+    if(tenant_ctx.pace.dummy_num < PACE_MAX_DUMMY)
+      tenant_ctx.pace.dummy_num = tenant_ctx.pace.dummy_num + step < PACE_MAX_DUMMY ? tenant_ctx.pace.dummy_num + step : PACE_MAX_DUMMY;
+    else if(!tenant_ctx.pace.time_pacing)
+    {
+      //dummies alone cannot slow this tenant enough
+      tenant_ctx.pace.time_pacing = true;
+      tenant_ctx.pace.next_chunk_ns = now;
+    }
+  }
+  else if(achieved + slack < target)
+  {
+    if(tenant_ctx.pace.time_pacing)
+      tenant_ctx.pace.time_pacing = false;
+    else
+      tenant_ctx.pace.dummy_num = tenant_ctx.pace.dummy_num > step ? tenant_ctx.pace.dummy_num - step : 0;
+  }
+
+  if(PACE_REPORT)
+    perf_pace_report();
+}
+
+//With time-based pacing, chunks leave at most every CHUNK_SIZE / target_rate
+bool perf_pace_chunk_due()
+{
+  if(!tenant_ctx.pace.time_pacing || !tenant_ctx.pace.target_rate)
+    return true;
+
+  uint64_t now = perf_now_ns();
+  uint64_t gap = CHUNK_SIZE * 1000000000ULL / tenant_ctx.pace.target_rate;
+
+  if(now < tenant_ctx.pace.next_chunk_ns)
+    return false;
+
+  //no credit for idle time
+  tenant_ctx.pace.next_chunk_ns = (tenant_ctx.pace.next_chunk_ns + gap > now ? tenant_ctx.pace.next_chunk_ns : now) + gap;
+  return true;
+}
+
 bool perf_large_process(uint32_t q_idx, struct ibv_send_wr *wr, uint64_t size)
 {
   uint64_t chunk_num = ceil(size / (double)CHUNK_SIZE);
   struct ibv_send_wr* bad_wr;
 
+  //only single-SGE WRs are split, the receiver leaves multi-SGE ones whole too
+  if(wr->num_sge != 1 && chunk_num > 1)
+    chunk_num = 1;
+
   uint64_t origin_length = wr->sg_list[0].length;
   uint64_t origin_addr = wr->sg_list[0].addr;
   uint32_t origin_flag = wr->send_flags;
@@ -1804,17 +2336,10 @@ bool perf_large_process(uint32_t q_idx, struct ibv_send_wr *wr, uint64_t size)
   {
     while(qp_ctx[q_idx].chunk_sent_bytes >= CHUNK_SIZE)
     {
-      if(shm_ctx->active_stenant_num)
+      uint32_t dummy_num = tenant_ctx.pace.dummy_num;
+      if(tenant_ctx.pace.target_rate && dummy_num)
       {
-        if(DUMMY_FACTOR_2 != 0)
-        {
-          if(shm_ctx->active_mtenant_num == 0)
-            DUMMY_FACTOR = DUMMY_FACTOR_2; // for large throughput
-          else
-            DUMMY_FACTOR = DUMMY_FACTOR_1; // for high message rate
-        }
-
-        uint32_t dummy_num = CHUNK_SIZE / DUMMY_FACTOR;
+        uint32_t dummy_bytes = CHUNK_SIZE / dummy_num;
         struct ibv_exp_send_wr* dummy = qp_ctx[q_idx].dummy;
         struct ibv_exp_send_wr* exp_bad_wr;
 
@@ -1841,21 +2366,22 @@ bool perf_large_process(uint32_t q_idx, struct ibv_send_wr *wr, uint64_t size)
           uint32_t can_post_num = qp_ctx[q_idx].max_wr - 10 - mlx5_get_sq_num(qp_ctx[q_idx].qp);
           can_post_num = can_post_num < dummy_num ? can_post_num : dummy_num;
 
-          if(mlx5_exp_post_send2(qp_ctx[q_idx].qp, &(dummy[(uint32_t)(CHUNK_SIZE / DUMMY_FACTOR_1) - can_post_num]), &exp_bad_wr, 1) != 0)
+          if(mlx5_exp_post_send2(qp_ctx[q_idx].qp, &(dummy[PACE_MAX_DUMMY - can_post_num]), &exp_bad_wr, 1) != 0)
           {
             LOG_ERROR("Send dummy error: %d %d\n", qp_ctx[q_idx].max_wr, mlx5_get_sq_num(qp_ctx[q_idx].qp));
             exit(1);
           }
 
           dummy_num -= can_post_num;
-          qp_ctx[q_idx].chunk_sent_bytes -= (DUMMY_FACTOR * can_post_num);
+          qp_ctx[q_idx].chunk_sent_bytes = qp_ctx[q_idx].chunk_sent_bytes > dummy_bytes * can_post_num ? qp_ctx[q_idx].chunk_sent_bytes - dummy_bytes * can_post_num : 0;
+          atomic_fetch_add_explicit(&(tenant_ctx.pace.dummy_wrs), can_post_num, memory_order_relaxed);
           manage_stop = false;
         }
 
         if(poll_break)
           break;
         
-        //qp_ctx[q_idx].chunk_sent_bytes -= (DUMMY_FACTOR * (uint32_t)(CHUNK_SIZE / DUMMY_FACTOR)) ;
+        //qp_ctx[q_idx].chunk_sent_bytes -= (dummy_bytes * dummy_num) ;
         //LOG_ERROR("after dummy send: %d %ld %d\n", dummy_num, qp_ctx[q_idx].chunk_sent_bytes, mlx5_get_sq_num(qp_ctx[q_idx].qp));
         //LOG_ERROR("dummy send comp\n");
       }
@@ -1882,6 +2408,12 @@ bool perf_large_process(uint32_t q_idx, struct ibv_send_wr *wr, uint64_t size)
     if(poll_break)
       break;
 
+    if(size >= PERF_LARGE_FLOW && !perf_pace_chunk_due())
+    {
+      poll_break = true;
+      break;
+    }
+
     if(chunk_num > 1)
     { 
       wr->wr_id = -1;
@@ -1910,13 +2442,18 @@ bool perf_large_process(uint32_t q_idx, struct ibv_send_wr *wr, uint64_t size)
       exit(1);
     }
 
-    if(origin_length >= PERF_LARGE_FLOW) // require to improve!
-      qp_ctx[q_idx].chunk_sent_bytes += wr->sg_list[0].length;
+    if(size >= PERF_LARGE_FLOW) // require to improve!
+    {
+      uint64_t sent = chunk_num > 1 ? wr->sg_list[0].length : size;
+      qp_ctx[q_idx].chunk_sent_bytes += sent;
+      atomic_fetch_add_explicit(&(tenant_ctx.pace.window_bytes), sent, memory_order_relaxed);
+      atomic_fetch_add_explicit(&(tenant_ctx.pace.data_wrs), 1, memory_order_relaxed);
+    }
 
     manage_stop = false;
   }
   
-  if(global_qnum > 1 && mqp_ctx && (global_qnum == mqp_ctx[0].manage_qnum || global_qnum == global_mqnum))
+  if(perf_mqp_ready())
     perf_mqp_process();
 
   perf_update_active_state(q_idx);
@@ -1942,67 +2479,76 @@ bool perf_large_process(uint32_t q_idx, struct ibv_send_wr *wr, uint64_t size)
 }
 
 
-bool perf_large_recv_process(uint32_t q_idx, struct ibv_recv_wr *wr, uint64_t size)
+//Posts up to budget (at most RECV_PIPELINE_DEPTH) chunks of the queued receive WRs
+//as one chained list, i.e. one doorbell. A WR may span several calls; it is dequeued
+//once its last chunk, the one carrying the original wr_id, is posted.
+uint32_t perf_large_recv_process(uint32_t q_idx, uint32_t budget)
 {
-  //LOG_ERROR("perf_large_recv_process start: %d %ld\n", q_idx, size);
-  uint64_t chunk_num = ceil(size / (double)CHUNK_SIZE);
+  struct ibv_recv_wr batch[RECV_PIPELINE_MAX];
+  struct ibv_sge sge[RECV_PIPELINE_MAX];
   struct ibv_recv_wr* bad_wr;
 
-  //perf_preemption_process(qp_ctx[q_idx].qp, 0);
-  uint64_t origin_length = wr->sg_list[0].length;
-  uint64_t origin_addr = wr->sg_list[0].addr;
-  uint64_t origin_wrid = wr->wr_id;
+  uint32_t n = 0;
+  uint32_t done = 0;
+  uint32_t chunk_idx = qp_ctx[q_idx].recv_chunk_idx;
 
-  uint32_t i;
+  if(budget > RECV_PIPELINE_DEPTH)
+    budget = RECV_PIPELINE_DEPTH;
 
-  for(i=0; i<chunk_num; i++)
+  while(n < budget && done < qp_ctx[q_idx].recv_wr_queue_len)
   {
-    /*
-    while(qp_ctx[q_idx].max_recv_wr - mlx5_get_rq_num(qp_ctx[q_idx].qp) == 0)
-    {
-      perf_early_poll_cq();
-    }
-    */
-    if(qp_ctx[q_idx].max_recv_wr - mlx5_get_rq_num(qp_ctx[q_idx].qp) == 0)
-    {
-      perf_early_poll_cq();
-      if(qp_ctx[q_idx].max_recv_wr - mlx5_get_rq_num(qp_ctx[q_idx].qp) == 0)
-        break;
-    }
- 
-    if(i < chunk_num - 1)
-    {
-      wr->sg_list[0].length = CHUNK_SIZE;
-      wr->wr_id = -1;
-    }
-    else
+    struct ibv_recv_wr* wr = get_queued_recv_wr(q_idx, done);
+    //only single-SGE WRs are split, as perf_large_process does on the sender
+    bool whole = wr->num_sge != 1;
+    uint64_t size = whole ? 0 : wr->sg_list[0].length;
+    uint32_t chunk_num = size ? (size + CHUNK_SIZE - 1) / CHUNK_SIZE : 1;
+
+    for(; chunk_idx < chunk_num && n < budget; chunk_idx++, n++)
     {
-      wr->sg_list[0].length = origin_length - (i * CHUNK_SIZE);
-    }
+      if(whole)
+      {
+        batch[n].wr_id = wr->wr_id;
+        batch[n].sg_list = wr->sg_list;
+        batch[n].num_sge = wr->num_sge;
+        batch[n].next = &batch[n + 1];
+        continue;
+      }
 
-    wr->sg_list[0].addr = origin_addr + (i * CHUNK_SIZE);
+      uint64_t offset = (uint64_t)chunk_idx * CHUNK_SIZE;
+      bool last = chunk_idx == chunk_num - 1;
 
-    //LOG_ERROR("perf_large_recv_process start 1: %d %ld %d %ld %ld\n", q_idx, size, i, (uint64_t)(wr->sg_list[0].length), chunk_num);
+      sge[n] = wr->sg_list[0];
+      sge[n].addr += offset;
+      sge[n].length = last ? size - offset : CHUNK_SIZE;
 
-    if(mlx5_post_recv2(qp_ctx[q_idx].qp, wr, &bad_wr, 1))
-    {
-      LOG_ERROR("Bacground posting error in large process < MTU\n");
-      exit(1);
+      batch[n].wr_id = last ? wr->wr_id : (uint64_t)-1;
+      batch[n].sg_list = &sge[n];
+      batch[n].num_sge = 1;
+      batch[n].next = &batch[n + 1];
     }
 
-    wr->wr_id = origin_wrid;
-  }
+    if(chunk_idx < chunk_num)
+      break;
 
-  if(i == chunk_num)
-  {
-    return true;
+    chunk_idx = 0;
+    done++;
   }
-  else
+
+  if(!n)
+    return 0;
+
+  batch[n - 1].next = NULL;
+
+  if(mlx5_post_recv2(qp_ctx[q_idx].qp, batch, &bad_wr, 1))
   {
-    wr->sg_list[0].length = origin_length - i * CHUNK_SIZE;
-    wr->sg_list[0].addr = origin_addr + i * CHUNK_SIZE;
-    return false;
+    LOG_ERROR("Bacground posting error in large recv process\n");
+    exit(1);
   }
+
+  dequeue_recv_wr(q_idx, done);
+  qp_ctx[q_idx].recv_chunk_idx = chunk_idx;
+
+  return n;
 }
 
 void perf_update_active_state(uint32_t q_idx)
@@ -2036,29 +2582,26 @@ void perf_preemption_process(struct ibv_qp  *qp, uint32_t nreq, bool is_read)
     return;
 
   //if(!tenant_ctx.delay_sensitive && shm_ctx->active_tenant_num > 1 && (shm_ctx->active_qps_num > shm_ctx->max_qps_limit || shm_ctx->active_tenant_num != shm_ctx->active_stenant_num))
-  if(!tenant_ctx.delay_sensitive && shm_ctx->active_tenant_num > 1 && shm_ctx->active_qps_num > shm_ctx->max_qps_limit)
+  if(!tenant_ctx.delay_sensitive && perf_shm_over_limit())
   {
     if(qp_ctx[q_idx].is_first_wait)
     {
       //LOG_ERROR("perf_preemption_process: %d\n", q_idx);
-      pthread_mutex_lock(&(tenant_ctx.wait_lock));
-      if(!perf_check_paused(q_idx))
+      bool first = true;
+      if(!perf_check_paused(q_idx) && atomic_exchange(&(qp_ctx[q_idx].is_first_wait), false))
       {
-        if(tenant_ctx.is_first_wait && qp_ctx[q_idx].is_first_wait)
+        if(atomic_compare_exchange_strong(&(tenant_ctx.is_first_wait), &first, false))
         {
           //LOG_ERROR("Wait initialization: %d\n", q_idx);
-          tenant_ctx.is_first_wait = false;
-          qp_ctx[q_idx].is_first_wait = false;
           qp_ctx[q_idx].post_num = 0;
 
-          gettimeofday(&(tenant_ctx.enabled_time[tenant_ctx.enabled_tail]), NULL);
-          tenant_ctx.enabled_qps[tenant_ctx.enabled_tail] = q_idx;
-          tenant_ctx.enabled_tail = (tenant_ctx.enabled_tail + 1) % global_qnum;
+          gettimeofday(&(qp_ctx[q_idx].enabled_time), NULL);
+          perf_qring_push(&(tenant_ctx.enabled_qps), q_idx);
         }
-        else if(!tenant_ctx.is_first_wait && qp_ctx[q_idx].is_first_wait)
+        else
         {
           //LOG_ERROR("Wait initialization 2: %d\n", q_idx);
-          uint32_t mqp_idx = USE_MULTI_MQP ? q_idx : 0; 
+          uint32_t mqp_idx = perf_mqp_of(q_idx); 
           struct ibv_exp_send_wr *exp_bad_wr;
 
           if(mlx5_exp_post_send2(qp_ctx[q_idx].qp, &(mqp_ctx[mqp_idx].wait_cqe_wr), &exp_bad_wr, 1) != 0)
@@ -2067,15 +2610,13 @@ void perf_preemption_process(struct ibv_qp  *qp, uint32_t nreq, bool is_read)
             exit(1);
           }
 
-          tenant_ctx.wait_num++;
-          qp_ctx[q_idx].is_first_wait = false;
           qp_ctx[q_idx].post_num = 0;
 
-          tenant_ctx.waiting_qps[tenant_ctx.waiting_tail] = q_idx;
-          tenant_ctx.waiting_tail = (tenant_ctx.waiting_tail + 1) % global_qnum;
+          //queue before counting so perf_thread never sees wait_num ahead of the ring
+          perf_qring_push(&(tenant_ctx.waiting_qps), q_idx);
+          tenant_ctx.wait_num++;
         }
       }
-      pthread_mutex_unlock(&(tenant_ctx.wait_lock));
     }
     qp_ctx[q_idx].post_num += nreq;
 
@@ -2084,61 +2625,105 @@ void perf_preemption_process(struct ibv_qp  *qp, uint32_t nreq, bool is_read)
     qp_ctx[q_idx].post_num = 0;
 }
 
-int perf_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc, int cqe_ver)
+int32_t perf_poll_prepare(struct ibv_cq *cq)
 {
-  if(!use_perf)
-    return mlx5_poll_cq2(cq, ne, wc, cqe_ver, 1);
- 
   while(rc_used && !read_qp_connected)
     sleep(1);
 
-  if(!shm_ctx->btenant_can_post[tenant_id]) 
+  if(!shm_ctx->tenant[tenant_id].btenant_can_post) 
   {
     pthread_mutex_lock(&(tenant_ctx.poll_lock));
-    while(!shm_ctx->btenant_can_post[tenant_id])
+    while(!shm_ctx->tenant[tenant_id].btenant_can_post)
       pthread_cond_wait(&(tenant_ctx.poll_cond), &(tenant_ctx.poll_lock));
     pthread_mutex_unlock(&(tenant_ctx.poll_lock));
   } 
 
-  uint32_t cq_idx = kh_value(cq_hash, kh_get(cqh, cq_hash, cq->handle));
+  int k = kh_get(cqh, cq_hash, cq->handle);
+  if(k == kh_end(cq_hash))
+    return -1;
 
-  //pthread_mutex_lock(&(cq_ctx[cq_idx].lock));
-  if(cq_ctx[cq_idx].early_poll_num)
-  {
-    int ret = cq_ctx[cq_idx].early_poll_num < ne ? cq_ctx[cq_idx].early_poll_num : ne;
-    
-    for(uint32_t i=0; i<ret; i++)
-    {
-      memcpy(wc + i, ((struct ibv_exp_wc*)cq_ctx[cq_idx].wc_list) + cq_ctx[cq_idx].wc_head, sizeof(struct ibv_wc));
-      LOG_DEBUG("before real poll: %lu %d\n", (((struct ibv_exp_wc*)cq_ctx[cq_idx].wc_list) + cq_ctx[cq_idx].wc_head)->wr_id, (((struct ibv_exp_wc*)cq_ctx[cq_idx].wc_list) + cq_ctx[cq_idx].wc_head)->exp_opcode);
-      cq_ctx[cq_idx].wc_head = (cq_ctx[cq_idx].wc_head + 1) % cq_ctx[cq_idx].max_cqe;
+  return kh_value(cq_hash, k);
+}
 
-      //LOG_ERROR("real poll: %lu %d\n", wc[i].wr_id, wc[i].opcode);
-    }
+static void perf_early_wc_to_wc(struct perf_early_wc* ewc, struct ibv_wc* wc, uint32_t num)
+{
+  for(uint32_t i=0; i<num; i++)
+  {
+    memset(&wc[i], 0, sizeof(struct ibv_wc));
+    wc[i].wr_id = ewc[i].wr_id;
+    wc[i].status = ewc[i].status;
+    wc[i].opcode = ewc[i].opcode;
+    wc[i].byte_len = ewc[i].byte_len;
+    wc[i].imm_data = ewc[i].imm_data;
+    wc[i].qp_num = ewc[i].qp_num;
+    wc[i].wc_flags = ewc[i].wc_flags;
+  }
+}
 
-    cq_ctx[cq_idx].early_poll_num -= ret;
-    //LOG_ERROR("Copy early polled: %d, wc_head: %d, %d %d\n", ret, cq_ctx[cq_idx].wc_head, cq_idx, cq_ctx[cq_idx].early_poll_num);
-    //pthread_mutex_unlock(&(cq_ctx[cq_idx].lock));
-    return ret;
+static void perf_early_wc_to_exp_wc(struct perf_early_wc* ewc, void* wc, uint32_t wc_size, uint32_t num)
+{
+  for(uint32_t i=0; i<num; i++)
+  {
+    struct ibv_exp_wc* w = (struct ibv_exp_wc*)(wc + i * wc_size);
+
+    //callers may pass a wc_size shorter than the full ibv_exp_wc
+    memset(w, 0, wc_size < sizeof(struct ibv_exp_wc) ? wc_size : sizeof(struct ibv_exp_wc));
+    w->wr_id = ewc[i].wr_id;
+    w->status = ewc[i].status;
+    w->exp_opcode = ewc[i].opcode;
+    w->byte_len = ewc[i].byte_len;
+    w->imm_data = ewc[i].imm_data;
+    w->qp_num = ewc[i].qp_num;
+    if(wc_size >= offsetof(struct ibv_exp_wc, exp_wc_flags) + sizeof(w->exp_wc_flags))
+      w->exp_wc_flags = ewc[i].wc_flags;
   }
-  //pthread_mutex_unlock(&(cq_ctx[cq_idx].lock));
+}
 
-  return mlx5_poll_cq2(cq, ne, wc, cqe_ver, 1);
- 
-  /* 
-  int ret =   mlx5_poll_cq2(cq, ne, wc, cqe_ver, 1);
-  
-  if(ret > 0)
+int perf_copy_early_wc(uint32_t cq_idx, uint32_t ne, void *wc, uint32_t wc_size, bool exp)
+{
+  //pthread_mutex_lock(&(cq_ctx[cq_idx].lock));
+  int avail = atomic_load_explicit(&(cq_ctx[cq_idx].early_poll_num), memory_order_acquire);
+  int ret = avail < ne ? avail : ne;
+  uint32_t done = 0;
+
+  //at most two contiguous runs of the ring
+  while(done < ret)
   {
-    LOG_ERROR("Polled: %d\n", ret);
-    for(uint32_t i=0; i<ret; i++)
-    {
-      LOG_ERROR("WC ID: %ld, Status: %d\n", wc[i].wr_id, wc[i].status);
-    }
+    uint32_t run = cq_ctx[cq_idx].max_cqe - cq_ctx[cq_idx].wc_head;
+    if(run > ret - done)
+      run = ret - done;
+
+    struct perf_early_wc* ewc = &(cq_ctx[cq_idx].wc_list[cq_ctx[cq_idx].wc_head]);
+    LOG_DEBUG("before real poll: %lu %d\n", ewc->wr_id, ewc->opcode);
+    if(exp)
+      perf_early_wc_to_exp_wc(ewc, wc + done * wc_size, wc_size, run);
+    else
+      perf_early_wc_to_wc(ewc, (struct ibv_wc*)wc + done, run);
+
+    cq_ctx[cq_idx].wc_head = (cq_ctx[cq_idx].wc_head + run) & (cq_ctx[cq_idx].max_cqe - 1);
+    done += run;
   }
-  return  ret;
-  */
-  
+
+  atomic_fetch_sub_explicit(&(cq_ctx[cq_idx].early_poll_num), ret, memory_order_release);
+  //LOG_ERROR("Copy early polled: %d, wc_head: %d, %d %d\n", ret, cq_ctx[cq_idx].wc_head, cq_idx, cq_ctx[cq_idx].early_poll_num);
+  //pthread_mutex_unlock(&(cq_ctx[cq_idx].lock));
+  return ret;
+}
+
+int perf_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc, int cqe_ver)
+{
+  int ret;
+  int32_t cq_idx = use_perf ? perf_poll_prepare(cq) : -1;
+
+  if(cq_idx != -1 && cq_ctx[cq_idx].early_poll_num)
+    ret = perf_copy_early_wc(cq_idx, ne, wc, sizeof(struct ibv_wc), false);
+  else
+    ret = mlx5_poll_cq2(cq, ne, wc, cqe_ver, 1);
+
+  if(perf_trace)
+    perf_trace_comp(perf_trace, wc, ret, sizeof(struct ibv_wc), false);
+
+  return ret;
 }
 
 void perf_create_read_qp()
@@ -2160,6 +2745,27 @@ void perf_create_read_qp()
   env = getenv("PERF_MAX_READ_BATCH_NUM");
   if(env)
     MAX_READ_BATCH_NUM = atoi(env);
+
+  env = getenv("PERF_GIDX");
+  if(env)
+    read_qp_ctx.sgid_idx = atoi(env);
+  else
+    read_qp_ctx.sgid_idx = 5;
+
+  env = getenv("PERF_MAX_READ_PEER_NUM");
+  if(env)
+    read_qp_ctx.max_peer_num = atoi(env);
+  else
+    read_qp_ctx.max_peer_num = MAX_READ_PEER_NUM;
+
+  env = getenv("PERF_READ_AH_CACHE_SIZE");
+  if(env)
+    read_qp_ctx.max_ah_num = atoi(env);
+  else
+    read_qp_ctx.max_ah_num = READ_AH_CACHE_SIZE;
+
+  if(read_qp_ctx.max_ah_num == 0)
+    read_qp_ctx.max_ah_num = 1;
  
   dev_list = ibv_get_device_list(NULL);
 	if (!dev_list) {
@@ -2197,6 +2803,29 @@ void perf_create_read_qp()
     exit(1);
   }
 
+  uint64_t peer_queue_bytes = sizeof(union perf_read_request) * (MAX_READ_BATCH_NUM + 1) * READ_PEER_QUEUE_DEPTH;
+  read_qp_ctx.peer_queue = (void*)malloc(peer_queue_bytes * read_qp_ctx.max_peer_num);
+  read_qp_ctx.peer_mr = ibv_reg_mr(read_qp_ctx.pd, read_qp_ctx.peer_queue, peer_queue_bytes * read_qp_ctx.max_peer_num, IBV_ACCESS_LOCAL_WRITE);
+  if(!read_qp_ctx.peer_mr)
+  {
+    LOG_ERROR("No peer MR for read qp\n");
+    exit(1);
+  }
+
+  read_qp_ctx.peers = (struct perf_read_peer*)calloc(read_qp_ctx.max_peer_num, sizeof(struct perf_read_peer));
+  for(uint32_t i=0; i<read_qp_ctx.max_peer_num; i++)
+  {
+    atomic_init(&(read_qp_ctx.peers[i].remote_qpn), -1);
+    read_qp_ctx.peers[i].read_queue = read_qp_ctx.peer_queue + peer_queue_bytes * i;
+    read_qp_ctx.peers[i].read_queue_size = (MAX_READ_BATCH_NUM + 1) * READ_PEER_QUEUE_DEPTH;
+    pthread_mutex_init(&(read_qp_ctx.peers[i].lock), NULL);
+  }
+  read_qp_ctx.peer_num = 0;
+  read_qp_ctx.def_peer = -1;
+  read_qp_ctx.ah_num = 0;
+  read_qp_ctx.ah_clock = 0;
+  read_qp_ctx.listen_sock = -1;
+
   read_qp_ctx.cq = ibv_create_cq(read_qp_ctx.context, read_qp_ctx.read_queue_size, NULL, NULL, 0);
 
   if(!read_qp_ctx.cq)
@@ -2265,12 +2894,10 @@ void perf_create_read_qp()
   read_qp_ctx.read_queue_tail = 0;
   read_qp_ctx.read_queue_head = 0;
 
-  read_qp_ctx.remote_qpn = -1;
-  pthread_mutex_init(&(read_qp_ctx.read_queue_lock), NULL);
+  pthread_mutex_init(&(read_qp_ctx.peer_lock), NULL);
   pthread_mutex_init(&(read_qp_ctx.read_qp_con_lock), NULL);
  
-  read_qp_ctx.cmd_wr.sg_list = (struct ibv_sge*)malloc(sizeof(struct ibv_sge));
-  read_qp_ctx.cmd_wr.sg_list[0].lkey = read_qp_ctx.mr->lkey;
+  read_qp_ctx.cmd_wr.sg_list = NULL;
 
   read_qp_ctx.cmd_wr.wr_id = -1;
   read_qp_ctx.cmd_wr.num_sge = 1;
@@ -2306,13 +2933,133 @@ void perf_create_read_qp()
 }
 
 
-void perf_set_dest_info(struct ibv_qp *qp, union ibv_gid dgid, int sgid_idx)
+//peer_lock orders the writers; the resolver, route and post paths read without it
+static inline uint32_t perf_read_peer_qpn(uint32_t p_idx)
 {
-  if(!use_perf)
+  return atomic_load_explicit(&(read_qp_ctx.peers[p_idx].remote_qpn), memory_order_relaxed);
+}
+
+void perf_set_dest_info(struct ibv_qp *qp, union ibv_gid dgid, int sgid_idx, uint32_t dest_qpn)
+{
+  if(!use_perf || !read_qp_ctx.peers)
+    return;
+
+  int k = kh_get(qph, qp_hash, qp->qp_num);
+  if(k == kh_end(qp_hash))
+    return;
+
+  uint32_t q_idx = kh_value(qp_hash, k);
+  int32_t p_idx = perf_get_read_peer(dgid, sgid_idx);
+
+  qp_ctx[q_idx].dest_qpn = dest_qpn;
+  qp_ctx[q_idx].read_peer = p_idx;
+
+  if(p_idx == -1)
+  {
+    LOG_ERROR("Read peer table is full (%d), large READs of QP %d are not isolated\n", read_qp_ctx.max_peer_num, qp->qp_num);
     return;
+  }
+
+  pthread_mutex_lock(&read_qp_ctx.peer_lock);
+  bool resolve = perf_read_peer_qpn(p_idx) == (uint32_t)-1 && !read_qp_ctx.peers[p_idx].resolving;
+  if(resolve)
+    read_qp_ctx.peers[p_idx].resolving = true;
+  pthread_mutex_unlock(&read_qp_ctx.peer_lock);
+
+  if(resolve)
+  {
+    pthread_t resolve_thread;
+    pthread_create(&resolve_thread, NULL, perf_resolve_read_peer, (void*)(uint64_t)p_idx);
+    pthread_detach(resolve_thread);
+  }
+}
+
+int32_t perf_get_read_peer(union ibv_gid dgid, int sgid_idx)
+{
+  int32_t p_idx = -1;
+
+  pthread_mutex_lock(&read_qp_ctx.peer_lock);
+  for(uint32_t i=0; i<read_qp_ctx.peer_num; i++)
+  {
+    if(!memcmp(read_qp_ctx.peers[i].dgid.raw, dgid.raw, sizeof(dgid.raw)))
+    {
+      p_idx = i;
+      break;
+    }
+  }
+
+  if(p_idx == -1 && read_qp_ctx.peer_num < read_qp_ctx.max_peer_num)
+  {
+    p_idx = read_qp_ctx.peer_num;
+    read_qp_ctx.peers[p_idx].dgid = dgid;
+    read_qp_ctx.peers[p_idx].sgid_idx = sgid_idx;
+    atomic_store_explicit(&(read_qp_ctx.peers[p_idx].remote_qpn), -1, memory_order_relaxed);
+    read_qp_ctx.peers[p_idx].ah = NULL;
+    read_qp_ctx.peers[p_idx].read_queue_tail = 0;
+    read_qp_ctx.peer_num++;
+  }
+  pthread_mutex_unlock(&read_qp_ctx.peer_lock);
+
+  return p_idx;
+}
 
-  if(qp_ctx[0].qp->qp_num == qp->qp_num && read_qp_ctx.ah == NULL)
+int32_t perf_set_read_peer_qpn(union ibv_gid dgid, int sgid_idx, uint32_t remote_qpn)
+{
+  int32_t p_idx = perf_get_read_peer(dgid, sgid_idx);
+  if(p_idx == -1)
+  {
+    LOG_ERROR("Read peer table is full (%d), cannot add read peer\n", read_qp_ctx.max_peer_num);
+    return -1;
+  }
+
+  pthread_mutex_lock(&read_qp_ctx.peer_lock);
+  atomic_store_explicit(&(read_qp_ctx.peers[p_idx].remote_qpn), remote_qpn, memory_order_relaxed);
+  read_qp_ctx.peers[p_idx].resolving = false;
+  pthread_mutex_unlock(&read_qp_ctx.peer_lock);
+
+  LOG_DEBUG("Read peer %d: REMOTE_QPN: %d\n", p_idx, remote_qpn);
+  return p_idx;
+}
+
+//must be called with peers[p_idx].lock held
+struct ibv_ah* perf_get_read_peer_ah(uint32_t p_idx)
+{
+  struct perf_read_peer* peer = &(read_qp_ctx.peers[p_idx]);
+
+  pthread_mutex_lock(&read_qp_ctx.peer_lock);
+  peer->ah_last_used = ++read_qp_ctx.ah_clock;
+
+  if(peer->ah == NULL)
   {
+    //evict the least recently used AH, mlx5 copies the AV into the WQE so in-flight sends are not affected.
+    //A peer whose lock is taken may be posting with its AH right now, so only idle peers are evicted;
+    //trylock since we already hold our own peer lock.
+    while(read_qp_ctx.ah_num >= read_qp_ctx.max_ah_num)
+    {
+      int32_t lru_idx = -1;
+      for(uint32_t i=0; i<read_qp_ctx.peer_num; i++)
+      {
+        if(!read_qp_ctx.peers[i].ah || (lru_idx != -1 && read_qp_ctx.peers[i].ah_last_used >= read_qp_ctx.peers[lru_idx].ah_last_used))
+          continue;
+
+        if(pthread_mutex_trylock(&(read_qp_ctx.peers[i].lock)))
+          continue;
+
+        if(lru_idx != -1)
+          pthread_mutex_unlock(&(read_qp_ctx.peers[lru_idx].lock));
+        lru_idx = i;
+      }
+
+      //every cached AH is in use, go over the limit for now
+      if(lru_idx == -1)
+        break;
+
+      ibv_destroy_ah(read_qp_ctx.peers[lru_idx].ah);
+      read_qp_ctx.peers[lru_idx].ah = NULL;
+      read_qp_ctx.ah_num--;
+      pthread_mutex_unlock(&(read_qp_ctx.peers[lru_idx].lock));
+    }
+
     struct ibv_ah_attr ah_attr = {
       .is_global = 1,
       .dlid = 0,
@@ -2320,26 +3067,149 @@ void perf_set_dest_info(struct ibv_qp *qp, union ibv_gid dgid, int sgid_idx)
       .src_path_bits = 0,
       .port_num = read_qp_ctx.port_num,
       .grh.hop_limit = 10,
-      .grh.dgid = dgid,
-      .grh.sgid_index = sgid_idx,
+      .grh.dgid = peer->dgid,
+      .grh.sgid_index = peer->sgid_idx,
       .grh.traffic_class = 106
     };
-    read_qp_ctx.dgid = dgid;
-    read_qp_ctx.ah = ibv_create_ah(read_qp_ctx.pd, &ah_attr);
 
+    peer->ah = ibv_create_ah(read_qp_ctx.pd, &ah_attr);
+    if(!peer->ah)
+    {
+      LOG_ERROR("Failed to create AH for read peer %d\n", p_idx);
+      exit(1);
+    }
+    read_qp_ctx.ah_num++;
   }
+  struct ibv_ah* ah = peer->ah;
+  pthread_mutex_unlock(&read_qp_ctx.peer_lock);
 
-  /*
-  char wgid[33];
-	uint32_t *raw = (uint32_t *)dgid.raw;
-	int i;
-	
-	for (i = 0; i < 4; ++i)
-		sprintf(&wgid[i * 8], "%08x",
-			htonl(raw[i]));
-
-  printf("Set Dest Info for UD QP: %u %s %lu %lu %d\n", qp->qp_num, wgid, dgid.global.subnet_prefix, dgid.global.interface_id, sgid_idx);
-  */
+  //stays valid while the caller holds peer->lock
+  return ah;
+}
+
+int32_t perf_route_read_peer(uint32_t q_idx)
+{
+  int32_t p_idx = qp_ctx[q_idx].read_peer;
+
+  if(p_idx == -1 || perf_read_peer_qpn(p_idx) == (uint32_t)-1)
+    p_idx = read_qp_ctx.def_peer;
+
+  if(p_idx == -1 || perf_read_peer_qpn(p_idx) == (uint32_t)-1)
+    return -1;
+
+  return p_idx;
+}
+
+uint32_t perf_route_read_qp(void* req_ptr)
+{
+  struct perf_read_header* header = &(((union perf_read_request*)req_ptr)->header);
+
+  if(header->dest_qpn)
+  {
+    int k = kh_get(qph, qp_hash, header->dest_qpn);
+    if(k != kh_end(qp_hash))
+      return kh_value(qp_hash, k);
+  }
+
+  return header->q_idx;
+}
+
+static void perf_read_peer_resolve_end(uint32_t p_idx)
+{
+  pthread_mutex_lock(&read_qp_ctx.peer_lock);
+  read_qp_ctx.peers[p_idx].resolving = false;
+  pthread_mutex_unlock(&read_qp_ctx.peer_lock);
+}
+
+void* perf_resolve_read_peer(void* para)
+{
+  uint32_t p_idx = (uint64_t)para;
+  struct perf_read_peer* peer = &(read_qp_ctx.peers[p_idx]);
+  uint32_t local_qpn = read_qp_ctx.qp->qp_num;
+  union ibv_gid local_gid;
+  uint32_t remote_qpn = 0;
+  union ibv_gid remote_gid;
+  struct sockaddr_in address;
+
+  //only IPv4-mapped (RoCE) GIDs carry an address we can reach
+  for(uint32_t i=0; i<10; i++)
+  {
+    if(peer->dgid.raw[i])
+    {
+      perf_read_peer_resolve_end(p_idx);
+      return NULL;
+    }
+  }
+  if(peer->dgid.raw[10] != 0xff || peer->dgid.raw[11] != 0xff)
+  {
+    perf_read_peer_resolve_end(p_idx);
+    return NULL;
+  }
+
+  ibv_query_gid(read_qp_ctx.context, read_qp_ctx.port_num, read_qp_ctx.sgid_idx, &local_gid);
+
+  address.sin_family = AF_INET;
+  memcpy(&(address.sin_addr.s_addr), &(peer->dgid.raw[12]), 4);
+
+  for(uint32_t cnt=0; cnt<READ_PEER_RESOLVE_RETRY && perf_read_peer_qpn(p_idx) == (uint32_t)-1; cnt++)
+  {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0)
+      break;
+
+    address.sin_port = READ_PORT + cnt % 10;
+    if(connect(sock, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        send(sock, &local_qpn, sizeof(local_qpn), 0) < 0 ||
+        recv(sock, &remote_qpn, sizeof(remote_qpn), MSG_WAITALL) != sizeof(remote_qpn) ||
+        send(sock, &local_gid, sizeof(local_gid), 0) < 0 ||
+        recv(sock, &remote_gid, sizeof(remote_gid), MSG_WAITALL) != sizeof(remote_gid))
+    {
+      close(sock);
+      sleep(1);
+      continue;
+    }
+
+    close(sock);
+    perf_set_read_peer_qpn(peer->dgid, peer->sgid_idx, remote_qpn);
+  }
+
+  if(perf_read_peer_qpn(p_idx) == (uint32_t)-1)
+    LOG_ERROR("Cannot resolve read peer %d, large READs to it are not isolated\n", p_idx);
+
+  perf_read_peer_resolve_end(p_idx);
+  return NULL;
+}
+
+void* perf_read_listener(void* para)
+{
+  uint32_t local_qpn = read_qp_ctx.qp->qp_num;
+  union ibv_gid local_gid;
+  union ibv_gid remote_gid;
+  uint32_t remote_qpn = 0;
+  struct sockaddr_in remote_address;
+  socklen_t namelen;
+
+  ibv_query_gid(read_qp_ctx.context, read_qp_ctx.port_num, read_qp_ctx.sgid_idx, &local_gid);
+
+  while(use_perf)
+  {
+    namelen = sizeof(remote_address);
+    int conn = accept(read_qp_ctx.listen_sock, (struct sockaddr*)&remote_address, &namelen);
+    if(conn == -1)
+      break;
+
+    if(recv(conn, &remote_qpn, sizeof(remote_qpn), MSG_WAITALL) == sizeof(remote_qpn) &&
+        send(conn, &local_qpn, sizeof(local_qpn), 0) >= 0 &&
+        recv(conn, &remote_gid, sizeof(remote_gid), MSG_WAITALL) == sizeof(remote_gid) &&
+        send(conn, &local_gid, sizeof(local_gid), 0) >= 0)
+      perf_set_read_peer_qpn(remote_gid, read_qp_ctx.sgid_idx, remote_qpn);
+
+    close(conn);
+  }
+
+  close(read_qp_ctx.listen_sock);
+  read_qp_ctx.listen_sock = -1;
+  return NULL;
 }
 
 void* perf_exchange_read_qpn()
@@ -2429,7 +3299,7 @@ void* perf_exchange_read_qpn()
       cnt++;
     }
 
-    if(listen(sock, 1) != 0)
+    if(listen(sock, read_qp_ctx.max_peer_num) != 0)
     {
       LOG_ERROR("Read_qp exchange Listen() error\n");
       exit(1);
@@ -2481,7 +3351,12 @@ void* perf_exchange_read_qpn()
     LOG_ERROR("Remote GID for read_qp: %s\n", wgid);
 
     close(conn);
-    close(sock);
+
+    //keep answering the other clients that read from this node
+    pthread_t listen_thread;
+    read_qp_ctx.listen_sock = sock;
+    pthread_create(&listen_thread, NULL, perf_read_listener, NULL);
+    pthread_detach(listen_thread);
   }
   else
   {
@@ -2550,16 +3425,9 @@ void* perf_exchange_read_qpn()
     sleep(1);
   }
 
-  read_qp_ctx.dgid = remote_gid;
-  ah_attr.grh.dgid = remote_gid;
-  read_qp_ctx.ah = ibv_create_ah(read_qp_ctx.pd, &ah_attr);
-  read_qp_ctx.remote_qpn = remote_qpn;
-
-  //for crail
-  read_qp_ctx.ah_list[0] = read_qp_ctx.ah;
-  read_qp_ctx.rqpn_list[0] = read_qp_ctx.remote_qpn;
+  read_qp_ctx.def_peer = perf_set_read_peer_qpn(remote_gid, ah_attr.grh.sgid_index, remote_qpn);
 
-  LOG_ERROR("LOCAL_QPN: %d, REMOTE_QPN: %d\n", read_qp_ctx.qp->qp_num, read_qp_ctx.remote_qpn);
+  LOG_ERROR("LOCAL_QPN: %d, REMOTE_QPN: %d\n", read_qp_ctx.qp->qp_num, remote_qpn);
   
   read_qp_connected = 1;
   pthread_mutex_unlock(&read_qp_ctx.read_qp_con_lock);
@@ -2765,16 +3633,10 @@ void* perf_exchange_read_qpn2()
     sleep(1);
   }
 
-  read_qp_ctx.dgid = remote_gid;
-  ah_attr.grh.dgid = remote_gid;
-  read_qp_ctx.ah = ibv_create_ah(read_qp_ctx.pd, &ah_attr);
-  read_qp_ctx.remote_qpn = remote_qpn;
-
   //for crail
-  read_qp_ctx.ah_list[1] = read_qp_ctx.ah;
-  read_qp_ctx.rqpn_list[1] = read_qp_ctx.remote_qpn;
+  perf_set_read_peer_qpn(remote_gid, ah_attr.grh.sgid_index, remote_qpn);
   
-  LOG_ERROR("LOCAL_QPN: %d, REMOTE_QPN: %d\n", read_qp_ctx.qp->qp_num, read_qp_ctx.remote_qpn);
+  LOG_ERROR("LOCAL_QPN: %d, REMOTE_QPN: %d\n", read_qp_ctx.qp->qp_num, remote_qpn);
   
   read_qp_connected = 1;
   pthread_mutex_unlock(&read_qp_ctx.read_qp_con_lock);
@@ -2784,16 +3646,32 @@ void* perf_exchange_read_qpn2()
 
 void send_read_request(uint32_t q_idx, struct ibv_send_wr *wr)
 {
-  pthread_mutex_lock(&read_qp_ctx.read_queue_lock);
+  int32_t p_idx = perf_route_read_peer(q_idx);
+  if(p_idx == -1)
+  {
+    LOG_ERROR("Error, no read peer for QP %d\n", q_idx);
+    exit(1);
+  }
 
-  union perf_read_request* req_ptr = &(((union perf_read_request*)read_qp_ctx.read_queue)[read_qp_ctx.read_queue_tail]);
-  struct perf_read_header* header_ptr = (struct perf_read_header*)(&(((union perf_read_request*)read_qp_ctx.read_queue)[read_qp_ctx.read_queue_tail]));
-  struct perf_read_payload* payload_ptr = (struct perf_read_payload*)(&(((union perf_read_request*)read_qp_ctx.read_queue)[read_qp_ctx.read_queue_tail + 1]));
+  struct perf_read_peer* peer = &(read_qp_ctx.peers[p_idx]);
+  pthread_mutex_lock(&(peer->lock));
+
+  union perf_read_request* req_ptr = &(((union perf_read_request*)peer->read_queue)[peer->read_queue_tail]);
+  struct perf_read_header* header_ptr = (struct perf_read_header*)(&(((union perf_read_request*)peer->read_queue)[peer->read_queue_tail]));
+  struct perf_read_payload* payload_ptr = (struct perf_read_payload*)(&(((union perf_read_request*)peer->read_queue)[peer->read_queue_tail + 1]));
   
   uint32_t batch_num = 0;
   
   struct ibv_send_wr *bad_wr;
   struct ibv_recv_wr *bad_recv_wr;
+  struct ibv_recv_wr recv_wr;
+  struct ibv_sge recv_sge;
+  struct ibv_send_wr cmd_wr = read_qp_ctx.cmd_wr;
+  struct ibv_sge cmd_sge;
+
+  recv_wr.sg_list = &recv_sge;
+  cmd_wr.sg_list = &cmd_sge;
+  cmd_sge.lkey = read_qp_ctx.peer_mr->lkey;
 
 //  while (wr != NULL) # read large batch not supported yet
 //  {
@@ -2813,27 +3691,27 @@ void send_read_request(uint32_t q_idx, struct ibv_send_wr *wr)
     uint64_t last_chunk_offset = (chunk_num - 1) * CHUNK_SIZE;
 
     if((wr->send_flags & IBV_SEND_SIGNALED) != IBV_SEND_SIGNALED)
-      read_qp_ctx.recv_wr.wr_id = -1;
+      recv_wr.wr_id = -1;
     else
-      read_qp_ctx.recv_wr.wr_id = wr->wr_id;
+      recv_wr.wr_id = wr->wr_id;
 
-    read_qp_ctx.recv_wr.num_sge = 1;
+    recv_wr.num_sge = 1;
     if(last_chunk_offset != 0 /*&& (chunk_num * CHUNK_SIZE) != wr[batch_num - 1].sg_list[0].length*/)
     {
-      read_qp_ctx.recv_wr.sg_list[0].addr = payload_ptr[batch_num-1].addr + last_chunk_offset;
-      read_qp_ctx.recv_wr.sg_list[0].length = payload_ptr[batch_num-1].len - last_chunk_offset;
+      recv_wr.sg_list[0].addr = payload_ptr[batch_num-1].addr + last_chunk_offset;
+      recv_wr.sg_list[0].length = payload_ptr[batch_num-1].len - last_chunk_offset;
     }
     else
     {
-      read_qp_ctx.recv_wr.sg_list[0].addr = payload_ptr[batch_num-1].addr;
-      read_qp_ctx.recv_wr.sg_list[0].length = payload_ptr[batch_num-1].len;
+      recv_wr.sg_list[0].addr = payload_ptr[batch_num-1].addr;
+      recv_wr.sg_list[0].length = payload_ptr[batch_num-1].len;
     }
 
-    read_qp_ctx.recv_wr.sg_list[0].lkey = payload_ptr[batch_num-1].lkey;
-    read_qp_ctx.recv_wr.next = NULL;
+    recv_wr.sg_list[0].lkey = payload_ptr[batch_num-1].lkey;
+    recv_wr.next = NULL;
 
-    //LOG_ERROR("Comp WR: %lu %lu %u\n", wr->wr_id, read_qp_ctx.recv_wr.sg_list[0].addr, read_qp_ctx.recv_wr.sg_list[0].length);
-    if(mlx5_post_recv(qp_ctx[q_idx].qp, &(read_qp_ctx.recv_wr), &bad_recv_wr))
+    //LOG_ERROR("Comp WR: %lu %lu %u\n", wr->wr_id, recv_wr.sg_list[0].addr, recv_wr.sg_list[0].length);
+    if(mlx5_post_recv(qp_ctx[q_idx].qp, &recv_wr, &bad_recv_wr))
     {
       LOG_ERROR("Error, post recv error for PERF_READ: %d %d\n", read_qp_ctx.max_wr, mlx5_get_rq_num(read_qp_ctx.qp)); 
       exit(1);
@@ -2844,20 +3722,21 @@ void send_read_request(uint32_t q_idx, struct ibv_send_wr *wr)
 
   header_ptr->q_idx = q_idx;
   header_ptr->batch_num = batch_num;
+  header_ptr->dest_qpn = qp_ctx[q_idx].dest_qpn;
 
-  if(read_qp_ctx.read_queue_tail + MAX_READ_BATCH_NUM + 1 > read_qp_ctx.read_queue_size)
+  if(peer->read_queue_tail + 2 * (MAX_READ_BATCH_NUM + 1) > peer->read_queue_size)
   {
-    read_qp_ctx.read_queue_tail = 0;
+    peer->read_queue_tail = 0;
     header_ptr->next_offset = 0;
   }
   else
   {
-    read_qp_ctx.read_queue_tail += MAX_READ_BATCH_NUM + 1;
-    header_ptr->next_offset = read_qp_ctx.read_queue_tail;
+    peer->read_queue_tail += MAX_READ_BATCH_NUM + 1;
+    header_ptr->next_offset = peer->read_queue_tail;
   }
 
-  read_qp_ctx.cmd_wr.sg_list[0].addr   = (uint64_t)req_ptr;
-  read_qp_ctx.cmd_wr.sg_list[0].length = sizeof(union perf_read_request) * (MAX_READ_BATCH_NUM + 1);
+  cmd_sge.addr   = (uint64_t)req_ptr;
+  cmd_sge.length = sizeof(union perf_read_request) * (MAX_READ_BATCH_NUM + 1);
   
   //for crail
   if(crail)
@@ -2866,22 +3745,19 @@ void send_read_request(uint32_t q_idx, struct ibv_send_wr *wr)
       header_ptr->q_idx = 1;
     else if(crail_type == CRAIL_NAMENODE)
       header_ptr->q_idx = 0;
-    
-    read_qp_ctx.ah = read_qp_ctx.ah_list[q_idx];
-    read_qp_ctx.remote_qpn = read_qp_ctx.rqpn_list[q_idx];
   }
 
-  read_qp_ctx.cmd_wr.wr.ud.ah          = read_qp_ctx.ah;
-  read_qp_ctx.cmd_wr.wr.ud.remote_qpn  = read_qp_ctx.remote_qpn;
-  read_qp_ctx.cmd_wr.wr.ud.remote_qkey = 0x1234;
+  cmd_wr.wr.ud.ah          = perf_get_read_peer_ah(p_idx);
+  cmd_wr.wr.ud.remote_qpn  = perf_read_peer_qpn(p_idx);
+  cmd_wr.wr.ud.remote_qkey = 0x1234;
  
-  if(mlx5_post_send2(read_qp_ctx.qp, &(read_qp_ctx.cmd_wr), &bad_wr, 1))
+  if(mlx5_post_send2(read_qp_ctx.qp, &cmd_wr, &bad_wr, 1))
   {
     LOG_ERROR("Error, send read_request for PERF_READ: %d %d\n",mlx5_get_sq_num(read_qp_ctx.qp), read_qp_ctx.max_wr);
     exit(1);
   }
 
-  pthread_mutex_unlock(&read_qp_ctx.read_queue_lock);
+  pthread_mutex_unlock(&(peer->lock));
 
   perf_preemption_process(qp_ctx[q_idx].qp, batch_num, 0);
 
@@ -3029,7 +3905,7 @@ void perf_resp_read_cmd()
   while(polled - post_num)
   {
     void* req_ptr = get_next_read_header();
-    uint32_t q_idx = ((union perf_read_request*)req_ptr)->header.q_idx;
+    uint32_t q_idx = perf_route_read_qp(req_ptr);
 
     if(qp_ctx[q_idx].qp->state != IBV_QPS_RTS)
     {
@@ -3066,7 +3942,7 @@ void perf_resp_read_cmd()
     union perf_read_request* req = (union perf_read_request*)req_ptr;
     if(req[0].header.batch_num == 0)
     {
-      qp_ctx[req[0].header.q_idx].is_active = true;
+      qp_ctx[q_idx].is_active = true;
       tenant_ctx.passive_reading = true;
       tenant_ctx.passive_delay_sensitive = req[0].header.read_delay_sensitive ? true : false;
       tenant_ctx.passive_msg_sensitive = req[0].header.read_msg_sensitive ? true : false;
@@ -3101,31 +3977,42 @@ void perf_resp_read_cmd()
 
 void perf_send_read_report(uint32_t q_idx)
 {
-  pthread_mutex_lock(&read_qp_ctx.read_queue_lock);
-  union perf_read_request* req_ptr = &(((union perf_read_request*)read_qp_ctx.read_queue)[read_qp_ctx.read_queue_tail]);
-  struct perf_read_header* header_ptr = (struct perf_read_header*)(&(((union perf_read_request*)read_qp_ctx.read_queue)[read_qp_ctx.read_queue_tail]));
+  int32_t p_idx = perf_route_read_peer(q_idx);
+  if(p_idx == -1)
+    return;
+
+  struct perf_read_peer* peer = &(read_qp_ctx.peers[p_idx]);
+  pthread_mutex_lock(&(peer->lock));
+  union perf_read_request* req_ptr = &(((union perf_read_request*)peer->read_queue)[peer->read_queue_tail]);
+  struct perf_read_header* header_ptr = (struct perf_read_header*)(&(((union perf_read_request*)peer->read_queue)[peer->read_queue_tail]));
   
   struct ibv_send_wr *bad_wr;
+  struct ibv_send_wr cmd_wr = read_qp_ctx.cmd_wr;
+  struct ibv_sge cmd_sge;
+
+  cmd_wr.sg_list = &cmd_sge;
+  cmd_sge.lkey = read_qp_ctx.peer_mr->lkey;
 
   header_ptr->q_idx = q_idx;
   header_ptr->batch_num = 0;
   header_ptr->read_report = 1;
-  header_ptr->read_delay_sensitive = (shm_ctx->delay_sensitive[tenant_id] && !tenant_ctx.is_bw_read) ? 1 : 0;
-  header_ptr->read_msg_sensitive = (shm_ctx->msg_sensitive[tenant_id] && !tenant_ctx.is_bw_read) ? 1 : 0;
+  header_ptr->read_delay_sensitive = (shm_ctx->tenant[tenant_id].delay_sensitive && !tenant_ctx.is_bw_read) ? 1 : 0;
+  header_ptr->read_msg_sensitive = (shm_ctx->tenant[tenant_id].msg_sensitive && !tenant_ctx.is_bw_read) ? 1 : 0;
+  header_ptr->dest_qpn = qp_ctx[q_idx].dest_qpn;
 
-  if(read_qp_ctx.read_queue_tail + MAX_READ_BATCH_NUM + 1 > read_qp_ctx.read_queue_size)
+  if(peer->read_queue_tail + 2 * (MAX_READ_BATCH_NUM + 1) > peer->read_queue_size)
   {
-    read_qp_ctx.read_queue_tail = 0;
+    peer->read_queue_tail = 0;
     header_ptr->next_offset = 0;
   }
   else
   {
-    read_qp_ctx.read_queue_tail += MAX_READ_BATCH_NUM + 1;
-    header_ptr->next_offset = read_qp_ctx.read_queue_tail;
+    peer->read_queue_tail += MAX_READ_BATCH_NUM + 1;
+    header_ptr->next_offset = peer->read_queue_tail;
   }
 
-  read_qp_ctx.cmd_wr.sg_list[0].addr   = (uint64_t)req_ptr;
-  read_qp_ctx.cmd_wr.sg_list[0].length = sizeof(union perf_read_request) * (MAX_READ_BATCH_NUM + 1);
+  cmd_sge.addr   = (uint64_t)req_ptr;
+  cmd_sge.length = sizeof(union perf_read_request) * (MAX_READ_BATCH_NUM + 1);
   
   //for crail 
   if(crail)
@@ -3134,22 +4021,19 @@ void perf_send_read_report(uint32_t q_idx)
       header_ptr->q_idx = 1;
     else if(crail_type == CRAIL_NAMENODE)
       header_ptr->q_idx = 0;
-    
-    read_qp_ctx.ah = read_qp_ctx.ah_list[q_idx];
-    read_qp_ctx.remote_qpn = read_qp_ctx.rqpn_list[q_idx];
   }
 
-  read_qp_ctx.cmd_wr.wr.ud.ah          = read_qp_ctx.ah;
-  read_qp_ctx.cmd_wr.wr.ud.remote_qpn  = read_qp_ctx.remote_qpn;
-  read_qp_ctx.cmd_wr.wr.ud.remote_qkey = 0x1234;
+  cmd_wr.wr.ud.ah          = perf_get_read_peer_ah(p_idx);
+  cmd_wr.wr.ud.remote_qpn  = perf_read_peer_qpn(p_idx);
+  cmd_wr.wr.ud.remote_qkey = 0x1234;
 
-  if(mlx5_post_send2(read_qp_ctx.qp, &(read_qp_ctx.cmd_wr), &bad_wr, 1))
+  if(mlx5_post_send2(read_qp_ctx.qp, &cmd_wr, &bad_wr, 1))
   {
     LOG_ERROR("Error, send read_request for PERF_READ: %d %d\n",mlx5_get_sq_num(read_qp_ctx.qp), read_qp_ctx.max_wr);
     exit(1);
   }
 
-  pthread_mutex_unlock(&read_qp_ctx.read_queue_lock);
+  pthread_mutex_unlock(&(peer->lock));
 
   struct ibv_wc wc[32];
   if(mlx5_poll_cq2(read_qp_ctx.cq, 32, wc, 1, 1))
@@ -3159,29 +4043,117 @@ void perf_send_read_report(uint32_t q_idx)
   }
 }
 
-//EXP is not supported yet.
+static __thread struct ibv_send_wr* exp_conv_wrs = NULL;
+static __thread uint32_t exp_conv_size = 0;
+
+struct ibv_send_wr* perf_exp_convert_wr(struct ibv_exp_send_wr *wr)
+{
+  uint32_t nreq = 0;
+  struct ibv_exp_send_wr *tmp;
+
+  for(tmp = wr; tmp != NULL; tmp = tmp->next)
+  {
+    //cross-channel, UMR, atomic and other exp-only WRs are not scheduled
+    switch(tmp->exp_opcode)
+    {
+      case IBV_EXP_WR_RDMA_WRITE:
+      case IBV_EXP_WR_RDMA_WRITE_WITH_IMM:
+      case IBV_EXP_WR_SEND:
+      case IBV_EXP_WR_SEND_WITH_IMM:
+      case IBV_EXP_WR_RDMA_READ:
+        break;
+      default:
+        return NULL;
+    }
+
+    if(tmp->exp_send_flags & ~(uint64_t)(IBV_EXP_SEND_FENCE | IBV_EXP_SEND_SIGNALED | IBV_EXP_SEND_SOLICITED | IBV_EXP_SEND_INLINE))
+      return NULL;
+
+    nreq++;
+  }
+
+  if(nreq > exp_conv_size)
+  {
+    struct ibv_send_wr* wrs = (struct ibv_send_wr*)realloc(exp_conv_wrs, sizeof(struct ibv_send_wr) * nreq);
+    if(wrs == NULL)
+      return NULL;
+
+    exp_conv_wrs = wrs;
+    exp_conv_size = nreq;
+  }
+
+  uint32_t i = 0;
+  for(tmp = wr; tmp != NULL; tmp = tmp->next, i++)
+  {
+    struct ibv_send_wr* conv = &(exp_conv_wrs[i]);
+
+    memset(conv, 0, sizeof(struct ibv_send_wr));
+    conv->wr_id = tmp->wr_id;
+    conv->sg_list = tmp->sg_list;
+    conv->num_sge = tmp->num_sge;
+    conv->opcode = (enum ibv_wr_opcode)tmp->exp_opcode;
+    conv->send_flags = (int)tmp->exp_send_flags;
+    conv->imm_data = tmp->ex.imm_data;
+    conv->wr.rdma.remote_addr = tmp->wr.rdma.remote_addr;
+    conv->wr.rdma.rkey = tmp->wr.rdma.rkey;
+    conv->next = tmp->next ? &(exp_conv_wrs[i + 1]) : NULL;
+  }
+
+  return exp_conv_wrs;
+}
+
 int perf_exp_process(struct ibv_qp *qp, struct ibv_exp_send_wr *wr)
 {
-  return PERF_BYPASS;
+  struct ibv_send_wr* conv = perf_exp_convert_wr(wr);
+  if(conv == NULL)
+    return PERF_BYPASS;
+
+  return perf_process(qp, conv);
 }
-void perf_exp_small_process(uint32_t q_idx, struct ibv_exp_send_wr *wr, uint32_t nreq) {}
-void perf_exp_large_process(uint32_t q_idx, struct ibv_exp_send_wr *wr, uint64_t size) {}
-void perf_exp_bg_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr) {}
-void perf_exp_poll_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr, uint32_t size) {}
-int perf_exp_recv_process(struct ibv_qp *qp, struct ibv_recv_wr *wr)
+
+//false when the WRs cannot be converted, the caller posts them itself
+bool perf_exp_bg_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr)
 {
-  return PERF_BYPASS;
+  struct ibv_send_wr* conv = perf_exp_convert_wr(wr);
+  if(conv == NULL)
+    return false;
+
+  perf_bg_post(qp, conv);
+  return true;
 }
-void perf_exp_bg_recv_post(struct ibv_qp *qp, struct ibv_recv_wr *wr) {}
-int perf_exp_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_exp_wc *wc, uint32_t wc_size, int cqe_ver)
+
+bool perf_exp_poll_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr, uint32_t size)
 {
-  if(!use_perf)
-    return mlx5_poll_cq_ex2(cq, ne, wc, wc_size, cqe_ver, 1);
-  
-	return mlx5_poll_cq_ex2(cq, ne, wc, wc_size, cqe_ver, 1);
+  struct ibv_send_wr* conv = perf_exp_convert_wr(wr);
+  if(conv == NULL)
+    return false;
+
+  perf_poll_post(qp, conv, size);
+  return true;
 }
 
+int perf_exp_recv_process(struct ibv_qp *qp, struct ibv_recv_wr *wr)
+{
+  return perf_recv_process(qp, wr);
+}
 
+void perf_exp_bg_recv_post(struct ibv_qp *qp, struct ibv_recv_wr *wr)
+{
+  perf_bg_recv_post(qp, wr);
+}
 
+int perf_exp_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_exp_wc *wc, uint32_t wc_size, int cqe_ver)
+{
+  int ret;
+  int32_t cq_idx = use_perf ? perf_poll_prepare(cq) : -1;
 
+  if(cq_idx != -1 && cq_ctx[cq_idx].early_poll_num)
+    ret = perf_copy_early_wc(cq_idx, ne, wc, wc_size, true);
+  else
+    ret = mlx5_poll_cq_ex2(cq, ne, wc, wc_size, cqe_ver, 1);
 
+  if(perf_trace)
+    perf_trace_comp(perf_trace, wc, ret, wc_size, true);
+
+  return ret;
+}
@@ -20,12 +20,17 @@
 
 #if ((LOG_LEVEL) > 0)
   #define LOG_DEBUG(s, a...)  printf((s), ##a)
+  #define LOG_INFO(s, a...)   printf((s), ##a)
 #else
   #define LOG_DEBUG(s, a...)
+  #define LOG_INFO(s, a...)
 #endif
 #define LOG_ERROR(s, a...)  printf((s), ##a)
 
 #define MAX_TENANT_NUM 3000 //same as in perf_main.c
+#define PERF_CACHE_LINE_SIZE 64
+#define PERF_SHM_MAGIC 0x46524550 //"PERF"
+#define PERF_SHM_VERSION 3
 #define MAX_SGE_LEN 16
 
 #define PERF_LARGE_FLOW 1024
@@ -39,16 +44,23 @@
 #define DELAY_SEN_NUM_TH         5 
 #define DELAY_SEN_BYTES_TH    1024 //byte
 #define TENANT_ACTIVE_CHECK_INTERVAL 10000 //us     
+#define CLS_BUCKET_NUM 32 //log2 buckets of the classifier histograms
+#define EARLY_POLL_BATCH 16 //completions pulled from the CQ per early poll call
+#define RECV_PIPELINE_MAX 64 //upper bound of PERF_RECV_PIPELINE_DEPTH
 #define TENANT_INACTIVE_CHECK_INTERVAL 1000000 //us     
 
-#define USE_MULTI_MQP 0
 
 #define ALLOWED_QP_TIME_TH 10000 //us, 10ms
 #define MAX_ALLOWED_QP_NUM 2 
 
+#define MAX_READ_PEER_NUM 64 //default, PERF_MAX_READ_PEER_NUM
+#define READ_AH_CACHE_SIZE 16 //default, PERF_READ_AH_CACHE_SIZE
+#define READ_PEER_QUEUE_DEPTH 256
+#define READ_PEER_RESOLVE_RETRY 30
+
 //GLOBAL FUNC
 void update_perf_state(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr, uint32_t origin_max_send_wr, uint32_t origin_max_recv_wr, int sig_all);
-void perf_set_dest_info(struct ibv_qp *qp, union ibv_gid dgid, int sgid_idx); 
+void perf_set_dest_info(struct ibv_qp *qp, union ibv_gid dgid, int sgid_idx, uint32_t dest_qpn);
 int perf_process(struct ibv_qp *qp, struct ibv_send_wr *wr);
 int perf_recv_process(struct ibv_qp *qp, struct ibv_recv_wr *wr);
 
@@ -63,14 +75,22 @@ void perf_destroy_qp();
 //LOCAL FUNC
 
 void perf_update_active_state(uint32_t q_idx);
+struct perf_qring;
+void perf_qring_init(struct perf_qring* ring, uint32_t size);
+bool perf_qring_push(struct perf_qring* ring, uint32_t val);
+bool perf_qring_pop(struct perf_qring* ring, uint32_t* val);
+uint32_t perf_qring_peek(struct perf_qring* ring);
+uint32_t perf_qring_len(struct perf_qring* ring);
+bool perf_qp_paused(uint32_t q_idx);
 void perf_init_pause_state();
 bool perf_check_paused(uint32_t q_idx);
+bool perf_pause_qp(uint32_t q_idx);
 void perf_allowed_release(uint32_t q_idx);
 void perf_wr_queue_manage();
 void perf_recv_wr_queue_manage();
 bool perf_large_process(uint32_t q_idx, struct ibv_send_wr *wr, uint64_t size);
 bool perf_small_process(uint32_t q_idx, struct ibv_send_wr *wr, uint32_t nreq);
-bool perf_large_recv_process(uint32_t q_idx, struct ibv_recv_wr *wr, uint64_t size);
+uint32_t perf_large_recv_process(uint32_t q_idx, uint32_t budget);
 
 void load_perf_config();
 void update_qp_ctx(struct ibv_qp *qp, uint32_t max_send_wr, uint32_t max_recv_wr, uint32_t origin_max_send_wr, uint32_t origin_max_recv_wr, int sig_all);
@@ -79,9 +99,30 @@ void update_mqp_ctx();
 void update_tenant_ctx();
 void perf_create_read_qp();
 void perf_early_poll_cq();
+int32_t perf_poll_prepare(struct ibv_cq *cq);
+int perf_copy_early_wc(uint32_t cq_idx, uint32_t ne, void *wc, uint32_t wc_size, bool exp);
 void perf_create_master_qp();
+bool perf_mqp_ready();
+uint32_t perf_mqp_of(uint32_t q_idx);
 void perf_mqp_process();
 void perf_update_tenant_state();
+uint64_t perf_now_ns();
+void perf_pace_update();
+bool perf_pace_chunk_due();
+void perf_pace_report();
+struct perf_shm_context;
+void perf_shm_init(struct perf_shm_context* ctx);
+int perf_shm_lock(struct perf_shm_context* ctx);
+int perf_shm_thread_lock(struct perf_shm_context* ctx, uint32_t id);
+int perf_shm_thread_wait(struct perf_shm_context* ctx, uint32_t id);
+int32_t perf_shm_alloc_tenant(struct perf_shm_context* ctx, pid_t pid);
+void perf_shm_release_tenant(struct perf_shm_context* ctx, uint32_t id);
+bool perf_shm_reap_tenant(struct perf_shm_context* ctx, uint32_t id);
+struct perf_shm_context* perf_shm_attach();
+bool perf_shm_over_limit();
+uint32_t perf_cls_bucket(uint64_t v);
+void perf_cls_decay();
+void perf_classify();
 
 void enqueue_wr(uint32_t q_idx, struct ibv_send_wr *wr);
 struct ibv_send_wr* get_queued_wr(uint32_t q_idx, uint32_t pwr_idx);
@@ -105,13 +146,20 @@ void* perf_thread(void *para);
 void* perf_exchange_read_qpn();
 void* perf_exchange_read_qpn2();
 
+int32_t perf_get_read_peer(union ibv_gid dgid, int sgid_idx);
+int32_t perf_set_read_peer_qpn(union ibv_gid dgid, int sgid_idx, uint32_t remote_qpn);
+struct ibv_ah* perf_get_read_peer_ah(uint32_t p_idx);
+int32_t perf_route_read_peer(uint32_t q_idx);
+uint32_t perf_route_read_qp(void* req_ptr);
+void* perf_resolve_read_peer(void* para);
+void* perf_read_listener(void* para);
+
 
-//EXP is not supported yet.
+//EXP WRs with a plain verbs equivalent share the verbs path
+struct ibv_send_wr* perf_exp_convert_wr(struct ibv_exp_send_wr *wr);
 int perf_exp_process(struct ibv_qp *qp, struct ibv_exp_send_wr *wr);
-void perf_exp_small_process(uint32_t q_idx, struct ibv_exp_send_wr *wr, uint32_t nreq);
-void perf_exp_large_process(uint32_t q_idx, struct ibv_exp_send_wr *wr, uint64_t size);
-void perf_exp_bg_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr);
-void perf_exp_poll_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr, uint32_t size);
+bool perf_exp_bg_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr);
+bool perf_exp_poll_post(struct ibv_qp *qp, struct ibv_exp_send_wr *wr, uint32_t size);
 int perf_exp_recv_process(struct ibv_qp *qp, struct ibv_recv_wr *wr);
 void perf_exp_bg_recv_post(struct ibv_qp *qp, struct ibv_recv_wr *wr);
 int perf_exp_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_exp_wc *wc, uint32_t wc_size, int cqe_ver);
@@ -124,6 +172,53 @@ void perf_comp(uint32_t wr_id);
 
 //Structures 
 
+//Bounded lock-free MPMC ring of QP indexes (Vyukov), capacity is a power of 2
+struct perf_qring_cell {
+  atomic_uint seq;
+  uint32_t val;
+};
+
+struct perf_qring {
+  struct perf_qring_cell* cells;
+  uint32_t mask;
+  atomic_uint head;
+  atomic_uint tail;
+};
+
+#define PERF_QP_ALLOWED 0x1 //holds one of the tenant's allowed slots
+#define PERF_QP_QUEUED  0x2 //has an entry in tenant_ctx.paused_qps
+
+enum perf_tenant_class {
+  PERF_CLASS_IDLE = 0,
+  PERF_CLASS_DELAY,
+  PERF_CLASS_MSG,
+  PERF_CLASS_BW,
+};
+
+struct perf_pace {
+  atomic_ulong window_bytes; //large-flow bytes posted since window_start
+  atomic_ulong data_wrs;
+  atomic_ulong dummy_wrs;
+  uint64_t window_start;     //ns
+
+  uint64_t target_rate;      //B/s, 0: not shaping
+  uint64_t achieved_rate;    //B/s over the last window
+  uint32_t dummy_num;        //dummy WRs per CHUNK_SIZE
+  bool     time_pacing;
+  uint64_t next_chunk_ns;
+};
+
+struct perf_classifier {
+  atomic_uint msg_hist[CLS_BUCKET_NUM];  //message sizes, updated by the posting threads
+  uint32_t depth_hist[CLS_BUCKET_NUM];   //outstanding WRs, sampled by perf_thread
+  struct timeval last_decay_time;
+
+  uint32_t cls;
+  uint32_t confidence; //%
+  uint32_t candidate;
+  uint32_t candidate_num;
+};
+
 struct perf_tenant_context {
   uint32_t sq_history_len;
   uint32_t* sq_history;
@@ -132,10 +227,13 @@ struct perf_tenant_context {
   
   struct timeval last_sq_check_time;
 
+  struct perf_classifier cls;
+  struct perf_pace pace;
+
   bool delay_sensitive;
   bool small_msg_sending;
   double avg_msg_size;
-  uint64_t max_msg_size;
+  uint64_t max_msg_size; //decays with the classifier histograms
   uint64_t max_recv_msg_size;
 
   struct timeval last_active_check_time;
@@ -143,30 +241,22 @@ struct perf_tenant_context {
   uint32_t active_qps_num;
   pthread_mutex_t active_lock;
 
-  bool is_first_wait;
-  uint32_t *waiting_qps;
-  uint32_t waiting_head;
-  uint32_t waiting_tail;
-
-  struct timeval* enabled_time;
-  uint32_t* enabled_qps;
-  uint32_t enabled_head;
-  uint32_t enabled_tail;
+  //pushed by application threads, popped only in perf_mqp_process under mqp_lock
+  atomic_bool is_first_wait;
+  struct perf_qring waiting_qps;
+  struct perf_qring enabled_qps;
+  pthread_mutex_t mqp_lock;
 
   uint32_t additional_enable_num;
 
-  uint32_t wait_num;
-  uint32_t enable_num;
+  atomic_uint wait_num;
+  atomic_uint enable_num;
 
-  uint32_t* paused_qps;
-  uint32_t  paused_qps_head;
-  uint32_t  paused_qps_tail;
+  //QPs waiting for an allowed slot, see PERF_QP_ALLOWED/PERF_QP_QUEUED
+  struct perf_qring paused_qps;
 
   uint32_t* allowed_qp;
-  uint32_t allowed_qps_num;
-
-  pthread_mutex_t wait_lock;
-  pthread_mutex_t allow_lock;
+  atomic_uint allowed_qps_num;
 
   bool resp_read;
   bool passive_reading;
@@ -228,30 +318,64 @@ struct perf_qp_context {
   uint32_t recv_wr_queue_tail;
   atomic_int recv_wr_queue_len;
   uint32_t recv_wr_queue_size;
+  uint32_t recv_chunk_idx; //chunks of the head queued recv WR already posted
+  uint32_t recv_rq_num;    //RQ occupancy right after the last pipelined post
+  uint32_t recv_rate;      //RQ completions per manage pass, EWMA scaled by 16
 
   
-  bool is_paused;
-  bool is_allowed;
+  atomic_uint sched_state; //PERF_QP_ALLOWED | PERF_QP_QUEUED
   struct timeval last_allowed_time;
-  uint32_t paused_idx;
+  struct timeval enabled_time;
   
   uint32_t post_num;
 
   uint64_t chunk_sent_bytes;
   
-  bool is_first_wait;
+  atomic_bool is_first_wait;
 
   bool is_reading;
+
+  uint32_t mqp_idx; //master QP enabling this QP, -1 until assigned
+
+  int32_t read_peer; //index in read_qp_ctx.peers, -1 if unknown
+  uint32_t dest_qpn;
+};
+
+//What is needed to rebuild an ibv_wc or ibv_exp_wc of an early-polled completion
+struct perf_early_wc {
+  uint64_t wr_id;
+  uint32_t byte_len;
+  uint32_t qp_num;
+  uint32_t imm_data;
+  uint16_t opcode;   //enum ibv_exp_wc_opcode
+  uint8_t  status;   //enum ibv_wc_status
+  uint8_t  wc_flags; //IBV_WC_GRH/WITH_IMM/WITH_INV
 };
 
 struct perf_cq_context {
   struct ibv_cq* cq;
-  uint32_t max_cqe;
+  uint32_t max_cqe; //power of 2 >= cq->cqe
   atomic_int early_poll_num;
   
-  void* wc_list;
-  uint32_t wc_head;
-  uint32_t wc_tail;
+  struct perf_early_wc* wc_list;
+  uint32_t wc_head; //consumed by the application
+  uint32_t wc_tail; //produced by perf_thread
+
+  pthread_mutex_t lock;
+};
+
+struct perf_read_peer {
+  union ibv_gid dgid;
+  int sgid_idx;
+  _Atomic uint32_t remote_qpn; //read QPN of the peer, -1 until exchanged; stored under peer_lock, loaded relaxed without it
+  bool resolving;
+
+  struct ibv_ah *ah; //NULL when evicted from the AH cache
+  uint64_t ah_last_used;
+
+  void* read_queue; //Q_idx + Batch_num + read_request, per peer
+  uint32_t read_queue_tail;
+  uint32_t read_queue_size;
 
   pthread_mutex_t lock;
 };
@@ -262,19 +386,25 @@ struct perf_read_qp_context {
   struct ibv_mr *mr;
   struct ibv_qp *qp;
   struct ibv_cq *cq;
-  struct ibv_ah *ah;
-  union ibv_gid dgid;
  
   uint32_t max_wr; 
 
-  uint32_t remote_qpn;
   uint32_t port_num;
-
-  //for crail
-  struct ibv_ah *ah_list[2];
-  uint32_t rqpn_list[2];
-
-  void* read_queue; //Q_idx + Batch_num + read_request
+  int sgid_idx;
+
+  struct perf_read_peer* peers;
+  uint32_t peer_num;
+  uint32_t max_peer_num;
+  int32_t def_peer; //peer given by PERF_REMOTE_IP
+  uint32_t ah_num;
+  uint32_t max_ah_num;
+  uint64_t ah_clock;
+  void* peer_queue;
+  struct ibv_mr *peer_mr;
+  pthread_mutex_t peer_lock;
+  int listen_sock;
+
+  void* read_queue; //receive ring of read_requests
   uint32_t read_queue_head;
   uint32_t read_queue_tail;
   uint32_t read_queue_len;
@@ -304,6 +434,7 @@ struct perf_read_header {
     uint8_t read_report;
     uint8_t read_delay_sensitive;
     uint8_t read_msg_sensitive;
+    uint32_t dest_qpn; //responder's QPN, 0 if unknown
 };
 
 struct perf_read_payload {
@@ -320,29 +451,75 @@ union perf_read_request {
   struct perf_read_payload payload;
 };
 
-struct perf_shm_context {
-  uint32_t next_tenant_id;
-  uint32_t tenant_num;
-  uint32_t active_tenant_num;
+//Everything one tenant publishes, in its own cache line
+struct perf_shm_tenant {
+  pid_t    pid;                //0: free slot
+  uint32_t active_qps;
+  uint32_t additional_qps_num; //written by the controller
+  uint64_t avg_msg_size;
+  bool     msg_sensitive;
+  bool     delay_sensitive;
+  bool     resp_read;
+  bool     btenant_can_post;   //written by the controller
+  uint8_t  tenant_class;       //enum perf_tenant_class
+  uint8_t  class_confidence;   //%
+} __attribute__((aligned(PERF_CACHE_LINE_SIZE)));
+
+//Written by the controller only, read under shm_ctx->agg_seq
+struct perf_shm_agg {
   uint64_t active_qps_num;
+  uint32_t active_tenant_num;
   uint32_t active_stenant_num;
   uint32_t active_dtenant_num;
   uint32_t active_mtenant_num;
   uint32_t active_rrtenant_num;
   uint32_t max_qps_limit;
+};
+
+struct perf_shm_context {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint32_t next_tenant_id;     //highest slot ever used + 1
+  uint32_t tenant_num;
+  pthread_mutex_t lock;        //robust, tenants may die holding it
+  pthread_mutex_t ctl_lock;    //robust, held by the running controller
 
-  uint32_t active_qps_per_tenant[MAX_TENANT_NUM];
-  uint32_t additional_qps_num[MAX_TENANT_NUM];
-  bool     msg_sensitive[MAX_TENANT_NUM];
-  bool     delay_sensitive[MAX_TENANT_NUM];
-  bool     resp_read[MAX_TENANT_NUM];
-  uint64_t avg_msg_size[MAX_TENANT_NUM];
-  bool     btenant_can_post[MAX_TENANT_NUM];
+  atomic_uint agg_seq __attribute__((aligned(PERF_CACHE_LINE_SIZE))); //odd while the controller writes agg
+  struct perf_shm_agg agg;
 
+  struct perf_shm_tenant tenant[MAX_TENANT_NUM];
 
   pthread_mutex_t perf_thread_lock[MAX_TENANT_NUM];
   pthread_cond_t perf_thread_cond[MAX_TENANT_NUM];
-  pthread_mutex_t lock;
+  pthread_mutex_t tenant_alive[MAX_TENANT_NUM]; //robust, held by the tenant while its slot is taken
+};
+
+//Unversioned layout used before PERF_SHM_VERSION 2, kept to migrate idle segments
+struct perf_shm_context_v1 {
+  uint32_t next_tenant_id;
+  uint32_t tenant_num;
 };
 
+static inline void perf_shm_agg_write_begin(struct perf_shm_context* ctx)
+{
+  atomic_fetch_add_explicit(&ctx->agg_seq, 1, memory_order_acq_rel);
+}
+
+static inline void perf_shm_agg_write_end(struct perf_shm_context* ctx)
+{
+  atomic_fetch_add_explicit(&ctx->agg_seq, 1, memory_order_release);
+}
+
+static inline void perf_shm_agg_read(struct perf_shm_context* ctx, struct perf_shm_agg* agg)
+{
+  uint32_t seq;
+  do {
+    while((seq = atomic_load_explicit(&ctx->agg_seq, memory_order_acquire)) & 1)
+      ;
+    *agg = ctx->agg;
+    atomic_thread_fence(memory_order_acquire);
+  } while(seq != atomic_load_explicit(&ctx->agg_seq, memory_order_relaxed));
+}
+
 #endif
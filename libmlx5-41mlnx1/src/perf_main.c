@@ -0,0 +1,345 @@
+#include "perf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+//PeRF controller: owns /perf-shm, aggregates the tenants' published state
+//and decides max_qps_limit, additional_qps_num and btenant_can_post.
+
+uint32_t CTL_TICK_US = 100;          //us between two policy decisions
+uint32_t CTL_REAP_INTERVAL = 1000;   //ticks between two dead-tenant scans
+uint32_t CTL_MAX_QPS_LIMIT = 8;      //active QPs allowed before bandwidth tenants are throttled
+uint32_t CTL_GATE_PERIOD = 100;      //ticks
+uint32_t CTL_GATE_DUTY = 50;         //% of CTL_GATE_PERIOD bandwidth tenants may post while delay-sensitive ones are active
+int32_t  CTL_CPU = -1;
+
+struct perf_ctl_policy {
+  const char* name;
+  //fills agg->max_qps_limit and every active tenant's additional_qps_num / btenant_can_post
+  void (*tick)(struct perf_shm_context* ctx, struct perf_shm_agg* agg, bool* can_post, uint64_t tick);
+};
+
+static bool is_btenant(struct perf_shm_tenant* t)
+{
+  return t->pid && t->active_qps && !t->delay_sensitive && !t->msg_sensitive;
+}
+
+//Bandwidth tenants split the QPs left over by the baseline MAX_ALLOWED_QP_NUM each
+static void perf_policy_share(struct perf_shm_context* ctx, struct perf_shm_agg* agg, bool* can_post, uint64_t tick)
+{
+  uint32_t additional = 0;
+  uint32_t base = agg->active_dtenant_num * MAX_ALLOWED_QP_NUM;
+
+  agg->max_qps_limit = CTL_MAX_QPS_LIMIT;
+  if(agg->active_dtenant_num && CTL_MAX_QPS_LIMIT > base)
+    additional = (CTL_MAX_QPS_LIMIT - base) / agg->active_dtenant_num;
+
+  for(uint32_t i=0; i<ctx->next_tenant_id; i++)
+  {
+    ctx->tenant[i].additional_qps_num = is_btenant(&(ctx->tenant[i])) ? additional : 0;
+    can_post[i] = true;
+  }
+}
+
+//Same as share, and bandwidth tenants are duty-cycled while delay-sensitive tenants are active
+static void perf_policy_gate(struct perf_shm_context* ctx, struct perf_shm_agg* agg, bool* can_post, uint64_t tick)
+{
+  perf_policy_share(ctx, agg, can_post, tick);
+
+  if(!agg->active_stenant_num)
+    return;
+
+  bool open = (tick % CTL_GATE_PERIOD) * 100 < (uint64_t)CTL_GATE_PERIOD * CTL_GATE_DUTY;
+  for(uint32_t i=0; i<ctx->next_tenant_id; i++)
+  {
+    if(is_btenant(&(ctx->tenant[i])))
+      can_post[i] = open;
+  }
+}
+
+static struct perf_ctl_policy policies[] = {
+  { "share", perf_policy_share },
+  { "gate",  perf_policy_gate },
+};
+
+static struct perf_ctl_policy* perf_find_policy(const char* name)
+{
+  for(uint32_t i=0; i<sizeof(policies) / sizeof(policies[0]); i++)
+  {
+    if(!strcmp(policies[i].name, name))
+      return &policies[i];
+  }
+  return NULL;
+}
+
+static void perf_aggregate(struct perf_shm_context* ctx, struct perf_shm_agg* agg)
+{
+  memset(agg, 0, sizeof(struct perf_shm_agg));
+
+  for(uint32_t i=0; i<ctx->next_tenant_id; i++)
+  {
+    struct perf_shm_tenant* t = &(ctx->tenant[i]);
+    if(!t->pid || !t->active_qps)
+      continue;
+
+    agg->active_tenant_num++;
+    agg->active_qps_num += t->active_qps;
+    if(t->delay_sensitive)
+      agg->active_stenant_num++;
+    else if(t->msg_sensitive)
+      agg->active_mtenant_num++;
+    else
+      agg->active_dtenant_num++;
+    if(t->resp_read)
+      agg->active_rrtenant_num++;
+  }
+}
+
+static void perf_set_can_post(struct perf_shm_context* ctx, uint32_t id, bool can_post)
+{
+  if(ctx->tenant[id].btenant_can_post == can_post)
+    return;
+
+  if(!can_post)
+  {
+    ctx->tenant[id].btenant_can_post = false;
+    return;
+  }
+
+  //the tenant's perf_thread may be sleeping on its condition variable
+  if(perf_shm_thread_lock(ctx, id))
+  {
+    ctx->tenant[id].btenant_can_post = true;
+    return;
+  }
+  ctx->tenant[id].btenant_can_post = true;
+  pthread_cond_broadcast(&(ctx->perf_thread_cond[id]));
+  pthread_mutex_unlock(&(ctx->perf_thread_lock[id]));
+}
+
+//Tenants killed without running perf_thread_end would otherwise keep their slot forever
+static void perf_reap_tenants(struct perf_shm_context* ctx)
+{
+  for(uint32_t i=0; i<ctx->next_tenant_id; i++)
+  {
+    pid_t pid = ctx->tenant[i].pid;
+    if(!pid || !perf_shm_reap_tenant(ctx, i))
+      continue;
+
+    LOG_ERROR("Tenant %u (pid %d) is gone, releasing its slot\n", i, pid);
+    perf_set_can_post(ctx, i, true);
+  }
+}
+
+//Adopts /perf-shm unless another controller holds ctl_lock. The pshared objects tenants
+//block on are only initialised in a segment nobody has set up; one of another layout is
+//unlinked instead, its tenants keep their mapping
+static struct perf_shm_context* perf_ctl_open_shm()
+{
+  while(1)
+  {
+    int shm_fd = shm_open("/perf-shm", O_CREAT | O_RDWR, 0666);
+    if(shm_fd == -1)
+    {
+      LOG_ERROR("Cannot create perf_shm: %s\n", strerror(errno));
+      return NULL;
+    }
+
+    //the lock tenants take in perf_shm_attach
+    flock(shm_fd, LOCK_EX);
+
+    struct stat st;
+    if(fstat(shm_fd, &st) == -1 || ((size_t)st.st_size < sizeof(struct perf_shm_context) && ftruncate(shm_fd, sizeof(struct perf_shm_context)) == -1))
+    {
+      LOG_ERROR("Cannot size perf_shm: %s\n", strerror(errno));
+      flock(shm_fd, LOCK_UN);
+      close(shm_fd);
+      return NULL;
+    }
+
+    //replaced by another controller between our open and flock
+    if(!st.st_nlink)
+    {
+      flock(shm_fd, LOCK_UN);
+      close(shm_fd);
+      continue;
+    }
+
+    struct perf_shm_context* ctx = (struct perf_shm_context*) mmap(NULL, sizeof(struct perf_shm_context), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if(ctx == MAP_FAILED)
+    {
+      LOG_ERROR("Error mapping shared memory perf_shm\n");
+      flock(shm_fd, LOCK_UN);
+      close(shm_fd);
+      return NULL;
+    }
+
+    bool foreign = ctx->magic == PERF_SHM_MAGIC ? ctx->version != PERF_SHM_VERSION : ((struct perf_shm_context_v1*) ctx)->tenant_num != 0;
+    if(foreign)
+    {
+      LOG_ERROR("perf_shm has another layout and may be in use, replacing it\n");
+      munmap(ctx, sizeof(struct perf_shm_context));
+      shm_unlink("/perf-shm");
+      flock(shm_fd, LOCK_UN);
+      close(shm_fd);
+      continue;
+    }
+
+    if(ctx->magic != PERF_SHM_MAGIC)
+      perf_shm_init(ctx);
+
+    int ret = pthread_mutex_trylock(&ctx->ctl_lock);
+    if(ret == EOWNERDEAD)
+    {
+      LOG_ERROR("Previous PeRF controller died, taking over perf_shm\n");
+      ret = pthread_mutex_consistent(&ctx->ctl_lock);
+    }
+    flock(shm_fd, LOCK_UN);
+    close(shm_fd);
+
+    if(ret)
+    {
+      LOG_ERROR(ret == EBUSY ? "Another PeRF controller owns perf_shm\n" : "Cannot take perf_shm: %s\n", strerror(ret));
+      munmap(ctx, sizeof(struct perf_shm_context));
+      return NULL;
+    }
+    return ctx;
+  }
+}
+
+static void load_ctl_config()
+{
+  char* env;
+
+  env = getenv("PERF_CTL_TICK_US");
+  if(env)
+    CTL_TICK_US = atoi(env);
+
+  env = getenv("PERF_CTL_REAP_INTERVAL");
+  if(env)
+    CTL_REAP_INTERVAL = atoi(env);
+
+  env = getenv("PERF_MAX_QPS_LIMIT");
+  if(env)
+    CTL_MAX_QPS_LIMIT = atoi(env);
+
+  env = getenv("PERF_CTL_GATE_PERIOD");
+  if(env)
+    CTL_GATE_PERIOD = atoi(env);
+
+  env = getenv("PERF_CTL_GATE_DUTY");
+  if(env)
+    CTL_GATE_DUTY = atoi(env);
+
+  env = getenv("PERF_CTL_CPU");
+  if(env)
+    CTL_CPU = atoi(env);
+
+  if(!CTL_TICK_US)
+    CTL_TICK_US = 1;
+  if(!CTL_REAP_INTERVAL)
+    CTL_REAP_INTERVAL = 1;
+  if(!CTL_GATE_PERIOD)
+    CTL_GATE_PERIOD = 1;
+}
+
+int main(int argc, char** argv)
+{
+  const char* policy_name = getenv("PERF_CTL_POLICY");
+  struct perf_ctl_policy* policy = perf_find_policy(policy_name ? policy_name : "share");
+  if(!policy)
+  {
+    LOG_ERROR("Unknown PERF_CTL_POLICY %s\n", policy_name);
+    return 1;
+  }
+
+  load_ctl_config();
+
+  struct perf_shm_context* ctx = perf_ctl_open_shm();
+  if(!ctx)
+    return 1;
+
+  bool* can_post = calloc(MAX_TENANT_NUM, sizeof(bool));
+
+  //keep the loop off page faults and other cores' noise
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+  if(CTL_CPU >= 0)
+  {
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(CTL_CPU, &cpu);
+    sched_setaffinity(0, sizeof(cpu), &cpu);
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+  //absolute deadlines so a late tick does not shift every following one
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  struct itimerspec its;
+  clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+  its.it_interval.tv_sec = CTL_TICK_US / 1000000;
+  its.it_interval.tv_nsec = (CTL_TICK_US % 1000000) * 1000;
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+  LOG_ERROR("PeRF controller: policy %s, tick %u us, max_qps_limit %u\n", policy->name, CTL_TICK_US, CTL_MAX_QPS_LIMIT);
+
+  struct pollfd fds[2] = {{ timer_fd, POLLIN, 0 }, { sig_fd, POLLIN, 0 }};
+  uint64_t tick = 0, missed = 0;
+
+  while(1)
+  {
+    if(poll(fds, 2, -1) < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+
+    if(fds[1].revents)
+      break;
+
+    uint64_t expired;
+    if(read(timer_fd, &expired, sizeof(expired)) != sizeof(expired))
+      continue;
+
+    missed += expired - 1;
+    tick += expired;
+
+    if(tick / CTL_REAP_INTERVAL != (tick - expired) / CTL_REAP_INTERVAL)
+      perf_reap_tenants(ctx);
+
+    struct perf_shm_agg agg;
+    perf_aggregate(ctx, &agg);
+    policy->tick(ctx, &agg, can_post, tick);
+
+    perf_shm_agg_write_begin(ctx);
+    ctx->agg = agg;
+    perf_shm_agg_write_end(ctx);
+
+    for(uint32_t i=0; i<ctx->next_tenant_id; i++)
+      perf_set_can_post(ctx, i, can_post[i]);
+  }
+
+  LOG_ERROR("PeRF controller exiting after %lu ticks (%lu missed)\n", tick, missed);
+
+  //let blocked tenants go before the segment disappears
+  for(uint32_t i=0; i<ctx->next_tenant_id; i++)
+    perf_set_can_post(ctx, i, true);
+
+  free(can_post);
+  shm_unlink("/perf-shm");
+  pthread_mutex_unlock(&ctx->ctl_lock);
+  munmap(ctx, sizeof(struct perf_shm_context));
+  return 0;
+}
@@ -0,0 +1,614 @@
+#include "perf.h"
+#include "perf_trace.h"
+#include "khash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+//Offline replay of PERF_TRACE files: the posted WRs of every trace are merged
+//by timestamp and fed through a scheduler model in front of a software NIC.
+//
+//NIC model: one port of REPLAY_RATE bytes/s. QPs with posted work are served
+//round-robin, REPLAY_MTU bytes at a time, each WQE adds REPLAY_WQE_NS and its
+//completion is seen REPLAY_BASE_NS after the last byte left the port.
+//
+//Schedulers:
+//  none:   every WR goes to the NIC as soon as it is posted
+//  perf:   while a delay-sensitive tenant is active, bandwidth tenants' WRs
+//          above PERF_LARGE_FLOW are cut into REPLAY_CHUNK_SIZE chunks, one
+//          chunk in flight per QP and REPLAY_ALLOWED_QP QPs per tenant
+//  mtrdma: a WR is admitted only if its tenant has the credit for it,
+//          REPLAY_MT_CREDIT bytes are added every REPLAY_MT_CREDIT_NS
+//
+//Tenants are classified once from their whole trace, the same thresholds the
+//online classifier starts from.
+
+uint64_t REPLAY_RATE = 12500000000; //bytes/s
+uint32_t REPLAY_MTU = 4096;
+uint32_t REPLAY_WQE_NS = 10;
+uint32_t REPLAY_BASE_NS = 2000;
+uint32_t REPLAY_CHUNK_SIZE = 8192;
+uint32_t REPLAY_ALLOWED_QP = MAX_ALLOWED_QP_NUM;
+uint32_t REPLAY_BW_ENTER = 50; //% of large messages, as PERF_CLS_BW_ENTER
+uint32_t REPLAY_ACTIVE_NS = TENANT_ACTIVE_CHECK_INTERVAL * 1000;
+uint64_t REPLAY_MT_CREDIT = 400000;
+uint32_t REPLAY_MT_CREDIT_NS = 1000;
+
+KHASH_MAP_INIT_INT64(rqp, uint32_t);
+
+struct replay_job {
+  uint64_t post_ts;
+  uint64_t trace_comp;  //0 if unsignaled or unmatched
+  uint64_t comp_ts;
+  uint64_t wr_id;
+  uint32_t bytes;
+  uint32_t admitted;    //bytes the scheduler let the NIC see
+  uint32_t sent;
+  uint32_t wqe_end;     //admitted bytes when the WQE being sent was posted
+  uint32_t qp;
+  uint32_t next;        //sw or hw queue link, -1 terminates
+  bool signaled;
+};
+
+struct replay_qp {
+  uint32_t tenant;
+  uint32_t qp_num;
+  uint32_t sw_head, sw_tail;
+  uint32_t hw_head, hw_tail;
+  uint64_t chunk_ready; //perf: the next chunk may be admitted from then on
+  bool allowed;         //perf: holds one of the tenant's allowed slots
+};
+
+struct replay_tenant {
+  const char* path;
+  int32_t pid;
+  uint32_t sched;
+  uint64_t posts;
+  uint64_t large;
+  uint64_t bytes;
+  bool bw;
+  bool delay;
+  uint32_t allowed_num;
+  uint64_t last_post;
+  uint64_t credit;
+  uint64_t last_credit;
+};
+
+struct replay_ctx {
+  struct replay_job* job;
+  uint64_t job_num;
+  struct replay_qp* qp;
+  uint32_t qp_num;
+  struct replay_tenant* tenant;
+  uint32_t tenant_num;
+  khash_t(rqp)* qp_hash;
+};
+
+struct replay_sched {
+  const char* name;
+  //moves work from the sw queues to the NIC; returns the next time it can make progress
+  uint64_t (*pump)(struct replay_ctx* ctx, uint64_t now);
+};
+
+static void replay_push(struct replay_ctx* ctx, uint32_t* head, uint32_t* tail, uint32_t j)
+{
+  ctx->job[j].next = -1;
+  if(*head == (uint32_t)-1)
+    *head = j;
+  else
+    ctx->job[*tail].next = j;
+  *tail = j;
+}
+
+static uint32_t replay_pop(struct replay_ctx* ctx, uint32_t* head)
+{
+  uint32_t j = *head;
+  *head = ctx->job[j].next;
+  return j;
+}
+
+static uint64_t replay_pump_none(struct replay_ctx* ctx, uint64_t now)
+{
+  for(uint32_t i=0; i<ctx->qp_num; i++)
+  {
+    struct replay_qp* qp = &(ctx->qp[i]);
+    while(qp->sw_head != (uint32_t)-1)
+    {
+      uint32_t j = replay_pop(ctx, &qp->sw_head);
+      ctx->job[j].admitted = ctx->job[j].bytes;
+      replay_push(ctx, &qp->hw_head, &qp->hw_tail, j);
+    }
+  }
+  return UINT64_MAX;
+}
+
+static uint64_t replay_pump_perf(struct replay_ctx* ctx, uint64_t now)
+{
+  uint64_t next = UINT64_MAX;
+  bool delay_active = false;
+
+  for(uint32_t i=0; i<ctx->tenant_num; i++)
+  {
+    if(ctx->tenant[i].delay && ctx->tenant[i].last_post && now - ctx->tenant[i].last_post < REPLAY_ACTIVE_NS)
+      delay_active = true;
+  }
+
+  //release the slots of drained QPs first so any waiting QP can take them in this pass
+  for(uint32_t i=0; i<ctx->qp_num; i++)
+  {
+    struct replay_qp* qp = &(ctx->qp[i]);
+    if(qp->allowed && qp->hw_head == (uint32_t)-1 && qp->sw_head == (uint32_t)-1)
+    {
+      qp->allowed = false;
+      ctx->tenant[qp->tenant].allowed_num--;
+    }
+  }
+
+  for(uint32_t i=0; i<ctx->qp_num; i++)
+  {
+    struct replay_qp* qp = &(ctx->qp[i]);
+    struct replay_tenant* t = &(ctx->tenant[qp->tenant]);
+
+    if(!t->bw || !delay_active)
+    {
+      while(qp->sw_head != (uint32_t)-1)
+      {
+        uint32_t j = replay_pop(ctx, &qp->sw_head);
+        ctx->job[j].admitted = ctx->job[j].bytes;
+        replay_push(ctx, &qp->hw_head, &qp->hw_tail, j);
+      }
+      //a job chunked so far goes out whole once the delay-sensitive tenants are gone
+      if(qp->hw_head != (uint32_t)-1)
+        ctx->job[qp->hw_head].admitted = ctx->job[qp->hw_head].bytes;
+      continue;
+    }
+
+    //small WRs keep flowing, they only queue behind the QP's own chunks
+    while(qp->sw_head != (uint32_t)-1 && ctx->job[qp->sw_head].bytes < PERF_LARGE_FLOW
+          && (qp->hw_head == (uint32_t)-1 || ctx->job[qp->hw_tail].admitted == ctx->job[qp->hw_tail].bytes))
+    {
+      uint32_t j = replay_pop(ctx, &qp->sw_head);
+      ctx->job[j].admitted = ctx->job[j].bytes;
+      replay_push(ctx, &qp->hw_head, &qp->hw_tail, j);
+    }
+
+    if(!qp->allowed)
+    {
+      if((qp->sw_head == (uint32_t)-1 && qp->hw_head == (uint32_t)-1) || t->allowed_num >= REPLAY_ALLOWED_QP)
+        continue;
+      qp->allowed = true;
+      t->allowed_num++;
+    }
+
+    if(qp->hw_head == (uint32_t)-1 && qp->sw_head != (uint32_t)-1)
+    {
+      uint32_t j = replay_pop(ctx, &qp->sw_head);
+      ctx->job[j].admitted = 0;
+      replay_push(ctx, &qp->hw_head, &qp->hw_tail, j);
+    }
+
+    if(qp->hw_head == (uint32_t)-1)
+      continue;
+
+    struct replay_job* job = &(ctx->job[qp->hw_head]);
+    if(job->sent < job->admitted || job->admitted == job->bytes)
+      continue;
+
+    //the next chunk waits for the previous one's completion
+    if(now < qp->chunk_ready)
+    {
+      next = next < qp->chunk_ready ? next : qp->chunk_ready;
+      continue;
+    }
+
+    job->admitted += REPLAY_CHUNK_SIZE;
+    if(job->admitted > job->bytes)
+      job->admitted = job->bytes;
+  }
+
+  return next;
+}
+
+static uint64_t replay_pump_mtrdma(struct replay_ctx* ctx, uint64_t now)
+{
+  bool blocked = false;
+
+  for(uint32_t i=0; i<ctx->tenant_num; i++)
+  {
+    struct replay_tenant* t = &(ctx->tenant[i]);
+    if(!t->last_credit)
+      t->last_credit = now;
+    if(now > t->last_credit)
+    {
+      t->credit += (now - t->last_credit) / REPLAY_MT_CREDIT_NS * REPLAY_MT_CREDIT;
+      t->last_credit = now - (now - t->last_credit) % REPLAY_MT_CREDIT_NS;
+    }
+  }
+
+  for(uint32_t i=0; i<ctx->qp_num; i++)
+  {
+    struct replay_qp* qp = &(ctx->qp[i]);
+    struct replay_tenant* t = &(ctx->tenant[qp->tenant]);
+
+    while(qp->sw_head != (uint32_t)-1)
+    {
+      if(ctx->job[qp->sw_head].bytes > t->credit)
+      {
+        blocked = true;
+        break;
+      }
+
+      uint32_t j = replay_pop(ctx, &qp->sw_head);
+      t->credit -= ctx->job[j].bytes;
+      ctx->job[j].admitted = ctx->job[j].bytes;
+      replay_push(ctx, &qp->hw_head, &qp->hw_tail, j);
+    }
+  }
+
+  return blocked ? now + REPLAY_MT_CREDIT_NS : UINT64_MAX;
+}
+
+//indexed by PERF_TRACE_SCHED_*
+static struct replay_sched scheds[] = {
+  { "none",   replay_pump_none },
+  { "perf",   replay_pump_perf },
+  { "mtrdma", replay_pump_mtrdma },
+};
+
+static uint32_t replay_qp_idx(struct replay_ctx* ctx, uint32_t tenant, uint32_t qp_num)
+{
+  int ret;
+  uint64_t key = ((uint64_t)tenant << 32) | qp_num;
+  khiter_t k = kh_get(rqp, ctx->qp_hash, key);
+  if(k != kh_end(ctx->qp_hash))
+    return kh_value(ctx->qp_hash, k);
+
+  ctx->qp = (struct replay_qp*) realloc(ctx->qp, sizeof(struct replay_qp) * (ctx->qp_num + 1));
+  struct replay_qp* qp = &(ctx->qp[ctx->qp_num]);
+  memset(qp, 0, sizeof(struct replay_qp));
+  qp->tenant = tenant;
+  qp->qp_num = qp_num;
+  qp->sw_head = qp->hw_head = -1;
+
+  k = kh_put(rqp, ctx->qp_hash, key, &ret);
+  kh_value(ctx->qp_hash, k) = ctx->qp_num;
+  return ctx->qp_num++;
+}
+
+//Appends the POST records of one trace as jobs and matches the signaled ones
+//with their send completions, which an RC QP returns in posting order
+static int replay_load(struct replay_ctx* ctx, const char* path, uint32_t tenant)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st) == -1)
+  {
+    LOG_ERROR("Cannot open trace %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct perf_trace_hdr* hdr = (struct perf_trace_hdr*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(hdr == MAP_FAILED || (size_t)st.st_size < PERF_TRACE_DATA_OFFSET || hdr->magic != PERF_TRACE_MAGIC
+     || hdr->version != PERF_TRACE_VERSION || hdr->rec_size != sizeof(struct perf_trace_rec)
+     || (size_t)st.st_size < PERF_TRACE_DATA_OFFSET + (hdr->mask + 1) * sizeof(struct perf_trace_rec))
+  {
+    LOG_ERROR("%s is not a PeRF trace\n", path);
+    if(hdr != MAP_FAILED)
+      munmap(hdr, st.st_size);
+    return -1;
+  }
+
+  struct perf_trace_rec* rec = (struct perf_trace_rec*)((char*)hdr + PERF_TRACE_DATA_OFFSET);
+  uint64_t head = atomic_load(&hdr->head);
+  uint64_t first = head > hdr->mask + 1 ? head - hdr->mask - 1 : 0;
+
+  struct replay_tenant* t = &(ctx->tenant[tenant]);
+  memset(t, 0, sizeof(struct replay_tenant));
+  t->path = path;
+  t->pid = hdr->pid;
+  t->sched = hdr->sched;
+  if(first)
+    LOG_ERROR("%s: ring wrapped, replaying the last %lu of %lu records\n", path, hdr->mask + 1, head);
+
+  uint64_t base = ctx->job_num;
+  ctx->job = (struct replay_job*) realloc(ctx->job, sizeof(struct replay_job) * (ctx->job_num + head - first));
+
+  //per QP list of the signaled jobs still waiting for their completion
+  uint32_t* pending = NULL;
+  uint32_t pending_cap = 0;
+
+  for(uint64_t i=first; i<head; i++)
+  {
+    struct perf_trace_rec* r = &(rec[i & hdr->mask]);
+    uint32_t q = replay_qp_idx(ctx, tenant, r->qp_num);
+
+    if(q >= pending_cap)
+    {
+      pending = (uint32_t*) realloc(pending, sizeof(uint32_t) * (q + 1) * 2);
+      for(uint32_t k=pending_cap * 2; k<(q + 1) * 2; k++)
+        pending[k] = -1;
+      pending_cap = q + 1;
+    }
+
+    if(r->type == PERF_TRACE_POST)
+    {
+      struct replay_job* job = &(ctx->job[ctx->job_num]);
+      memset(job, 0, sizeof(struct replay_job));
+      job->post_ts = perf_trace_to_ns(hdr, r->ts);
+      job->wr_id = r->wr_id;
+      job->bytes = r->bytes;
+      job->qp = q;
+      job->next = -1;
+      job->signaled = r->flags & PERF_TRACE_SIGNALED;
+
+      if(job->signaled)
+        replay_push(ctx, &pending[q * 2], &pending[q * 2 + 1], ctx->job_num);
+
+      t->posts++;
+      t->bytes += r->bytes;
+      if(r->bytes >= PERF_LARGE_FLOW)
+        t->large++;
+      ctx->job_num++;
+    }
+    else if(r->type == PERF_TRACE_COMP && !(r->opcode & IBV_WC_RECV))
+    {
+      while(pending[q * 2] != (uint32_t)-1)
+      {
+        uint32_t j = replay_pop(ctx, &pending[q * 2]);
+        if(ctx->job[j].wr_id == r->wr_id)
+        {
+          ctx->job[j].trace_comp = perf_trace_to_ns(hdr, r->ts);
+          break;
+        }
+      }
+    }
+  }
+
+  for(uint64_t j=base; j<ctx->job_num; j++)
+    ctx->job[j].next = -1;
+
+  free(pending);
+  munmap(hdr, st.st_size);
+
+  t->bw = t->posts && t->large * 100 >= t->posts * REPLAY_BW_ENTER;
+  t->delay = t->posts && !t->bw && t->bytes / t->posts < DELAY_SEN_BYTES_TH;
+  return 0;
+}
+
+static int replay_cmp_job(const void* a, const void* b, void* arg)
+{
+  struct replay_job* job = (struct replay_job*)arg;
+  uint64_t x = job[*(const uint32_t*)a].post_ts;
+  uint64_t y = job[*(const uint32_t*)b].post_ts;
+  return x < y ? -1 : x > y;
+}
+
+static int replay_cmp_u64(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void replay_run(struct replay_ctx* ctx, struct replay_sched* sched)
+{
+  uint32_t* order = (uint32_t*) malloc(sizeof(uint32_t) * ctx->job_num);
+  for(uint64_t i=0; i<ctx->job_num; i++)
+    order[i] = i;
+  qsort_r(order, ctx->job_num, sizeof(uint32_t), replay_cmp_job, ctx->job);
+
+  uint64_t arrived = 0, done = 0;
+  uint64_t frac = 0; //sub-ns remainder of the port time, in 1/REPLAY_RATE ns
+  uint64_t now = ctx->job_num ? ctx->job[order[0]].post_ts : 0;
+  uint32_t rr = 0;
+
+  while(done < ctx->job_num)
+  {
+    for(; arrived < ctx->job_num && ctx->job[order[arrived]].post_ts <= now; arrived++)
+    {
+      uint32_t j = order[arrived];
+      struct replay_qp* qp = &(ctx->qp[ctx->job[j].qp]);
+      replay_push(ctx, &qp->sw_head, &qp->sw_tail, j);
+      ctx->tenant[qp->tenant].last_post = ctx->job[j].post_ts;
+    }
+
+    uint64_t next = sched->pump(ctx, now);
+
+    uint32_t q;
+    for(q=0; q<ctx->qp_num; q++)
+    {
+      struct replay_qp* qp = &(ctx->qp[(rr + q) % ctx->qp_num]);
+      struct replay_job* job = qp->hw_head != (uint32_t)-1 ? &(ctx->job[qp->hw_head]) : NULL;
+      if(job && (job->sent < job->admitted || job->bytes == 0))
+        break;
+    }
+
+    if(q == ctx->qp_num)
+    {
+      //idle port: jump to whatever can happen first
+      if(arrived < ctx->job_num && ctx->job[order[arrived]].post_ts < next)
+        next = ctx->job[order[arrived]].post_ts;
+
+      if(next == UINT64_MAX)
+      {
+        LOG_ERROR("Replay stalled with %lu of %lu WRs completed\n", done, ctx->job_num);
+        break;
+      }
+      now = next > now ? next : now + 1;
+      continue;
+    }
+
+    q = (rr + q) % ctx->qp_num;
+    rr = q + 1;
+
+    struct replay_qp* qp = &(ctx->qp[q]);
+    struct replay_job* job = &(ctx->job[qp->hw_head]);
+    uint32_t seg = job->admitted - job->sent;
+    if(seg > REPLAY_MTU)
+      seg = REPLAY_MTU;
+
+    //every chunk is a WQE of its own
+    if(job->sent == job->wqe_end)
+    {
+      now += REPLAY_WQE_NS;
+      job->wqe_end = job->admitted;
+    }
+
+    uint64_t t = seg * 1000000000UL + frac;
+    now += t / REPLAY_RATE;
+    frac = t % REPLAY_RATE;
+    job->sent += seg;
+
+    if(job->sent == job->admitted)
+      qp->chunk_ready = now + REPLAY_BASE_NS;
+
+    if(job->sent == job->bytes)
+    {
+      job->comp_ts = now + REPLAY_BASE_NS;
+      replay_pop(ctx, &qp->hw_head);
+      done++;
+    }
+  }
+
+  free(order);
+}
+
+static void replay_report(struct replay_ctx* ctx, struct replay_sched* sched)
+{
+  uint64_t* lat = (uint64_t*) malloc(sizeof(uint64_t) * (ctx->job_num + 1));
+  uint64_t* tlat = (uint64_t*) malloc(sizeof(uint64_t) * (ctx->job_num + 1));
+
+  printf("scheduler %s, %.1f Gbps, mtu %u, chunk %u\n", sched->name, REPLAY_RATE * 8 / 1e9, REPLAY_MTU, REPLAY_CHUNK_SIZE);
+  printf("%-4s %-8s %-7s %-6s %10s %12s %10s %10s %10s %10s %10s %10s\n",
+         "id", "pid", "traced", "class", "wrs", "bytes", "Gbps", "avg_us", "p50_us", "p99_us", "trace_p50", "trace_p99");
+
+  for(uint32_t i=0; i<ctx->tenant_num; i++)
+  {
+    struct replay_tenant* t = &(ctx->tenant[i]);
+    uint64_t n = 0, tn = 0, sum = 0;
+    uint64_t first = UINT64_MAX, last = 0;
+
+    for(uint64_t j=0; j<ctx->job_num; j++)
+    {
+      struct replay_job* job = &(ctx->job[j]);
+      if(ctx->qp[job->qp].tenant != i || !job->comp_ts)
+        continue;
+
+      lat[n++] = job->comp_ts - job->post_ts;
+      sum += job->comp_ts - job->post_ts;
+      first = first < job->post_ts ? first : job->post_ts;
+      last = last > job->comp_ts ? last : job->comp_ts;
+      if(job->trace_comp)
+        tlat[tn++] = job->trace_comp - job->post_ts;
+    }
+
+    qsort(lat, n, sizeof(uint64_t), replay_cmp_u64);
+    qsort(tlat, tn, sizeof(uint64_t), replay_cmp_u64);
+
+    printf("%-4u %-8d %-7s %-6s %10lu %12lu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+           i, t->pid, t->sched < sizeof(scheds) / sizeof(scheds[0]) ? scheds[t->sched].name : "?", t->bw ? "bw" : t->delay ? "delay" : "msg", n, t->bytes,
+           last > first ? t->bytes * 8.0 / (last - first) : 0,
+           n ? sum / 1000.0 / n : 0,
+           n ? lat[n / 2] / 1000.0 : 0, n ? lat[n * 99 / 100] / 1000.0 : 0,
+           tn ? tlat[tn / 2] / 1000.0 : 0, tn ? tlat[tn * 99 / 100] / 1000.0 : 0);
+  }
+
+  free(lat);
+  free(tlat);
+}
+
+static void load_replay_config()
+{
+  char* env;
+
+  env = getenv("PERF_REPLAY_RATE");
+  if(env)
+    REPLAY_RATE = atol(env);
+
+  env = getenv("PERF_REPLAY_MTU");
+  if(env)
+    REPLAY_MTU = atoi(env);
+
+  env = getenv("PERF_REPLAY_WQE_NS");
+  if(env)
+    REPLAY_WQE_NS = atoi(env);
+
+  env = getenv("PERF_REPLAY_BASE_NS");
+  if(env)
+    REPLAY_BASE_NS = atoi(env);
+
+  env = getenv("PERF_CHUNK_SIZE");
+  if(env)
+    REPLAY_CHUNK_SIZE = atoi(env);
+
+  env = getenv("PERF_REPLAY_ALLOWED_QP");
+  if(env)
+    REPLAY_ALLOWED_QP = atoi(env);
+
+  env = getenv("PERF_REPLAY_MT_CREDIT");
+  if(env)
+    REPLAY_MT_CREDIT = atol(env);
+
+  env = getenv("PERF_REPLAY_MT_CREDIT_NS");
+  if(env)
+    REPLAY_MT_CREDIT_NS = atoi(env);
+
+  if(!REPLAY_RATE)
+    REPLAY_RATE = 1;
+  if(!REPLAY_MTU)
+    REPLAY_MTU = 1;
+  if(!REPLAY_CHUNK_SIZE)
+    REPLAY_CHUNK_SIZE = 1;
+  if(!REPLAY_ALLOWED_QP)
+    REPLAY_ALLOWED_QP = 1;
+  if(!REPLAY_MT_CREDIT_NS)
+    REPLAY_MT_CREDIT_NS = 1;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2)
+  {
+    LOG_ERROR("usage: PERF_REPLAY_SCHED=none|perf|mtrdma %s <trace>...\n", argv[0]);
+    return 1;
+  }
+
+  const char* sched_name = getenv("PERF_REPLAY_SCHED");
+  struct replay_sched* sched = NULL;
+  for(uint32_t i=0; i<sizeof(scheds) / sizeof(scheds[0]); i++)
+  {
+    if(!strcmp(scheds[i].name, sched_name ? sched_name : "perf"))
+      sched = &scheds[i];
+  }
+  if(!sched)
+  {
+    LOG_ERROR("Unknown PERF_REPLAY_SCHED %s\n", sched_name);
+    return 1;
+  }
+
+  load_replay_config();
+
+  struct replay_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.qp_hash = kh_init(rqp);
+  ctx.tenant_num = argc - 1;
+  ctx.tenant = (struct replay_tenant*) calloc(ctx.tenant_num, sizeof(struct replay_tenant));
+
+  for(uint32_t i=0; i<ctx.tenant_num; i++)
+  {
+    if(replay_load(&ctx, argv[i + 1], i))
+      return 1;
+  }
+
+  replay_run(&ctx, sched);
+  replay_report(&ctx, sched);
+
+  kh_destroy(rqp, ctx.qp_hash);
+  free(ctx.job);
+  free(ctx.qp);
+  free(ctx.tenant);
+  return 0;
+}
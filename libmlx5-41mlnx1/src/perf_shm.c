@@ -0,0 +1,161 @@
+#include "perf.h"
+#include <string.h>
+#include <errno.h>
+
+//Shared by libmlx5 and perf_main, must not depend on the rest of PeRF
+
+void perf_shm_init(struct perf_shm_context* ctx)
+{
+  pthread_mutexattr_t mattr;
+  pthread_condattr_t cattr;
+
+  memset(ctx, 0, sizeof(struct perf_shm_context));
+
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+
+  for(uint32_t i=0; i<MAX_TENANT_NUM; i++)
+  {
+    ctx->tenant[i].btenant_can_post = true;
+    pthread_mutex_init(&(ctx->perf_thread_lock[i]), &mattr);
+    pthread_cond_init(&(ctx->perf_thread_cond[i]), &cattr);
+    pthread_mutex_init(&(ctx->tenant_alive[i]), &mattr);
+  }
+
+  pthread_mutex_init(&ctx->lock, &mattr);
+  pthread_mutex_init(&ctx->ctl_lock, &mattr);
+
+  pthread_mutexattr_destroy(&mattr);
+  pthread_condattr_destroy(&cattr);
+
+  ctx->size = sizeof(struct perf_shm_context);
+  ctx->version = PERF_SHM_VERSION;
+  atomic_thread_fence(memory_order_release);
+  ctx->magic = PERF_SHM_MAGIC;
+}
+
+int perf_shm_lock(struct perf_shm_context* ctx)
+{
+  int ret = pthread_mutex_lock(&ctx->lock);
+
+  //the previous owner died, the fields it guards are plain counters we can keep
+  if(ret == EOWNERDEAD)
+    ret = pthread_mutex_consistent(&ctx->lock);
+
+  return ret;
+}
+
+//perf_thread_lock[id] only guards btenant_can_post, which the controller rewrites every tick
+int perf_shm_thread_lock(struct perf_shm_context* ctx, uint32_t id)
+{
+  int ret = pthread_mutex_lock(&(ctx->perf_thread_lock[id]));
+
+  if(ret == EOWNERDEAD)
+    ret = pthread_mutex_consistent(&(ctx->perf_thread_lock[id]));
+
+  return ret;
+}
+
+int perf_shm_thread_wait(struct perf_shm_context* ctx, uint32_t id)
+{
+  int ret = pthread_cond_wait(&(ctx->perf_thread_cond[id]), &(ctx->perf_thread_lock[id]));
+
+  if(ret == EOWNERDEAD)
+    ret = pthread_mutex_consistent(&(ctx->perf_thread_lock[id]));
+
+  return ret;
+}
+
+//The calling thread holds tenant_alive[id] until perf_shm_release_tenant, which it must
+//call itself; the controller takes a slot whose alive lock it can get as abandoned
+int32_t perf_shm_alloc_tenant(struct perf_shm_context* ctx, pid_t pid)
+{
+  int32_t id = -1;
+
+  if(perf_shm_lock(ctx))
+    return -1;
+
+  for(uint32_t i=0; i<MAX_TENANT_NUM; i++)
+  {
+    if(!ctx->tenant[i].pid)
+    {
+      id = i;
+      break;
+    }
+  }
+
+  if(id != -1 && pthread_mutex_lock(&(ctx->tenant_alive[id])) == EOWNERDEAD)
+    pthread_mutex_consistent(&(ctx->tenant_alive[id]));
+
+  if(id != -1)
+  {
+    struct perf_shm_tenant* t = &(ctx->tenant[id]);
+
+    memset(t, 0, sizeof(struct perf_shm_tenant));
+    t->btenant_can_post = true;
+    t->pid = pid;
+
+    ctx->tenant_num++;
+    if((uint32_t)id >= ctx->next_tenant_id)
+      ctx->next_tenant_id = id + 1;
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+  return id;
+}
+
+//ctx->lock held
+static void perf_shm_clear_tenant(struct perf_shm_context* ctx, uint32_t id)
+{
+  struct perf_shm_tenant* t = &(ctx->tenant[id]);
+
+  if(t->pid)
+  {
+    t->active_qps = 0;
+    t->additional_qps_num = 0;
+    t->delay_sensitive = false;
+    t->msg_sensitive = false;
+    t->resp_read = false;
+    t->btenant_can_post = true;
+    t->pid = 0;
+    ctx->tenant_num--;
+  }
+}
+
+void perf_shm_release_tenant(struct perf_shm_context* ctx, uint32_t id)
+{
+  perf_shm_lock(ctx);
+  perf_shm_clear_tenant(ctx, id);
+  pthread_mutex_unlock(&(ctx->tenant_alive[id]));
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+//A taken slot whose alive lock is free or owner-dead belongs to a process that is gone,
+//whatever pid namespace it ran in and whoever has its pid now
+bool perf_shm_reap_tenant(struct perf_shm_context* ctx, uint32_t id)
+{
+  bool dead = false;
+
+  if(perf_shm_lock(ctx))
+    return false;
+
+  if(ctx->tenant[id].pid)
+  {
+    int ret = pthread_mutex_trylock(&(ctx->tenant_alive[id]));
+    if(ret == EOWNERDEAD)
+      ret = pthread_mutex_consistent(&(ctx->tenant_alive[id]));
+
+    if(!ret)
+    {
+      pthread_mutex_unlock(&(ctx->tenant_alive[id]));
+      perf_shm_clear_tenant(ctx, id);
+      dead = true;
+    }
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+  return dead;
+}
@@ -0,0 +1,92 @@
+#include "perf.h"
+#include "perf_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct perf_trace_hdr* perf_trace = NULL;
+static size_t perf_trace_len;
+
+//PERF_TRACE=<prefix> writes <prefix>.<pid>; PERF_TRACE_RECORDS is rounded up to a power of 2
+//and capped at PERF_TRACE_MAX_RECORDS
+void perf_trace_open(uint32_t sched)
+{
+  char* env = getenv("PERF_TRACE");
+  if(!env || perf_trace)
+    return;
+
+  uint64_t records = PERF_TRACE_RECORDS;
+  char* rec_env = getenv("PERF_TRACE_RECORDS");
+  if(rec_env)
+  {
+    long long val = strtoll(rec_env, NULL, 0);
+    if(val <= 0)
+      LOG_ERROR("Ignoring PERF_TRACE_RECORDS=%s, using %lu records\n", rec_env, records);
+    else
+      records = val < PERF_TRACE_MAX_RECORDS ? val : PERF_TRACE_MAX_RECORDS;
+  }
+
+  uint64_t cap = 1;
+  while(cap < records)
+    cap <<= 1;
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.%d", env, getpid());
+
+  perf_trace_len = PERF_TRACE_DATA_OFFSET + cap * sizeof(struct perf_trace_rec);
+
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if(fd == -1 || ftruncate(fd, perf_trace_len) == -1)
+  {
+    LOG_ERROR("Cannot create trace file %s: %s\n", path, strerror(errno));
+    if(fd != -1)
+      close(fd);
+    return;
+  }
+
+  //prefault the whole ring so the post path never takes a page fault
+  struct perf_trace_hdr* hdr = (struct perf_trace_hdr*) mmap(NULL, perf_trace_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  close(fd);
+  if(hdr == MAP_FAILED)
+  {
+    LOG_ERROR("Error mapping trace file %s\n", path);
+    return;
+  }
+
+  hdr->version = PERF_TRACE_VERSION;
+  hdr->rec_size = sizeof(struct perf_trace_rec);
+  hdr->sched = sched;
+  hdr->pid = getpid();
+  hdr->mask = cap - 1;
+  hdr->tick_hz = 0;
+  hdr->start_ns = perf_trace_ns();
+  hdr->start_tick = perf_trace_tick();
+  if(PERF_TRACE_TSC)
+  {
+    //calibrate the TSC against CLOCK_MONOTONIC over ~10ms
+    struct timespec wait = { 0, 10000000 };
+    nanosleep(&wait, NULL);
+    uint64_t ns = perf_trace_ns();
+    uint64_t tick = perf_trace_tick();
+    hdr->tick_hz = (tick - hdr->start_tick) * 1000000000.0 / (ns - hdr->start_ns);
+  }
+  atomic_init(&hdr->head, 0);
+  atomic_thread_fence(memory_order_release);
+  hdr->magic = PERF_TRACE_MAGIC;
+
+  perf_trace = hdr;
+  atexit(perf_trace_close);
+  LOG_INFO("PeRF trace: %s, %lu records\n", path, cap);
+}
+
+//Other threads may still be posting, so the ring stays mapped until exit
+void perf_trace_close()
+{
+  struct perf_trace_hdr* hdr = perf_trace;
+  if(!hdr)
+    return;
+
+  perf_trace = NULL;
+  msync(hdr, perf_trace_len, MS_ASYNC);
+}
@@ -0,0 +1,165 @@
+#ifndef PERF_TRACE_H
+#define PERF_TRACE_H
+
+#include <infiniband/verbs.h>
+#include <infiniband/verbs_exp.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+
+//WR trace: one memory-mapped ring file per tenant process, read by perf_replay.
+//The record layout is shared with mlx5/mtrdma_trace.h, keep both in sync.
+
+#define PERF_TRACE_MAGIC   0x43525450 //"PTRC"
+#define PERF_TRACE_VERSION 1
+#define PERF_TRACE_RECORDS (1 << 20) //default, PERF_TRACE_RECORDS
+#define PERF_TRACE_MAX_RECORDS (1 << 28) //PERF_TRACE_RECORDS is clamped to this, 8GB of records
+
+#define PERF_TRACE_POST 1
+#define PERF_TRACE_COMP 2
+
+#define PERF_TRACE_SIGNALED 0x1
+
+#define PERF_TRACE_SCHED_NONE   0
+#define PERF_TRACE_SCHED_PERF   1
+#define PERF_TRACE_SCHED_MTRDMA 2
+
+struct perf_trace_rec {
+  uint64_t ts;      //perf_trace_tick(), see perf_trace_hdr
+  uint64_t wr_id;
+  uint32_t qp_num;
+  uint32_t bytes;   //sum of the SGEs on POST, byte_len on COMP
+  uint8_t  type;    //PERF_TRACE_POST / PERF_TRACE_COMP
+  uint8_t  opcode;  //ibv_wr_opcode on POST, ibv_wc_opcode on COMP
+  uint8_t  num_sge;
+  uint8_t  flags;   //PERF_TRACE_SIGNALED
+  uint32_t status;  //ibv_wc_status on COMP
+};
+
+struct perf_trace_hdr {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t rec_size;
+  uint32_t sched;   //PERF_TRACE_SCHED_*
+  int32_t  pid;
+  uint64_t mask;    //records - 1
+
+  //record ts to CLOCK_MONOTONIC ns: start_ns + (ts - start_tick) * 1e9 / tick_hz,
+  //tick_hz == 0 means ts already is CLOCK_MONOTONIC ns
+  uint64_t start_ns;
+  uint64_t start_tick;
+  uint64_t tick_hz;
+
+  //records written so far, the ring holds the last mask + 1 of them
+  _Alignas(64) atomic_uint_fast64_t head;
+};
+
+#define PERF_TRACE_DATA_OFFSET ((sizeof(struct perf_trace_hdr) + 63) & ~63UL)
+
+extern struct perf_trace_hdr* perf_trace;
+
+void perf_trace_open(uint32_t sched);
+void perf_trace_close();
+
+static inline struct perf_trace_rec* perf_trace_slot(struct perf_trace_hdr* hdr)
+{
+  uint64_t pos = atomic_fetch_add_explicit(&hdr->head, 1, memory_order_relaxed);
+  return (struct perf_trace_rec*)((char*)hdr + PERF_TRACE_DATA_OFFSET) + (pos & hdr->mask);
+}
+
+static inline uint64_t perf_trace_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+//the TSC costs a fraction of clock_gettime, which alone would eat most of the per-WR budget
+#if defined(__x86_64__) || defined (__i386__)
+#define PERF_TRACE_TSC 1
+static inline uint64_t perf_trace_tick()
+{
+  uint32_t low, high;
+  asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+  return ((uint64_t)high << 32) | low;
+}
+#else
+#define PERF_TRACE_TSC 0
+static inline uint64_t perf_trace_tick()
+{
+  return perf_trace_ns();
+}
+#endif
+
+static inline uint64_t perf_trace_to_ns(struct perf_trace_hdr* hdr, uint64_t tick)
+{
+  if(!hdr->tick_hz)
+    return tick;
+  return hdr->start_ns + (int64_t)((__int128)((int64_t)(tick - hdr->start_tick)) * 1000000000 / (int64_t)hdr->tick_hz);
+}
+
+//One record per WR of the list; the caller checks perf_trace first so a
+//disabled tracer costs a single branch
+static inline void perf_trace_post(struct perf_trace_hdr* hdr, uint32_t qp_num, int sig_all, struct ibv_send_wr* wr)
+{
+  uint64_t now = perf_trace_tick();
+
+  for(; wr; wr = wr->next)
+  {
+    uint32_t bytes = 0;
+    for(int i=0; i<wr->num_sge; i++)
+      bytes += wr->sg_list[i].length;
+
+    struct perf_trace_rec* rec = perf_trace_slot(hdr);
+    rec->ts = now;
+    rec->wr_id = wr->wr_id;
+    rec->qp_num = qp_num;
+    rec->bytes = bytes;
+    rec->type = PERF_TRACE_POST;
+    rec->opcode = wr->opcode;
+    rec->num_sge = wr->num_sge;
+    rec->flags = (sig_all || (wr->send_flags & IBV_SEND_SIGNALED)) ? PERF_TRACE_SIGNALED : 0;
+    rec->status = 0;
+  }
+}
+
+static inline void perf_trace_comp(struct perf_trace_hdr* hdr, void* wc, int ne, uint32_t wc_size, bool exp)
+{
+  if(ne <= 0)
+    return;
+
+  uint64_t now = perf_trace_tick();
+
+  for(int i=0; i<ne; i++, wc = (char*)wc + wc_size)
+  {
+    struct perf_trace_rec* rec = perf_trace_slot(hdr);
+    rec->ts = now;
+    rec->type = PERF_TRACE_COMP;
+    rec->num_sge = 0;
+    rec->flags = 0;
+
+    if(exp)
+    {
+      struct ibv_exp_wc* ewc = (struct ibv_exp_wc*)wc;
+      rec->wr_id = ewc->wr_id;
+      rec->qp_num = ewc->qp_num;
+      rec->bytes = ewc->byte_len;
+      rec->opcode = ewc->exp_opcode;
+      rec->status = ewc->status;
+    }
+    else
+    {
+      struct ibv_wc* iwc = (struct ibv_wc*)wc;
+      rec->wr_id = iwc->wr_id;
+      rec->qp_num = iwc->qp_num;
+      rec->bytes = iwc->byte_len;
+      rec->opcode = iwc->opcode;
+      rec->status = iwc->status;
+    }
+  }
+}
+
+#endif
@@ -2444,16 +2444,17 @@ int mlx5_exp_post_send2(struct ibv_qp *ibqp, struct ibv_exp_send_wr *wr,
     
   if(!skip_perf)
   {
+    //a failed conversion (ENOMEM) posts the WRs unscheduled
     int ret = perf_exp_process(ibqp, wr);
     if(ret == -1)
     {
-      perf_exp_bg_post(ibqp, wr);
-      return 0;
+      if(perf_exp_bg_post(ibqp, wr))
+        return 0;
     }
     else if(ret > 0)
     {
-      perf_exp_poll_post(ibqp, wr, ret);
-      return 0;
+      if(perf_exp_poll_post(ibqp, wr, ret))
+        return 0;
     }
   }
   return __mlx5_post_send(ibqp, wr, bad_wr, 1);
@@ -3072,6 +3072,11 @@ int mlx5_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		mqp->gen_data.db[MLX5_RCV_DBR] = htonl(mqp->rq.head & 0xffff);
 		mlx5_unlock(&mqp->rq.lock);
 	}
+
+  if(!ret && (attr_mask & IBV_QP_STATE) && attr->qp_state == IBV_QPS_RTR &&
+      (attr_mask & IBV_QP_AV) && attr->ah_attr.is_global && qp->qp_type == IBV_QPT_RC)
+    perf_set_dest_info(qp, attr->ah_attr.grh.dgid, attr->ah_attr.grh.sgid_index,
+        (attr_mask & IBV_QP_DEST_QPN) ? attr->dest_qp_num : 0);
   
 	return ret;
 }
@@ -3810,6 +3815,11 @@ int mlx5_modify_qp_ex(struct ibv_qp *qp, struct ibv_exp_qp_attr *attr,
 		mlx5_unlock(&mqp->rq.lock);
 	}
 
+  if(!ret && (attr_mask & IBV_QP_STATE) && attr->qp_state == IBV_QPS_RTR &&
+      (attr_mask & IBV_QP_AV) && attr->ah_attr.is_global && qp->qp_type == IBV_QPT_RC)
+    perf_set_dest_info(qp, attr->ah_attr.grh.dgid, attr->ah_attr.grh.sgid_index,
+        (attr_mask & IBV_QP_DEST_QPN) ? attr->dest_qp_num : 0);
+
 	return ret;
 }
 
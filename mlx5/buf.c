@@ -38,7 +38,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <util/bitmap.h>
 
 #include "mlx5.h"
@@ -59,6 +61,14 @@
 #define MLX5_SHM_LENGTH         HPAGE_SIZE
 #define MLX5_Q_CHUNK_SIZE       32768
 
+/* Bound on freed chunks kept in the size class lists, 32MB */
+#define MLX5_HUGETLB_CACHE_CHUNKS 1024
+
+/* Seconds without shmget() after it failed for lack of hugepages */
+#define MLX5_HUGETLB_RETRY_SEC	1
+
+#define MLX5_MPOL_PREFERRED     1
+
 static void free_huge_mem(struct mlx5_hugetlb_mem *hmem)
 {
 	if (hmem->bitmap)
@@ -70,10 +80,29 @@ static void free_huge_mem(struct mlx5_hugetlb_mem *hmem)
 	free(hmem);
 }
 
-static struct mlx5_hugetlb_mem *alloc_huge_mem(size_t size)
+/*
+ * Prefer the device's node for the segment. It is called before anything
+ * touches the segment, so no pages need to move. Failure is harmless.
+ */
+static void bind_huge_mem(void *addr, size_t len, int node)
+{
+	unsigned long mask[16] = {};
+
+	if (node < 0 || node >= sizeof(mask) * 8)
+		return;
+
+	mask[node / (8 * sizeof(long))] = 1UL << (node % (8 * sizeof(long)));
+	if (syscall(SYS_mbind, addr, len, MLX5_MPOL_PREFERRED, mask,
+		    sizeof(mask) * 8 + 1, 0))
+		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "mbind: %s\n", strerror(errno));
+}
+
+/* Sets errno on failure */
+static struct mlx5_hugetlb_mem *alloc_huge_mem(size_t size, int node)
 {
 	struct mlx5_hugetlb_mem *hmem;
 	size_t shm_len;
+	int err;
 
 	hmem = malloc(sizeof(*hmem));
 	if (!hmem)
@@ -82,19 +111,24 @@ static struct mlx5_hugetlb_mem *alloc_huge_mem(size_t size)
 	shm_len = align(size, MLX5_SHM_LENGTH);
 	hmem->shmid = shmget(IPC_PRIVATE, shm_len, SHM_HUGETLB | SHM_R | SHM_W);
 	if (hmem->shmid == -1) {
-		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
+		err = errno;
+		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(err));
 		goto out_free;
 	}
 
 	hmem->shmaddr = shmat(hmem->shmid, MLX5_SHM_ADDR, MLX5_SHMAT_FLAGS);
 	if (hmem->shmaddr == (void *)-1) {
-		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
+		err = errno;
+		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(err));
 		goto out_rmid;
 	}
 
+	bind_huge_mem(hmem->shmaddr, shm_len, node);
+
 	hmem->bitmap = bitmap_alloc0(shm_len / MLX5_Q_CHUNK_SIZE);
 	if (!hmem->bitmap) {
-		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(errno));
+		err = ENOMEM;
+		mlx5_dbg(stderr, MLX5_DBG_CONTIG, "%s\n", strerror(err));
 		goto out_shmdt;
 	}
 
@@ -116,12 +150,52 @@ out_rmid:
 
 out_free:
 	free(hmem);
+	errno = err;
 	return NULL;
 }
 
+/*
+ * hugetlb_list keeps segments with free chunks ahead of full ones, so the
+ * scan for a free range stops at the first full segment. Call with
+ * hugetlb_lock held after the segment's bitmap changed.
+ */
+static void huge_mem_update(struct mlx5_context *mctx,
+			    struct mlx5_hugetlb_mem *hmem, bool was_full)
+{
+	bool full = bitmap_full(hmem->bitmap, hmem->bmp_size);
+
+	if (full == was_full)
+		return;
+
+	list_del(&hmem->entry);
+	if (full)
+		list_add_tail(&mctx->hugetlb_list, &hmem->entry);
+	else
+		list_add(&mctx->hugetlb_list, &hmem->entry);
+}
+
+/* Call with hugetlb_lock held, the chunks must belong to a listed segment */
+static void huge_mem_release(struct mlx5_context *mctx,
+			     struct mlx5_hugetlb_mem *hmem, int base, int nchunk)
+{
+	bool was_full = bitmap_full(hmem->bitmap, hmem->bmp_size);
+
+	bitmap_zero_region(hmem->bitmap, base, base + nchunk);
+	if (bitmap_empty(hmem->bitmap, hmem->bmp_size)) {
+		list_del(&hmem->entry);
+		mlx5_spin_unlock(&mctx->hugetlb_lock);
+		free_huge_mem(hmem);
+		mlx5_spin_lock(&mctx->hugetlb_lock);
+		return;
+	}
+
+	huge_mem_update(mctx, hmem, was_full);
+}
+
 static int alloc_huge_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
 			  size_t size, int page_size)
 {
+	struct mlx5_hugetlb_free *cached;
 	int found = 0;
 	int nchunk;
 	struct mlx5_hugetlb_mem *hmem;
@@ -134,26 +208,56 @@ static int alloc_huge_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
 		return 0;
 
 	mlx5_spin_lock(&mctx->hugetlb_lock);
+	if (nchunk <= MLX5_HUGETLB_CLASSES && mctx->hugetlb_free[nchunk - 1]) {
+		cached = mctx->hugetlb_free[nchunk - 1];
+		mctx->hugetlb_free[nchunk - 1] = cached->next;
+		mctx->hugetlb_cached -= nchunk;
+		hmem = cached->hmem;
+		buf->base = ((void *)cached - hmem->shmaddr) / MLX5_Q_CHUNK_SIZE;
+		buf->hmem = hmem;
+		found = 1;
+		goto out_unlock;
+	}
+
 	list_for_each(&mctx->hugetlb_list, hmem, entry) {
-		if (!bitmap_full(hmem->bitmap, hmem->bmp_size)) {
-			buf->base = bitmap_find_free_region(hmem->bitmap,
-							    hmem->bmp_size,
-							    nchunk);
-			if (buf->base != hmem->bmp_size) {
-				bitmap_fill_region(hmem->bitmap, buf->base,
-						   buf->base + nchunk);
-				buf->hmem = hmem;
-				found = 1;
-				break;
-			}
+		if (bitmap_full(hmem->bitmap, hmem->bmp_size))
+			break;
+
+		buf->base = bitmap_find_free_region(hmem->bitmap,
+						    hmem->bmp_size, nchunk);
+		if (buf->base != hmem->bmp_size) {
+			bitmap_fill_region(hmem->bitmap, buf->base,
+					   buf->base + nchunk);
+			huge_mem_update(mctx, hmem, false);
+			buf->hmem = hmem;
+			found = 1;
+			break;
 		}
 	}
+out_unlock:
 	mlx5_spin_unlock(&mctx->hugetlb_lock);
 
 	if (!found) {
-		hmem = alloc_huge_mem(buf->length);
-		if (!hmem)
+		/*
+		 * Don't retry shmget() for every resource once it failed:
+		 * never again when hugetlb shm is not allowed or supported,
+		 * otherwise (no free hugepages, shm limits) after a while.
+		 */
+		if (mctx->hugetlb_unavail || time(NULL) < mctx->hugetlb_retry)
+			return -1;
+
+		if (mctx->hugetlb_node == -2)
+			mctx->hugetlb_node = mlx5_local_node(mctx);
+
+		hmem = alloc_huge_mem(buf->length, mctx->hugetlb_node);
+		if (!hmem) {
+			if (errno == EPERM || errno == ENOSYS)
+				mctx->hugetlb_unavail = true;
+			else
+				mctx->hugetlb_retry = time(NULL) +
+						      MLX5_HUGETLB_RETRY_SEC;
 			return -1;
+		}
 
 		buf->base = 0;
 		assert(nchunk <= hmem->bmp_size);
@@ -182,33 +286,74 @@ static int alloc_huge_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
 
 out_fork:
 	mlx5_spin_lock(&mctx->hugetlb_lock);
-	bitmap_zero_region(hmem->bitmap, buf->base, buf->base + nchunk);
-	if (bitmap_empty(hmem->bitmap, hmem->bmp_size)) {
-		list_del(&hmem->entry);
-		mlx5_spin_unlock(&mctx->hugetlb_lock);
-		free_huge_mem(hmem);
-	} else
-		mlx5_spin_unlock(&mctx->hugetlb_lock);
+	huge_mem_release(mctx, hmem, buf->base, nchunk);
+	mlx5_spin_unlock(&mctx->hugetlb_lock);
 
 	return -1;
 }
 
+/*
+ * Freed regions of up to MLX5_HUGETLB_CLASSES chunks go to a per size free
+ * list, so recreating a resource of the same shape skips the bitmap scan.
+ * Their chunks stay allocated in the segment bitmap meanwhile.
+ */
 static void free_huge_buf(struct mlx5_context *ctx, struct mlx5_buf *buf)
 {
+	struct mlx5_hugetlb_free *cached;
 	int nchunk;
 
 	nchunk = buf->length / MLX5_Q_CHUNK_SIZE;
 	if (!nchunk)
 		return;
 
+	ibv_dofork_range(buf->buf, buf->length);
+
+	mlx5_spin_lock(&ctx->hugetlb_lock);
+	if (nchunk <= MLX5_HUGETLB_CLASSES &&
+	    ctx->hugetlb_cached + nchunk <= MLX5_HUGETLB_CACHE_CHUNKS) {
+		cached = buf->buf;
+		cached->hmem = buf->hmem;
+		cached->next = ctx->hugetlb_free[nchunk - 1];
+		ctx->hugetlb_free[nchunk - 1] = cached;
+		ctx->hugetlb_cached += nchunk;
+	} else {
+		huge_mem_release(ctx, buf->hmem, buf->base, nchunk);
+	}
+	mlx5_spin_unlock(&ctx->hugetlb_lock);
+}
+
+/*
+ * Called when the context goes away: gives the cached regions back to
+ * their segments, which frees the segments they kept alive, then frees
+ * any segment still left over from buffers that were never freed.
+ */
+void mlx5_free_huge_cache(struct mlx5_context *ctx)
+{
+	struct mlx5_hugetlb_free *cached, *next;
+	struct mlx5_hugetlb_mem *hmem, *tmp;
+	int i;
+
 	mlx5_spin_lock(&ctx->hugetlb_lock);
-	bitmap_zero_region(buf->hmem->bitmap, buf->base, buf->base + nchunk);
-	if (bitmap_empty(buf->hmem->bitmap, buf->hmem->bmp_size)) {
-		list_del(&buf->hmem->entry);
-		mlx5_spin_unlock(&ctx->hugetlb_lock);
-		free_huge_mem(buf->hmem);
-	} else
-		mlx5_spin_unlock(&ctx->hugetlb_lock);
+	for (i = 0; i < MLX5_HUGETLB_CLASSES; i++) {
+		for (cached = ctx->hugetlb_free[i]; cached; cached = next) {
+			/* The entry lives in the region being released */
+			next = cached->next;
+			hmem = cached->hmem;
+			huge_mem_release(ctx, hmem,
+					 ((void *)cached - hmem->shmaddr) /
+					 MLX5_Q_CHUNK_SIZE, i + 1);
+		}
+		ctx->hugetlb_free[i] = NULL;
+	}
+	ctx->hugetlb_cached = 0;
+
+	list_for_each_safe(&ctx->hugetlb_list, hmem, tmp, entry) {
+		mlx5_dbg(ctx->dbg_fp, MLX5_DBG_CONTIG,
+			 "hugetlb segment %p still in use\n", hmem->shmaddr);
+		list_del(&hmem->entry);
+		free_huge_mem(hmem);
+	}
+	mlx5_spin_unlock(&ctx->hugetlb_lock);
 }
 
 void mlx5_free_buf_extern(struct mlx5_context *ctx, struct mlx5_buf *buf)
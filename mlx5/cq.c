@@ -43,6 +43,11 @@
 #include <util/mmio.h>
 #include <infiniband/opcode.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define MLX5_CQE_SCAN_AVX2
+#endif
+
 #include "mlx5.h"
 #include "wqe.h"
 
@@ -149,6 +154,75 @@ static void *next_cqe_sw(struct mlx5_cq *cq)
 	return get_sw_cqe(cq, cq->cons_index);
 }
 
+/* CQEs checked for SW ownership per scan, and covered by one barrier */
+#define MLX5_CQE_SCAN_BATCH 8
+
+static unsigned int scan_sw_cqes_scalar(struct mlx5_cq *cq)
+{
+	unsigned int n;
+
+	for (n = 1; n < MLX5_CQE_SCAN_BATCH; n++)
+		if (!get_sw_cqe(cq, cq->cons_index + n))
+			break;
+
+	return n;
+}
+
+#ifdef MLX5_CQE_SCAN_AVX2
+/*
+ * Gathers the op_own byte of the next 8 CQEs and checks opcode and owner
+ * bit of all of them at once. op_own is the last byte of a 64B CQE, and of
+ * the second half of a 128B one.
+ */
+__attribute__((target("avx2")))
+static unsigned int scan_sw_cqes_avx2(struct mlx5_cq *cq)
+{
+	const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	uint32_t mask = cq->verbs_cq.cq.cqe;
+	__m256i n, off, own, owner, ok;
+	unsigned int valid;
+
+	n = _mm256_add_epi32(_mm256_set1_epi32(cq->cons_index), lane);
+	off = _mm256_and_si256(n, _mm256_set1_epi32(mask));
+	off = _mm256_add_epi32(_mm256_mullo_epi32(off,
+						  _mm256_set1_epi32(cq->cqe_sz)),
+			       _mm256_set1_epi32(cq->cqe_sz - 4));
+	own = _mm256_srli_epi32(
+		_mm256_i32gather_epi32((const int *)cq->active_buf->buf, off,
+				       1),
+		24);
+
+	/* the owner bit SW expects flips on every pass over the ring */
+	owner = _mm256_srl_epi32(n, _mm_cvtsi32_si128(__builtin_ctz(mask + 1)));
+	owner = _mm256_and_si256(_mm256_xor_si256(owner, own),
+				 _mm256_set1_epi32(MLX5_CQE_OWNER_MASK));
+	ok = _mm256_andnot_si256(
+		_mm256_cmpeq_epi32(_mm256_srli_epi32(own, 4),
+				   _mm256_set1_epi32(MLX5_CQE_INVALID)),
+		_mm256_cmpeq_epi32(owner, _mm256_setzero_si256()));
+
+	valid = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+	return __builtin_ctz(~valid);
+}
+#endif
+
+/*
+ * Returns how many CQEs from cons_index on are in SW ownership, up to
+ * MLX5_CQE_SCAN_BATCH. An empty CQ costs a single scalar check.
+ */
+static inline unsigned int scan_sw_cqes(struct mlx5_cq *cq)
+{
+	if (!next_cqe_sw(cq))
+		return 0;
+
+#ifdef MLX5_CQE_SCAN_AVX2
+	if (cq->flags & MLX5_CQ_FLAGS_SCAN_AVX2)
+		return scan_sw_cqes_avx2(cq);
+#endif
+
+	return scan_sw_cqes_scalar(cq);
+}
+
 static void update_cons_index(struct mlx5_cq *cq)
 {
 	cq->dbrec[MLX5_CQ_SET_CI] = htobe32(cq->cons_index & 0xffffff);
@@ -408,6 +482,87 @@ static void mlx5_get_cycles(uint64_t *cycles)
 }
 #endif
 
+enum mlx5_stall_result {
+	MLX5_STALL_EMPTY,	/* nothing found */
+	MLX5_STALL_PARTIAL,	/* found CQEs and drained the CQ */
+	MLX5_STALL_FULL,	/* the caller could have taken more */
+};
+
+/* 1/1024 fixed point, see struct mlx5dv_cq_stall_state */
+#define MLX5_STALL_RATIO_ONE 1024
+
+/*
+ * Learned mode: the stall after a poll that did not fill the caller's
+ * array is the completion inter-arrival time, scaled by half the ratio of
+ * polls that come back empty. A CQ that is mostly idle backs off towards
+ * the gap between its completions instead of hammering a cache line the
+ * HCA is about to write; a busy one goes back to polling right away.
+ */
+static inline void mlx5_stall_learn(struct mlx5_cq *cq,
+				    enum mlx5_stall_result res)
+{
+	uint64_t now = 0;
+	uint64_t stall;
+
+	mlx5_get_cycles(&now);
+
+	cq->stall_polls++;
+	if (res == MLX5_STALL_EMPTY) {
+		cq->stall_empty_polls++;
+		cq->stall_empty_ratio +=
+			(MLX5_STALL_RATIO_ONE - cq->stall_empty_ratio) >> 4;
+	} else {
+		cq->stall_empty_ratio -= cq->stall_empty_ratio >> 4;
+		if (cq->stall_last_comp && now > cq->stall_last_comp) {
+			uint64_t gap = now - cq->stall_last_comp;
+
+			cq->stall_gap = cq->stall_gap - (cq->stall_gap >> 3) +
+					(gap >> 3);
+		}
+		cq->stall_last_comp = now;
+	}
+
+	if (res == MLX5_STALL_FULL) {
+		cq->stall_cycles = mlx5_stall_cq_poll_min;
+		cq->stall_last_count = 0;
+		return;
+	}
+
+	stall = (cq->stall_gap * cq->stall_empty_ratio) /
+		(2 * MLX5_STALL_RATIO_ONE);
+	cq->stall_cycles = min_t(uint64_t,
+				 max_t(uint64_t, stall, mlx5_stall_cq_poll_min),
+				 mlx5_stall_cq_poll_max);
+	cq->stall_last_count = now;
+}
+
+static inline void mlx5_stall_adapt(struct mlx5_cq *cq,
+				    enum mlx5_stall_result res)
+{
+	if (cq->stall_learn) {
+		mlx5_stall_learn(cq, res);
+		return;
+	}
+
+	switch (res) {
+	case MLX5_STALL_EMPTY:
+		cq->stall_cycles = max(cq->stall_cycles - mlx5_stall_cq_dec_step,
+				       mlx5_stall_cq_poll_min);
+		mlx5_get_cycles(&cq->stall_last_count);
+		break;
+	case MLX5_STALL_PARTIAL:
+		cq->stall_cycles = min(cq->stall_cycles + mlx5_stall_cq_inc_step,
+				       mlx5_stall_cq_poll_max);
+		mlx5_get_cycles(&cq->stall_last_count);
+		break;
+	case MLX5_STALL_FULL:
+		cq->stall_cycles = max(cq->stall_cycles - mlx5_stall_cq_dec_step,
+				       mlx5_stall_cq_poll_min);
+		cq->stall_last_count = 0;
+		break;
+	}
+}
+
 static inline struct mlx5_qp *get_req_context(struct mlx5_context *mctx,
 					      struct mlx5_resource **cur_rsc,
 					      uint32_t rsn,
@@ -528,22 +683,26 @@ static inline int mlx5_get_next_cqe(struct mlx5_cq *cq,
 	void *cqe;
 	struct mlx5_cqe64 *cqe64;
 
-	cqe = next_cqe_sw(cq);
-	if (!cqe)
-		return CQ_EMPTY;
+	if (!cq->cqe_ready) {
+		cq->cqe_ready = scan_sw_cqes(cq);
+		if (!cq->cqe_ready)
+			return CQ_EMPTY;
 
+		/*
+		 * Make sure we read the contents of all scanned CQ entries
+		 * after we've checked their ownership bits.
+		 */
+		udma_from_device_barrier();
+	}
+
+	cqe = get_cqe(cq, cq->cons_index & cq->verbs_cq.cq.cqe);
 	cqe64 = (cq->cqe_sz == 64) ? cqe : cqe + 64;
 
+	--cq->cqe_ready;
 	++cq->cons_index;
 
 	VALGRIND_MAKE_MEM_DEFINED(cqe64, sizeof *cqe64);
 
-	/*
-	 * Make sure we read CQ entry contents after we've checked the
-	 * ownership bit.
-	 */
-	udma_from_device_barrier();
-
 #ifdef MLX5_DEBUG
 	{
 		struct mlx5_context *mctx = to_mctx(cq->verbs_cq.cq_ex.context);
@@ -997,7 +1156,7 @@ static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc,
 			  int cqe_ver)
 {
 	struct mlx5_cq *cq = to_mcq(ibcq);
-	struct mlx5_resource *rsc = NULL;
+	struct mlx5_resource *rsc;
 	struct mlx5_srq *srq = NULL;
 	int npolled;
 	int err = CQ_OK;
@@ -1013,39 +1172,38 @@ static inline int poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc,
 		}
 	}
 
+	if (unlikely(!list_empty(&cq->db_batch_qps)))
+		mlx5_cq_flush_db(cq);
+
 	mlx5_spin_lock(&cq->lock);
 
+	/* CQs fed by a single QP resolve it once, not once per poll */
+	rsc = cq->last_rsc;
 	for (npolled = 0; npolled < ne; ++npolled) {
 		err = mlx5_poll_one(cq, &rsc, &srq, wc + npolled, cqe_ver);
 		if (err != CQ_OK)
 			break;
 	}
 
+	/* only resources whose destroy cleans this CQ may stay cached */
+	if (rsc && (rsc->type == MLX5_RSC_TYPE_QP ||
+		    rsc->type == MLX5_RSC_TYPE_RWQ))
+		cq->last_rsc = rsc;
+	else
+		cq->last_rsc = NULL;
+
 	update_cons_index(cq);
 
 	mlx5_spin_unlock(&cq->lock);
 
 	if (cq->stall_enable) {
 		if (cq->stall_adaptive_enable) {
-			if (npolled == 0) {
-				cq->stall_cycles =
-					max(cq->stall_cycles -
-						    mlx5_stall_cq_dec_step,
-					    mlx5_stall_cq_poll_min);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else if (npolled < ne) {
-				cq->stall_cycles =
-					min(cq->stall_cycles +
-						    mlx5_stall_cq_inc_step,
-					    mlx5_stall_cq_poll_max);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else {
-				cq->stall_cycles =
-					max(cq->stall_cycles -
-						    mlx5_stall_cq_dec_step,
-					    mlx5_stall_cq_poll_min);
-				cq->stall_last_count = 0;
-			}
+			if (npolled == 0)
+				mlx5_stall_adapt(cq, MLX5_STALL_EMPTY);
+			else if (npolled < ne)
+				mlx5_stall_adapt(cq, MLX5_STALL_PARTIAL);
+			else
+				mlx5_stall_adapt(cq, MLX5_STALL_FULL);
 		} else if (err == CQ_EMPTY) {
 			cq->stall_next_poll = 1;
 		}
@@ -1074,26 +1232,12 @@ static inline void _mlx5_end_poll(struct ibv_cq_ex *ibcq, int lock,
 
 	if (stall) {
 		if (stall == POLLING_MODE_STALL_ADAPTIVE) {
-			if (!(cq->flags & MLX5_CQ_FLAGS_FOUND_CQES)) {
-				cq->stall_cycles =
-					max(cq->stall_cycles -
-						    mlx5_stall_cq_dec_step,
-					    mlx5_stall_cq_poll_min);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else if (cq->flags &
-				   MLX5_CQ_FLAGS_EMPTY_DURING_POLL) {
-				cq->stall_cycles =
-					min(cq->stall_cycles +
-						    mlx5_stall_cq_inc_step,
-					    mlx5_stall_cq_poll_max);
-				mlx5_get_cycles(&cq->stall_last_count);
-			} else {
-				cq->stall_cycles =
-					max(cq->stall_cycles -
-						    mlx5_stall_cq_dec_step,
-					    mlx5_stall_cq_poll_min);
-				cq->stall_last_count = 0;
-			}
+			if (!(cq->flags & MLX5_CQ_FLAGS_FOUND_CQES))
+				mlx5_stall_adapt(cq, MLX5_STALL_EMPTY);
+			else if (cq->flags & MLX5_CQ_FLAGS_EMPTY_DURING_POLL)
+				mlx5_stall_adapt(cq, MLX5_STALL_PARTIAL);
+			else
+				mlx5_stall_adapt(cq, MLX5_STALL_FULL);
 		} else if (!(cq->flags & MLX5_CQ_FLAGS_FOUND_CQES)) {
 			cq->stall_next_poll = 1;
 		}
@@ -1131,6 +1275,9 @@ static inline int mlx5_start_poll(struct ibv_cq_ex *ibcq,
 		}
 	}
 
+	if (unlikely(!list_empty(&cq->db_batch_qps)))
+		mlx5_cq_flush_db(cq);
+
 	if (lock)
 		mlx5_spin_lock(&cq->lock);
 
@@ -1144,11 +1291,7 @@ static inline int mlx5_start_poll(struct ibv_cq_ex *ibcq,
 
 		if (stall) {
 			if (stall == POLLING_MODE_STALL_ADAPTIVE) {
-				cq->stall_cycles =
-					max(cq->stall_cycles -
-						    mlx5_stall_cq_dec_step,
-					    mlx5_stall_cq_poll_min);
-				mlx5_get_cycles(&cq->stall_last_count);
+				mlx5_stall_adapt(cq, MLX5_STALL_EMPTY);
 			} else {
 				cq->stall_next_poll = 1;
 			}
@@ -1165,12 +1308,8 @@ static inline int mlx5_start_poll(struct ibv_cq_ex *ibcq,
 		mlx5_spin_unlock(&cq->lock);
 
 	if (stall && err == CQ_POLL_ERR) {
-		if (stall == POLLING_MODE_STALL_ADAPTIVE) {
-			cq->stall_cycles =
-				max(cq->stall_cycles - mlx5_stall_cq_dec_step,
-				    mlx5_stall_cq_poll_min);
-			cq->stall_last_count = 0;
-		}
+		if (stall == POLLING_MODE_STALL_ADAPTIVE)
+			mlx5_stall_adapt(cq, MLX5_STALL_FULL);
 
 		cq->flags &= ~(MLX5_CQ_FLAGS_FOUND_CQES);
 
@@ -1885,9 +2024,18 @@ void __mlx5_cq_clean(struct mlx5_cq *cq, uint32_t rsn, struct mlx5_srq *srq)
 	uint8_t owner_bit;
 	int cqe_version;
 
-	if (!cq || cq->flags & MLX5_CQ_FLAGS_DV_OWNED)
+	if (!cq)
+		return;
+
+	/* the resource being cleaned may be about to go away */
+	cq->last_rsc = NULL;
+
+	if (cq->flags & MLX5_CQ_FLAGS_DV_OWNED)
 		return;
 
+	/* entries below get moved, scan them again */
+	cq->cqe_ready = 0;
+
 	/*
 	 * First we need to find the current producer index, so we
 	 * know where to start cleaning from.  It doesn't matter if HW
@@ -1964,6 +2112,7 @@ void mlx5_cq_resize_copy_cqes(struct mlx5_context *mctx, struct mlx5_cq *cq)
 	ssize = cq->cqe_sz;
 	dsize = cq->resize_cqe_sz;
 
+	cq->cqe_ready = 0;
 	i = cq->cons_index;
 	scqe = get_buf_cqe(cq->active_buf, i & cq->active_cqes, ssize);
 	scqe64 = ssize == 64 ? scqe : scqe + 64;
@@ -2045,3 +2194,29 @@ int mlx5_free_cq_buf(struct mlx5_context *ctx, struct mlx5_buf *buf)
 {
 	return mlx5_free_actual_buf(ctx, buf);
 }
+
+int mlx5dv_cq_query_stall(struct ibv_cq *ibcq,
+			  struct mlx5dv_cq_stall_state *state)
+{
+	struct mlx5_cq *cq = to_mcq(ibcq);
+
+	if (state->comp_mask)
+		return EINVAL;
+
+	if (!cq->stall_enable)
+		state->mode = MLX5DV_CQ_STALL_NONE;
+	else if (!cq->stall_adaptive_enable)
+		state->mode = MLX5DV_CQ_STALL_LOOP;
+	else if (!cq->stall_learn)
+		state->mode = MLX5DV_CQ_STALL_ADAPTIVE;
+	else
+		state->mode = MLX5DV_CQ_STALL_LEARN;
+
+	state->stall_cycles = cq->stall_cycles;
+	state->empty_ratio = cq->stall_empty_ratio;
+	state->arrival_cycles = cq->stall_gap;
+	state->polls = cq->stall_polls;
+	state->empty_polls = cq->stall_empty_polls;
+
+	return 0;
+}
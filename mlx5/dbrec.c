@@ -35,6 +35,9 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "mlx5.h"
 
@@ -42,12 +45,62 @@ struct mlx5_db_page {
 	cl_map_item_t			cl_map;
 	struct list_node		available;
 	struct mlx5_buf			buf;
+	int				node;
 	int				num_db;
 	int				use_cnt;
 	unsigned long			free[0];
 };
 
-static struct mlx5_db_page *__add_page(struct mlx5_context *context)
+/* NUMA node of the calling thread, -1 when the kernel can't tell */
+static int dbr_node(void)
+{
+	unsigned int node;
+
+	if (syscall(SYS_getcpu, NULL, &node, NULL))
+		return -1;
+
+	return node;
+}
+
+/*
+ * Doorbell pages come straight from mmap() rather than the heap, so the
+ * first touch below happens on a never used page and the kernel places
+ * it on the node of the thread creating the resource.
+ */
+static int dbr_alloc_page(struct mlx5_buf *buf, int ps)
+{
+	void *addr;
+
+	addr = mmap(NULL, ps, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	if (ibv_dontfork_range(addr, ps)) {
+		munmap(addr, ps);
+		return -1;
+	}
+
+	memset(addr, 0, ps);
+	buf->buf = addr;
+	buf->length = ps;
+	buf->type = MLX5_ALLOC_TYPE_ANON;
+
+	return 0;
+}
+
+static void dbr_free_page(struct mlx5_context *context, struct mlx5_buf *buf)
+{
+	if (buf->type == MLX5_ALLOC_TYPE_EXTERNAL) {
+		mlx5_free_buf_extern(context, buf);
+		return;
+	}
+
+	ibv_dofork_range(buf->buf, buf->length);
+	munmap(buf->buf, buf->length);
+}
+
+static struct mlx5_db_page *__add_page(struct mlx5_context *context, int node)
 {
 	struct mlx5_db_page *page;
 	int ps = to_mdev(context->ibv_ctx.context.device)->page_size;
@@ -56,7 +109,7 @@ static struct mlx5_db_page *__add_page(struct mlx5_context *context)
 	int nlong;
 	int ret;
 
-	pp = ps / context->cache_line_size;
+	pp = ps / context->dbr_stride;
 	nlong = (pp + 8 * sizeof(long) - 1) / (8 * sizeof(long));
 
 	page = malloc(sizeof *page + nlong * sizeof(long));
@@ -66,12 +119,13 @@ static struct mlx5_db_page *__add_page(struct mlx5_context *context)
 	if (mlx5_is_extern_alloc(context))
 		ret = mlx5_alloc_buf_extern(context, &page->buf, ps);
 	else
-		ret = mlx5_alloc_buf(&page->buf, ps, ps);
+		ret = dbr_alloc_page(&page->buf, ps);
 	if (ret) {
 		free(page);
 		return NULL;
 	}
 
+	page->node = node;
 	page->num_db  = pp;
 	page->use_cnt = 0;
 	for (i = 0; i < nlong; ++i)
@@ -89,6 +143,7 @@ __be32 *mlx5_alloc_dbrec(struct mlx5_context *context, struct ibv_pd *pd,
 {
 	struct mlx5_db_page *page;
 	__be32 *db = NULL;
+	int node;
 	int i, j;
 
 	if (mlx5_is_custom_alloc(pd)) {
@@ -109,14 +164,19 @@ __be32 *mlx5_alloc_dbrec(struct mlx5_context *context, struct ibv_pd *pd,
 	}
 
 default_alloc:
+	/*
+	 * Hand out records from pages local to the creating thread, which is
+	 * usually the one ringing the doorbell and polling the CQ.
+	 */
+	node = dbr_node();
+
 	pthread_mutex_lock(&context->dbr_map_mutex);
 
-	page = list_top(&context->dbr_available_pages, struct mlx5_db_page,
-			available);
-	if (page)
-		goto found;
+	list_for_each(&context->dbr_available_pages, page, available)
+		if (page->node == node)
+			goto found;
 
-	page = __add_page(context);
+	page = __add_page(context, node);
 	if (!page)
 		goto out;
 
@@ -131,7 +191,7 @@ found:
 	j = ffsl(page->free[i]);
 	--j;
 	page->free[i] &= ~(1UL << j);
-	db = page->buf.buf + (i * 8 * sizeof(long) + j) * context->cache_line_size;
+	db = page->buf.buf + (i * 8 * sizeof(long) + j) * context->dbr_stride;
 
 out:
 	pthread_mutex_unlock(&context->dbr_map_mutex);
@@ -164,7 +224,7 @@ void mlx5_free_db(struct mlx5_context *context, __be32 *db, struct ibv_pd *pd,
 	assert(item != cl_qmap_end(&context->dbr_map));
 
 	page = (container_of(item, struct mlx5_db_page, cl_map));
-	i = ((void *) db - page->buf.buf) / context->cache_line_size;
+	i = ((void *) db - page->buf.buf) / context->dbr_stride;
 	page->free[i / (8 * sizeof(long))] |= 1UL << (i % (8 * sizeof(long)));
 	if (page->use_cnt == page->num_db)
 		list_add(&context->dbr_available_pages, &page->available);
@@ -172,12 +232,7 @@ void mlx5_free_db(struct mlx5_context *context, __be32 *db, struct ibv_pd *pd,
 	if (!--page->use_cnt) {
 		cl_qmap_remove_item(&context->dbr_map, item);
 		list_del(&page->available);
-
-		if (page->buf.type == MLX5_ALLOC_TYPE_EXTERNAL)
-			mlx5_free_buf_extern(context, &page->buf);
-		else
-			mlx5_free_buf(&page->buf);
-
+		dbr_free_page(context, &page->buf);
 		free(page);
 	}
 
@@ -41,6 +41,7 @@
 #include <pthread.h>
 #include <string.h>
 #include <sched.h>
+#include <dirent.h>
 #include <sys/param.h>
 
 #include <util/symver.h>
@@ -265,15 +266,22 @@ int32_t mlx5_store_uidx(struct mlx5_context *ctx, void *rsc)
 
 	tind = uidx >> MLX5_UIDX_TABLE_SHIFT;
 
-	if (!ctx->uidx_table[tind].refcnt) {
-		ctx->uidx_table[tind].table = calloc(MLX5_UIDX_TABLE_MASK + 1,
-						     sizeof(struct mlx5_resource *));
-		if (!ctx->uidx_table[tind].table)
+	if (!ctx->uidx_table[tind].table) {
+		struct mlx5_resource **table;
+
+		table = calloc(MLX5_UIDX_TABLE_MASK + 1,
+			       sizeof(struct mlx5_resource *));
+		if (!table)
 			goto out;
+
+		__atomic_store_n(&ctx->uidx_table[tind].table, table,
+				 __ATOMIC_RELEASE);
 	}
 
 	++ctx->uidx_table[tind].refcnt;
-	ctx->uidx_table[tind].table[uidx & MLX5_UIDX_TABLE_MASK] = rsc;
+	__atomic_store_n(&ctx->uidx_table[tind].table[uidx &
+						      MLX5_UIDX_TABLE_MASK],
+			 rsc, __ATOMIC_RELEASE);
 	ret = uidx;
 
 out:
@@ -287,10 +295,10 @@ void mlx5_clear_uidx(struct mlx5_context *ctx, uint32_t uidx)
 
 	pthread_mutex_lock(&ctx->uidx_table_mutex);
 
-	if (!--ctx->uidx_table[tind].refcnt)
-		free(ctx->uidx_table[tind].table);
-	else
-		ctx->uidx_table[tind].table[uidx & MLX5_UIDX_TABLE_MASK] = NULL;
+	--ctx->uidx_table[tind].refcnt;
+	__atomic_store_n(&ctx->uidx_table[tind].table[uidx &
+						      MLX5_UIDX_TABLE_MASK],
+			 NULL, __ATOMIC_RELEASE);
 
 	pthread_mutex_unlock(&ctx->uidx_table_mutex);
 }
@@ -511,6 +519,42 @@ static void mlx5_local_cpu_set(struct ibv_device *ibdev, struct mlx5_context *mc
 	} while (i < CPU_SETSIZE);
 }
 
+/*
+ * NUMA node of the device, taken as the node of the first CPU in its local
+ * CPU set (MLX5_LOCAL_CPUS or sysfs). Returns -1 when it can't be found.
+ */
+int mlx5_local_node(struct mlx5_context *mctx)
+{
+	struct ibv_device *ibdev = mctx->ibv_ctx.context.device;
+	char fname[MAXPATHLEN];
+	cpu_set_t dev_local_cpus;
+	struct dirent *dent;
+	int node = -1;
+	DIR *dir;
+	int cpu;
+
+	CPU_ZERO(&dev_local_cpus);
+	mlx5_local_cpu_set(ibdev, mctx, &dev_local_cpus);
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &dev_local_cpus))
+			break;
+	if (cpu == CPU_SETSIZE)
+		return -1;
+
+	snprintf(fname, MAXPATHLEN, "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(fname);
+	if (!dir)
+		return -1;
+
+	while ((dent = readdir(dir)))
+		if (sscanf(dent->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+
+	return node;
+}
+
 static int mlx5_enable_sandy_bridge_fix(struct ibv_device *ibdev, struct mlx5_context *mctx)
 {
 	cpu_set_t my_cpus, dev_local_cpus, result_set;
@@ -585,10 +629,16 @@ static void mlx5_read_env(struct ibv_device *ibdev, struct mlx5_context *ctx)
 	if (env_value)
 		mlx5_stall_cq_dec_step = atoi(env_value);
 
+	/* asking for a learned stall turns stalling on */
+	env_value = getenv("MLX5_STALL_CQ_LEARN");
+	ctx->stall_learn = env_value && strcmp(env_value, "0");
+	if (ctx->stall_learn)
+		ctx->stall_enable = 1;
+
 	ctx->stall_adaptive_enable = 0;
 	ctx->stall_cycles = 0;
 
-	if (mlx5_stall_num_loop < 0) {
+	if (mlx5_stall_num_loop < 0 || ctx->stall_learn) {
 		ctx->stall_adaptive_enable = 1;
 		ctx->stall_cycles = mlx5_stall_cq_poll_min;
 	}
@@ -686,6 +736,45 @@ static int get_shut_up_bf(void)
 	return strcmp(env, "0") ? 1 : 0;
 }
 
+/*
+ * Pick the widest store the CPU has for BlueFlame copies, so a 64 byte
+ * WQE block reaches the write-combining buffer in one or two stores.
+ * MLX5_BF_COPY_WIDE=0 keeps the 16 byte mmio_memcpy_x64() path.
+ */
+static int get_bf_copy(void)
+{
+	char *env;
+
+	env = getenv("MLX5_BF_COPY_WIDE");
+	if (env && !strcmp(env, "0"))
+		return MLX5_BF_COPY_SCALAR;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return MLX5_BF_COPY_AVX512;
+	if (__builtin_cpu_supports("avx"))
+		return MLX5_BF_COPY_AVX;
+#endif
+	return MLX5_BF_COPY_SCALAR;
+}
+
+/*
+ * Every doorbell record has a cache line of its own. MLX5_DBR_ISOLATE=1
+ * spaces them two lines apart so the adjacent-line prefetcher doesn't
+ * pull a record of an unrelated QP or CQ along with it.
+ */
+static int get_dbr_stride(int cache_line_size)
+{
+	char *env;
+
+	env = getenv("MLX5_DBR_ISOLATE");
+	if (env && strcmp(env, "0"))
+		return 2 * cache_line_size;
+
+	return cache_line_size;
+}
+
 static int get_num_low_lat_uuars(int tot_uuars)
 {
 	char *env;
@@ -1044,6 +1133,7 @@ static int mlx5dv_get_cq(struct ibv_cq *cq_in,
 	cq_out->cq_uar	  = mctx->cq_uar_reg;
 
 	mcq->flags	 |= MLX5_CQ_FLAGS_DV_OWNED;
+	mcq->cqe_ready	  = 0;
 
 	return 0;
 }
@@ -2455,9 +2545,11 @@ static int mlx5_set_context(struct mlx5_context *context,
 	cl_qmap_init(&context->dbr_map);
 
 	pthread_mutex_init(&context->dbr_map_mutex, NULL);
+	context->dbr_stride = get_dbr_stride(context->cache_line_size);
 
 	context->prefer_bf = get_always_bf();
 	context->shut_up_bf = get_shut_up_bf();
+	context->bf_copy = get_bf_copy();
 
 	if (resp->tot_bfregs) {
 		if (is_import) {
@@ -2527,6 +2619,7 @@ bf_done:
 
 	mlx5_spinlock_init(&context->hugetlb_lock, !mlx5_single_threaded);
 	list_head_init(&context->hugetlb_list);
+	context->hugetlb_node = -2;
 
 	verbs_set_ops(v_ctx, &mlx5_ctx_common_ops);
 	if (context->cqe_version) {
@@ -2663,6 +2756,24 @@ err:
 	return NULL;
 }
 
+/*
+ * The lookup tables are read without locks, so their second levels are
+ * kept once allocated and only released here.
+ */
+static void mlx5_free_rsc_tables(struct mlx5_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < MLX5_QP_TABLE_SIZE; ++i)
+		free(ctx->qp_table[i].table);
+
+	for (i = 0; i < MLX5_SRQ_TABLE_SIZE; ++i)
+		free(ctx->srq_table[i].table);
+
+	for (i = 0; i < MLX5_UIDX_TABLE_SIZE; ++i)
+		free(ctx->uidx_table[i].table);
+}
+
 static void mlx5_free_context(struct ibv_context *ibctx)
 {
 	struct mlx5_context *context = to_mctx(ibctx);
@@ -2679,9 +2790,11 @@ static void mlx5_free_context(struct ibv_context *ibctx)
 		       page_size);
 	if (context->clock_info_page)
 		munmap((void *)context->clock_info_page, page_size);
+	mlx5_free_huge_cache(context);
 	mlx5_close_debug_file(context->dbg_fp);
 	clean_dyn_uars(ibctx);
 	reserved_qpn_blks_free(context);
+	mlx5_free_rsc_tables(context);
 
 	verbs_uninit_context(&context->ibv_ctx);
 	free(context);
@@ -156,6 +156,9 @@ enum {
 
 enum { MLX5_BF_OFFSET = 0x800 };
 
+/* Reused hugetlb regions are kept per size, one class per 32K chunk count */
+enum { MLX5_HUGETLB_CLASSES = 64 };
+
 enum {
 	MLX5_TM_OPCODE_NOP = 0x00,
 	MLX5_TM_OPCODE_APPEND = 0x01,
@@ -308,6 +311,12 @@ struct mlx5_dma_mmo_caps {
 	uint64_t dma_max_size;
 };
 
+enum mlx5_bf_copy_mode {
+	MLX5_BF_COPY_SCALAR,
+	MLX5_BF_COPY_AVX,
+	MLX5_BF_COPY_AVX512,
+};
+
 struct mlx5_context {
 	struct verbs_context ibv_ctx;
 	int max_num_qps;
@@ -319,6 +328,7 @@ struct mlx5_context {
 	int num_bf_regs;
 	int prefer_bf;
 	int shut_up_bf;
+	int bf_copy;		/* enum mlx5_bf_copy_mode */
 	struct {
 		struct mlx5_qp **table;
 		int refcnt;
@@ -347,6 +357,7 @@ struct mlx5_context {
 	struct list_head dbr_available_pages;
 	cl_qmap_t dbr_map;
 	pthread_mutex_t dbr_map_mutex;
+	int dbr_stride;
 	int cache_line_size;
 	int max_sq_desc_sz;
 	int max_rq_desc_sz;
@@ -357,11 +368,17 @@ struct mlx5_context {
 	int stall_enable;
 	int stall_adaptive_enable;
 	int stall_cycles;
+	int stall_learn;
 	struct mlx5_bf *bfs;
 	FILE *dbg_fp;
 	char hostname[40];
 	struct mlx5_spinlock hugetlb_lock;
 	struct list_head hugetlb_list;
+	struct mlx5_hugetlb_free *hugetlb_free[MLX5_HUGETLB_CLASSES];
+	int hugetlb_cached;
+	int hugetlb_node;
+	bool hugetlb_unavail;	/* shmget() can never give us hugepages */
+	time_t hugetlb_retry;	/* no shmget() before this after a failure */
 	int cqe_version;
 	uint8_t cached_link_layer[MLX5_MAX_PORTS_NUM];
 	uint8_t cached_port_flags[MLX5_MAX_PORTS_NUM];
@@ -419,6 +436,12 @@ struct mlx5_context {
 	pthread_mutex_t crypto_login_mutex;
 };
 
+/* Freed hugetlb region kept for reuse, stored in the region itself */
+struct mlx5_hugetlb_free {
+	struct mlx5_hugetlb_free *next;
+	struct mlx5_hugetlb_mem *hmem;
+};
+
 struct mlx5_hugetlb_mem {
 	int shmid;
 	void *shmaddr;
@@ -480,6 +503,7 @@ enum {
 	MLX5_CQ_FLAGS_DV_OWNED = 1 << 5,
 	MLX5_CQ_FLAGS_TM_SYNC_REQ = 1 << 6,
 	MLX5_CQ_FLAGS_RAW_WQE = 1 << 7,
+	MLX5_CQ_FLAGS_SCAN_AVX2 = 1 << 8,
 };
 
 struct mlx5_cq {
@@ -503,13 +527,27 @@ struct mlx5_cq {
 	uint64_t stall_last_count;
 	int stall_adaptive_enable;
 	int stall_cycles;
+	/* learned stall, see mlx5_stall_learn() */
+	int stall_learn;
+	uint32_t stall_empty_ratio;
+	uint64_t stall_gap;
+	uint64_t stall_last_comp;
+	uint64_t stall_polls;
+	uint64_t stall_empty_polls;
 	struct mlx5_resource *cur_rsc;
 	struct mlx5_srq *cur_srq;
 	struct mlx5_cqe64 *cqe64;
+	/* CQEs from cons_index on already seen in SW ownership */
+	uint32_t cqe_ready;
+	/* resource of the last CQE ibv_poll_cq() saw, dropped on cq_clean */
+	struct mlx5_resource *last_rsc;
 	uint32_t flags;
 	int cached_opcode;
 	struct mlx5dv_clock_info last_clock_info;
 	struct ibv_pd *parent_domain;
+	/* QPs with a deferred doorbell sending to this CQ */
+	struct list_head db_batch_qps;
+	struct mlx5_spinlock db_batch_lock;
 };
 
 struct mlx5_tag_entry {
@@ -705,6 +743,29 @@ struct mlx5_qp {
 	uint32_t get_ece;
 
 	uint8_t need_mmo_enable : 1;
+
+	/* Deferred doorbell, see mlx5dv_qp_set_db_batch() */
+	uint32_t db_batch_max; /* 0: ring on every post */
+	uint32_t db_batch_nreq; /* WRs built but not rung yet */
+	uint64_t db_batch_delay_ns;
+	uint64_t db_batch_start_ns; /* when the oldest pending WR was built */
+	void *db_batch_ctrl; /* ctrl segment of the last pending WQE */
+	struct list_node db_batch_entry;
+};
+
+struct mlx5dv_wqe_tmpl {
+	struct mlx5_qp *qp;
+	struct mlx5dv_wqe_tmpl_attr attr;
+	uint32_t mlx5_opcode;
+	uint8_t size; /* WQE size in 16 byte units */
+	uint8_t bbs; /* send WQE basic blocks per post */
+	uint8_t image_size; /* bytes of image, the inline payload excluded */
+	uint8_t raddr_off; /* 0: no remote address segment */
+	uint8_t data_off; /* data segment, or inline payload when inl */
+	bool inl;
+	bool sched; /* large enough to go through MT-RDMA scheduling */
+	/* ctrl, raddr and data segments, with the varying fields left 0 */
+	uint8_t image[3 * 16] __attribute__((aligned(16)));
 };
 
 struct mlx5_ah {
@@ -1075,6 +1136,7 @@ static inline struct mlx5_flow *to_mflow(struct ibv_flow *flow_id)
 
 bool is_mlx5_vfio_dev(struct ibv_device *device);
 
+int mlx5_local_node(struct mlx5_context *mctx);
 void mlx5_open_debug_file(FILE **dbg_fp);
 void mlx5_close_debug_file(FILE *dbg_fp);
 void mlx5_set_debug_mask(void);
@@ -1084,6 +1146,7 @@ void mlx5_free_buf(struct mlx5_buf *buf);
 int mlx5_alloc_buf_contig(struct mlx5_context *mctx, struct mlx5_buf *buf,
 			  size_t size, int page_size, const char *component);
 void mlx5_free_buf_contig(struct mlx5_context *mctx, struct mlx5_buf *buf);
+void mlx5_free_huge_cache(struct mlx5_context *mctx);
 int mlx5_alloc_prefered_buf(struct mlx5_context *mctx, struct mlx5_buf *buf,
 			    size_t size, int page_size,
 			    enum mlx5_alloc_type alloc_type,
@@ -1221,6 +1284,8 @@ int mlx5_detach_mcast(struct ibv_qp *qp, const union ibv_gid *gid,
 		      uint16_t lid);
 void *mlx5_get_atomic_laddr(struct mlx5_qp *qp, uint16_t idx, int *byte_count);
 void *mlx5_get_send_wqe(struct mlx5_qp *qp, int n);
+void mlx5_cq_flush_db(struct mlx5_cq *cq);
+void mlx5_qp_db_batch_detach(struct mlx5_qp *qp);
 int mlx5_copy_to_recv_wqe(struct mlx5_qp *qp, int idx, void *buf, int size);
 int mlx5_copy_to_send_wqe(struct mlx5_qp *qp, int idx, void *buf, int size);
 int mlx5_copy_to_recv_srq(struct mlx5_srq *srq, int idx, void *buf, int size);
@@ -1302,12 +1367,16 @@ int mlx5_query_ece(struct ibv_qp *qp, struct ibv_ece *ece);
 struct mlx5_psv *mlx5_create_psv(struct ibv_pd *pd);
 int mlx5_destroy_psv(struct mlx5_psv *psv);
 
+/* Lock-free lookup, see mlx5_find_qp() */
 static inline void *mlx5_find_uidx(struct mlx5_context *ctx, uint32_t uidx)
 {
 	int tind = uidx >> MLX5_UIDX_TABLE_SHIFT;
+	struct mlx5_resource **table;
 
-	if (likely(ctx->uidx_table[tind].refcnt))
-		return ctx->uidx_table[tind].table[uidx & MLX5_UIDX_TABLE_MASK];
+	table = __atomic_load_n(&ctx->uidx_table[tind].table, __ATOMIC_ACQUIRE);
+	if (likely(table))
+		return __atomic_load_n(&table[uidx & MLX5_UIDX_TABLE_MASK],
+				       __ATOMIC_ACQUIRE);
 
 	return NULL;
 }
@@ -620,6 +620,75 @@ static inline int mlx5dv_mkey_check(struct mlx5dv_mkey *mkey,
 
 int mlx5dv_qp_cancel_posted_send_wrs(struct mlx5dv_qp_ex *mqp, uint64_t wr_id);
 
+struct mlx5dv_wqe_tmpl;
+
+struct mlx5dv_wqe_tmpl_attr {
+	uint64_t comp_mask; /* must be 0 */
+	enum ibv_wr_opcode opcode;
+	unsigned int send_flags; /* IBV_SEND_SIGNALED, _SOLICITED, _FENCE, _INLINE */
+	uint32_t lkey;
+	uint32_t rkey;
+	uint32_t length;
+	__be32 imm_data;
+};
+
+/* The fields that may change between two posts of one template */
+struct mlx5dv_wqe_tmpl_wr {
+	uint64_t wr_id;
+	uint64_t laddr;
+	uint64_t raddr;
+};
+
+struct mlx5dv_wqe_tmpl *
+mlx5dv_wqe_tmpl_create(struct ibv_qp *qp,
+		       const struct mlx5dv_wqe_tmpl_attr *attr);
+int mlx5dv_wqe_tmpl_destroy(struct mlx5dv_wqe_tmpl *tmpl);
+int mlx5dv_wqe_tmpl_post(struct mlx5dv_wqe_tmpl *tmpl,
+			 const struct mlx5dv_wqe_tmpl_wr *wr, uint32_t num);
+
+struct mlx5dv_qp_db_batch_attr {
+	uint64_t comp_mask;
+	uint32_t max_wrs;
+	uint32_t max_delay_ns;
+};
+
+int mlx5dv_qp_set_db_batch(struct ibv_qp *qp,
+			   const struct mlx5dv_qp_db_batch_attr *attr);
+int mlx5dv_qp_flush_db(struct ibv_qp *qp);
+
+enum mlx5dv_cq_stall_mode {
+	MLX5DV_CQ_STALL_NONE,
+	MLX5DV_CQ_STALL_LOOP,
+	MLX5DV_CQ_STALL_ADAPTIVE,
+	MLX5DV_CQ_STALL_LEARN,
+};
+
+struct mlx5dv_cq_stall_state {
+	uint64_t comp_mask;
+	enum mlx5dv_cq_stall_mode mode;
+	uint32_t stall_cycles;
+	/* The fields below are only maintained in MLX5DV_CQ_STALL_LEARN */
+	uint32_t empty_ratio; /* EWMA of empty polls, 1024 == all empty */
+	uint64_t arrival_cycles; /* EWMA of the gap between completions */
+	uint64_t polls;
+	uint64_t empty_polls;
+};
+
+int mlx5dv_cq_query_stall(struct ibv_cq *cq,
+			  struct mlx5dv_cq_stall_state *state);
+
+struct mlx5dv_srq_pool {
+	uint64_t comp_mask;
+	uint64_t addr;
+	uint32_t stride;
+	uint32_t length;
+	uint32_t lkey;
+};
+
+int mlx5dv_srq_post_pool(struct ibv_srq *srq,
+			 const struct mlx5dv_srq_pool *pool,
+			 const uint32_t *bufs, uint32_t num);
+
 static inline void mlx5dv_wr_raw_wqe(struct mlx5dv_qp_ex *mqp, const void *wqe)
 {
 	mqp->wr_raw_wqe(mqp, wqe);
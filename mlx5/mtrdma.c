@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 
 #include "mtrdma.h"
+#include "mtrdma_trace.h"
 #include "mlx5.h"
 #include "khash.h"
 
@@ -291,6 +292,7 @@ void load_mtrdma_config()
 	use_mtrdma = 1;
 
 	atexit(mtrdma_destroy_qp);
+	mtrdma_trace_open();
 
 	qp_hash = kh_init(qph);
 	cq_hash = kh_init(cqh);
@@ -647,8 +649,8 @@ void update_tenant_ctx()
 	pthread_cond_init(&(tenant_ctx.poll_cond), NULL);
 }
 
-int mtrdma_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc,
-		   int cqe_ver)
+static int __mtrdma_poll_cq(struct ibv_cq *cq, uint32_t ne,
+			    struct ibv_wc *wc, int cqe_ver)
 {
 	uint32_t cq_idx = kh_value(cq_hash, kh_get(cqh, cq_hash, cq->handle));
 
@@ -699,3 +701,14 @@ int mtrdma_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc,
   return  ret;
   */
 }
+
+int mtrdma_poll_cq(struct ibv_cq *cq, uint32_t ne, struct ibv_wc *wc,
+		   int cqe_ver)
+{
+	int ret = __mtrdma_poll_cq(cq, ne, wc, cqe_ver);
+
+	if (mtrdma_trace)
+		mtrdma_trace_comp(mtrdma_trace, wc, ret);
+
+	return ret;
+}
@@ -50,6 +50,7 @@
 #define TENANT_SQ_CHECK_WINDOW 1000000 //us
 
 #define MTRDMA_LARGE_WR 4096
+#define MTRDMA_BYPASS_WR 1024 // WRs up to this size skip MT-RDMA scheduling
 
 // mtrdma global functions
 int mtrdma_get_sq_num(struct ibv_qp *ibqp);
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mtrdma.h"
+#include "mtrdma_trace.h"
+
+struct mtrdma_trace_hdr *mtrdma_trace = NULL;
+static size_t mtrdma_trace_len;
+
+/* PERF_TRACE=<prefix> writes <prefix>.<pid>, same knobs as PeRF */
+void mtrdma_trace_open(void)
+{
+	char *env = getenv("PERF_TRACE");
+	char *rec_env = getenv("PERF_TRACE_RECORDS");
+	uint64_t records = MTRDMA_TRACE_RECORDS;
+	struct mtrdma_trace_hdr *hdr;
+	char path[4096];
+	uint64_t cap = 1;
+	int fd;
+
+	if (!env || mtrdma_trace)
+		return;
+
+	if (rec_env) {
+		long long val = strtoll(rec_env, NULL, 0);
+
+		if (val <= 0)
+			LOG_ERROR("Ignoring PERF_TRACE_RECORDS=%s, using %lu records\n",
+				  rec_env, records);
+		else
+			records = val < MTRDMA_TRACE_MAX_RECORDS ?
+				  val : MTRDMA_TRACE_MAX_RECORDS;
+	}
+	while (cap < records)
+		cap <<= 1;
+
+	snprintf(path, sizeof(path), "%s.%d", env, getpid());
+	mtrdma_trace_len = MTRDMA_TRACE_DATA_OFFSET +
+			   cap * sizeof(struct mtrdma_trace_rec);
+
+	fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, mtrdma_trace_len) == -1) {
+		LOG_ERROR("Cannot create trace file %s: %s\n", path,
+			  strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+
+	/* prefault the whole ring so the post path never takes a page fault */
+	hdr = mmap(NULL, mtrdma_trace_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		LOG_ERROR("Error mapping trace file %s\n", path);
+		return;
+	}
+
+	hdr->version = MTRDMA_TRACE_VERSION;
+	hdr->rec_size = sizeof(struct mtrdma_trace_rec);
+	hdr->sched = MTRDMA_TRACE_SCHED;
+	hdr->pid = getpid();
+	hdr->mask = cap - 1;
+	hdr->tick_hz = 0;
+	hdr->start_ns = mtrdma_trace_ns();
+	hdr->start_tick = mtrdma_trace_tick();
+	if (MTRDMA_TRACE_TSC) {
+		/* calibrate the TSC against CLOCK_MONOTONIC over ~10ms */
+		struct timespec wait = { 0, 10000000 };
+		uint64_t ns, tick;
+
+		nanosleep(&wait, NULL);
+		ns = mtrdma_trace_ns();
+		tick = mtrdma_trace_tick();
+		hdr->tick_hz = (tick - hdr->start_tick) * 1000000000.0 /
+			       (ns - hdr->start_ns);
+	}
+	atomic_init(&hdr->head, 0);
+	atomic_thread_fence(memory_order_release);
+	hdr->magic = MTRDMA_TRACE_MAGIC;
+
+	mtrdma_trace = hdr;
+	atexit(mtrdma_trace_close);
+	LOG_INFO("MT-RDMA trace: %s, %lu records\n", path, cap);
+}
+
+/* other threads may still be posting, so the ring stays mapped until exit */
+void mtrdma_trace_close(void)
+{
+	struct mtrdma_trace_hdr *hdr = mtrdma_trace;
+
+	if (!hdr)
+		return;
+
+	mtrdma_trace = NULL;
+	msync(hdr, mtrdma_trace_len, MS_ASYNC);
+}
@@ -0,0 +1,167 @@
+#ifndef MTRDMA_TRACE_H
+#define MTRDMA_TRACE_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*
+ * WR trace: one memory-mapped ring file per tenant process, replayed offline
+ * by perf_replay. The file layout is the one of libmlx5's perf_trace.h, keep
+ * both in sync.
+ */
+
+#define MTRDMA_TRACE_MAGIC 0x43525450 /* "PTRC" */
+#define MTRDMA_TRACE_VERSION 1
+#define MTRDMA_TRACE_RECORDS (1 << 20) /* default, PERF_TRACE_RECORDS */
+#define MTRDMA_TRACE_MAX_RECORDS (1 << 28) /* PERF_TRACE_RECORDS is clamped to this */
+
+#define MTRDMA_TRACE_POST 1
+#define MTRDMA_TRACE_COMP 2
+
+#define MTRDMA_TRACE_SIGNALED 0x1
+
+#define MTRDMA_TRACE_SCHED 2 /* PERF_TRACE_SCHED_MTRDMA */
+
+struct mtrdma_trace_rec {
+	uint64_t ts; /* mtrdma_trace_tick(), see mtrdma_trace_hdr */
+	uint64_t wr_id;
+	uint32_t qp_num;
+	uint32_t bytes; /* sum of the SGEs on POST, byte_len on COMP */
+	uint8_t type; /* MTRDMA_TRACE_POST / MTRDMA_TRACE_COMP */
+	uint8_t opcode; /* ibv_wr_opcode on POST, ibv_wc_opcode on COMP */
+	uint8_t num_sge;
+	uint8_t flags; /* MTRDMA_TRACE_SIGNALED */
+	uint32_t status; /* ibv_wc_status on COMP */
+};
+
+struct mtrdma_trace_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rec_size;
+	uint32_t sched;
+	int32_t pid;
+	uint64_t mask; /* records - 1 */
+
+	/*
+	 * ts to CLOCK_MONOTONIC ns: start_ns + (ts - start_tick) * 1e9 / tick_hz,
+	 * tick_hz == 0 means ts already is CLOCK_MONOTONIC ns
+	 */
+	uint64_t start_ns;
+	uint64_t start_tick;
+	uint64_t tick_hz;
+
+	/* records written so far, the ring holds the last mask + 1 of them */
+	_Alignas(64) atomic_uint_fast64_t head;
+};
+
+#define MTRDMA_TRACE_DATA_OFFSET \
+	((sizeof(struct mtrdma_trace_hdr) + 63) & ~63UL)
+
+extern struct mtrdma_trace_hdr *mtrdma_trace;
+
+void mtrdma_trace_open(void);
+void mtrdma_trace_close(void);
+
+static inline struct mtrdma_trace_rec *
+mtrdma_trace_slot(struct mtrdma_trace_hdr *hdr)
+{
+	uint64_t pos = atomic_fetch_add_explicit(&hdr->head, 1,
+						 memory_order_relaxed);
+
+	return (struct mtrdma_trace_rec *)((char *)hdr +
+					   MTRDMA_TRACE_DATA_OFFSET) +
+	       (pos & hdr->mask);
+}
+
+static inline uint64_t mtrdma_trace_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MTRDMA_TRACE_TSC 1
+static inline uint64_t mtrdma_trace_tick(void)
+{
+	uint32_t low, high;
+
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+#else
+#define MTRDMA_TRACE_TSC 0
+static inline uint64_t mtrdma_trace_tick(void)
+{
+	return mtrdma_trace_ns();
+}
+#endif
+
+static inline void mtrdma_trace_post_one(struct mtrdma_trace_hdr *hdr,
+					 uint64_t now, uint32_t qp_num,
+					 uint64_t wr_id, uint32_t bytes,
+					 uint8_t opcode, uint8_t num_sge,
+					 bool signaled)
+{
+	struct mtrdma_trace_rec *rec = mtrdma_trace_slot(hdr);
+
+	rec->ts = now;
+	rec->wr_id = wr_id;
+	rec->qp_num = qp_num;
+	rec->bytes = bytes;
+	rec->type = MTRDMA_TRACE_POST;
+	rec->opcode = opcode;
+	rec->num_sge = num_sge;
+	rec->flags = signaled ? MTRDMA_TRACE_SIGNALED : 0;
+	rec->status = 0;
+}
+
+/* callers check mtrdma_trace first, a disabled tracer costs one branch */
+static inline void mtrdma_trace_post(struct mtrdma_trace_hdr *hdr,
+				     uint32_t qp_num, int sig_all,
+				     struct ibv_send_wr *wr)
+{
+	uint64_t now = mtrdma_trace_tick();
+
+	for (; wr; wr = wr->next) {
+		uint32_t bytes = 0;
+
+		for (int i = 0; i < wr->num_sge; i++)
+			bytes += wr->sg_list[i].length;
+
+		mtrdma_trace_post_one(hdr, now, qp_num, wr->wr_id, bytes,
+				      wr->opcode, wr->num_sge,
+				      sig_all ||
+					      (wr->send_flags & IBV_SEND_SIGNALED));
+	}
+}
+
+static inline void mtrdma_trace_comp(struct mtrdma_trace_hdr *hdr,
+				     struct ibv_wc *wc, int ne)
+{
+	uint64_t now;
+
+	if (ne <= 0)
+		return;
+
+	now = mtrdma_trace_tick();
+	for (int i = 0; i < ne; i++) {
+		struct mtrdma_trace_rec *rec = mtrdma_trace_slot(hdr);
+
+		rec->ts = now;
+		rec->wr_id = wc[i].wr_id;
+		rec->qp_num = wc[i].qp_num;
+		rec->bytes = wc[i].byte_len;
+		rec->type = MTRDMA_TRACE_COMP;
+		rec->opcode = wc[i].opcode;
+		rec->num_sge = 0;
+		rec->flags = 0;
+		rec->status = wc[i].status;
+	}
+}
+
+#endif
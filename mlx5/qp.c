@@ -39,12 +39,16 @@
 #include <stdio.h>
 #include <util/mmio.h>
 #include <util/compiler.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #include "mlx5.h"
 #include "mlx5_ifc.h"
 #include "wqe.h"
 #include <unistd.h>
 #include "mtrdma.h"
+#include "mtrdma_trace.h"
 
 #include <infiniband/verbs.h>
 
@@ -293,22 +297,74 @@ static void set_data_ptr_seg_end(struct mlx5_wqe_data_seg *dseg)
 	dseg->addr = 0;
 }
 
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * Wide-store variants of the BlueFlame copy. WQE basic blocks and the
+ * BlueFlame register are both 64 byte aligned, so aligned loads and
+ * stores are safe. A whole block goes out in one AVX-512 store or two
+ * AVX stores, in ascending address order like mmio_memcpy_x64().
+ */
+__attribute__((target("avx512f")))
+static void bf_copy_avx512(uint64_t *dst, const uint64_t *src,
+			   unsigned bytecnt)
+{
+	for (; bytecnt; bytecnt -= 64, dst += 8, src += 8)
+		_mm512_store_si512((void *)dst,
+				   _mm512_load_si512((const void *)src));
+}
+
+__attribute__((target("avx")))
+static void bf_copy_avx(uint64_t *dst, const uint64_t *src, unsigned bytecnt)
+{
+	__m256i lo, hi;
+
+	for (; bytecnt; bytecnt -= 64, dst += 8, src += 8) {
+		lo = _mm256_load_si256((const __m256i *)src);
+		hi = _mm256_load_si256((const __m256i *)(src + 4));
+		_mm256_store_si256((__m256i *)dst, lo);
+		_mm256_store_si256((__m256i *)(dst + 4), hi);
+	}
+}
+#endif
+
+/* Copy bytecnt (a multiple of 64) contiguous bytes to the BlueFlame page */
+static inline void bf_copy_run(int mode, uint64_t *dst, const uint64_t *src,
+			       unsigned bytecnt)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	switch (mode) {
+	case MLX5_BF_COPY_AVX512:
+		bf_copy_avx512(dst, src, bytecnt);
+		return;
+	case MLX5_BF_COPY_AVX:
+		bf_copy_avx(dst, src, bytecnt);
+		return;
+	}
+#endif
+	for (; bytecnt; bytecnt -= 64, dst += 8, src += 8)
+		mmio_memcpy_x64(dst, src, 64);
+}
+
 /*
  * Avoid using memcpy() to copy to BlueFlame page, since memcpy()
  * implementations may use move-string-buffer assembler instructions,
  * which do not guarantee order of copying.
+ *
+ * The WQE wraps at most once, so split it at qend up front instead of
+ * checking every block; the common non-wrapping WQE is a single run.
  */
 static void mlx5_bf_copy(uint64_t *dst, const uint64_t *src, unsigned bytecnt,
-			 struct mlx5_qp *qp)
+			 struct mlx5_qp *qp, int mode)
 {
-	do {
-		mmio_memcpy_x64(dst, src, 64);
-		bytecnt -= 64;
-		dst += 8;
-		src += 8;
-		if (unlikely(src == qp->sq.qend))
-			src = qp->sq_start;
-	} while (bytecnt > 0);
+	unsigned first = qp->sq.qend - (void *)src;
+
+	if (likely(bytecnt <= first)) {
+		bf_copy_run(mode, dst, src, bytecnt);
+		return;
+	}
+
+	bf_copy_run(mode, dst, src, first);
+	bf_copy_run(mode, dst + first / 8, qp->sq_start, bytecnt - first);
 }
 
 static __be32 send_ieth(struct ibv_send_wr *wr)
@@ -759,16 +815,11 @@ static inline int mlx5_post_send_underlay(struct mlx5_qp *qp,
 	return 0;
 }
 
-static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
+static inline void ring_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
 				int nreq, int inl, int size, void *ctrl)
 {
 	struct mlx5_context *ctx;
 
-	if (unlikely(!nreq))
-		return;
-
-	qp->sq.head += nreq;
-
 	/*
 	 * Make sure that descriptors are written before
 	 * updating doorbell record and ringing the doorbell
@@ -788,7 +839,7 @@ static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
 	if (!ctx->shut_up_bf && nreq == 1 && bf->uuarn &&
 	    (inl || ctx->prefer_bf) && size > 1 && size <= bf->buf_size / 16)
 		mlx5_bf_copy(bf->reg + bf->offset, ctrl, align(size * 16, 64),
-			     qp);
+			     qp, ctx->bf_copy);
 	else
 		mmio_write64_be(bf->reg + bf->offset, *(__be64 *)ctrl);
 
@@ -808,6 +859,71 @@ static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
 		mlx5_spin_unlock(&bf->lock);
 }
 
+static inline uint64_t db_batch_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns true when the deferred batch, including the nreq WRs just built,
+ * has to be rung now.
+ */
+static inline bool db_batch_due(struct mlx5_qp *qp, int nreq, void *ctrl)
+{
+	uint64_t now;
+
+	qp->db_batch_ctrl = ctrl;
+	qp->db_batch_nreq += nreq;
+	if (qp->db_batch_nreq >= qp->db_batch_max)
+		return true;
+
+	if (!qp->db_batch_delay_ns)
+		return false;
+
+	now = db_batch_now_ns();
+	if (qp->db_batch_nreq == nreq) {
+		qp->db_batch_start_ns = now;
+		return false;
+	}
+
+	return now - qp->db_batch_start_ns >= qp->db_batch_delay_ns;
+}
+
+static inline void post_send_db(struct mlx5_qp *qp, struct mlx5_bf *bf,
+				int nreq, int inl, int size, void *ctrl)
+{
+	if (unlikely(!nreq))
+		return;
+
+	qp->sq.head += nreq;
+
+	if (unlikely(qp->db_batch_max)) {
+		if (!db_batch_due(qp, nreq, ctrl))
+			return;
+
+		/* BlueFlame only carries the last WQE, keep it for lone WRs */
+		nreq = qp->db_batch_nreq;
+		qp->db_batch_nreq = 0;
+	}
+
+	ring_send_db(qp, bf, nreq, inl, size, ctrl);
+}
+
+/* Called with the SQ lock held */
+static void flush_send_db(struct mlx5_qp *qp)
+{
+	int nreq = qp->db_batch_nreq;
+
+	if (!nreq)
+		return;
+
+	qp->db_batch_nreq = 0;
+	ring_send_db(qp, qp->bf, nreq, 0, 0, qp->db_batch_ctrl);
+}
+
 static inline int _mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 				  struct ibv_send_wr **bad_wr)
 {
@@ -1218,7 +1334,11 @@ int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	// printf("The return value of mlx5_get_sq_num is: %d\n", qp->sq.max_post);
 
 	// printf("phx change\n");
-	if (wr->sg_list->length <= 1024) {
+	if (mtrdma_trace)
+		mtrdma_trace_post(mtrdma_trace, ibqp->qp_num,
+				  to_mqp(ibqp)->sq_signal_bits, wr);
+
+	if (wr->sg_list->length <= MTRDMA_BYPASS_WR) {
 		return _mlx5_post_send(ibqp, wr, bad_wr);
 	}
 
@@ -4131,29 +4251,41 @@ int mlx5_use_huge(const char *key)
 	return 0;
 }
 
+/*
+ * Lookups run from the poll path without qp_table_mutex. Second level
+ * tables are therefore published with a release store and only freed with
+ * the context, see mlx5_free_rsc_tables().
+ */
 struct mlx5_qp *mlx5_find_qp(struct mlx5_context *ctx, uint32_t qpn)
 {
 	int tind = qpn >> MLX5_QP_TABLE_SHIFT;
+	struct mlx5_qp **table;
 
-	if (ctx->qp_table[tind].refcnt)
-		return ctx->qp_table[tind].table[qpn & MLX5_QP_TABLE_MASK];
-	else
+	table = __atomic_load_n(&ctx->qp_table[tind].table, __ATOMIC_ACQUIRE);
+	if (!table)
 		return NULL;
+
+	return __atomic_load_n(&table[qpn & MLX5_QP_TABLE_MASK],
+			       __ATOMIC_ACQUIRE);
 }
 
 int mlx5_store_qp(struct mlx5_context *ctx, uint32_t qpn, struct mlx5_qp *qp)
 {
 	int tind = qpn >> MLX5_QP_TABLE_SHIFT;
+	struct mlx5_qp **table = ctx->qp_table[tind].table;
 
-	if (!ctx->qp_table[tind].refcnt) {
-		ctx->qp_table[tind].table = calloc(MLX5_QP_TABLE_MASK + 1,
-						   sizeof(struct mlx5_qp *));
-		if (!ctx->qp_table[tind].table)
+	if (!table) {
+		table = calloc(MLX5_QP_TABLE_MASK + 1, sizeof(struct mlx5_qp *));
+		if (!table)
 			return -1;
+
+		__atomic_store_n(&ctx->qp_table[tind].table, table,
+				 __ATOMIC_RELEASE);
 	}
 
 	++ctx->qp_table[tind].refcnt;
-	ctx->qp_table[tind].table[qpn & MLX5_QP_TABLE_MASK] = qp;
+	__atomic_store_n(&table[qpn & MLX5_QP_TABLE_MASK], qp,
+			 __ATOMIC_RELEASE);
 	return 0;
 }
 
@@ -4161,10 +4293,9 @@ void mlx5_clear_qp(struct mlx5_context *ctx, uint32_t qpn)
 {
 	int tind = qpn >> MLX5_QP_TABLE_SHIFT;
 
-	if (!--ctx->qp_table[tind].refcnt)
-		free(ctx->qp_table[tind].table);
-	else
-		ctx->qp_table[tind].table[qpn & MLX5_QP_TABLE_MASK] = NULL;
+	--ctx->qp_table[tind].refcnt;
+	__atomic_store_n(&ctx->qp_table[tind].table[qpn & MLX5_QP_TABLE_MASK],
+			 NULL, __ATOMIC_RELEASE);
 }
 
 static int mlx5_qp_query_sqd(struct mlx5_qp *mqp, unsigned int *cur_idx)
@@ -4301,3 +4432,340 @@ unlock_and_exit:
 
 	return ret;
 }
+
+struct mlx5dv_wqe_tmpl *
+mlx5dv_wqe_tmpl_create(struct ibv_qp *ibqp,
+		       const struct mlx5dv_wqe_tmpl_attr *attr)
+{
+	struct mlx5_qp *qp = to_mqp(ibqp);
+	struct mlx5_wqe_ctrl_seg *ctrl;
+	struct mlx5dv_wqe_tmpl *tmpl;
+	bool raddr = false;
+	int size;
+
+	if (attr->comp_mask ||
+	    attr->send_flags & ~(IBV_SEND_SIGNALED | IBV_SEND_SOLICITED |
+				 IBV_SEND_FENCE | IBV_SEND_INLINE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (ibqp->qp_type != IBV_QPT_RC && ibqp->qp_type != IBV_QPT_UC) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	switch (attr->opcode) {
+	case IBV_WR_RDMA_READ:
+		if (ibqp->qp_type != IBV_QPT_RC ||
+		    attr->send_flags & IBV_SEND_INLINE) {
+			errno = EINVAL;
+			return NULL;
+		}
+		SWITCH_FALLTHROUGH;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		raddr = true;
+		break;
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		break;
+	default:
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	if (attr->send_flags & IBV_SEND_INLINE &&
+	    attr->length > qp->max_inline_data) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tmpl = calloc(1, sizeof(*tmpl));
+	if (!tmpl) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	tmpl->qp = qp;
+	tmpl->attr = *attr;
+	tmpl->mlx5_opcode = mlx5_ib_opcode[attr->opcode];
+	tmpl->inl = attr->send_flags & IBV_SEND_INLINE;
+	tmpl->sched = attr->length > MTRDMA_BYPASS_WR;
+
+	/* Same layout _mlx5_post_send() builds for such a WR */
+	ctrl = (struct mlx5_wqe_ctrl_seg *)tmpl->image;
+	if (attr->opcode == IBV_WR_SEND_WITH_IMM ||
+	    attr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+		ctrl->imm = attr->imm_data;
+	ctrl->fm_ce_se =
+		qp->sq_signal_bits |
+		(attr->send_flags & IBV_SEND_FENCE ? MLX5_WQE_CTRL_FENCE : 0) |
+		(attr->send_flags & IBV_SEND_SIGNALED ? MLX5_WQE_CTRL_CQ_UPDATE :
+							0) |
+		(attr->send_flags & IBV_SEND_SOLICITED ?
+			 MLX5_WQE_CTRL_SOLICITED :
+			 0);
+	size = sizeof(*ctrl) / 16;
+
+	if (raddr) {
+		tmpl->raddr_off = size * 16;
+		set_raddr_seg((void *)tmpl->image + tmpl->raddr_off, 0,
+			      attr->rkey);
+		size += sizeof(struct mlx5_wqe_raddr_seg) / 16;
+	}
+
+	tmpl->data_off = size * 16;
+	tmpl->image_size = size * 16;
+	if (tmpl->inl) {
+		if (attr->length) {
+			struct mlx5_wqe_inline_seg *iseg =
+				(void *)tmpl->image + tmpl->data_off;
+
+			iseg->byte_count =
+				htobe32(attr->length | MLX5_INLINE_SEG);
+			tmpl->data_off += sizeof(*iseg);
+			tmpl->image_size += sizeof(*iseg);
+			size += align(attr->length + sizeof(*iseg), 16) / 16;
+		}
+	} else if (attr->length) {
+		struct ibv_sge sge = { .length = attr->length,
+				       .lkey = attr->lkey };
+
+		set_data_ptr_seg((void *)tmpl->image + tmpl->data_off, &sge, 0);
+		tmpl->image_size += sizeof(struct mlx5_wqe_data_seg);
+		size += sizeof(struct mlx5_wqe_data_seg) / 16;
+	}
+
+	ctrl->qpn_ds = htobe32(size | (ibqp->qp_num << 8));
+	tmpl->size = size;
+	tmpl->bbs = DIV_ROUND_UP(size * 16, MLX5_SEND_WQE_BB);
+
+	return tmpl;
+}
+
+int mlx5dv_wqe_tmpl_destroy(struct mlx5dv_wqe_tmpl *tmpl)
+{
+	free(tmpl);
+	return 0;
+}
+
+#define MLX5_WQE_TMPL_BATCH 16
+
+/*
+ * WRs above MTRDMA_BYPASS_WR must not bypass MT-RDMA, hand them over as
+ * regular WR lists.
+ */
+static int mlx5_wqe_tmpl_post_sched(struct mlx5dv_wqe_tmpl *tmpl,
+				    const struct mlx5dv_wqe_tmpl_wr *wr,
+				    uint32_t num)
+{
+	struct ibv_send_wr swr[MLX5_WQE_TMPL_BATCH] = {};
+	struct ibv_sge sge[MLX5_WQE_TMPL_BATCH];
+	struct ibv_send_wr *bad_wr;
+	uint32_t i, n;
+
+	for (i = 0; i < num; i += n) {
+		n = min_t(uint32_t, num - i, MLX5_WQE_TMPL_BATCH);
+		for (uint32_t j = 0; j < n; j++) {
+			sge[j].addr = wr[i + j].laddr;
+			sge[j].length = tmpl->attr.length;
+			sge[j].lkey = tmpl->attr.lkey;
+
+			swr[j].wr_id = wr[i + j].wr_id;
+			swr[j].next = j + 1 < n ? &swr[j + 1] : NULL;
+			swr[j].sg_list = &sge[j];
+			swr[j].num_sge = 1;
+			swr[j].opcode = tmpl->attr.opcode;
+			swr[j].send_flags = tmpl->attr.send_flags;
+			swr[j].imm_data = tmpl->attr.imm_data;
+			swr[j].wr.rdma.remote_addr = wr[i + j].raddr;
+			swr[j].wr.rdma.rkey = tmpl->attr.rkey;
+		}
+
+		if (mlx5_post_send(tmpl->qp->ibv_qp, swr, &bad_wr))
+			return i + (bad_wr - swr);
+	}
+
+	return num;
+}
+
+static inline void mlx5_wqe_tmpl_copy_inl(struct mlx5_qp *qp, void *wqe,
+					  const void *addr, uint32_t len)
+{
+	void *qend = qp->sq.qend;
+
+	if (unlikely(wqe + len > qend)) {
+		uint32_t copy = qend - wqe;
+
+		memcpy(wqe, addr, copy);
+		addr += copy;
+		len -= copy;
+		wqe = mlx5_get_send_wqe(qp, 0);
+	}
+	memcpy(wqe, addr, len);
+}
+
+/*
+ * Posts num WRs from the template under one doorbell. Only wr_id, the local
+ * and the remote address are written per WR, the rest is copied from the
+ * prebuilt image. Returns the number of WRs posted, fewer than num when the
+ * SQ is full.
+ */
+int mlx5dv_wqe_tmpl_post(struct mlx5dv_wqe_tmpl *tmpl,
+			 const struct mlx5dv_wqe_tmpl_wr *wr, uint32_t num)
+{
+	struct mlx5_qp *qp = tmpl->qp;
+	struct mlx5_cq *send_cq = to_mcq(qp->ibv_qp->send_cq);
+	struct mlx5_wqe_ctrl_seg *ctrl = NULL;
+	uint32_t nreq;
+
+	if (tmpl->sched)
+		return mlx5_wqe_tmpl_post_sched(tmpl, wr, num);
+
+	mlx5_spin_lock(&qp->sq.lock);
+
+	for (nreq = 0; nreq < num; nreq++) {
+		unsigned int idx;
+
+		if (unlikely(mlx5_wq_overflow(&qp->sq, nreq, send_cq)))
+			break;
+
+		idx = qp->sq.cur_post & (qp->sq.wqe_cnt - 1);
+		ctrl = mlx5_get_send_wqe(qp, idx);
+
+		/* the image is smaller than a basic block, it never wraps */
+		memcpy(ctrl, tmpl->image, tmpl->image_size);
+		ctrl->opmod_idx_opcode = htobe32(
+			((qp->sq.cur_post & 0xffff) << 8) | tmpl->mlx5_opcode);
+		if (!nreq)
+			ctrl->fm_ce_se |= qp->fm_cache;
+
+		if (tmpl->raddr_off) {
+			struct mlx5_wqe_raddr_seg *rseg =
+				(void *)ctrl + tmpl->raddr_off;
+
+			rseg->raddr = htobe64(wr[nreq].raddr);
+		}
+
+		if (tmpl->inl) {
+			mlx5_wqe_tmpl_copy_inl(
+				qp, (void *)ctrl + tmpl->data_off,
+				(void *)(uintptr_t)wr[nreq].laddr,
+				tmpl->attr.length);
+		} else if (tmpl->attr.length) {
+			struct mlx5_wqe_data_seg *dseg =
+				(void *)ctrl + tmpl->data_off;
+
+			dseg->addr = htobe64(wr[nreq].laddr);
+		}
+
+		if (unlikely(qp->wq_sig))
+			ctrl->signature = wq_sig(ctrl);
+
+		qp->sq.wrid[idx] = wr[nreq].wr_id;
+		qp->sq.wr_data[idx] = 0;
+		qp->sq.wqe_head[idx] = qp->sq.head + nreq;
+		qp->sq.cur_post += tmpl->bbs;
+	}
+
+	if (nreq)
+		qp->fm_cache = 0;
+	post_send_db(qp, qp->bf, nreq, tmpl->inl, tmpl->size, ctrl);
+
+	mlx5_spin_unlock(&qp->sq.lock);
+
+	if (mtrdma_trace) {
+		uint64_t now = mtrdma_trace_tick();
+		bool signaled = qp->sq_signal_bits ||
+				(tmpl->attr.send_flags & IBV_SEND_SIGNALED);
+
+		for (uint32_t i = 0; i < nreq; i++)
+			mtrdma_trace_post_one(mtrdma_trace, now,
+					      qp->ibv_qp->qp_num, wr[i].wr_id,
+					      tmpl->attr.length,
+					      tmpl->attr.opcode, 1, signaled);
+	}
+
+	return nreq;
+}
+
+int mlx5dv_qp_flush_db(struct ibv_qp *ibqp)
+{
+	struct mlx5_qp *qp = to_mqp(ibqp);
+
+	mlx5_spin_lock(&qp->sq.lock);
+	flush_send_db(qp);
+	mlx5_spin_unlock(&qp->sq.lock);
+
+	return 0;
+}
+
+/* Rings the doorbells ibv_poll_cq() on this CQ may otherwise wait for */
+void mlx5_cq_flush_db(struct mlx5_cq *cq)
+{
+	struct mlx5_qp *qp;
+
+	mlx5_spin_lock(&cq->db_batch_lock);
+	list_for_each(&cq->db_batch_qps, qp, db_batch_entry) {
+		if (!qp->db_batch_nreq)
+			continue;
+
+		mlx5_spin_lock(&qp->sq.lock);
+		flush_send_db(qp);
+		mlx5_spin_unlock(&qp->sq.lock);
+	}
+	mlx5_spin_unlock(&cq->db_batch_lock);
+}
+
+void mlx5_qp_db_batch_detach(struct mlx5_qp *qp)
+{
+	struct mlx5_cq *cq = to_mcq(qp->ibv_qp->send_cq);
+
+	mlx5_spin_lock(&qp->sq.lock);
+	flush_send_db(qp);
+	qp->db_batch_max = 0;
+	mlx5_spin_unlock(&qp->sq.lock);
+
+	mlx5_spin_lock(&cq->db_batch_lock);
+	list_del(&qp->db_batch_entry);
+	mlx5_spin_unlock(&cq->db_batch_lock);
+}
+
+int mlx5dv_qp_set_db_batch(struct ibv_qp *ibqp,
+			   const struct mlx5dv_qp_db_batch_attr *attr)
+{
+	struct mlx5_qp *qp = to_mqp(ibqp);
+	struct mlx5_cq *cq;
+	bool attached;
+
+	if (attr->comp_mask)
+		return EINVAL;
+
+	if (!ibqp->send_cq || !qp->sq.max_post)
+		return EOPNOTSUPP;
+
+	if (!attr->max_wrs) {
+		if (qp->db_batch_max)
+			mlx5_qp_db_batch_detach(qp);
+		return 0;
+	}
+
+	cq = to_mcq(ibqp->send_cq);
+
+	mlx5_spin_lock(&qp->sq.lock);
+	flush_send_db(qp);
+	attached = qp->db_batch_max;
+	/* A batch larger than the SQ would never be rung by posting alone */
+	qp->db_batch_max = min_t(uint32_t, attr->max_wrs, qp->sq.max_post);
+	qp->db_batch_delay_ns = attr->max_delay_ns;
+	mlx5_spin_unlock(&qp->sq.lock);
+
+	if (!attached) {
+		mlx5_spin_lock(&cq->db_batch_lock);
+		list_add_tail(&cq->db_batch_qps, &qp->db_batch_entry);
+		mlx5_spin_unlock(&cq->db_batch_lock);
+	}
+
+	return 0;
+}
@@ -234,6 +234,73 @@ int mlx5_post_srq_recv(struct ibv_srq *ibsrq,
 	return err;
 }
 
+/*
+ * Posts num buffers of a contiguous pool, buffer bufs[i] starting at
+ * pool->addr + bufs[i] * pool->stride and completing with wr_id bufs[i].
+ * One lock and one doorbell record update for the whole batch, and no
+ * ibv_recv_wr/ibv_sge lists to walk. Returns the number of buffers posted,
+ * fewer than num when the SRQ is full, or -1 with errno set.
+ */
+int mlx5dv_srq_post_pool(struct ibv_srq *ibsrq,
+			 const struct mlx5dv_srq_pool *pool,
+			 const uint32_t *bufs, uint32_t num)
+{
+	struct mlx5_srq *srq = to_msrq(ibsrq);
+	struct mlx5_wqe_srq_next_seg *next;
+	struct mlx5_wqe_data_seg *scat;
+	__be32 byte_count = htobe32(pool->length);
+	__be32 lkey = htobe32(pool->lkey);
+	uint32_t nreq;
+
+	if (pool->comp_mask) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mlx5_spin_lock(&srq->lock);
+
+	for (nreq = 0; nreq < num; ++nreq) {
+		if (srq->head == srq->tail)
+			break;
+
+		srq->wrid[srq->head] = bufs[nreq];
+
+		next      = get_wqe(srq, srq->head);
+		srq->head = be16toh(next->next_wqe_index);
+		scat      = (struct mlx5_wqe_data_seg *) (next + 1);
+
+		/* the next WQE holds the following free list link */
+		__builtin_prefetch(get_wqe(srq, srq->head), 1);
+
+		scat[0].byte_count = byte_count;
+		scat[0].lkey       = lkey;
+		scat[0].addr       = htobe64(pool->addr +
+					     (uint64_t)bufs[nreq] * pool->stride);
+
+		if (srq->max_gs > 1) {
+			scat[1].byte_count = 0;
+			scat[1].lkey       = htobe32(MLX5_INVALID_LKEY);
+			scat[1].addr       = 0;
+		}
+	}
+
+	if (nreq) {
+		srq->counter += nreq;
+
+		/*
+		 * Make sure that descriptors are written before
+		 * we write doorbell record.
+		 */
+		udma_to_device_barrier();
+
+		*srq->db = htobe32(srq->counter);
+	}
+
+	mlx5_spin_unlock(&srq->lock);
+
+	return nreq;
+}
+
 /* Build a linked list on an array of SRQ WQEs.
  * Since WQEs are always added to the tail and taken from the head
  * it doesn't matter where the last WQE points to.
@@ -344,30 +411,39 @@ int mlx5_alloc_srq_buf(struct ibv_context *context, struct mlx5_srq *srq,
 	return 0;
 }
 
+/* Lock-free lookup, see mlx5_find_qp() */
 struct mlx5_srq *mlx5_find_srq(struct mlx5_context *ctx, uint32_t srqn)
 {
 	int tind = srqn >> MLX5_SRQ_TABLE_SHIFT;
+	struct mlx5_srq **table;
 
-	if (ctx->srq_table[tind].refcnt)
-		return ctx->srq_table[tind].table[srqn & MLX5_SRQ_TABLE_MASK];
-	else
+	table = __atomic_load_n(&ctx->srq_table[tind].table, __ATOMIC_ACQUIRE);
+	if (!table)
 		return NULL;
+
+	return __atomic_load_n(&table[srqn & MLX5_SRQ_TABLE_MASK],
+			       __ATOMIC_ACQUIRE);
 }
 
 int mlx5_store_srq(struct mlx5_context *ctx, uint32_t srqn,
 		   struct mlx5_srq *srq)
 {
 	int tind = srqn >> MLX5_SRQ_TABLE_SHIFT;
+	struct mlx5_srq **table = ctx->srq_table[tind].table;
 
-	if (!ctx->srq_table[tind].refcnt) {
-		ctx->srq_table[tind].table = calloc(MLX5_SRQ_TABLE_MASK + 1,
-						   sizeof(struct mlx5_srq *));
-		if (!ctx->srq_table[tind].table)
+	if (!table) {
+		table = calloc(MLX5_SRQ_TABLE_MASK + 1,
+			       sizeof(struct mlx5_srq *));
+		if (!table)
 			return -1;
+
+		__atomic_store_n(&ctx->srq_table[tind].table, table,
+				 __ATOMIC_RELEASE);
 	}
 
 	++ctx->srq_table[tind].refcnt;
-	ctx->srq_table[tind].table[srqn & MLX5_SRQ_TABLE_MASK] = srq;
+	__atomic_store_n(&table[srqn & MLX5_SRQ_TABLE_MASK], srq,
+			 __ATOMIC_RELEASE);
 	return 0;
 }
 
@@ -375,8 +451,8 @@ void mlx5_clear_srq(struct mlx5_context *ctx, uint32_t srqn)
 {
 	int tind = srqn >> MLX5_SRQ_TABLE_SHIFT;
 
-	if (!--ctx->srq_table[tind].refcnt)
-		free(ctx->srq_table[tind].table);
-	else
-		ctx->srq_table[tind].table[srqn & MLX5_SRQ_TABLE_MASK] = NULL;
+	--ctx->srq_table[tind].refcnt;
+	__atomic_store_n(
+		&ctx->srq_table[tind].table[srqn & MLX5_SRQ_TABLE_MASK], NULL,
+		__ATOMIC_RELEASE);
 }
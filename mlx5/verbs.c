@@ -891,6 +891,22 @@ static int use_scatter_to_cqe(void)
 	return 1;
 }
 
+/*
+ * The AVX2 CQE scan depends on vpgather, which microcode mitigations make
+ * slower than scalar loads on some CPUs, so it is opt-in.
+ */
+static int use_cqe_scan_avx2(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	char *env;
+
+	env = getenv("MLX5_CQE_SCAN_AVX2");
+	if (env && !strcmp(env, "1"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 0;
+}
+
 static int srq_sig_enabled(void)
 {
 	char *env;
@@ -1025,6 +1041,10 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	if (mlx5_spinlock_init(&cq->lock, !mlx5_single_threaded))
 		goto err;
 
+	list_head_init(&cq->db_batch_qps);
+	if (mlx5_spinlock_init(&cq->db_batch_lock, !mlx5_single_threaded))
+		goto err_spl;
+
 	ncqe = align_queue_size(cq_attr->cqe + 1);
 	if ((ncqe > (1 << 24)) || (ncqe < (cq_attr->cqe + 1))) {
 		mlx5_dbg(fp, MLX5_DBG_CQ, "ncqe %d\n", ncqe);
@@ -1056,6 +1076,8 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	cq->arm_sn = 0;
 	cq->cqe_sz = cqe_sz;
 	cq->flags = cq_alloc_flags;
+	if (use_cqe_scan_avx2())
+		cq->flags |= MLX5_CQ_FLAGS_SCAN_AVX2;
 
 	cmd_drv->buf_addr = (uintptr_t)cq->buf_a.buf;
 	cmd_drv->db_addr = (uintptr_t)cq->dbrec;
@@ -1141,6 +1163,7 @@ static struct ibv_cq_ex *create_cq(struct ibv_context *context,
 	cq->stall_enable = to_mctx(context)->stall_enable;
 	cq->stall_adaptive_enable = to_mctx(context)->stall_adaptive_enable;
 	cq->stall_cycles = to_mctx(context)->stall_cycles;
+	cq->stall_learn = to_mctx(context)->stall_learn;
 
 	return &cq->verbs_cq.cq_ex;
 
@@ -1152,6 +1175,7 @@ err_buf:
 	mlx5_free_cq_buf(to_mctx(context), &cq->buf_a);
 
 err_spl:
+	mlx5_spinlock_destroy(&cq->db_batch_lock);
 	mlx5_spinlock_destroy(&cq->lock);
 
 err:
@@ -1300,6 +1324,7 @@ int mlx5_destroy_cq(struct ibv_cq *cq)
 	mlx5_free_db(to_mctx(cq->context), mcq->dbrec, mcq->parent_domain,
 		     mcq->custom_db);
 	mlx5_free_cq_buf(to_mctx(cq->context), mcq->active_buf);
+	mlx5_spinlock_destroy(&mcq->db_batch_lock);
 	if (mcq->parent_domain)
 		atomic_fetch_sub(
 			&to_mparent_domain(mcq->parent_domain)->mpd.refcount,
@@ -2806,6 +2831,10 @@ int mlx5_destroy_qp(struct ibv_qp *ibqp)
 		goto free;
 	}
 
+	/* Ring what is still deferred while the QP can take it */
+	if (qp->db_batch_max)
+		mlx5_qp_db_batch_detach(qp);
+
 	if (!ctx->cqe_version)
 		pthread_mutex_lock(&ctx->qp_table_mutex);
 